@@ -0,0 +1,95 @@
+// array_bench - Compare Kale's array kernels with the same kernels in C.
+//
+//   array_bench [N] [REPS]
+//
+// Links with the output.o Kale compiles from arrays.kl, so it isn't built
+// with the compiler; array_bench.sh builds and runs it. Runs saxpy and dot
+// over N doubles (ten million by default) with each, checks that they
+// compute the same, and prints the best of REPS (10 by default) times, the
+// memory bandwidth Kale's reaches and how many times faster than C it is.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" double saxpy(int64_t N, double A, double *X, double *Y);
+extern "C" double dot(int64_t N, double *X, double *Y);
+
+__attribute__((noinline)) static void cSaxpy(int64_t N, double A,
+                                             const double *__restrict X,
+                                             double *__restrict Y) {
+    for (int64_t I = 0; I < N; ++I)
+        Y[I] = A * X[I] + Y[I];
+}
+
+__attribute__((noinline)) static double cDot(int64_t N,
+                                             const double *__restrict X,
+                                             const double *__restrict Y) {
+    double S = 0;
+    for (int64_t I = 0; I < N; ++I)
+        S += X[I] * Y[I];
+    return S;
+}
+
+/// bestOf - The fastest of Reps runs of F, in milliseconds.
+template <typename Fn> static double bestOf(int Reps, Fn F) {
+    double Best = 1e300;
+    for (int R = 0; R < Reps; ++R) {
+        auto Start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double, std::milli> T =
+            std::chrono::steady_clock::now() - Start;
+        Best = std::min(Best, T.count());
+    }
+    return Best;
+}
+
+static void report(const char *Name, double KaleMs, double CMs,
+                   double Bytes) {
+    printf("%-8s %10.2f %10.2f %10.2f %8.2fx\n", Name, KaleMs, CMs,
+           Bytes / (KaleMs * 1e6), CMs / KaleMs);
+}
+
+int main(int argc, char **argv) {
+    int64_t N = argc > 1 ? atoll(argv[1]) : 10000000;
+    int Reps = argc > 2 ? atoi(argv[2]) : 10;
+    if (N < 1 || Reps < 1) {
+        fprintf(stderr, "usage: %s [N] [REPS]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<double> X(N), Y(N), KaleY(N), CY(N);
+    for (int64_t I = 0; I < N; ++I) {
+        X[I] = double(I % 1000) / 7;
+        Y[I] = double(N - I) / 3;
+    }
+
+    // Both must compute the same, bit for bit: nothing is reassociated.
+    KaleY = Y;
+    CY = Y;
+    saxpy(N, 1.5, X.data(), KaleY.data());
+    cSaxpy(N, 1.5, X.data(), CY.data());
+    if (memcmp(KaleY.data(), CY.data(), N * sizeof(double)) != 0 ||
+        dot(N, X.data(), Y.data()) != cDot(N, X.data(), Y.data())) {
+        fprintf(stderr, "error: Kale and C kernels differ\n");
+        return 1;
+    }
+
+    printf("%lld doubles, best of %d\n", (long long)N, Reps);
+    printf("%-8s %10s %10s %10s %9s\n", "kernel", "kale-ms", "c-ms",
+           "kale-GB/s", "c/kale");
+    double A = 1.0;
+    report("saxpy",
+           bestOf(Reps, [&] { saxpy(N, A, X.data(), KaleY.data()); }),
+           bestOf(Reps, [&] { cSaxpy(N, A, X.data(), CY.data()); }),
+           3.0 * N * sizeof(double));
+    volatile double Sink;
+    report("dot", bestOf(Reps, [&] { Sink = dot(N, X.data(), Y.data()); }),
+           bestOf(Reps, [&] { Sink = cDot(N, X.data(), Y.data()); }),
+           2.0 * N * sizeof(double));
+    (void)Sink;
+    return 0;
+}
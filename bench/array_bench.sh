@@ -0,0 +1,27 @@
+#!/bin/sh
+# array_bench.sh - Kale's array kernels against the same kernels in C.
+#
+#   bench/array_bench.sh [path/to/Kale] [OPTLEVEL] [N] [REPS]
+#
+# Compiles bench/arrays.kl at -O<OPTLEVEL> (default 2), links the output.o
+# with array_bench.cc, whose C kernels are built with $CXXFLAGS (default
+# -O2), and times saxpy and dot over N (default 10000000) doubles, best of
+# REPS (default 10) runs. Run from the source tree.
+set -e
+
+KALE=${1:-./build/Kale}
+OPT=${2:-2}
+N=${3:-10000000}
+REPS=${4:-10}
+CXX=${CXX:-c++}
+CXXFLAGS=${CXXFLAGS:--O2}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+SRC=$(pwd)/bench
+
+# Kale writes output.o to the current directory.
+(cd "$WORK" && "$KALE" -O$OPT "$SRC/arrays.kl" >/dev/null 2>&1)
+$CXX $CXXFLAGS "$SRC/array_bench.cc" "$WORK/output.o" -o "$WORK/array_bench"
+"$WORK/array_bench" "$N" "$REPS"
@@ -0,0 +1,115 @@
+// ast_bench - Measure what building the AST costs in allocations and memory.
+//
+//   ast_bench [file.kl]
+//
+// Parses every top-level item of the input (a generated program of about
+// 32 MB by default) without code generation. Each mode runs in a child
+// process so that its peak RSS is its own:
+//
+//   reset  - release the arena after every item, as the compiler does
+//   keep   - never release it, i.e. hold the AST of the whole program
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "parser.h"
+
+static size_t NumAllocs = 0;
+static size_t AllocBytes = 0;
+
+void *operator new(size_t Size) {
+    ++NumAllocs;
+    AllocBytes += Size;
+    if (void *P = malloc(Size ? Size : 1))
+        return P;
+    throw std::bad_alloc();
+}
+void operator delete(void *P) noexcept { free(P); }
+void operator delete(void *P, size_t) noexcept { free(P); }
+
+namespace {
+
+std::string makeProgram(size_t Bytes) {
+    std::string Text;
+    Text.reserve(Bytes + 256);
+    char Buf[512];
+    for (unsigned I = 0; Text.size() < Bytes; ++I) {
+        snprintf(Buf, sizeof(Buf),
+                 "def kernel%u(x y z)\n"
+                 "    var acc = %u.25, t = x * y in\n"
+                 "        (for i = 0, i < x, 1.5 in\n"
+                 "            acc = acc * 0.999 + kernel%u(y, i, z) - t * (z - 1))\n"
+                 "        : (if acc < 0 then 0 - acc else acc);\n\n",
+                 I, I, I ? I - 1 : 0);
+        Text += Buf;
+    }
+    return Text;
+}
+
+void runMode(const SourceBuffer &Src, bool Reset) {
+    CompilerInstance CI;
+    CI.BinopPrecedence[':'] = 1;
+
+    TokenStream Toks(Src, /*AllowThread=*/false);
+    size_t AllocsBefore = NumAllocs, BytesBefore = AllocBytes;
+    size_t Nodes = 0, Items = 0;
+    auto Start = std::chrono::steady_clock::now();
+
+    Parser P(CI, Toks);
+    P.getNextToken();
+    while (P._curTok != tok_eof) {
+        if (P._curTok == ';') {
+            P.getNextToken();
+            continue;
+        }
+        size_t NodesBefore = P.Arena.getNumNodes();
+        bool Ok = P._curTok == tok_def ? bool(P.ParseDefinition())
+                                       : bool(P.ParseTopLevelExpr());
+        if (!Ok)
+            exit(1);
+        ++Items;
+        Nodes += P.Arena.getNumNodes() - NodesBefore;
+        if (Reset)
+            P.Arena.reset();
+    }
+
+    std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+    struct rusage RU;
+    getrusage(RUSAGE_SELF, &RU);
+    printf("%-6s %8zu items %10zu nodes %9zu allocs (%.3f/node) %8.1f MB "
+           "allocated  peak RSS %6.1f MB  %.3fs\n",
+           Reset ? "reset" : "keep", Items, Nodes, NumAllocs - AllocsBefore,
+           double(NumAllocs - AllocsBefore) / Nodes,
+           (AllocBytes - BytesBefore) / 1e6, RU.ru_maxrss / 1024.0, D.count());
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    std::unique_ptr<SourceBuffer> Src;
+    if (argc > 1)
+        Src = SourceBuffer::openFile(argv[1]);
+    else
+        Src = SourceBuffer::fromString(makeProgram(32 << 20), "<generated>");
+    if (!Src)
+        return 1;
+    printf("input: %.1f MB\n", Src->size() / 1e6);
+    fflush(stdout);
+
+    for (bool Reset : {true, false}) {
+        pid_t Pid = fork();
+        if (Pid == 0) {
+            runMode(*Src, Reset);
+            fflush(stdout);
+            _exit(0);
+        }
+        int Status;
+        waitpid(Pid, &Status, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+// batch_bench - Per-row calls of JIT'd functions against compileBatch().
+//
+//   batch_bench [ROWS] [REPS]
+//
+// Defines a few scalar functions of the kind an embedder would evaluate over
+// columnar data, then, for each, fills an output column of ROWS (default a
+// million) rows twice: calling the compiled function once per row through a
+// pointer, and calling the batch Executor::compileBatch() made of it once.
+// Reports the best time per row of REPS (default 10) runs of each, the
+// speedup, and how long the batch took to compile. Both must give the same
+// results, bit for bit.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "llvm/Support/TargetSelect.h"
+#include "codegenVisitor.h"
+#include "executor.h"
+#include "parser.h"
+#include "simplify.h"
+
+namespace {
+
+const char *Program =
+    "def binary : 1 (x y) y;\n"
+    "def lin(x y) 3 * x + 2 * y - 1;\n"
+    "def poly(x) ((0.5 * x + 1.5) * x - 2) * x + 4;\n"
+    "def clamp(x lo hi) if x < lo then lo else if hi < x then hi else x;\n"
+    "def dist(x y z) var d = x * x + y * y + z * z in d * 0.5 + 1;\n";
+
+/// Kernel - A function of the program, with how many columns it takes.
+struct Kernel {
+    const char *Name;
+    unsigned Columns;
+};
+const Kernel Kernels[] = {{"lin", 2}, {"poly", 1}, {"clamp", 3}, {"dist", 3}};
+
+/// define - Compile every definition in Text and hand it to Exec.
+bool define(CompilerInstance &CI, Executor &Exec, const char *Text) {
+    auto Src = SourceBuffer::fromString(Text, "<program>");
+    TokenStream Toks(*Src, /*AllowThread=*/false);
+    Parser P(CI, Toks);
+    P.getNextToken();
+    while (P._curTok != tok_eof) {
+        if (P._curTok == ';') {
+            P.getNextToken();
+            continue;
+        }
+        auto FnAST = P.ParseDefinition();
+        if (!FnAST)
+            return false;
+        ASTSimplifier::simplify(*FnAST, CI, P.Arena);
+        codegenVisitor CodeV(CI);
+        std::string Error;
+        if (!CodeV.codegen(*FnAST) || !Exec.addDefinitions(CI, Error)) {
+            fprintf(stderr, "Error: %s\n", Error.c_str());
+            return false;
+        }
+        P.Arena.reset();
+    }
+    return true;
+}
+
+/// perRow - Out[r] = F(Cols[0][r], ...) a row at a time, the way an embedder
+/// without batches would.
+void perRow(void *F, unsigned NumCols, const double *const *Cols, double *Out,
+            int64_t Rows) {
+    switch (NumCols) {
+    case 1: {
+        auto *Fn = reinterpret_cast<double (*)(double)>(F);
+        for (int64_t R = 0; R != Rows; ++R)
+            Out[R] = Fn(Cols[0][R]);
+        break;
+    }
+    case 2: {
+        auto *Fn = reinterpret_cast<double (*)(double, double)>(F);
+        for (int64_t R = 0; R != Rows; ++R)
+            Out[R] = Fn(Cols[0][R], Cols[1][R]);
+        break;
+    }
+    default: {
+        auto *Fn = reinterpret_cast<double (*)(double, double, double)>(F);
+        for (int64_t R = 0; R != Rows; ++R)
+            Out[R] = Fn(Cols[0][R], Cols[1][R], Cols[2][R]);
+        break;
+    }
+    }
+}
+
+template <typename Fn> double bestOf(unsigned Reps, Fn F) {
+    double Best = 1e30;
+    for (unsigned I = 0; I != Reps; ++I) {
+        auto Start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> D =
+            std::chrono::steady_clock::now() - Start;
+        Best = std::min(Best, D.count());
+    }
+    return Best;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    int64_t Rows = argc > 1 ? atoll(argv[1]) : 1000000;
+    unsigned Reps = argc > 2 ? atoi(argv[2]) : 10;
+    if (Rows <= 0 || Reps == 0) {
+        fprintf(stderr, "usage: %s [ROWS] [REPS]\n", argv[0]);
+        return 1;
+    }
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    // The scalar functions are compiled at -O2, as for any JIT user.
+    Executor::Options Opts;
+    Opts.OptLevel = 2;
+    std::string Error;
+    auto Exec = Executor::create(Opts, Error);
+    if (!Exec) {
+        fprintf(stderr, "Error: %s\n", Error.c_str());
+        return 1;
+    }
+    CompilerInstance CI;
+    CI.TM = &Exec->getTargetMachine();
+    CI.initializeModule(Exec->getDataLayout());
+    if (!define(CI, *Exec, Program))
+        return 1;
+
+    std::vector<std::vector<double>> Columns(3, std::vector<double>(Rows));
+    srand(1);
+    for (auto &Col : Columns)
+        for (double &X : Col)
+            X = rand() / double(RAND_MAX) * 20 - 10;
+    const double *Cols[] = {Columns[0].data(), Columns[1].data(),
+                            Columns[2].data()};
+    std::vector<double> RowOut(Rows), BatchOut(Rows);
+
+    printf("%lld rows, best of %u\n", (long long)Rows, Reps);
+    printf("%-8s %12s %12s %8s %12s\n", "function", "per-row ns", "batch ns",
+           "speedup", "compile ms");
+    for (const Kernel &K : Kernels) {
+        void *F = Exec->lookup(K.Name, Error);
+        auto Start = std::chrono::steady_clock::now();
+        Executor::BatchFn Batch = Exec->compileBatch(CI, K.Name, Error);
+        std::chrono::duration<double> Compile =
+            std::chrono::steady_clock::now() - Start;
+        if (!F || !Batch) {
+            fprintf(stderr, "Error: %s\n", Error.c_str());
+            return 1;
+        }
+
+        double RowSecs = bestOf(Reps, [&] {
+            perRow(F, K.Columns, Cols, RowOut.data(), Rows);
+        });
+        double BatchSecs = bestOf(Reps, [&] {
+            Batch(Cols, BatchOut.data(), Rows);
+        });
+        if (memcmp(RowOut.data(), BatchOut.data(), Rows * sizeof(double))) {
+            fprintf(stderr, "%s: the batch gives different results\n", K.Name);
+            return 1;
+        }
+        printf("%-8s %12.2f %12.2f %7.2fx %12.2f\n", K.Name,
+               RowSecs / Rows * 1e9, BatchSecs / Rows * 1e9,
+               RowSecs / BatchSecs, Compile.count() * 1e3);
+    }
+    return 0;
+}
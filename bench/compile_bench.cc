@@ -0,0 +1,133 @@
+// compile_bench - Check that independent compilations scale with threads.
+//
+//   compile_bench [-t MAXTHREADS] [-n COMPILES] [file.kl]
+//
+// Each thread repeatedly compiles the input (a generated program of a few
+// hundred functions by default) from scratch with its own CompilerInstance:
+// lexing, parsing and code generation into a fresh module. The run is repeated
+// with 1, 2, 4, ... MAXTHREADS threads (default: the number of cores), each
+// thread doing COMPILES compilations, and throughput is reported relative to
+// one thread. Compilations share nothing but the symbol table, so on an
+// otherwise idle machine the speedup should be close to the thread count.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "codegenVisitor.h"
+#include "parser.h"
+
+namespace {
+
+std::string makeProgram(unsigned NumFunctions) {
+    std::string Text;
+    char Buf[512];
+    for (unsigned I = 0; I != NumFunctions; ++I) {
+        snprintf(Buf, sizeof(Buf),
+                 "def kernel%u(x y z)\n"
+                 "    var acc = %u.25, t = x * y in\n"
+                 "        (for i = 0, i < x, 1.5 in\n"
+                 "            acc = acc * 0.999 + kernel%u(y, i, z) - t * (z - 1))\n"
+                 "        + (if acc < 0 then 0 - acc else acc);\n\n",
+                 I, I, I ? I - 1 : 0);
+        Text += Buf;
+    }
+    return Text;
+}
+
+/// compile - Compile Src from scratch; return the number of functions in the
+/// resulting module, or 0 on error.
+size_t compile(const SourceBuffer &Src, const llvm::DataLayout &DL) {
+    CompilerInstance CI;
+    CI.initializeModule(DL);
+    TokenStream Toks(Src, /*AllowThread=*/false);
+    Parser P(CI, Toks);
+    P.getNextToken();
+    while (P._curTok != tok_eof) {
+        if (P._curTok == ';') {
+            P.getNextToken();
+            continue;
+        }
+        if (P._curTok != tok_def)
+            return 0;
+        auto FnAST = P.ParseDefinition();
+        if (!FnAST)
+            return 0;
+        codegenVisitor CodeV(CI);
+        if (!CodeV.codegen(*FnAST))
+            return 0;
+        P.Arena.reset();
+    }
+    return CI.TheModule->size();
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    unsigned MaxThreads = std::thread::hardware_concurrency();
+    unsigned Compiles = 20;
+    const char *Path = nullptr;
+    for (int I = 1; I != argc; ++I) {
+        if (!strcmp(argv[I], "-t") && I + 1 != argc)
+            MaxThreads = atoi(argv[++I]);
+        else if (!strcmp(argv[I], "-n") && I + 1 != argc)
+            Compiles = atoi(argv[++I]);
+        else
+            Path = argv[I];
+    }
+    if (MaxThreads == 0)
+        MaxThreads = 1;
+
+    std::unique_ptr<SourceBuffer> Src;
+    if (Path)
+        Src = SourceBuffer::openFile(Path);
+    else
+        Src = SourceBuffer::fromString(makeProgram(400), "<generated>");
+    if (!Src)
+        return 1;
+    llvm::DataLayout DL("");
+
+    // Warm up, and make sure the program compiles at all.
+    size_t NumFunctions = compile(*Src, DL);
+    if (!NumFunctions) {
+        fprintf(stderr, "input does not compile\n");
+        return 1;
+    }
+    printf("input: %.1f KB, %zu functions, %u compiles per thread\n",
+           Src->size() / 1e3, NumFunctions, Compiles);
+
+    double Base = 0;
+    for (unsigned Threads = 1;; Threads = std::min(Threads * 2, MaxThreads)) {
+        std::atomic<bool> Failed(false);
+        auto Start = std::chrono::steady_clock::now();
+        std::vector<std::thread> Workers;
+        for (unsigned T = 0; T != Threads; ++T)
+            Workers.emplace_back([&] {
+                for (unsigned I = 0; I != Compiles; ++I)
+                    if (compile(*Src, DL) != NumFunctions)
+                        Failed = true;
+            });
+        for (auto &W : Workers)
+            W.join();
+        std::chrono::duration<double> D =
+            std::chrono::steady_clock::now() - Start;
+        if (Failed) {
+            fprintf(stderr, "compilation failed with %u threads\n", Threads);
+            return 1;
+        }
+
+        double PerSec = Threads * Compiles / D.count();
+        if (Threads == 1)
+            Base = PerSec;
+        printf("%3u threads %9.1f compiles/s  speedup %5.2fx  "
+               "efficiency %5.1f%%\n",
+               Threads, PerSec, PerSec / Base, 100 * PerSec / Base / Threads);
+        fflush(stdout);
+        if (Threads == MaxThreads)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# incremental_bench.sh - Edit-rebuild latency of --incremental builds.
+#
+#   bench/incremental_bench.sh [path/to/Kale] [FUNCTIONS] [OPTLEVEL]
+#
+# Generates a program of FUNCTIONS functions (default 10000), one in a
+# hundred of them using a user-defined operator, and times at -O<OPTLEVEL>
+# (default 1), in milliseconds:
+#
+#   full       a plain build of output.o
+#   cold       the first --incremental build
+#   no-op      an --incremental build with nothing changed
+#   body       after editing the body of one function
+#   operator   after changing the operator's precedence, which changes how
+#              every function using it parses
+set -e
+
+KALE=${1:-./build/Kale}
+FUNCS=${2:-10000}
+OPT=${3:-1}
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+# generate PREC EDITED - Write the program to prog.kl, with the operator at
+# precedence PREC and function number EDITED changed.
+generate() {
+    awk -v n="$FUNCS" -v prec="$1" -v edited="$2" 'BEGIN {
+        printf "def binary | %d (a b) if a then 1 else if b then 1 else 0;\n\n", prec
+        for (i = 0; i < n; i++) {
+            printf "def f%d(x y)\n", i
+            printf "    var acc = %s in\n", i == edited ? i + 0.5 : i
+            printf "        (for k = 0, k < x, 1 in acc = acc * 0.5 + y * k) +\n"
+            if (i % 100 == 0)
+                printf "        (x < 1 | y < 1 + 2)"
+            else
+                printf "        (if acc < %d then f%d(x - 1, y) else acc)", \
+                    i, i ? i - 1 : 0
+            printf ";\n\n"
+        }
+        print "f10(10, 2);"
+    }' > prog.kl
+}
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# step NAME ARGS... - Run Kale with ARGS and report the time taken.
+step() {
+    name=$1
+    shift
+    start=$(now_ms)
+    "$KALE" -O$OPT "$@" prog.kl > /dev/null 2> log
+    t=$(($(now_ms) - start))
+    printf '%-10s %10s ms   %s\n' "$name" "$t" \
+        "$(grep 'items compiled' log || true)"
+}
+
+generate 5 -1
+step full
+step cold --incremental=state
+step no-op --incremental=state
+generate 5 $((FUNCS / 2 + 1))
+step body --incremental=state
+generate 6 $((FUNCS / 2 + 1))
+step operator --incremental=state
@@ -0,0 +1,45 @@
+#!/bin/sh
+# lazy_bench.sh - Startup cost of a large prelude on the eager and the lazy
+# JIT.
+#
+#   bench/lazy_bench.sh [path/to/Kale] [DEFINITIONS] [OPTLEVEL]
+#
+# Generates a prelude of DEFINITIONS functions (default 4000) followed by a
+# program that only calls a handful of them, and runs it with --jit and with
+# --lazy at -O<OPTLEVEL> (default 2). Reports the wall time to the result
+# (best of three, in milliseconds) and how many functions and bytes of code
+# the JIT generated.
+set -e
+
+KALE=${1:-./build/Kale}
+DEFS=${2:-4000}
+OPT=${3:-2}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+awk -v n="$DEFS" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "def prelude%d(x y)\n", i
+        printf "    var acc = %d in\n", i
+        printf "        (for k = 0, k < x, 1 in acc = acc * 0.5 + y * k) +\n"
+        printf "        (if acc < %d then prelude%d(x - 1, y) else acc);\n\n", \
+            i, i ? i - 1 : 0
+    }
+    print "prelude0(10, 2) + prelude1(10, 2) + prelude2(10, 2);"
+}' > "$WORK/prelude.kl"
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+printf '%-6s %10s %12s %12s %12s\n' mode wall-ms defined compiled code-bytes
+for MODE in jit lazy; do
+    best=
+    for _ in 1 2 3; do
+        start=$(now_ms)
+        "$KALE" --$MODE -O$OPT -time "$WORK/prelude.kl" 2> "$WORK/stats"
+        t=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+    done
+    # "N functions defined, N compiled, N bytes of code"
+    set -- $(grep 'functions defined' "$WORK/stats" | tr -d ,)
+    printf '%-6s %10s %12s %12s %12s\n' $MODE "$best" "$1" "$4" "$6"
+done
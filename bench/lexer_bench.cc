@@ -0,0 +1,145 @@
+// lexer_bench - Measure lexer throughput in MB/s.
+//
+//   lexer_bench [file.kl]
+//
+// Without a file a synthetic program of about 32 MB is generated. Each lexer
+// is run a few times over the same bytes and the best time is reported. The
+// "getchar" row is the original byte-at-a-time lexer, kept here as the
+// baseline to compare against; "stream" also stores every token into a
+// TokenStream.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "lexer.h"
+#include "source.h"
+#include "tokenStream.h"
+
+namespace {
+
+/// LegacyLexer - The lexer as it was before it worked on a SourceBuffer: one
+/// getc() per byte, identifiers and numbers built up in std::strings.
+class LegacyLexer {
+    FILE *_in;
+    int _lastChar = ' ';
+public:
+    std::string IdentifierStr;
+    double NumVal;
+    explicit LegacyLexer(FILE *In) : _in(In) {}
+
+    int gettok() {
+        while (isspace(_lastChar))
+            _lastChar = getc(_in);
+
+        if (isalpha(_lastChar)) {
+            IdentifierStr = _lastChar;
+            while (isalnum((_lastChar = getc(_in))))
+                IdentifierStr += _lastChar;
+            static const char *const Keywords[] = {"def", "extern", "if",
+                "then", "else", "for", "in", "binary", "unary", "in", "var"};
+            for (const char *Kw : Keywords)
+                if (IdentifierStr == Kw)
+                    return -2;
+            return tok_identifier;
+        }
+
+        if (isdigit(_lastChar) || _lastChar == '.') {
+            std::string NumStr;
+            do {
+                NumStr += _lastChar;
+                _lastChar = getc(_in);
+            } while (isdigit(_lastChar) || _lastChar == '.');
+            NumVal = strtod(NumStr.c_str(), nullptr);
+            return tok_number;
+        }
+
+        if (_lastChar == '#') {
+            do
+                _lastChar = getc(_in);
+            while (_lastChar != EOF && _lastChar != '\n' && _lastChar != '\r');
+            if (_lastChar != EOF)
+                return gettok();
+        }
+
+        if (_lastChar == EOF)
+            return tok_eof;
+        int ThisChar = _lastChar;
+        _lastChar = getc(_in);
+        return ThisChar;
+    }
+};
+
+std::string makeProgram(size_t Bytes) {
+    std::string Text;
+    Text.reserve(Bytes + 256);
+    char Buf[512];
+    for (unsigned I = 0; Text.size() < Bytes; ++I) {
+        snprintf(Buf, sizeof(Buf),
+                 "# generated kernel number %u, the comment is here to be skipped\n"
+                 "def kernel%u(x y)\n"
+                 "    var acc = %u.25 in\n"
+                 "        (for i = 0, i < x, 1.5 in\n"
+                 "            acc = acc * 0.999 + y * i - 12345.678)\n"
+                 "        : acc;\n\n",
+                 I, I, I);
+        Text += Buf;
+    }
+    return Text;
+}
+
+template <typename Fn> double bestSeconds(Fn F) {
+    double Best = 1e30;
+    for (int Run = 0; Run < 3; ++Run) {
+        auto Start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+        if (D.count() < Best)
+            Best = D.count();
+    }
+    return Best;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    std::unique_ptr<SourceBuffer> Src;
+    if (argc > 1)
+        Src = SourceBuffer::openFile(argv[1]);
+    else
+        Src = SourceBuffer::fromString(makeProgram(32 << 20), "<generated>");
+    if (!Src)
+        return 1;
+    double MB = Src->size() / 1e6;
+
+    size_t Tokens = 0;
+    double Legacy = bestSeconds([&] {
+        FILE *In = fmemopen(const_cast<char *>(Src->begin()), Src->size(), "r");
+        LegacyLexer Lex(In);
+        Tokens = 0;
+        while (Lex.gettok() != tok_eof)
+            ++Tokens;
+        fclose(In);
+    });
+    printf("%-10s %10zu tokens %8.1f MB/s\n", "getchar", Tokens, MB / Legacy);
+
+    double Buffered = bestSeconds([&] {
+        Lexer Lex(*Src);
+        Tokens = 0;
+        for (int Tok; (Tok = Lex.gettok()) != tok_eof; ++Tokens)
+            if (Tok == tok_error) {
+                fprintf(stderr, "lex error at offset %u\n", Lex.TokOffset);
+                exit(1);
+            }
+    });
+    printf("%-10s %10zu tokens %8.1f MB/s\n", "buffer", Tokens, MB / Buffered);
+
+    // Tokenizing into a TokenStream, on the calling thread so the time covers
+    // all of the work.
+    double Stream = bestSeconds([&] {
+        TokenStream Toks(*Src, /*AllowThread=*/false);
+        Tokens = Toks.size();
+    });
+    printf("%-10s %10zu tokens %8.1f MB/s\n", "stream", Tokens, MB / Stream);
+    printf("speedup    %.2fx on %.1f MB\n", Legacy / Buffered, MB);
+    return 0;
+}
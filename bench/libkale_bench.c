@@ -0,0 +1,151 @@
+/* libkale_bench - How long a host program waits to compile and call Kale
+ * code through libkale.
+ *
+ *   libkale_bench [COMPILES] [THREADS]
+ *
+ * For -O0 and -O2, creates sessions, then compiles COMPILES (default 200)
+ * small functions one source at a time, looking each up and calling it
+ * once, and reports the median, 90th and 99th percentile and worst
+ * latency of each step. Then THREADS (default 4) threads call one
+ * compiled function concurrently and check every result.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kale.h"
+
+static double nowUs(void) {
+    struct timespec T;
+    clock_gettime(CLOCK_MONOTONIC, &T);
+    return T.tv_sec * 1e6 + T.tv_nsec / 1e3;
+}
+
+static int compareDoubles(const void *A, const void *B) {
+    double X = *(const double *)A, Y = *(const double *)B;
+    return X < Y ? -1 : X > Y;
+}
+
+/* report - Print the distribution of the N latencies in Us, sorting them. */
+static void report(const char *What, double *Us, int N) {
+    qsort(Us, N, sizeof(double), compareDoubles);
+    printf("  %-22s %9.1f %9.1f %9.1f %9.1f\n", What, Us[N / 2],
+           Us[N * 9 / 10], Us[N * 99 / 100], Us[N - 1]);
+}
+
+static int fail(const char *What, char *Error) {
+    fprintf(stderr, "%s: %s\n", What, Error ? Error : "failed");
+    kale_error_free(Error);
+    return 1;
+}
+
+/* The function every calling thread calls, and how many times. */
+static double (*Shared)(double, double);
+enum { CallsPerThread = 1000000 };
+
+static void *callShared(void *Arg) {
+    intptr_t Bad = 0;
+    double Seed = (double)(intptr_t)Arg;
+    for (int I = 0; I != CallsPerThread; ++I) {
+        double X = Seed + I;
+        if (Shared(X, 2) != X * 2 + 1)
+            ++Bad;
+    }
+    return (void *)Bad;
+}
+
+static int bench(unsigned OptLevel, int Compiles, int Threads) {
+    char *Error = NULL;
+    double *Create = malloc(sizeof(double) * Compiles);
+    double *Compile = malloc(sizeof(double) * Compiles);
+    double *Lookup = malloc(sizeof(double) * Compiles);
+    double *Call = malloc(sizeof(double) * Compiles);
+    double *Total = malloc(sizeof(double) * Compiles);
+    int Sessions = Compiles < 20 ? Compiles : 20;
+
+    printf("-O%u                       median       p90       p99       max"
+           " (us)\n", OptLevel);
+    for (int I = 0; I != Sessions; ++I) {
+        double Start = nowUs();
+        kale_session *S = kale_session_create(OptLevel, &Error);
+        Create[I] = nowUs() - Start;
+        if (!S)
+            return fail("kale_session_create", Error);
+        kale_session_release(S);
+    }
+    report("create session", Create, Sessions);
+
+    kale_session *S = kale_session_create(OptLevel, &Error);
+    if (!S)
+        return fail("kale_session_create", Error);
+    for (int I = 0; I != Compiles; ++I) {
+        char Src[256], Name[32];
+        snprintf(Name, sizeof(Name), "f%d", I);
+        snprintf(Src, sizeof(Src),
+                 "def %s(x y) var s = 0 in "
+                 "(for i = 0, i < y in s = s + x * i + %d) + s;", Name, I);
+
+        double Start = nowUs();
+        if (kale_compile(S, Src, strlen(Src), &Error))
+            return fail("kale_compile", Error);
+        double Compiled = nowUs();
+        double (*F)(double, double) =
+            (double (*)(double, double))kale_lookup(S, Name, &Error);
+        if (!F)
+            return fail("kale_lookup", Error);
+        double Found = nowUs();
+        volatile double R = F(1, 10);
+        (void)R;
+        double Called = nowUs();
+
+        Compile[I] = Compiled - Start;
+        Lookup[I] = Found - Compiled;
+        Call[I] = Called - Found;
+        Total[I] = Called - Start;
+    }
+    report("compile", Compile, Compiles);
+    report("lookup", Lookup, Compiles);
+    report("first call", Call, Compiles);
+    report("compile to result", Total, Compiles);
+
+    const char *Src = "def g(x y) x * y + 1;";
+    if (kale_compile(S, Src, strlen(Src), &Error))
+        return fail("kale_compile", Error);
+    Shared = (double (*)(double, double))kale_lookup(S, "g", &Error);
+    if (!Shared)
+        return fail("kale_lookup", Error);
+    pthread_t *Ids = malloc(sizeof(pthread_t) * Threads);
+    double Start = nowUs();
+    for (int T = 0; T != Threads; ++T)
+        pthread_create(&Ids[T], NULL, callShared, (void *)(intptr_t)T);
+    intptr_t Bad = 0;
+    for (int T = 0; T != Threads; ++T) {
+        void *Result;
+        pthread_join(Ids[T], &Result);
+        Bad += (intptr_t)Result;
+    }
+    double Us = nowUs() - Start;
+    printf("  %d threads: %.1f M calls/s, %ld wrong results\n\n", Threads,
+           Threads * (double)CallsPerThread / Us, (long)Bad);
+
+    kale_session_release(S);
+    free(Ids);
+    free(Create);
+    free(Compile);
+    free(Lookup);
+    free(Call);
+    free(Total);
+    return Bad != 0;
+}
+
+int main(int argc, char **argv) {
+    int Compiles = argc > 1 ? atoi(argv[1]) : 200;
+    int Threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (Compiles <= 0 || Threads <= 0) {
+        fprintf(stderr, "usage: %s [COMPILES] [THREADS]\n", argv[0]);
+        return 1;
+    }
+    return bench(0, Compiles, Threads) || bench(2, Compiles, Threads);
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# loop_bench.sh - Run time of programs with and without loop narrowing.
+#
+#   bench/loop_bench.sh [path/to/Kale] [OPTLEVEL] [program.kl ...]
+#
+# Every program is compiled at -O<OPTLEVEL> (default 2) as usual, where
+# loops over doubles that only hold whole numbers count in integers, and
+# with --no-count-loops, linked against print_dyn.cc and run. Times are the
+# best of three runs, in milliseconds, and both builds must print the same.
+# Programs default to bench/programs/*.kl; run from the source tree.
+set -e
+
+KALE=${1:-./build/Kale}
+OPT=${2:-2}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+PROGRAMS=${*:-bench/programs/*.kl}
+CXX=${CXX:-c++}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# best_of_3 CMD... - Run CMD three times and print the fastest time in ms.
+best_of_3() {
+    best=
+    for _ in 1 2 3; do
+        start=$(now_ms)
+        "$@" >/dev/null 2>&1 || true
+        t=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+    done
+    echo "$best"
+}
+
+$CXX -c -O2 src/print_dyn.cc -o "$WORK/print_dyn.o"
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+
+printf '%-12s %12s %12s %8s\n' program counted-ms double-ms speedup
+for P in $PROGRAMS; do
+    P=$(cd "$(dirname "$P")" && pwd)/$(basename "$P")
+    for MODE in counted double; do
+        FLAG=
+        [ $MODE = double ] && FLAG=--no-count-loops
+        # Kale writes output.o to the current directory.
+        (cd "$WORK" && "$KALE" -O$OPT $FLAG "$P" >/dev/null 2>&1)
+        $CXX -no-pie "$WORK/output.o" "$WORK/print_dyn.o" -o "$WORK/$MODE"
+        "$WORK/$MODE" > "$WORK/$MODE.out" 2>&1 || true
+    done
+    if ! cmp -s "$WORK/counted.out" "$WORK/double.out"; then
+        echo "error: $(basename "$P") prints different results" >&2
+        exit 1
+    fi
+    counted=$(best_of_3 "$WORK/counted")
+    double=$(best_of_3 "$WORK/double")
+    printf '%-12s %12s %12s %7sx\n' "$(basename "$P" .kl)" "$counted" \
+        "$double" "$(awk -v a="$double" -v b="$counted" \
+                     'BEGIN { printf "%.2f", b ? a / b : 0 }')"
+done
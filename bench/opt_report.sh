@@ -0,0 +1,49 @@
+#!/bin/sh
+# opt_report.sh - Compile time vs. run time of the benchmark programs at
+# each optimization level.
+#
+#   bench/opt_report.sh [path/to/Kale] [program.kl ...]
+#
+# Every program is compiled with -O0 to -O3, linked against print_dyn.cc and
+# run. Times are the best of three runs, in milliseconds. Programs default to
+# bench/programs/*.kl; run from the source tree.
+set -e
+
+KALE=${1:-./build/Kale}
+[ $# -gt 0 ] && shift
+PROGRAMS=${*:-bench/programs/*.kl}
+CXX=${CXX:-c++}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# best_of_3 CMD... - Run CMD three times and print the fastest time in ms.
+best_of_3() {
+    best=
+    for _ in 1 2 3; do
+        start=$(now_ms)
+        "$@" >/dev/null 2>&1 || true
+        t=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+    done
+    echo "$best"
+}
+
+$CXX -c -O2 src/print_dyn.cc -o "$WORK/print_dyn.o"
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+
+printf '%-12s %-4s %12s %10s %12s\n' program opt compile-ms run-ms text-bytes
+for P in $PROGRAMS; do
+    P=$(cd "$(dirname "$P")" && pwd)/$(basename "$P")
+    for O in 0 1 2 3; do
+        # Kale writes output.o to the current directory.
+        compile=$(cd "$WORK" && best_of_3 "$KALE" -O$O "$P")
+        (cd "$WORK" && "$KALE" -O$O "$P" >/dev/null 2>&1)
+        $CXX -no-pie "$WORK/output.o" "$WORK/print_dyn.o" -o "$WORK/prog"
+        run=$(best_of_3 "$WORK/prog")
+        text=$(size "$WORK/output.o" | awk 'NR == 2 { print $1 }')
+        printf '%-12s -O%-2s %12s %10s %12s\n' \
+            "$(basename "$P" .kl)" $O "$compile" "$run" "$text"
+    done
+done
@@ -0,0 +1,65 @@
+#!/bin/sh
+# parfor_bench.sh - How the parfors in bench/parfor.kl scale with threads.
+#
+#   bench/parfor_bench.sh [path/to/Kale] [OPTLEVEL] [MAXTHREADS]
+#
+# Compiles bench/parfor.kl at -O<OPTLEVEL> (default 2), links it against
+# print_dyn.cc and parfor_dyn.cc and runs it with KALE_THREADS set to 1, 2,
+# 4, ... and MAXTHREADS (default: every core). Times are the best of three
+# runs; every thread count must print the same results. Run from the source
+# tree.
+set -e
+
+KALE=${1:-./build/Kale}
+OPT=${2:-2}
+MAX=${3:-$(nproc)}
+CXX=${CXX:-c++}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# best_of_3 CMD... - Run CMD three times and print the fastest time in ms.
+best_of_3() {
+    best=
+    for _ in 1 2 3; do
+        start=$(now_ms)
+        "$@" >/dev/null 2>&1 || true
+        t=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$t" -lt "$best" ]; then best=$t; fi
+    done
+    echo "$best"
+}
+
+$CXX -c -O2 src/print_dyn.cc -o "$WORK/print_dyn.o"
+$CXX -c -O2 src/parfor_dyn.cc -o "$WORK/parfor_dyn.o"
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+P=$(pwd)/bench/parfor.kl
+
+# Kale writes output.o to the current directory.
+(cd "$WORK" && "$KALE" -O$OPT "$P" >/dev/null 2>&1)
+$CXX -no-pie "$WORK/output.o" "$WORK/print_dyn.o" "$WORK/parfor_dyn.o" \
+    -lpthread -o "$WORK/parfor"
+
+THREADS=1
+T=2
+while [ $T -lt "$MAX" ]; do
+    THREADS="$THREADS $T"
+    T=$((T * 2))
+done
+[ "$MAX" -gt 1 ] && THREADS="$THREADS $MAX"
+
+KALE_THREADS=1 "$WORK/parfor" > "$WORK/1.out" 2>&1 || true
+printf '%8s %10s %8s\n' threads ms speedup
+for T in $THREADS; do
+    export KALE_THREADS=$T
+    "$WORK/parfor" > "$WORK/$T.out" 2>&1 || true
+    if ! cmp -s "$WORK/1.out" "$WORK/$T.out"; then
+        echo "error: $T threads print different results" >&2
+        exit 1
+    fi
+    t=$(best_of_3 "$WORK/parfor")
+    [ $T = 1 ] && base=$t
+    printf '%8s %10s %7sx\n' "$T" "$t" \
+        "$(awk -v a="$base" -v b="$t" 'BEGIN { printf "%.2f", b ? a / b : 0 }')"
+done
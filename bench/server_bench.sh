@@ -0,0 +1,58 @@
+#!/bin/sh
+# server_bench.sh - What a compile server saves on builds of small programs.
+#
+#   bench/server_bench.sh [path/to/Kale] [OPTLEVEL] [RUNS]
+#
+# Builds output.o from each program in bench/programs/ RUNS times (default
+# 20) at -O<OPTLEVEL> (default 2), once with a fresh Kale process per build
+# and once with kale_client, from the same directory as Kale, against a
+# `Kale --server` started for the purpose, and reports the average time per
+# build in milliseconds. Neither uses an object cache, so every build
+# generates code; the server only saves starting up and setting up targets.
+# Both must write the same output.o. Run from the source tree.
+set -e
+
+KALE=${1:-./build/Kale}
+OPT=${2:-2}
+RUNS=${3:-20}
+WORK=$(mktemp -d)
+KALE=$(cd "$(dirname "$KALE")" && pwd)/$(basename "$KALE")
+CLIENT=$(dirname "$KALE")/kale_client
+
+KALE_SERVER=$WORK/kale.sock
+export KALE_SERVER
+unset KALE_CACHE_DIR
+"$KALE" --server 2>"$WORK/server.log" &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$WORK"' EXIT
+while [ ! -S "$KALE_SERVER" ]; do sleep 0.1; done
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+# avg_ms CMD... - Run CMD RUNS times and print the average time in ms.
+avg_ms() {
+    start=$(now_ms)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        "$@" >/dev/null 2>&1 || true
+        i=$((i + 1))
+    done
+    awk -v t=$(($(now_ms) - start)) -v n="$RUNS" \
+        'BEGIN { printf "%.1f", t / n }'
+}
+
+cd "$WORK"
+printf '%-12s %10s %10s %8s\n' program Kale client speedup
+for P in "$OLDPWD"/bench/programs/*.kl; do
+    "$KALE" -O$OPT "$P" >/dev/null 2>&1 || true
+    mv output.o kale.o
+    "$CLIENT" -O$OPT "$P" >/dev/null 2>&1 || true
+    if ! cmp -s kale.o output.o; then
+        echo "error: the server built a different $(basename "$P")" >&2
+        exit 1
+    fi
+    cold=$(avg_ms "$KALE" -O$OPT "$P")
+    warm=$(avg_ms "$CLIENT" -O$OPT "$P")
+    printf '%-12s %10s %10s %7sx\n' "$(basename "$P")" "$cold" "$warm" \
+        "$(awk -v a="$cold" -v b="$warm" 'BEGIN { printf "%.2f", b ? a / b : 0 }')"
+done
@@ -0,0 +1,181 @@
+// visitor_bench - Compare the two ways of walking an expression AST.
+//
+//   visitor_bench [NODES] [PASSES]
+//
+// Builds a random expression of NODES nodes (a million by default) out of
+// numbers, variables, unary and binary operators and ifs, then evaluates it PASSES
+// times (20 by default) with each scheme:
+//
+//   Visitor      - the virtual interface: accept() and a virtual visit() per
+//                  node, results passed back through a member
+//   ExprVisitor  - a switch on the node's kind calling the pass's methods
+//                  directly, results returned
+//
+// and prints the best time per pass and per node. Both must compute the
+// same value.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "ast.h"
+
+namespace {
+
+struct Tree {
+    ASTArena Arena;
+    std::vector<double> Env;  // The value of each variable, by symbol
+    std::vector<Symbol> VarNames;
+    std::mt19937 Rng{42};
+
+    /// make - A random expression of exactly N nodes.
+    ExprAST *make(size_t N) {
+        if (N <= 1) {
+            if (Rng() % 2)
+                return Arena.make<NumberExprAST>((Rng() % 1000) / 1000.0);
+            return Arena.make<VariableExprAST>(VarNames[Rng() % VarNames.size()]);
+        }
+        if (N == 2)
+            return Arena.make<UnaryExprAST>('-', make(1));
+        if (N >= 4 && Rng() % 5 == 0) {
+            size_t Part = (N - 1) / 3;
+            ExprAST *Cond = make(Part);
+            ExprAST *Then = make(Part);
+            return Arena.make<IfExprAST>(Cond, Then, make(N - 1 - 2 * Part));
+        }
+        static const char Ops[] = {'+', '-', '*', '<'};
+        size_t Left = (N - 1) / 2;
+        ExprAST *LHS = make(Left);
+        return Arena.make<BinaryExprAST>(Ops[Rng() % 4], LHS,
+                                         make(N - 1 - Left));
+    }
+};
+
+double apply(char Op, double L, double R) {
+    switch (Op) {
+    case '+': return L + R;
+    case '-': return L - R;
+    case '*': return L * R;
+    default:  return L < R;
+    }
+}
+
+/// LegacyEvaluator - Evaluates through the virtual Visitor interface, the
+/// way passes were written before nodes had a kind.
+class LegacyEvaluator : public Visitor {
+public:
+    const std::vector<double> &Env;
+    double Value = 0;
+    explicit LegacyEvaluator(const std::vector<double> &Env) : Env(Env) {}
+
+    void visit(NumberExprAST *e) override { Value = e->Val; }
+    void visit(VariableExprAST *e) override { Value = Env[e->Name]; }
+    void visit(BinaryExprAST *e) override {
+        e->LHS->accept(this);
+        double L = Value;
+        e->RHS->accept(this);
+        Value = apply(e->Op, L, Value);
+    }
+    void visit(IfExprAST *e) override {
+        // Walk every node, whichever way the condition goes.
+        e->Cond->accept(this);
+        double Cond = Value;
+        e->Then->accept(this);
+        double Then = Value;
+        e->Else->accept(this);
+        Value = Cond != 0 ? Then : Value;
+    }
+    void visit(CallExprAST *e) override { abort(); }
+    void visit(PrototypeAST *e) override { abort(); }
+    void visit(FunctionAST *e) override { abort(); }
+    void visit(ForExprAST *e) override { abort(); }
+    void visit(UnaryExprAST *e) override {
+        e->Operand->accept(this);
+        Value = -Value;
+    }
+    void visit(VarExprAST *e) override { abort(); }
+    void visit(IndexExprAST *e) override { abort(); }
+    void visit(ParForExprAST *e) override { abort(); }
+};
+
+/// Evaluator - The same pass as an ExprVisitor.
+class Evaluator : public ExprVisitor<Evaluator, double> {
+public:
+    const std::vector<double> &Env;
+    explicit Evaluator(const std::vector<double> &Env) : Env(Env) {}
+
+    double visitNumberExpr(NumberExprAST *e) { return e->Val; }
+    double visitVariableExpr(VariableExprAST *e) { return Env[e->Name]; }
+    double visitBinaryExpr(BinaryExprAST *e) {
+        double L = visit(e->LHS);
+        return apply(e->Op, L, visit(e->RHS));
+    }
+    double visitIfExpr(IfExprAST *e) {
+        double Cond = visit(e->Cond);
+        double Then = visit(e->Then);
+        double Else = visit(e->Else);
+        return Cond != 0 ? Then : Else;
+    }
+    double visitUnaryExpr(UnaryExprAST *e) { return -visit(e->Operand); }
+    double visitExpr(ExprAST *e) { abort(); }
+};
+
+template <typename Fn>
+double timeBest(unsigned Passes, double &Result, Fn Walk) {
+    double Best = 1e30;
+    for (unsigned I = 0; I != Passes; ++I) {
+        auto Start = std::chrono::steady_clock::now();
+        Result = Walk();
+        std::chrono::duration<double> D =
+            std::chrono::steady_clock::now() - Start;
+        Best = std::min(Best, D.count());
+    }
+    return Best;
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv) {
+    size_t Nodes = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    unsigned Passes = argc > 2 ? atoi(argv[2]) : 20;
+    if (Nodes == 0 || Passes == 0) {
+        fprintf(stderr, "usage: %s [NODES] [PASSES]\n", argv[0]);
+        return 1;
+    }
+
+    Tree T;
+    for (const char *Name : {"a", "b", "c", "d", "e", "f", "g", "h"})
+        T.VarNames.push_back(Symbols.intern(Name));
+    for (Symbol S : T.VarNames) {
+        if (T.Env.size() <= S)
+            T.Env.resize(S + 1);
+        T.Env[S] = 0.5 + S % 8 * 0.0625;
+    }
+    ExprAST *Root = T.make(Nodes);
+    printf("%zu nodes, %.1f MB of AST, best of %u passes\n",
+           Nodes, T.Arena.getBytesAllocated() / 1e6, Passes);
+
+    double Legacy, Static;
+    double LegacyTime = timeBest(Passes, Legacy, [&] {
+        LegacyEvaluator V(T.Env);
+        Root->accept(&V);
+        return V.Value;
+    });
+    double StaticTime = timeBest(Passes, Static, [&] {
+        return Evaluator(T.Env).visit(Root);
+    });
+
+    for (auto Row : {std::make_pair("Visitor", LegacyTime),
+                     std::make_pair("ExprVisitor", StaticTime)})
+        printf("%-12s %8.3f ms/pass %6.2f ns/node\n", Row.first,
+               Row.second * 1e3, Row.second * 1e9 / Nodes);
+    printf("speedup: %.2fx\n", LegacyTime / StaticTime);
+
+    if (memcmp(&Legacy, &Static, sizeof(double)) != 0) {
+        fprintf(stderr, "error: the walks disagree (%g vs %g)\n", Legacy,
+                Static);
+        return 1;
+    }
+    return 0;
+}
@@ -13,126 +13,182 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
-#include "llvm/ADT/STLExtras.h"
-#include "llvm/ADT/iterator_range.h"
-#include "llvm/ExecutionEngine/ExecutionEngine.h"
-#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
-#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
-#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/DataLayout.h"
-#include "llvm/IR/Mangler.h"
-#include "llvm/Support/DynamicLibrary.h"
-#include "llvm/Support/raw_ostream.h"
-#include "llvm/Target/TargetMachine.h"
-#include <algorithm>
-#include <map>
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdint>
 #include <memory>
-#include <string>
-#include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// KaleidoscopeJIT - An LLJIT that can also call the functions of the host
+/// process, such as putchard and printd. Compilation runs on a pool of
+/// compile threads if there is one, so a lookup that needs several modules
+/// compiles them in parallel. All members may be called from any thread.
+///
+/// A lazy JIT (an LLLazyJIT) puts each function of a definitions module
+/// behind a stub, and only optimizes and compiles it when it's first called.
+///
+/// Stubs (see addStub()) give functions an address that stays the same while
+/// the code behind it is replaced, e.g. by a better optimized version.
 class KaleidoscopeJIT {
+  std::unique_ptr<LLJIT> J;
+  bool Lazy;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+
+  KaleidoscopeJIT(std::unique_ptr<LLJIT> J, bool Lazy,
+                  std::unique_ptr<IndirectStubsManager> Stubs)
+      : J(std::move(J)), Lazy(Lazy), Stubs(std::move(Stubs)) {}
+
 public:
-  using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
-  using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
-
-  KaleidoscopeJIT()
-      : Resolver(createLegacyLookupResolver(
-            ES,
-            [this](StringRef Name) {
-              return findMangledSymbol(std::string(Name));
-            },
-            [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        ObjectLayer(AcknowledgeORCv1Deprecation, ES,
-                    [this](VModuleKey) {
-                      return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
-                    }),
-        CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
-    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  /// Create - A JIT generating code for JTMB's target, compiling on
+  /// NumCompileThreads threads, or on the looking up thread if that is 0.
+  /// Modules found in Cache, if there is one, aren't compiled again.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(JITTargetMachineBuilder JTMB, unsigned NumCompileThreads,
+         bool Lazy = false, ObjectCache *Cache = nullptr) {
+    auto CreateStubs =
+        createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple());
+    auto CreateCompiler = [Cache](JITTargetMachineBuilder JTMB)
+        -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+      return std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), Cache);
+    };
+    Expected<std::unique_ptr<LLJIT>> J = nullptr;
+    if (Lazy)
+      J = LLLazyJITBuilder()
+              .setJITTargetMachineBuilder(std::move(JTMB))
+              .setCompileFunctionCreator(CreateCompiler)
+              .setNumCompileThreads(NumCompileThreads)
+              .create();
+    else
+      J = LLJITBuilder()
+              .setJITTargetMachineBuilder(std::move(JTMB))
+              .setCompileFunctionCreator(CreateCompiler)
+              .setNumCompileThreads(NumCompileThreads)
+              .create();
+    if (!J)
+      return J.takeError();
+
+    auto Gen = DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        (*J)->getDataLayout().getGlobalPrefix());
+    if (!Gen)
+      return Gen.takeError();
+    (*J)->getMainJITDylib().addGenerator(std::move(*Gen));
+
+    return std::unique_ptr<KaleidoscopeJIT>(
+        new KaleidoscopeJIT(std::move(*J), Lazy, CreateStubs()));
   }
 
-  TargetMachine &getTargetMachine() { return *TM; }
+  const DataLayout &getDataLayout() const { return J->getDataLayout(); }
+
+  JITDylib &getMainJITDylib() { return J->getMainJITDylib(); }
+
+  bool isLazy() const { return Lazy; }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
-    auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
-    ModuleKeys.push_back(K);
-    return K;
+  /// setTransform - Run Transform on every module before it's compiled, e.g.
+  /// to optimize it. In a lazy JIT that's when one of its functions is first
+  /// called, and the module holds just that function.
+  void setTransform(IRTransformLayer::TransformFunction Transform) {
+    J->getIRTransformLayer().setTransform(std::move(Transform));
   }
 
-  void removeModule(VModuleKey K) {
-    ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+  /// setObjectTransform - Run Transform on every object file produced before
+  /// it is linked.
+  void setObjectTransform(ObjectTransformLayer::TransformFunction Transform) {
+    J->getObjTransformLayer().setTransform(std::move(Transform));
   }
 
-  JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+  /// addModule - Add TSM to the main JITDylib. It's compiled when one of its
+  /// symbols is first looked up, and its code can be freed again by removing
+  /// RT, if one is given.
+  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = J->getMainJITDylib().getDefaultResourceTracker();
+    return J->addIRModule(RT, std::move(TSM));
   }
 
-private:
-  std::string mangle(const std::string &Name) {
-    std::string MangledName;
-    {
-      raw_string_ostream MangledNameStream(MangledName);
-      Mangler::getNameWithPrefix(MangledNameStream, Name, DL);
-    }
-    return MangledName;
+  /// addDefinitions - Add TSM, a module of definitions that are there to
+  /// stay. A lazy JIT compiles each function when it's first called. Other
+  /// JITs start compiling all of them right away, in the background if
+  /// there are compile threads.
+  Error addDefinitions(ThreadSafeModule TSM) {
+    if (Lazy)
+      return static_cast<LLLazyJIT &>(*J).addLazyIRModule(std::move(TSM));
+
+    SymbolLookupSet Defined;
+    TSM.withModuleDo([&](Module &M) {
+      for (Function &F : M)
+        if (!F.isDeclaration() && F.hasExternalLinkage())
+          Defined.add(J->mangleAndIntern(F.getName()));
+    });
+    if (Error Err = J->addIRModule(std::move(TSM)))
+      return Err;
+    J->getExecutionSession().lookup(
+        LookupKind::Static, makeJITDylibSearchOrder(&J->getMainJITDylib()),
+        std::move(Defined), SymbolState::Ready,
+        [this](Expected<SymbolMap> Result) {
+          if (!Result)
+            J->getExecutionSession().reportError(Result.takeError());
+        },
+        NoDependenciesToRegister);
+    return Error::success();
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
-#ifdef _WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
-#else
-    const bool ExportedSymbolsOnly = true;
-#endif
+  /// addObjectFile - Add Obj, an object file compiled outside the JIT, to
+  /// the main JITDylib.
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj) {
+    return J->addObjectFile(std::move(Obj));
+  }
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
-        return Sym;
-
-    // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
-      return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-
-#ifdef _WIN32
-    // For Windows retry without "_" at beginning, as RTDyldMemoryManager uses
-    // GetProcAddress and standard libraries like msvcrt.dll use names
-    // with and without "_" (for example "_itoa" but "sin").
-    if (Name.length() > 2 && Name[0] == '_')
-      if (auto SymAddr =
-              RTDyldMemoryManager::getSymbolAddressInProcess(Name.substr(1)))
-        return JITSymbol(SymAddr, JITSymbolFlags::Exported);
-#endif
+  /// defineAbsolute - Define Name in the main JITDylib as Addr, e.g. the
+  /// address of something in this process.
+  Error defineAbsolute(StringRef Name, JITTargetAddress Addr,
+                       JITSymbolFlags Flags = JITSymbolFlags::Exported) {
+    return J->getMainJITDylib().define(absoluteSymbols(
+        {{J->mangleAndIntern(Name), JITEvaluatedSymbol(Addr, Flags)}}));
+  }
+
+  /// addStub - Define Name as a stub that jumps to Target, until
+  /// updateStub() points it elsewhere.
+  Error addStub(StringRef Name, JITTargetAddress Target) {
+    auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    if (Error Err = Stubs->createStub(Name, Target, Flags))
+      return Err;
+    return defineAbsolute(Name, Stubs->findStub(Name, true).getAddress(),
+                          Flags);
+  }
 
-    return nullptr;
+  /// updateStub - Make the stub Name jump to Target from now on. Threads
+  /// calling through it see either the old target or the new one.
+  Error updateStub(StringRef Name, JITTargetAddress Target) {
+    return Stubs->updatePointer(Name, Target);
   }
 
-  ExecutionSession ES;
-  std::shared_ptr<SymbolResolver> Resolver;
-  std::unique_ptr<TargetMachine> TM;
-  const DataLayout DL;
-  ObjLayerT ObjectLayer;
-  CompileLayerT CompileLayer;
-  std::vector<VModuleKey> ModuleKeys;
+  /// lookup - The address of the function or variable called Name, compiling
+  /// whatever it needs first.
+  Expected<uint64_t> lookup(StringRef Name) {
+    auto Sym = J->lookup(Name);
+    if (!Sym)
+      return Sym.takeError();
+#if LLVM_VERSION_MAJOR >= 15
+    return Sym->getValue();
+#else
+    return Sym->getAddress();
+#endif
+  }
 };
 
 } // end namespace orc
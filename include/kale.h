@@ -0,0 +1,59 @@
+/* kale.h - The C API of libkale, which compiles Kale programs in the
+ * calling process, from memory, and hands out the functions defined.
+ *
+ *   kale_session *S = kale_session_create(2, &Err);
+ *   kale_compile(S, Src, strlen(Src), &Err);
+ *   double (*F)(double) = (double (*)(double))kale_lookup(S, "f", &Err);
+ *   ... F(1.5) ...
+ *   kale_session_release(S);
+ *
+ * A function with no declared types takes and returns doubles; to C, an
+ * int is an int64_t, a bool a bool and a double* a double *. Functions
+ * stay valid until their session is released, and any number of threads
+ * may call them at the same time. Any thread may use a session; compiles
+ * in one session run one at a time, and separate sessions share nothing.
+ *
+ * Functions that fail return NULL or nonzero, and if ERROR isn't NULL, set
+ * *ERROR to a message to free with kale_error_free().
+ */
+#ifndef KALE_H
+#define KALE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kale_session kale_session;
+
+/* kale_session_create - A session compiling for this machine at
+ * -O<OPT_LEVEL>, 0 to 3. Its programs can use parfor, and call printd,
+ * putchard and whatever kale_define_symbol() adds as externs. */
+kale_session *kale_session_create(unsigned opt_level, char **error);
+
+/* kale_session_release - Free S and all the code compiled in it. */
+void kale_session_release(kale_session *s);
+
+/* kale_define_symbol - Let programs compiled in S call the function at
+ * ADDR, once they declare it as an extern called NAME. */
+int kale_define_symbol(kale_session *s, const char *name, void *addr,
+                       char **error);
+
+/* kale_compile - Compile the SIZE bytes of SOURCE, definitions and
+ * externs, which later sources can use in turn. Definitions before an
+ * error are kept. Returns 0 on success. */
+int kale_compile(kale_session *s, const char *source, size_t size,
+                 char **error);
+
+/* kale_lookup - The address of the function NAME defined in S, or NULL. */
+void *kale_lookup(kale_session *s, const char *name, char **error);
+
+/* kale_error_free - Free a message set by any of the above. */
+void kale_error_free(char *error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KALE_H */
@@ -0,0 +1,49 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <memory>
+#include <new>
+#include <utility>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Allocator.h"
+
+/// ASTArena - Bump-pointer storage for the expression nodes of one top-level
+/// item. Nodes are never freed one by one: once the item has been code
+/// generated, reset() releases all of them at once and keeps the first slab
+/// around for the next item. Destructors are not run, so anything allocated
+/// here must not own other memory.
+class ASTArena {
+  llvm::BumpPtrAllocator Alloc;
+  size_t NumNodes = 0;
+
+public:
+  /// make - Construct a T in the arena.
+  template <typename T, typename... ArgTs> T *make(ArgTs &&... Args) {
+    ++NumNodes;
+    return new (Alloc.Allocate(sizeof(T), alignof(T)))
+        T(std::forward<ArgTs>(Args)...);
+  }
+
+  /// copyArray - Copy Elts into the arena, e.g. to freeze a SmallVector of
+  /// child nodes that was built up on the stack.
+  template <typename T>
+  llvm::MutableArrayRef<T> copyArray(llvm::ArrayRef<T> Elts) {
+    if (Elts.empty())
+      return llvm::MutableArrayRef<T>();
+    T *Mem = Alloc.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return llvm::MutableArrayRef<T>(Mem, Elts.size());
+  }
+
+  /// reset - Drop every node allocated since the last reset.
+  void reset() {
+    Alloc.Reset();
+    NumNodes = 0;
+  }
+
+  size_t getNumNodes() const { return NumNodes; }
+  size_t getBytesAllocated() const { return Alloc.getBytesAllocated(); }
+  size_t getTotalMemory() const { return Alloc.getTotalMemory(); }
+};
+
+#endif	// ARENA_H
@@ -1,20 +1,18 @@
 #ifndef AST_H
 #define AST_H
 
+#include <cmath>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <vector>
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LegacyPassManager.h"
-
-extern std::unique_ptr<llvm::LLVMContext> TheContext;
-extern std::unique_ptr<llvm::IRBuilder<>> Builder;
-extern std::unique_ptr<llvm::Module> TheModule;
-extern std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-extern std::map<std::string, llvm::AllocaInst *> NamedValues;
-extern std::map<char, int> BinopPrecedence;
+#include "arena.h"
+#include "symbol.h"
 
 class NumberExprAST;
 class VariableExprAST;
@@ -26,7 +24,22 @@ class IfExprAST;
 class ForExprAST;
 class UnaryExprAST;
 class VarExprAST;
+class IndexExprAST;
+class ParForExprAST;
+
+/// ValueType - The type of a value. Kale had nothing but doubles at first,
+/// and a value is still one unless it's declared or inferred otherwise.
+enum ValueType : uint8_t {
+  VT_Double,
+  VT_Int,    // 64-bit signed integer
+  VT_Bool,
+  VT_DoublePtr,  // double*: an array of doubles in the caller's memory
+  VT_Infer,  // Not declared; type inference decides
+};
 
+/// Visitor - Double dispatch over the AST through virtual calls. Expression
+/// nodes reach it through ExprAST::accept(); new passes over expressions
+/// should derive from ExprVisitor instead, which is cheaper.
 class Visitor {
 public:
   virtual void visit(NumberExprAST* e) = 0;
@@ -39,95 +52,129 @@ public:
   virtual void visit(ForExprAST* e) = 0;
   virtual void visit(UnaryExprAST* e) = 0;
   virtual void visit(VarExprAST* e) = 0;
+  virtual void visit(IndexExprAST* e) = 0;
+  virtual void visit(ParForExprAST* e) = 0;
 };
 
-/// ExprAST - Base class for all expression nodes.
+/// ExprAST - Base class for all expression nodes. Expression nodes live in
+/// the ASTArena of the top-level item they belong to and point to each other
+/// with plain pointers; the arena releases them all at once.
+///
+/// Every node is tagged with its kind, which is what passes dispatch on (see
+/// ExprVisitor) and what llvm::isa<> and llvm::dyn_cast<> look at. Nodes have
+/// no virtual functions; the arena never runs their destructors anyway.
 class ExprAST {
 public:
-  virtual ~ExprAST() = default;
-  virtual void accept(Visitor *v) = 0;
+  enum ExprKind : uint8_t {
+    EK_Number,
+    EK_Variable,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+    EK_For,
+    EK_Unary,
+    EK_Var,
+    EK_Index,
+    EK_ParFor,
+  };
+
+  ExprKind getKind() const { return Kind; }
+
+  /// Type - The type of the value, once TypeInference has run.
+  ValueType Type = VT_Double;
+
+  /// accept - Visit this node with a Visitor.
+  inline void accept(Visitor *v);
+
+protected:
+  explicit ExprAST(ExprKind Kind) : Kind(Kind) {}
+
+private:
+  const ExprKind Kind;
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
 class NumberExprAST : public ExprAST {
 public:
   double Val;
-  NumberExprAST(double Val) : Val(Val) {}
-  void accept(Visitor* v) {
-    v->visit(this);
+  NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+  /// isIntegral - Whether Val is an int as it stands: a whole number no
+  /// bigger than 2^53, and not -0.
+  static bool isIntegral(double Val) {
+    return Val == std::trunc(Val) && std::fabs(Val) <= 0x1p53 &&
+           !(Val == 0 && std::signbit(Val));
   }
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST {
 public:
-  std::string Name;
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-  void accept(Visitor* v) {
-    v->visit(this);
-  }
-  const std::string &getName() const { return Name; }
+  Symbol Name;
+  VariableExprAST(Symbol Name) : ExprAST(EK_Variable), Name(Name) {}
+  const std::string &getName() const { return Symbols.getName(Name); }
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST {
 public:
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  void accept(Visitor* v) {
-    v->visit(this);
-  }
+  ExprAST *LHS, *RHS;
+  BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+      : ExprAST(EK_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
 /// CallExprAST - Expression class for function calls.
 class CallExprAST : public ExprAST {
 public:
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
-  void accept(Visitor* v) {
-    v->visit(this);
-  }
+  Symbol Callee;
+  llvm::MutableArrayRef<ExprAST *> Args;  // Allocated in the arena
+  CallExprAST(Symbol Callee, llvm::MutableArrayRef<ExprAST *> Args)
+      : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
+/// of arguments the function takes). Prototypes outlive the item they were
+/// parsed in (see CompilerInstance::FunctionProtos), so unlike expressions
+/// they are heap allocated.
 class PrototypeAST {
 public:
-  std::string Name;
-  std::vector<std::string> Args;
+  Symbol Name;
+  std::vector<Symbol> Args;
+  std::vector<ValueType> ArgTypes;  // Of each argument
+  ValueType RetType = VT_Double;
   bool IsOperator;
   unsigned Precedence;  // Precedence if a binary op
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args,
+  PrototypeAST(Symbol Name, std::vector<Symbol> Args,
                bool IsOperator = false, unsigned Prec = 0)
-      : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-        Precedence(Prec) {}
+      : Name(Name), Args(std::move(Args)), ArgTypes(this->Args.size()),
+        IsOperator(IsOperator), Precedence(Prec) {}
 
   void accept(Visitor* v) {
     v->visit(this);
   }
-  const std::string &getName() const { return Name; }
+  const std::string &getName() const { return Symbols.getName(Name); }
 
+  /// isTyped - Whether an argument or the result isn't a double.
+  bool isTyped() const;
   bool isUnaryOp() const;
   bool isBinaryOp() const;
   char getOperatorName() const;
   unsigned getBinaryPrecedence() const;
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself. The body
+/// lives in the parser's arena.
 class FunctionAST {
 public:
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  ExprAST *Body;
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
   void accept(Visitor* v) {
     v->visit(this);
   }
@@ -136,60 +183,171 @@ public:
 // IfExprAST - Expression class for if/then/else
 class IfExprAST : public ExprAST {
 public:
-    std::unique_ptr<ExprAST> Cond, Then, Else;
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-            std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-
-    void accept(Visitor* v) {
-      v->visit(this);
-    }
+    ExprAST *Cond, *Then, *Else;
+    IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+        : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
 };
 
 class ForExprAST : public ExprAST {
 public:
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-          Step(std::move(Step)), Body(std::move(Body)) {}
-
-    void accept(Visitor* v) {
-      v->visit(this);
-    }
+    Symbol VarName;
+    ExprAST *Start, *End, *Step, *Body;  // Step may be null
+    ValueType VarType = VT_Infer;  // Of the variable, filled in by inference
+    bool Counted = false;  // Whether LoopNarrowing lets it count in an i64
+    ForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+               ExprAST *Body)
+        : ExprAST(EK_For), VarName(VarName), Start(Start), End(End),
+          Step(Step), Body(Body) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
 };
 
 // UnaryExprAST - Expression class for a unary operator
 class UnaryExprAST : public ExprAST {
 public:
     char Opcode;
-    std::unique_ptr<ExprAST> Operand;
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-        : Opcode(Opcode), Operand(std::move(Operand)) {}
-
-    void accept(Visitor* v) {
-      v->visit(this);
-    }
+    ExprAST *Operand;
+    UnaryExprAST(char Opcode, ExprAST *Operand)
+        : ExprAST(EK_Unary), Opcode(Opcode), Operand(Operand) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
 };
 
 // VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
 public:
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-        std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
-    void accept(Visitor* v) {
-      v->visit(this);
+    // Initializers may be null. Allocated in the arena.
+    llvm::MutableArrayRef<std::pair<Symbol, ExprAST *>> VarNames;
+    // The type of each variable, VT_Infer where none is declared until
+    // inference fills it in. Allocated in the arena, the size of VarNames.
+    llvm::MutableArrayRef<ValueType> VarTypes;
+    ExprAST *Body;
+    VarExprAST(llvm::MutableArrayRef<std::pair<Symbol, ExprAST *>> VarNames,
+        llvm::MutableArrayRef<ValueType> VarTypes, ExprAST *Body)
+      : ExprAST(EK_Var), VarNames(VarNames), VarTypes(VarTypes), Body(Body) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+};
+
+/// IndexExprAST - Expression class for an element of an array, like "a[i]",
+/// read, or stored to as the LHS of an '='.
+class IndexExprAST : public ExprAST {
+public:
+    ExprAST *Array, *Index;
+    IndexExprAST(ExprAST *Array, ExprAST *Index)
+        : ExprAST(EK_Index), Array(Array), Index(Index) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+};
+
+/// ParForExprAST - Expression class for parfor/in, a loop over the whole
+/// numbers from Start up to, but not including, End whose trips run in
+/// parallel, Grain of them at a time. Its value is the body's values
+/// combined with Reduce, or 0 without one.
+class ParForExprAST : public ExprAST {
+public:
+    /// ReduceOp - How the body's values are combined. The numbering is the
+    /// runtime's too; see kale_parfor() in parfor_dyn.cc.
+    enum ReduceOp : uint8_t { RO_None, RO_Add, RO_Mul, RO_Min, RO_Max };
+
+    Symbol VarName;
+    ExprAST *Start, *End, *Grain, *Body;  // Grain may be null
+    ReduceOp Reduce;
+
+    ParForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End,
+                  ExprAST *Grain, ReduceOp Reduce, ExprAST *Body)
+        : ExprAST(EK_ParFor), VarName(VarName), Start(Start), End(End),
+          Grain(Grain), Body(Body), Reduce(Reduce) {}
+    static bool classof(const ExprAST *E) {
+        return E->getKind() == EK_ParFor;
+    }
+};
+
+/// ExprVisitor - Visits expressions by switching on their kind, in the style
+/// of llvm::InstVisitor. Derived implements visitNumberExpr(),
+/// visitBinaryExpr() and so on for the kinds it handles, each returning
+/// RetTy. The calls are resolved at compile time, so a pass costs one
+/// switch per node and its methods can be inlined into it. Kinds Derived
+/// doesn't handle go to its visitExpr().
+template <typename Derived, typename RetTy = void> class ExprVisitor {
+public:
+  RetTy visit(ExprAST *E) {
+    switch (E->getKind()) {
+    case ExprAST::EK_Number:
+      return derived().visitNumberExpr(static_cast<NumberExprAST *>(E));
+    case ExprAST::EK_Variable:
+      return derived().visitVariableExpr(static_cast<VariableExprAST *>(E));
+    case ExprAST::EK_Binary:
+      return derived().visitBinaryExpr(static_cast<BinaryExprAST *>(E));
+    case ExprAST::EK_Call:
+      return derived().visitCallExpr(static_cast<CallExprAST *>(E));
+    case ExprAST::EK_If:
+      return derived().visitIfExpr(static_cast<IfExprAST *>(E));
+    case ExprAST::EK_For:
+      return derived().visitForExpr(static_cast<ForExprAST *>(E));
+    case ExprAST::EK_Unary:
+      return derived().visitUnaryExpr(static_cast<UnaryExprAST *>(E));
+    case ExprAST::EK_Var:
+      return derived().visitVarExpr(static_cast<VarExprAST *>(E));
+    case ExprAST::EK_Index:
+      return derived().visitIndexExpr(static_cast<IndexExprAST *>(E));
+    case ExprAST::EK_ParFor:
+      return derived().visitParForExpr(static_cast<ParForExprAST *>(E));
     }
+    llvm_unreachable("unknown expression kind");
+  }
+
+  RetTy visitExpr(ExprAST *E) { return RetTy(); }
+  RetTy visitNumberExpr(NumberExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitVariableExpr(VariableExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitBinaryExpr(BinaryExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitCallExpr(CallExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitIfExpr(IfExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitForExpr(ForExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitUnaryExpr(UnaryExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitVarExpr(VarExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitIndexExpr(IndexExprAST *E) { return derived().visitExpr(E); }
+  RetTy visitParForExpr(ParForExprAST *E) { return derived().visitExpr(E); }
+
+private:
+  Derived &derived() { return *static_cast<Derived *>(this); }
+};
+
+/// VisitorAdapter - Runs a Visitor written against the virtual interface on
+/// the kind switch; ExprAST::accept() goes through it.
+class VisitorAdapter : public ExprVisitor<VisitorAdapter> {
+  Visitor &V;
+
+public:
+  explicit VisitorAdapter(Visitor &V) : V(V) {}
+  void visitNumberExpr(NumberExprAST *E) { V.visit(E); }
+  void visitVariableExpr(VariableExprAST *E) { V.visit(E); }
+  void visitBinaryExpr(BinaryExprAST *E) { V.visit(E); }
+  void visitCallExpr(CallExprAST *E) { V.visit(E); }
+  void visitIfExpr(IfExprAST *E) { V.visit(E); }
+  void visitForExpr(ForExprAST *E) { V.visit(E); }
+  void visitUnaryExpr(UnaryExprAST *E) { V.visit(E); }
+  void visitVarExpr(VarExprAST *E) { V.visit(E); }
+  void visitIndexExpr(IndexExprAST *E) { V.visit(E); }
+  void visitParForExpr(ParForExprAST *E) { V.visit(E); }
 };
 
+void ExprAST::accept(Visitor *v) { VisitorAdapter(*v).visit(this); }
+
 
-extern std::unique_ptr<ExprAST> LogError(const char *Str);
+/// ErrorLog - If set, errors reported on this thread are appended to it, a
+/// line each, instead of being printed to stderr; libkale collects them for
+/// its caller that way.
+extern thread_local std::string *ErrorLog;
+
+extern ExprAST *LogError(const char *Str);
 extern std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
 extern llvm::Value *LogErrorV(const char *Str);
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+/// getTypeName - How Ty is spelled in a declaration, e.g. "int".
+extern const char *getTypeName(ValueType Ty);
+/// lookupTypeName - The type spelled Name in a declaration, or VT_Infer if
+/// Name isn't one.
+extern ValueType lookupTypeName(Symbol Name);
+
+/// getOperatorSymbol - The symbol naming the function that implements a user
+/// defined operator, e.g. "binary|" or "unary!".
+extern Symbol getOperatorSymbol(const char *Kind, char Op);
 #endif	// AST_H
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cstring>
+#include "llvm/ADT/SmallVector.h"
+
+#include "bytecode.h"
+
+std::unique_ptr<BytecodeFunction>
+BytecodeCompiler::compile(FunctionAST &Expr, const CompilerInstance &CI) {
+  if (!Expr.Proto->Args.empty())
+    return nullptr;
+  auto Fn = std::make_unique<BytecodeFunction>();
+  BytecodeCompiler Compiler(CI, *Fn);
+  unsigned Result = Compiler.allocRegs(1);
+  Compiler.compileInto(Expr.Body, Result);
+  Compiler.emit(BC_Return, Result);
+  if (!Compiler.Ok)
+    return nullptr;
+  return Fn;
+}
+
+/// emit - Append an instruction, returning its index. Operands have 16 bits;
+/// an expression needing more registers, constants or instructions than that
+/// is left to the JIT.
+size_t BytecodeCompiler::emit(BCOpcode Op, size_t A, size_t B, size_t C) {
+  if (std::max({A, B, C}) > UINT16_MAX)
+    Ok = false;
+  Fn.Code.push_back({Op, uint16_t(A), uint16_t(B), uint16_t(C)});
+  return Fn.Code.size() - 1;
+}
+
+unsigned BytecodeCompiler::allocRegs(unsigned N) {
+  unsigned First = NextReg;
+  NextReg += N;
+  Fn.NumRegs = std::max(Fn.NumRegs, NextReg);
+  return First;
+}
+
+unsigned BytecodeCompiler::getConst(double Val) {
+  // By bit pattern, so that 0.0 and -0.0 stay apart.
+  uint64_t Bits;
+  memcpy(&Bits, &Val, sizeof(Bits));
+  auto Inserted = ConstIndex.try_emplace(Bits, Fn.Consts.size());
+  if (Inserted.second)
+    Fn.Consts.push_back(Val);
+  return Inserted.first->second;
+}
+
+void BytecodeCompiler::compileInto(ExprAST *E, unsigned Dst) {
+  if (!Ok)
+    return;
+  unsigned OldDst = this->Dst;
+  this->Dst = Dst;
+  visit(E);
+  this->Dst = OldDst;
+}
+
+/// emitCall - Call Name with Args, which go into consecutive registers.
+void BytecodeCompiler::emitCall(Symbol Name, llvm::ArrayRef<ExprAST *> Args) {
+  // Registers hold doubles, so the callee must take and return them.
+  auto Proto = CI.FunctionProtos.find(Name);
+  if (Proto == CI.FunctionProtos.end() ||
+      Proto->second->Args.size() != Args.size() ||
+      Proto->second->isTyped() || Args.size() > MaxCallArgs) {
+    Ok = false;
+    return;
+  }
+
+  unsigned Base = allocRegs(Args.size());
+  for (size_t I = 0; I != Args.size(); ++I)
+    compileInto(Args[I], Base + I);
+  auto Inserted = CalleeIndex.try_emplace(Name, Fn.Callees.size());
+  if (Inserted.second)
+    Fn.Callees.push_back({Name, unsigned(Args.size()), nullptr});
+  emit(BC_Call, Dst, Inserted.first->second, Base);
+  NextReg = Base;
+}
+
+void BytecodeCompiler::visitNumberExpr(NumberExprAST *e) {
+  emit(BC_LoadK, Dst, getConst(e->Val));
+}
+
+void BytecodeCompiler::visitVariableExpr(VariableExprAST *e) {
+  auto It = Vars.find(e->Name);
+  if (It == Vars.end()) {
+    Ok = false;
+    return;
+  }
+  emit(BC_Move, Dst, It->second);
+}
+
+void BytecodeCompiler::visitIndexExpr(IndexExprAST *e) {
+  // Registers hold doubles, and a top-level expression has no arrays to
+  // index; generating code for it reports the error.
+  Ok = false;
+}
+
+void BytecodeCompiler::visitParForExpr(ParForExprAST *e) {
+  // Its body runs on other threads, as a function of its own.
+  Ok = false;
+}
+
+void BytecodeCompiler::visitBinaryExpr(BinaryExprAST *e) {
+  if (e->Op == '=') {
+    auto *LHSE = llvm::dyn_cast<VariableExprAST>(e->LHS);
+    auto It = LHSE ? Vars.find(LHSE->Name) : Vars.end();
+    if (It == Vars.end()) {
+      Ok = false;
+      return;
+    }
+    compileInto(e->RHS, Dst);
+    emit(BC_Move, It->second, Dst);
+    return;
+  }
+
+  BCOpcode Op;
+  switch (e->Op) {
+  case '+': Op = BC_Add; break;
+  case '-': Op = BC_Sub; break;
+  case '*': Op = BC_Mul; break;
+  case '<': Op = BC_Less; break;
+  default:
+    emitCall(getOperatorSymbol("binary", e->Op), {e->LHS, e->RHS});
+    return;
+  }
+  compileInto(e->LHS, Dst);
+  unsigned RHS = allocRegs(1);
+  compileInto(e->RHS, RHS);
+  emit(Op, Dst, Dst, RHS);
+  NextReg = RHS;
+}
+
+void BytecodeCompiler::visitCallExpr(CallExprAST *e) {
+  emitCall(e->Callee, e->Args);
+}
+
+void BytecodeCompiler::visitIfExpr(IfExprAST *e) {
+  compileInto(e->Cond, Dst);
+  size_t ToElse = emit(BC_JumpIfNot, Dst);
+  compileInto(e->Then, Dst);
+  size_t ToEnd = emit(BC_Jump);
+  Fn.Code[ToElse].B = uint16_t(Fn.Code.size());
+  compileInto(e->Else, Dst);
+  Fn.Code[ToEnd].B = uint16_t(Fn.Code.size());
+  if (Fn.Code.size() > UINT16_MAX)
+    Ok = false;
+}
+
+void BytecodeCompiler::visitForExpr(ForExprAST *e) {
+  // The same order as the code generated for a loop: body, step, end
+  // condition, then the variable is stepped and the condition tested.
+  unsigned Var = allocRegs(1);
+  compileInto(e->Start, Var);
+  size_t Top = Fn.Code.size();
+
+  auto Old = Vars.find(e->VarName);
+  llvm::Optional<unsigned> OldReg;
+  if (Old != Vars.end())
+    OldReg = Old->second;
+  Vars[e->VarName] = Var;
+
+  // The body's value is thrown away, so the step can go where it was.
+  unsigned Step = allocRegs(1);
+  compileInto(e->Body, Step);
+  if (e->Step)
+    compileInto(e->Step, Step);
+  else
+    emit(BC_LoadK, Step, getConst(1.0));
+  unsigned End = allocRegs(1);
+  compileInto(e->End, End);
+  emit(BC_Add, Var, Var, Step);
+
+  BytecodeFunction::Loop L{e, {}};
+  for (auto &V : Vars)
+    L.Vars.push_back({V.first, V.second});
+  Fn.Loops.push_back(std::move(L));
+  emit(BC_LoopBack, End, Top, Fn.Loops.size() - 1);
+
+  if (OldReg)
+    Vars[e->VarName] = *OldReg;
+  else
+    Vars.erase(e->VarName);
+  NextReg = Var;
+
+  // for expr always returns 0.0
+  emit(BC_LoadK, Dst, getConst(0.0));
+}
+
+void BytecodeCompiler::visitUnaryExpr(UnaryExprAST *e) {
+  emitCall(getOperatorSymbol("unary", e->Opcode), {e->Operand});
+}
+
+void BytecodeCompiler::visitVarExpr(VarExprAST *e) {
+  unsigned First = NextReg;
+  llvm::SmallVector<std::pair<Symbol, llvm::Optional<unsigned>>, 4> Old;
+  for (ValueType Ty : e->VarTypes)
+    if (Ty == VT_Int || Ty == VT_Bool) {
+      Ok = false;  // Its value would need converting
+      return;
+    }
+  for (auto &Var : e->VarNames) {
+    // The initializer is emitted before the variable is in scope.
+    unsigned Reg = allocRegs(1);
+    if (Var.second)
+      compileInto(Var.second, Reg);
+    else
+      emit(BC_LoadK, Reg, getConst(0.0));
+
+    auto It = Vars.find(Var.first);
+    Old.push_back({Var.first, It == Vars.end()
+                                  ? llvm::Optional<unsigned>()
+                                  : llvm::Optional<unsigned>(It->second)});
+    Vars[Var.first] = Reg;
+  }
+
+  compileInto(e->Body, Dst);
+
+  for (auto &Binding : llvm::reverse(Old)) {
+    if (Binding.second)
+      Vars[Binding.first] = *Binding.second;
+    else
+      Vars.erase(Binding.first);
+  }
+  NextReg = First;
+}
+
+/// isTrue - A condition holds if it is neither 0 nor NaN, as in the code
+/// generated for if and for.
+static inline bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+/// callNative - Call the function at Addr, which takes NumArgs doubles.
+static double callNative(void *Addr, unsigned NumArgs, const double *A) {
+  using D = double;
+  switch (NumArgs) {
+  case 0: return reinterpret_cast<D (*)()>(Addr)();
+  case 1: return reinterpret_cast<D (*)(D)>(Addr)(A[0]);
+  case 2: return reinterpret_cast<D (*)(D, D)>(Addr)(A[0], A[1]);
+  case 3: return reinterpret_cast<D (*)(D, D, D)>(Addr)(A[0], A[1], A[2]);
+  case 4:
+    return reinterpret_cast<D (*)(D, D, D, D)>(Addr)(A[0], A[1], A[2], A[3]);
+  case 5:
+    return reinterpret_cast<D (*)(D, D, D, D, D)>(Addr)(A[0], A[1], A[2],
+                                                        A[3], A[4]);
+  case 6:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D)>(Addr)(A[0], A[1], A[2],
+                                                           A[3], A[4], A[5]);
+  case 7:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D, D)>(Addr)(
+        A[0], A[1], A[2], A[3], A[4], A[5], A[6]);
+  default:
+    static_assert(BytecodeCompiler::MaxCallArgs == 8, "add a case");
+    return reinterpret_cast<D (*)(D, D, D, D, D, D, D, D)>(Addr)(
+        A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+  }
+}
+
+// With GNU C, every instruction jumps straight to the code for the next one
+// (computed goto), which gives each its own indirect branch to predict.
+// Otherwise they all go back through one switch.
+#if defined(__GNUC__)
+#define BC_CASE(Op) Op##_Label
+#define BC_DISPATCH() goto *Targets[I->Op]
+#else
+#define BC_CASE(Op) case Op
+#define BC_DISPATCH() goto Dispatch
+#endif
+#define BC_NEXT()                                                              \
+  do {                                                                         \
+    ++I;                                                                       \
+    BC_DISPATCH();                                                             \
+  } while (0)
+
+double runBytecode(const BytecodeFunction &Fn, unsigned PromoteAfter,
+                   LoopRunner RunLoop) {
+  llvm::SmallVector<double, 64> Frame(Fn.NumRegs);
+  llvm::SmallVector<unsigned, 8> Trips(Fn.Loops.size());
+  double *R = Frame.data();
+  const double *K = Fn.Consts.data();
+  const BytecodeFunction::Callee *Callees = Fn.Callees.data();
+  const BCInstr *Code = Fn.Code.data();
+  const BCInstr *I = Code;
+
+#if defined(__GNUC__)
+  static const void *const Targets[] = {
+      &&BC_LoadK_Label,    &&BC_Move_Label,     &&BC_Add_Label,
+      &&BC_Sub_Label,      &&BC_Mul_Label,      &&BC_Less_Label,
+      &&BC_Jump_Label,     &&BC_JumpIfNot_Label, &&BC_LoopBack_Label,
+      &&BC_Call_Label,     &&BC_Return_Label,
+  };
+  static_assert(sizeof(Targets) / sizeof(Targets[0]) == BC_NumOpcodes,
+                "every opcode needs a target");
+  BC_DISPATCH();
+#else
+Dispatch:
+  switch (I->Op) {
+#endif
+
+  BC_CASE(BC_LoadK):
+    R[I->A] = K[I->B];
+    BC_NEXT();
+  BC_CASE(BC_Move):
+    R[I->A] = R[I->B];
+    BC_NEXT();
+  BC_CASE(BC_Add):
+    R[I->A] = R[I->B] + R[I->C];
+    BC_NEXT();
+  BC_CASE(BC_Sub):
+    R[I->A] = R[I->B] - R[I->C];
+    BC_NEXT();
+  BC_CASE(BC_Mul):
+    R[I->A] = R[I->B] * R[I->C];
+    BC_NEXT();
+  BC_CASE(BC_Less):
+    R[I->A] = !(R[I->B] >= R[I->C]) ? 1.0 : 0.0;
+    BC_NEXT();
+  BC_CASE(BC_Jump):
+    I = Code + I->B;
+    BC_DISPATCH();
+  BC_CASE(BC_JumpIfNot):
+    if (isTrue(R[I->A]))
+      BC_NEXT();
+    I = Code + I->B;
+    BC_DISPATCH();
+  BC_CASE(BC_LoopBack):
+    if (!isTrue(R[I->A]))
+      BC_NEXT();
+    // Once a loop is hot it stays hot, so re-entering it (e.g. as the inner
+    // loop of another) goes straight to the compiled code again.
+    if (RunLoop && ++Trips[I->C] >= PromoteAfter) {
+      if (RunLoop(I->C, R))
+        BC_NEXT();
+      Trips[I->C] = 0;
+    }
+    I = Code + I->B;
+    BC_DISPATCH();
+  BC_CASE(BC_Call): {
+    const BytecodeFunction::Callee &F = Callees[I->B];
+    R[I->A] = callNative(F.Addr, F.NumArgs, R + I->C);
+    BC_NEXT();
+  }
+  BC_CASE(BC_Return):
+    return R[I->A];
+
+#if !defined(__GNUC__)
+  default:
+    break;
+  }
+  return 0;
+#endif
+}
+
+#undef BC_CASE
+#undef BC_DISPATCH
+#undef BC_NEXT
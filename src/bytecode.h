@@ -0,0 +1,125 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "ast.h"
+#include "compilerInstance.h"
+
+/// BCOpcode - The instructions of the bytecode, a register machine for
+/// running top-level expressions without generating code for them. A frame
+/// is an array of doubles, the registers; variables live in registers of
+/// their own and temporaries in the ones above them.
+enum BCOpcode : uint16_t {
+  BC_LoadK,     // R[A] = K[B]
+  BC_Move,      // R[A] = R[B]
+  BC_Add,       // R[A] = R[B] + R[C]
+  BC_Sub,       // R[A] = R[B] - R[C]
+  BC_Mul,       // R[A] = R[B] * R[C]
+  BC_Less,      // R[A] = R[B] < R[C] (or unordered) ? 1 : 0
+  BC_Jump,      // goto B
+  BC_JumpIfNot, // if R[A] is 0 or NaN goto B
+  BC_LoopBack,  // if R[A] is neither 0 nor NaN: count an iteration of loop
+                // C, then goto B, or have the rest of the loop run compiled
+  BC_Call,      // R[A] = Callees[B](R[C], R[C+1], ...)
+  BC_Return,    // return R[A]
+  BC_NumOpcodes
+};
+
+/// BCInstr - One instruction; what its operands mean depends on the opcode.
+struct BCInstr {
+  BCOpcode Op;
+  uint16_t A, B, C;
+};
+
+/// BytecodeFunction - The bytecode of one top-level expression. It points
+/// into the expression's AST, so it is only good as long as that is.
+struct BytecodeFunction {
+  /// Callee - A function called by the bytecode. Addr is filled in by
+  /// whoever runs it, e.g. with the address the JIT has for Name.
+  struct Callee {
+    Symbol Name;
+    unsigned NumArgs;
+    void *Addr;
+  };
+
+  /// Loop - A for loop, and what it takes to compile the rest of it once it
+  /// has run for long enough: the loop itself, and the variables in scope in
+  /// its body, each with its register.
+  struct Loop {
+    ForExprAST *For;
+    std::vector<std::pair<Symbol, unsigned>> Vars;
+  };
+
+  std::vector<BCInstr> Code;
+  std::vector<double> Consts;
+  std::vector<Callee> Callees;
+  std::vector<Loop> Loops;
+  unsigned NumRegs = 0;
+};
+
+/// BytecodeCompiler - Turns the AST of a top-level expression into bytecode.
+class BytecodeCompiler : public ExprVisitor<BytecodeCompiler> {
+public:
+  /// MaxCallArgs - Functions taking more arguments than this can't be called
+  /// from bytecode.
+  static constexpr unsigned MaxCallArgs = 8;
+
+  /// compile - The bytecode for Expr, a top-level expression, calling the
+  /// functions declared in CI. Null if it can't be run as bytecode, e.g.
+  /// because it refers to an unknown variable; generating code for it then
+  /// reports the error.
+  static std::unique_ptr<BytecodeFunction> compile(FunctionAST &Expr,
+                                                   const CompilerInstance &CI);
+
+  void visitNumberExpr(NumberExprAST *e);
+  void visitVariableExpr(VariableExprAST *e);
+  void visitBinaryExpr(BinaryExprAST *e);
+  void visitCallExpr(CallExprAST *e);
+  void visitIfExpr(IfExprAST *e);
+  void visitForExpr(ForExprAST *e);
+  void visitUnaryExpr(UnaryExprAST *e);
+  void visitVarExpr(VarExprAST *e);
+  void visitIndexExpr(IndexExprAST *e);
+  void visitParForExpr(ParForExprAST *e);
+
+private:
+  BytecodeCompiler(const CompilerInstance &CI, BytecodeFunction &Fn)
+      : CI(CI), Fn(Fn) {}
+
+  /// compileInto - Emit E, leaving its value in register Dst.
+  void compileInto(ExprAST *E, unsigned Dst);
+  void emitCall(Symbol Name, llvm::ArrayRef<ExprAST *> Args);
+  size_t emit(BCOpcode Op, size_t A = 0, size_t B = 0, size_t C = 0);
+  unsigned allocRegs(unsigned N);
+  unsigned getConst(double Val);
+
+  const CompilerInstance &CI;
+  BytecodeFunction &Fn;
+  bool Ok = true;
+  unsigned Dst = 0;      // Where the expression being visited goes
+  unsigned NextReg = 0;  // The lowest register not in use
+  llvm::DenseMap<Symbol, unsigned> Vars;  // Variables in scope
+  llvm::DenseMap<uint64_t, unsigned> ConstIndex;
+  llvm::DenseMap<Symbol, unsigned> CalleeIndex;
+};
+
+/// LoopRunner - Called when loop LoopIndex has run for long enough, with the
+/// frame at the top of an iteration whose loop variable has just been
+/// stepped. Returns true if it ran the rest of the loop, leaving the
+/// variables of the loop's body in the frame, or false to have the
+/// interpreter carry on.
+using LoopRunner = llvm::function_ref<bool(unsigned LoopIndex, double *Frame)>;
+
+/// runBytecode - Run Fn, whose callees have all been given an address, and
+/// return its value. Once a loop has gone round PromoteAfter times, the rest
+/// of it is handed to RunLoop, if there is one.
+double runBytecode(const BytecodeFunction &Fn, unsigned PromoteAfter = 0,
+                   LoopRunner RunLoop = nullptr);
+
+#endif	// BYTECODE_H
@@ -1,27 +1,21 @@
+#include <cmath>
+#include <cstring>
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Verifier.h"
 
-#include "ast.h"
+#include "codegenVisitor.h"
+#include "loopNarrowing.h"
+#include "typeInference.h"
 
-std::unique_ptr<llvm::LLVMContext> TheContext;
-std::unique_ptr<llvm::IRBuilder<>> Builder;
-std::unique_ptr<llvm::Module> TheModule;
-std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-std::map<std::string, llvm::AllocaInst *> NamedValues;
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-std::map<char, int> BinopPrecedence;
-
-// Create an alloca instruction in the entry block of the function. This is used
-// for mutable variables etc.
-llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction,
-    const std::string &VarName) {
-  llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
-      TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(llvm::Type::getDoubleTy(*TheContext), 0, VarName.c_str());
-}
+thread_local std::string *ErrorLog = nullptr;
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
+ExprAST *LogError(const char *Str) {
+  if (ErrorLog)
+    *ErrorLog += std::string("Error: ") + Str + "\n";
+  else
+    fprintf(stderr, "Error: %s\n", Str);
   return nullptr;
 }
 std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
@@ -33,406 +27,1153 @@ llvm::Value *LogErrorV(const char *Str) {
   return nullptr;
 }
 
+llvm::Function *codegenVisitor::getFunction(Symbol Name) {
+  // First, see if the function has already been added to the current module.
+  if (auto *F = CI.TheModule->getFunction(Symbols.getName(Name)))
+    return F;
 
+  // If not, check whether we can codegen the declaration from some existing
+  // prototype.
+  auto FI = CI.FunctionProtos.find(Name);
+  if (FI != CI.FunctionProtos.end())
+    return codegen(*FI->second);
 
-class codegenVisitor : public Visitor {
-  llvm::Value* lastReturn;
-  llvm::Function *getFunction(std::string Name) {
-    // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
-      return F;
+  // If no existing prototype exists, return null.
+  return nullptr;
+}
 
-    // If not, check whether we can codegen the declaration from some existing
-    // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end()) {
-      FI->second->accept(this);
-      return generatedCode;
-    }
+void codegenVisitor::startFunction() {
+  CI.NamedValues.clear();
+  VarNames.clear();
+  VarTypes.clear();
+  CurrentDef.clear();
+  Unsealed.clear();
+  IncompletePhis.clear();
+  Outlined.clear();
+  CountLoops = CI.CountLoops;
+}
 
-    // If no existing prototype exists, return null.
-    return nullptr;
+void codegenVisitor::swapFunctionState(FunctionState &S) {
+  std::swap(S.NamedValues, CI.NamedValues);
+  std::swap(S.VarNames, VarNames);
+  std::swap(S.VarTypes, VarTypes);
+  std::swap(S.CurrentDef, CurrentDef);
+  std::swap(S.Unsealed, Unsealed);
+  std::swap(S.IncompletePhis, IncompletePhis);
+}
+
+void codegenVisitor::eraseOutlined(size_t N) {
+  // Later bodies call earlier ones, for the parfors in them.
+  while (Outlined.size() > N) {
+    Outlined.back()->eraseFromParent();
+    Outlined.pop_back();
   }
+}
 
-public:
-  llvm::Function* generatedCode;
-  void visit(NumberExprAST* e) {
-    lastReturn = llvm::ConstantFP::get(*TheContext, llvm::APFloat(e->Val));
-  }
-  void visit(VariableExprAST* e) {
-    llvm::Value *V = NamedValues[e->Name];
-    if (!V) {
-      lastReturn = LogErrorV("Unknown variable name");
-      return;
-    }
+unsigned codegenVisitor::declareVariable(Symbol Name, ValueType Ty,
+                                         llvm::Value *Init) {
+  unsigned Var = VarNames.size();
+  VarNames.push_back(Name);
+  VarTypes.push_back(Ty);
+  writeVariable(Var, CI.Builder->GetInsertBlock(), Init);
+  CI.NamedValues[Name] = Var;
+  return Var;
+}
 
-    // Load the value
-    lastReturn = Builder->CreateLoad(V, e->Name.c_str());
-  }
-  void visit(BinaryExprAST* e) {
-    // Special case '=' because we don't want to emit the LHS as an expression
-    if (e->Op == '=') {
-      VariableExprAST *LHSE = static_cast<VariableExprAST*>(e->LHS.get());
-      if (!LHSE) {
-        lastReturn = LogErrorV("destination of '=' must be a variable");
-        return;
-      }
-
-      // Codegen the RHS
-      e->RHS->accept(this);
-      llvm::Value *Val = lastReturn;
-      if (!Val) {
-        lastReturn = nullptr;
-        return;
-      }
-
-      llvm::Value *Variable = NamedValues[std::string(LHSE->getName())];
-      if (!Variable) {
-        lastReturn = LogErrorV("Unknown variable name");
-        return;
-      }
-      Builder->CreateStore(Val, Variable);
-      lastReturn = Val;
-      return;
-    }
+llvm::Value *codegenVisitor::readVariable(unsigned Var, llvm::BasicBlock *BB) {
+  auto It = CurrentDef.find({Var, BB});
+  if (It != CurrentDef.end())
+    return It->second;
+  return readVariableRecursive(Var, BB);
+}
 
-    e->LHS->accept(this);
-    llvm::Value *L = lastReturn;
-    e->RHS->accept(this);
-    llvm::Value *R = lastReturn;
-    if (!L || !R) {
-      lastReturn = nullptr;
-      return;
-    }
+// Create an empty phi at the start of BB, which may not have any
+// instructions yet.
+static llvm::PHINode *createPhi(llvm::Type *Ty, const llvm::Twine &Name,
+                                 llvm::BasicBlock *BB) {
+  if (BB->empty())
+    return llvm::PHINode::Create(Ty, 2, Name, BB);
+  return llvm::PHINode::Create(Ty, 2, Name, &BB->front());
+}
 
-    switch (e->Op) {
-      case '+':
-        lastReturn = Builder->CreateFAdd(L, R, "addtmp");
-        return;
-      case '-':
-        lastReturn = Builder->CreateFSub(L, R, "subtmp");
-        return;
-      case '*':
-        lastReturn = Builder->CreateFMul(L, R, "multmp");
-        return;
-      case '<':
-        L = Builder->CreateFCmpULT(L, R, "cmptmp");
-        // Convert bool 0/1 to double 0.0 or 1.0
-        lastReturn = Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext),
-            "booltmp");
-        return;
-      default:
-        break;
-    }
+llvm::Value *codegenVisitor::readVariableRecursive(unsigned Var,
+                                                   llvm::BasicBlock *BB) {
+  llvm::Value *Val;
+  llvm::Type *Ty = getType(VarTypes[Var]);
+  const std::string &Name = Symbols.getName(VarNames[Var]);
+  if (Unsealed.count(BB)) {
+    // Not all predecessors are known yet; fill the phi in once they are.
+    llvm::PHINode *Phi = createPhi(Ty, Name, BB);
+    IncompletePhis[BB].push_back({Var, Phi});
+    Val = Phi;
+  } else if (llvm::BasicBlock *Pred = BB->getSinglePredecessor()) {
+    Val = readVariable(Var, Pred);
+  } else {
+    // Record the phi first, to break cycles through loops.
+    llvm::PHINode *Phi = createPhi(Ty, Name, BB);
+    writeVariable(Var, BB, Phi);
+    Val = addPhiOperands(Var, Phi);
+  }
+  writeVariable(Var, BB, Val);
+  return Val;
+}
 
-    llvm::Function *F = getFunction(std::string("binary") + e->Op);
-    assert(F && "binary operator not found!");
+llvm::Value *codegenVisitor::addPhiOperands(unsigned Var, llvm::PHINode *Phi) {
+  llvm::BasicBlock *BB = Phi->getParent();
+  for (llvm::BasicBlock *Pred : llvm::predecessors(BB))
+    Phi->addIncoming(readVariable(Var, Pred), Pred);
+  return tryRemoveTrivialPhi(Phi);
+}
 
-    llvm::Value *Ops[2] = {L, R};
-    lastReturn = Builder->CreateCall(F, Ops, "binop");
+llvm::Value *codegenVisitor::tryRemoveTrivialPhi(llvm::PHINode *Phi) {
+  // A phi merging one value, besides itself, is that value.
+  llvm::Value *Same = nullptr;
+  for (llvm::Value *Op : Phi->incoming_values()) {
+    if (Op == Same || Op == Phi)
+      continue;
+    if (Same)
+      return Phi;
+    Same = Op;
   }
-  void visit(CallExprAST* expr) {
-    // Look up the name in the global module table.
-    llvm::Function *CalleeF = getFunction(expr->Callee);
-    if (!CalleeF) {
-      lastReturn = LogErrorV("Unknown function referenced");
-      return;
-    }
+  if (!Same)  // Unreachable, or the variable is never assigned
+    Same = llvm::UndefValue::get(Phi->getType());
+
+  // Phis using this one may become trivial in turn, except for ones still
+  // getting their operands, which have fewer than their block has
+  // predecessors and are checked once they have them all.
+  llvm::SmallVector<llvm::WeakVH, 4> Users;
+  for (llvm::User *U : Phi->users())
+    if (auto *UserPhi = llvm::dyn_cast<llvm::PHINode>(U))
+      if (UserPhi != Phi && UserPhi->getNumIncomingValues() ==
+                                llvm::pred_size(UserPhi->getParent()))
+        Users.push_back(U);
+  Phi->replaceAllUsesWith(Same);
+  Phi->eraseFromParent();
+  // Same may be one of them, and be replaced in turn.
+  llvm::WeakTrackingVH Result(Same);
+  for (llvm::WeakVH &U : Users)
+    if (auto *UserPhi = llvm::dyn_cast_or_null<llvm::PHINode>(U))
+      tryRemoveTrivialPhi(UserPhi);
+  return Result;
+}
 
-    // If argument mismatch error.
-    if (CalleeF->arg_size() != expr->Args.size()) {
-      lastReturn = LogErrorV("Incorrect # arguments passed");
-      return;
+void codegenVisitor::sealBlock(llvm::BasicBlock *BB) {
+  auto It = IncompletePhis.find(BB);
+  if (It != IncompletePhis.end()) {
+    for (auto &Incomplete : It->second)
+      addPhiOperands(Incomplete.first, Incomplete.second);
+    IncompletePhis.erase(BB);
+  }
+  Unsealed.erase(BB);
+}
+
+llvm::Type *codegenVisitor::getType(ValueType Ty) {
+  switch (Ty) {
+  case VT_Int:
+    return CI.Builder->getInt64Ty();
+  case VT_Bool:
+    return CI.Builder->getInt1Ty();
+  case VT_DoublePtr:
+    return CI.Builder->getDoubleTy()->getPointerTo();
+  default:
+    return CI.Builder->getDoubleTy();
+  }
+}
+
+/// getValueType - The type of Kale value an LLVM type holds.
+static ValueType getValueType(llvm::Type *Ty) {
+  if (Ty->isIntegerTy(64))
+    return VT_Int;
+  if (Ty->isIntegerTy(1))
+    return VT_Bool;
+  if (Ty->isPointerTy())
+    return VT_DoublePtr;
+  return VT_Double;
+}
+
+llvm::Value *codegenVisitor::convert(llvm::Value *V, ValueType From,
+                                     ValueType To) {
+  llvm::IRBuilder<> &B = *CI.Builder;
+  if (From == To)
+    return V;
+  // An array is only ever indexed, or passed to a function taking one.
+  if (From == VT_DoublePtr)
+    return LogErrorV("an array can only be indexed or passed as one");
+  if (To == VT_DoublePtr)
+    return LogErrorV("expected an array");
+  switch (To) {
+  case VT_Int:
+    if (From == VT_Bool)
+      return B.CreateZExt(V, B.getInt64Ty(), "inttmp");
+    // Saturating, so that no double gives poison.
+    return B.CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+                             {B.getInt64Ty(), B.getDoubleTy()}, V, nullptr,
+                             "inttmp");
+  case VT_Bool:
+    // Nonzero is true, as conditions have always had it; NaN isn't.
+    if (From == VT_Int)
+      return B.CreateICmpNE(V, B.getInt64(0), "booltmp");
+    return B.CreateFCmpONE(V, llvm::ConstantFP::get(B.getDoubleTy(), 0.0),
+                           "booltmp");
+  default:
+    if (From == VT_Bool)
+      return B.CreateUIToFP(V, B.getDoubleTy(), "doubletmp");
+    return B.CreateSIToFP(V, B.getDoubleTy(), "doubletmp");
+  }
+}
+
+llvm::Value *codegenVisitor::emit(ExprAST *E, ValueType Ty) {
+  llvm::Value *V = visit(E);
+  return V ? convert(V, E->Type, Ty) : nullptr;
+}
+
+llvm::Value *codegenVisitor::emitCall(llvm::Function *F,
+                                      llvm::ArrayRef<ExprAST *> Args,
+                                      const llvm::Twine &Name) {
+  std::vector<llvm::Value *> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    ArgsV.push_back(emit(Args[i], getValueType(F->getArg(i)->getType())));
+    if (!ArgsV.back())
+      return nullptr;
+  }
+  return CI.Builder->CreateCall(F, ArgsV, Name);
+}
+
+llvm::Value *codegenVisitor::visitNumberExpr(NumberExprAST *e) {
+  if (e->Type == VT_Int)
+    return CI.Builder->getInt64(int64_t(e->Val));
+  llvm::Value *V = llvm::ConstantFP::get(*CI.TheContext, llvm::APFloat(e->Val));
+  return convert(V, VT_Double, e->Type);
+}
+
+llvm::Value *codegenVisitor::visitVariableExpr(VariableExprAST *e) {
+  auto It = CI.NamedValues.find(e->Name);
+  if (It == CI.NamedValues.end())
+    return LogErrorV("Unknown variable name");
+  return readVariable(It->second, CI.Builder->GetInsertBlock());
+}
+
+llvm::Value *codegenVisitor::visitBinaryExpr(BinaryExprAST *e) {
+  // Special case '=' because we don't want to emit the LHS as an expression
+  if (e->Op == '=') {
+    if (auto *Elt = llvm::dyn_cast<IndexExprAST>(e->LHS)) {
+      llvm::Value *Addr = emitElementAddress(Elt);
+      if (!Addr)
+        return nullptr;
+      llvm::Value *Val = emit(e->RHS, VT_Double);
+      if (!Val)
+        return nullptr;
+      CI.Builder->CreateAlignedStore(Val, Addr, llvm::Align(8));
+      return Val;
     }
 
-    std::vector<llvm::Value *> ArgsV;
-    for (unsigned i = 0, e = expr->Args.size(); i != e; ++i) {
-      expr->Args[i]->accept(this);
-      ArgsV.push_back(lastReturn);
-      if (!ArgsV.back()) {
-        lastReturn = nullptr;
-        return;
-      }
+    auto *LHSE = llvm::dyn_cast<VariableExprAST>(e->LHS);
+    if (!LHSE)
+      return LogErrorV("destination of '=' must be a variable or an element");
+
+    auto It = CI.NamedValues.find(LHSE->Name);
+    if (It == CI.NamedValues.end()) {
+      // Still codegen the RHS, for its errors.
+      if (!visit(e->RHS))
+        return nullptr;
+      return LogErrorV("Unknown variable name");
     }
 
-    lastReturn = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    // Codegen the RHS
+    llvm::Value *Val = emit(e->RHS, VarTypes[It->second]);
+    if (!Val)
+      return nullptr;
+    writeVariable(It->second, CI.Builder->GetInsertBlock(), Val);
+    return Val;
   }
-  void visit(PrototypeAST* e) {
-    // Make the function type:  double(double,double) etc.
-    std::vector<llvm::Type *> Doubles(e->Args.size(), llvm::Type::getDoubleTy(*TheContext));
-    llvm::FunctionType *FT =
-      llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
 
-    llvm::Function *F =
-      llvm::Function::Create(FT, llvm::Function::ExternalLinkage, e->Name, TheModule.get());
+  if (!strchr("+-*<", e->Op)) {
+    llvm::Function *F = getFunction(getOperatorSymbol("binary", e->Op));
+    assert(F && "binary operator not found!");
+    return emitCall(F, {e->LHS, e->RHS}, "binop");
+  }
 
-    // Set names for all arguments.
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-      Arg.setName(e->Args[Idx++]);
+  // Both operands are ints, or both are made doubles.
+  ValueType OpTy = e->LHS->Type == VT_Int && e->RHS->Type == VT_Int
+                       ? VT_Int
+                       : VT_Double;
+  llvm::Value *L = emit(e->LHS, OpTy);
+  llvm::Value *R = emit(e->RHS, OpTy);
+  if (!L || !R)
+    return nullptr;
 
-    generatedCode = F;
+  bool IsInt = OpTy == VT_Int;
+  switch (e->Op) {
+    case '+':
+      return IsInt ? CI.Builder->CreateAdd(L, R, "addtmp")
+                   : CI.Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return IsInt ? CI.Builder->CreateSub(L, R, "subtmp")
+                   : CI.Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return IsInt ? CI.Builder->CreateMul(L, R, "multmp")
+                   : CI.Builder->CreateFMul(L, R, "multmp");
+    default:
+      return IsInt ? CI.Builder->CreateICmpSLT(L, R, "cmptmp")
+                   : CI.Builder->CreateFCmpULT(L, R, "cmptmp");
   }
-  void visit(FunctionAST* e) {
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
-    auto & P = *e->Proto;
-    FunctionProtos[e->Proto->getName()] = std::move(e->Proto);
-    llvm::Function *TheFunction = getFunction(P.getName());
-    if (!TheFunction) {
-      generatedCode = nullptr;
-      return;
-    }
+}
 
-    // If this is an operator, install it
-    if (P.isBinaryOp())
-      BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
-
-    // Create a new basic block to start insertion into.
-    llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
-
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args()) {
-      // Create an alloca
-      llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, std::string(Arg.getName()));
-      Builder->CreateStore(&Arg, Alloca);
-      NamedValues[std::string(Arg.getName())] = Alloca;
-    }
+llvm::Value *codegenVisitor::emitElementAddress(IndexExprAST *e) {
+  llvm::Value *Base = visit(e->Array);
+  if (!Base)
+    return nullptr;
+  llvm::Value *Idx = emit(e->Index, VT_Int);
+  if (!Idx)
+    return nullptr;
+  if (e->Array->Type != VT_DoublePtr)
+    return LogErrorV("only an array can be indexed");
+  // Indexing outside the array is undefined, as it is in C, which lets
+  // LLVM take the address for inbounds.
+  return CI.Builder->CreateInBoundsGEP(CI.Builder->getDoubleTy(), Base, Idx,
+                                       "eltaddr");
+}
 
-    e->Body->accept(this);
-    if (llvm::Value *RetVal = lastReturn) {
-      // Finish off the function.
-      Builder->CreateRet(RetVal);
+llvm::Value *codegenVisitor::visitIndexExpr(IndexExprAST *e) {
+  llvm::Value *Addr = emitElementAddress(e);
+  if (!Addr)
+    return nullptr;
+  return CI.Builder->CreateAlignedLoad(CI.Builder->getDoubleTy(), Addr,
+                                       llvm::Align(8), "elt");
+}
 
-      // Validate the generated code, checking for consistency.
-      llvm::verifyFunction(*TheFunction);
+llvm::Value *codegenVisitor::visitCallExpr(CallExprAST *expr) {
+  // Look up the name in the global module table.
+  llvm::Function *CalleeF = getFunction(expr->Callee);
+  if (!CalleeF)
+    return LogErrorV("Unknown function referenced");
 
-      // Optimize the function.
-      TheFPM->run(*TheFunction);
+  // If argument mismatch error.
+  if (CalleeF->arg_size() != expr->Args.size())
+    return LogErrorV("Incorrect # arguments passed");
 
-      generatedCode = TheFunction;
-      return;
+  return emitCall(CalleeF, expr->Args, "calltmp");
+}
+
+llvm::Function *codegenVisitor::codegen(PrototypeAST &P) {
+  // A function declared again, e.g. by a second extern, keeps the one it has.
+  if (auto *F = CI.TheModule->getFunction(P.getName()))
+    return F;
+
+  // Make the function type:  double(double,double) etc.
+  std::vector<llvm::Type *> ArgTys;
+  for (ValueType Ty : P.ArgTypes)
+    ArgTys.push_back(getType(Ty));
+  llvm::FunctionType *FT =
+    llvm::FunctionType::get(getType(P.RetType), ArgTys, false);
+
+  llvm::Function *F =
+    llvm::Function::Create(FT, llvm::Function::ExternalLinkage, P.getName(), CI.TheModule.get());
+
+  // Set names for all arguments. Bools are zero extended, as C's are.
+  // Arrays are taken to be aligned doubles that no other argument overlaps,
+  // like a restrict pointer in C, which lets the loops over them be
+  // vectorized without checking.
+  unsigned Idx = 0;
+  for (auto &Arg : F->args()) {
+    if (P.ArgTypes[Idx] == VT_Bool)
+      Arg.addAttr(llvm::Attribute::ZExt);
+    if (P.ArgTypes[Idx] == VT_DoublePtr) {
+      Arg.addAttr(llvm::Attribute::NoAlias);
+      Arg.addAttr(llvm::Attribute::getWithAlignment(*CI.TheContext,
+                                                    llvm::Align(8)));
     }
+    Arg.setName(Symbols.getName(P.Args[Idx++]));
+  }
+  if (P.RetType == VT_Bool)
+    F->addRetAttr(llvm::Attribute::ZExt);
 
-    // Error reading body, remove function.
-    TheFunction->eraseFromParent();
+  return F;
+}
 
-    if (P.isBinaryOp())
-      BinopPrecedence.erase(P.getOperatorName());
-    generatedCode = nullptr;
+llvm::Function *codegenVisitor::codegen(FunctionAST &Fn) {
+  // Transfer ownership of the prototype to the CI.FunctionProtos map, but keep a
+  // reference to it for use below.
+  auto & P = *Fn.Proto;
+  CI.FunctionProtos[P.Name] = std::move(Fn.Proto);
+  llvm::Function *TheFunction = getFunction(P.Name);
+  if (!TheFunction)
+    return nullptr;
+
+  // If this is an operator, install it
+  if (P.isBinaryOp())
+    CI.BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+
+  // Create a new basic block to start insertion into.
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CI.TheContext, "entry", TheFunction);
+  CI.Builder->SetInsertPoint(BB);
+
+  // Record the function arguments in the CI.NamedValues map.
+  startFunction();
+  std::vector<std::pair<Symbol, ValueType>> Params;
+  unsigned Idx = 0;
+  for (auto &Arg : TheFunction->args()) {
+    Params.push_back({P.Args[Idx], P.ArgTypes[Idx]});
+    declareVariable(P.Args[Idx], P.ArgTypes[Idx], &Arg);
+    ++Idx;
   }
-  void visit(IfExprAST* e) {
-    e->Cond->accept(this);
-    llvm::Value *CondV = lastReturn;
-    if (!CondV) {
-      lastReturn = nullptr;
-      return;
-    }
+  TypeInference::infer(Fn.Body, Params, P.RetType, CI);
+  LoopNarrowing::run(Fn.Body, Params);
 
-    // Convert condition to a bool by comparing non-equal to 0.0
-    CondV = Builder->CreateFCmpONE(
-        CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
+  if (CI.TierUpThreshold)
+    emitTierUpCounter(TheFunction);
 
-    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  if (llvm::Value *RetVal = emit(Fn.Body, P.RetType)) {
+    // Finish off the function.
+    CI.Builder->CreateRet(RetVal);
 
-    // Create blocks for the then and else cases.  Insert the 'then' block at the
-    // end of the function.
-    llvm::BasicBlock *ThenBB =
-      llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
-    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "else");
-    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont");
+    // Validate the generated code, checking for consistency.
+    llvm::verifyFunction(*TheFunction);
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    // Optimize the function.
+    CI.TheFPM->run(*TheFunction, *CI.TheFAM);
 
-    // Emit then value
-    Builder->SetInsertPoint(ThenBB);
+    return TheFunction;
+  }
 
-    e->Then->accept(this);
-    llvm::Value *ThenV = lastReturn;
-    if (!ThenV) {
-      lastReturn = nullptr;
-      return;
-    }
+  // Error reading body, remove function.
+  TheFunction->eraseFromParent();
+  eraseOutlined(0);
 
-    Builder->CreateBr(MergeBB);
-    // Codegen of 'Then' can change the current block, update ThenBB for the PHI
-    ThenBB = Builder->GetInsertBlock();
+  if (P.isBinaryOp())
+    CI.BinopPrecedence.erase(P.getOperatorName());
+  return nullptr;
+}
 
-    // Emit else block
-    TheFunction->getBasicBlockList().push_back(ElseBB);
-    Builder->SetInsertPoint(ElseBB);
+/// emitTierUpCounter - Count the calls of F at its entry, and on the call
+/// that reaches CI.TierUpThreshold, call
+///
+///   __kale_tier_up(&__kale_tier_context, "F")
+///
+/// which the executor defines to recompile F at a higher optimization level.
+/// The counter update and the branch on it carry !kale.tierup metadata, so
+/// that the recompiled version can take them out again.
+void codegenVisitor::emitTierUpCounter(llvm::Function *F) {
+  llvm::LLVMContext &C = *CI.TheContext;
+  llvm::Module &M = *CI.TheModule;
+  llvm::IRBuilder<> &B = *CI.Builder;
+  llvm::MDNode *TierUpMD = llvm::MDNode::get(C, {});
+
+  auto *Counter = new llvm::GlobalVariable(
+      M, B.getInt64Ty(), false, llvm::GlobalValue::InternalLinkage,
+      B.getInt64(0), F->getName() + ".calls");
+  // Atomic, so that calls on other threads can't make it skip the threshold.
+#if LLVM_VERSION_MAJOR >= 13
+  llvm::AtomicRMWInst *Calls = B.CreateAtomicRMW(
+      llvm::AtomicRMWInst::Add, Counter, B.getInt64(1), llvm::MaybeAlign(8),
+      llvm::AtomicOrdering::Monotonic);
+#else
+  llvm::AtomicRMWInst *Calls =
+      B.CreateAtomicRMW(llvm::AtomicRMWInst::Add, Counter, B.getInt64(1),
+                        llvm::AtomicOrdering::Monotonic);
+#endif
+  Calls->setMetadata("kale.tierup", TierUpMD);
+  llvm::Value *Hot =
+      B.CreateICmpEQ(Calls, B.getInt64(CI.TierUpThreshold - 1), "hot");
+
+  llvm::BasicBlock *TierUpBB = llvm::BasicBlock::Create(C, "tierup", F);
+  llvm::BasicBlock *BodyBB = llvm::BasicBlock::Create(C, "body", F);
+  B.CreateCondBr(Hot, TierUpBB, BodyBB)->setMetadata("kale.tierup", TierUpMD);
+
+  B.SetInsertPoint(TierUpBB);
+  llvm::Type *I8Ptr = B.getInt8PtrTy();
+  llvm::FunctionCallee TierUp = M.getOrInsertFunction(
+      "__kale_tier_up", B.getVoidTy(), I8Ptr, I8Ptr);
+  llvm::Constant *Context =
+      M.getOrInsertGlobal("__kale_tier_context", B.getInt8Ty());
+  B.CreateCall(TierUp, {Context, B.CreateGlobalStringPtr(F->getName(),
+                                                         F->getName() + ".name")});
+  B.CreateBr(BodyBB);
+  B.SetInsertPoint(BodyBB);
+}
 
-    e->Else->accept(this);
-    llvm::Value *ElseV = lastReturn;
-    if (!ElseV) {
-      lastReturn = nullptr;
-      return;
-    }
+llvm::Value *codegenVisitor::visitIfExpr(IfExprAST *e) {
+  llvm::Value *CondV = emit(e->Cond, VT_Bool);
+  if (!CondV)
+    return nullptr;
 
-    Builder->CreateBr(MergeBB);
-    // codegen of 'Else' an change the current block, update ElseBB for the PHI
-    ElseBB = Builder->GetInsertBlock();
-
-    // Emit merge block
-    TheFunction->getBasicBlockList().push_back(MergeBB);
-    Builder->SetInsertPoint(MergeBB);
-    llvm::PHINode *PN =
-      Builder->CreatePHI(llvm::Type::getDoubleTy(*TheContext), 2, "iftmp");
-    PN->addIncoming(ThenV, ThenBB);
-    PN->addIncoming(ElseV, ElseBB);
-    lastReturn = PN;
-  }
-  void visit(ForExprAST* e) {
-    // Make the new basic block for the loop header, inserting after current
-    // block
-    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
-
-    // Create an alloca for the variable in the entry block
-    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, e->VarName);
-
-    // Emit the start code first, without 'variable' in scope
-    e->Start->accept(this);
-    llvm::Value *StartVal = lastReturn;
-    if (!StartVal) {
-      lastReturn = nullptr;
-      return;
-    }
+  llvm::Function *TheFunction = CI.Builder->GetInsertBlock()->getParent();
+
+  // Create blocks for the then and else cases.  Insert the 'then' block at the
+  // end of the function.
+  llvm::BasicBlock *ThenBB =
+    llvm::BasicBlock::Create(*CI.TheContext, "then", TheFunction);
+  llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*CI.TheContext, "else");
+  llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*CI.TheContext, "ifcont");
 
-    // Store the value into the alloca
-    Builder->CreateStore(StartVal, Alloca);
+  CI.Builder->CreateCondBr(CondV, ThenBB, ElseBB);
 
-    llvm::BasicBlock *LoopBB =
-      llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+  // Emit then value
+  CI.Builder->SetInsertPoint(ThenBB);
 
-    // Insert an explicit fall through from the current block to the LoopBB
-    Builder->CreateBr(LoopBB);
+  llvm::Value *ThenV = emit(e->Then, e->Type);
+  if (!ThenV)
+    return nullptr;
 
-    // Start insertion in LoopBB
-    Builder->SetInsertPoint(LoopBB);
+  CI.Builder->CreateBr(MergeBB);
+  // Codegen of 'Then' can change the current block, update ThenBB for the PHI
+  ThenBB = CI.Builder->GetInsertBlock();
 
-    // If the loop variable shadows an existing variable, we have to restore it.
-    llvm::AllocaInst *OldVal = NamedValues[e->VarName];
-    NamedValues[e->VarName] = Alloca;
+  // Emit else block
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  CI.Builder->SetInsertPoint(ElseBB);
 
-    // Emit the body of the loop.  This, like any other expr, can change the
-    // current BB.  Note that we ignore the value computed by the body, but don't
-    // allow an error.
-    e->Body->accept(this);
-    if (!lastReturn) {
-      lastReturn = nullptr;
-      return;
-    }
+  llvm::Value *ElseV = emit(e->Else, e->Type);
+  if (!ElseV)
+    return nullptr;
 
-    // Emit the setp value
-    llvm::Value *StepVal = nullptr;
-    if (e->Step) {
-      e->Step->accept(this);
-      StepVal = lastReturn;
-      if (!StepVal) {
-        lastReturn = nullptr;
-        return;
-      }
-    } else {
-      // If not specified, use 1.0
-      StepVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
-    }
+  CI.Builder->CreateBr(MergeBB);
+  // codegen of 'Else' an change the current block, update ElseBB for the PHI
+  ElseBB = CI.Builder->GetInsertBlock();
+
+  // Emit merge block
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  CI.Builder->SetInsertPoint(MergeBB);
+  llvm::PHINode *PN = CI.Builder->CreatePHI(getType(e->Type), 2, "iftmp");
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+  return PN;
+}
 
-    // Compute the end condition
-    e->End->accept(this);
-    llvm::Value *EndCond = lastReturn;
-    if (!EndCond) {
-      lastReturn = nullptr;
-      return;
-    }
+llvm::Value *codegenVisitor::visitForExpr(ForExprAST *e) {
+  // Emit the start code first, without 'variable' in scope
+  llvm::Value *StartVal = emit(e->Start, e->VarType);
+  if (!StartVal)
+    return nullptr;
 
-    llvm::Value *CurVar = Builder->CreateLoad(Alloca, e->VarName.c_str());
-    llvm::Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-    Builder->CreateStore(NextVar, Alloca);
+  // If the loop variable shadows an existing variable, we have to restore it.
+  auto OldVal = CI.NamedValues.find(e->VarName);
+  llvm::Optional<unsigned> OldVar;
+  if (OldVal != CI.NamedValues.end())
+    OldVar = OldVal->second;
 
-    // Convert condition to a bool by comparing non-equal to 0.0
-    EndCond = Builder->CreateFCmpONE(
-        EndCond, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "loopcond");
+  if (e->Counted && CountLoops ? !emitCountedLoop(e, StartVal)
+                               : !emitLoop(e, StartVal))
+    return nullptr;
 
-    // Create the "after loop" block and insert it
-    llvm::BasicBlock *AfterBB =
-      llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+  // Restore the unshadowed variable
+  if (OldVar)
+    CI.NamedValues[e->VarName] = *OldVar;
+  else
+    CI.NamedValues.erase(e->VarName);
 
-    // Insert the conditional branch into the end of LoopEndBB.
-    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  // for expr always returns 0.0
+  return llvm::Constant::getNullValue(getType(e->Type));
+}
 
-    // Any new code will be inserted in AfterBB.
-    Builder->SetInsertPoint(AfterBB);
+bool codegenVisitor::emitLoop(ForExprAST *e, llvm::Value *StartVal) {
+  // Make the new basic block for the loop header, inserting after current
+  // block
+  llvm::Function *TheFunction = CI.Builder->GetInsertBlock()->getParent();
+  unsigned Var = declareVariable(e->VarName, e->VarType, StartVal);
+
+  // The back edge comes last; until then, the loop variable and whatever
+  // the body assigns get incomplete phis in the header.
+  llvm::BasicBlock *LoopBB =
+    llvm::BasicBlock::Create(*CI.TheContext, "loop", TheFunction);
+  Unsealed.insert(LoopBB);
+
+  // Insert an explicit fall through from the current block to the LoopBB
+  CI.Builder->CreateBr(LoopBB);
+
+  // Start insertion in LoopBB
+  CI.Builder->SetInsertPoint(LoopBB);
+
+  // Emit the body of the loop.  This, like any other expr, can change the
+  // current BB.  Note that we ignore the value computed by the body, but don't
+  // allow an error.
+  if (!visit(e->Body))
+    return false;
+
+  // Emit the setp value
+  llvm::Value *StepVal = nullptr;
+  if (e->Step) {
+    StepVal = emit(e->Step, e->VarType);
+    if (!StepVal)
+      return false;
+  } else if (e->VarType == VT_Int) {
+    // If not specified, use 1
+    StepVal = CI.Builder->getInt64(1);
+  } else {
+    StepVal = llvm::ConstantFP::get(*CI.TheContext, llvm::APFloat(1.0));
+  }
 
-    // Restore the unshadowed variable
-    if (OldVal)
-      NamedValues[e->VarName] = OldVal;
-    else
-      NamedValues.erase(e->VarName);
+  // Compute the end condition
+  llvm::Value *EndCond = emit(e->End, VT_Bool);
+  if (!EndCond)
+    return false;
+
+  llvm::Value *CurVar = readVariable(Var, CI.Builder->GetInsertBlock());
+  llvm::Value *NextVar = e->VarType == VT_Int
+                             ? CI.Builder->CreateAdd(CurVar, StepVal, "nextvar")
+                             : CI.Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+  writeVariable(Var, CI.Builder->GetInsertBlock(), NextVar);
+
+  // Create the "after loop" block and insert it
+  llvm::BasicBlock *AfterBB =
+    llvm::BasicBlock::Create(*CI.TheContext, "afterloop", TheFunction);
+
+  // Insert the conditional branch into the end of LoopEndBB.
+  CI.Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  sealBlock(LoopBB);
 
-    // for expr always returns 0.0
-    lastReturn = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*TheContext));
+  // Any new code will be inserted in AfterBB.
+  CI.Builder->SetInsertPoint(AfterBB);
+  return true;
+}
+
+bool codegenVisitor::emitCountedLoop(ForExprAST *e, llvm::Value *StartVal) {
+  llvm::IRBuilder<> &B = *CI.Builder;
+  llvm::LLVMContext &C = *CI.TheContext;
+  llvm::Function *TheFunction = B.GetInsertBlock()->getParent();
+  llvm::Type *Int64Ty = B.getInt64Ty(), *DoubleTy = B.getDoubleTy();
+  const int64_t MaxExact = int64_t(1) << 53;
+
+  // The end condition is Var < Limit, and Limit is the same on every trip.
+  ExprAST *Limit = llvm::cast<BinaryExprAST>(e->End)->RHS;
+  llvm::Value *LimitVal = emit(Limit, VT_Double);
+  if (!LimitVal)
+    return false;
+  int64_t Step =
+      e->Step ? int64_t(llvm::cast<NumberExprAST>(e->Step)->Val) : 1;
+
+  // Count if Start is, bit for bit, a whole number within 2^53 (so not -0),
+  // and the variable stays below 2^53 until it reaches Limit. Comparisons
+  // with a NaN fail, as they should: the loop never ends. An int variable
+  // only needs to be in range for the comparisons to be exact.
+  bool IsInt = e->VarType == VT_Int;
+  llvm::Value *First =
+      IsInt ? StartVal
+            : B.CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+                                {Int64Ty, DoubleTy}, StartVal, nullptr, "first");
+  llvm::Value *InRange =
+      B.CreateICmpULE(B.CreateAdd(First, B.getInt64(MaxExact)),
+                      B.getInt64(2 * MaxExact), "inrange");
+  llvm::Value *Ends = B.CreateFCmpOLE(
+      LimitVal, llvm::ConstantFP::get(DoubleTy, double(MaxExact - Step)),
+      "ends");
+  llvm::Value *Counts = B.CreateAnd(InRange, Ends, "counts");
+  if (!IsInt) {
+    llvm::Value *Whole = B.CreateICmpEQ(
+        B.CreateBitCast(StartVal, Int64Ty),
+        B.CreateBitCast(B.CreateSIToFP(First, DoubleTy), Int64Ty), "whole");
+    Counts = B.CreateAnd(Whole, Counts, "counts");
   }
-  void visit(UnaryExprAST* e) {
-    e->Operand->accept(this);
-    llvm::Value *OperandV = lastReturn;
-    if (!OperandV) {
-      lastReturn = nullptr;
+
+  llvm::BasicBlock *CountBB = llvm::BasicBlock::Create(C, "count", TheFunction);
+  llvm::BasicBlock *FallbackBB = llvm::BasicBlock::Create(C, "uncounted");
+  B.CreateCondBr(Counts, CountBB, FallbackBB);
+
+  // The body runs for First, First + Step, ... up to the first value not
+  // below Limit, or equivalently not below Last = ceil(Limit), and that
+  // one included: Trips = ceil((max(Last, First) - First) / Step) + 1.
+  // The loop counts up to First + Trips * Step, testing before each trip.
+  B.SetInsertPoint(CountBB);
+  llvm::Value *Last = B.CreateIntrinsic(
+      llvm::Intrinsic::fptosi_sat, {Int64Ty, DoubleTy},
+      B.CreateUnaryIntrinsic(llvm::Intrinsic::ceil, LimitVal), nullptr, "last");
+  Last = B.CreateBinaryIntrinsic(llvm::Intrinsic::smax, Last, First);
+  llvm::Value *Bound;
+  if (Step == 1) {
+    Bound = B.CreateNSWAdd(Last, B.getInt64(1), "bound");
+  } else {
+    llvm::Value *Trips = B.CreateUDiv(
+        B.CreateNSWAdd(B.CreateNSWSub(Last, First), B.getInt64(Step - 1)),
+        B.getInt64(Step));
+    Trips = B.CreateNSWAdd(Trips, B.getInt64(1), "trips");
+    Bound = B.CreateNSWAdd(First, B.CreateNSWMul(Trips, B.getInt64(Step)),
+                           "bound");
+  }
+
+  llvm::BasicBlock *HeaderBB =
+      llvm::BasicBlock::Create(C, "countloop", TheFunction);
+  llvm::BasicBlock *BodyBB = llvm::BasicBlock::Create(C, "countbody", TheFunction);
+  llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(C, "afterloop");
+  Unsealed.insert(HeaderBB);
+  Unsealed.insert(AfterBB);
+  B.CreateBr(HeaderBB);
+
+  B.SetInsertPoint(HeaderBB);
+  llvm::PHINode *IV = B.CreatePHI(Int64Ty, 2, "iv");
+  IV->addIncoming(First, CountBB);
+  B.CreateCondBr(B.CreateICmpSLT(IV, Bound, "more"), BodyBB, AfterBB);
+
+  // Nothing assigns the variable, and the step and end condition have no
+  // side effects, so the body is all there is to each trip.
+  B.SetInsertPoint(BodyBB);
+  if (IsInt)
+    declareVariable(e->VarName, VT_Int, IV);
+  else
+    declareVariable(e->VarName, VT_Double,
+                    B.CreateSIToFP(IV, DoubleTy, Symbols.getName(e->VarName)));
+  if (!visit(e->Body))
+    return false;
+  IV->addIncoming(B.CreateNSWAdd(IV, B.getInt64(Step), "nextiv"),
+                  B.GetInsertBlock());
+  B.CreateBr(HeaderBB);
+  sealBlock(HeaderBB);
+
+  // The loops in the fallback are left as written too, so that nested
+  // loops don't double the code at each level.
+  TheFunction->getBasicBlockList().push_back(FallbackBB);
+  B.SetInsertPoint(FallbackBB);
+  CountLoops = false;
+  bool Generated = emitLoop(e, StartVal);
+  CountLoops = true;
+  if (!Generated)
+    return false;
+  B.CreateBr(AfterBB);
+  sealBlock(AfterBB);
+
+  TheFunction->getBasicBlockList().push_back(AfterBB);
+  B.SetInsertPoint(AfterBB);
+  return true;
+}
+
+namespace {
+
+/// CaptureCollector - Finds the variables from around a parfor that its
+/// body uses, and which of them it assigns.
+class CaptureCollector : public ExprVisitor<CaptureCollector> {
+  llvm::DenseMap<Symbol, unsigned> Bound;  // Bindings in the body of each
+
+  void use(Symbol Name, bool Assign) {
+    if (Bound.lookup(Name))
       return;
+    Uses.insert(Name);
+    if (Assign)
+      Assigned.insert(Name);
+  }
+
+public:
+  llvm::SetVector<Symbol> Uses;  // In the order they're first used
+  llvm::DenseSet<Symbol> Assigned;
+
+  explicit CaptureCollector(ParForExprAST *e) {
+    ++Bound[e->VarName];
+    visit(e->Body);
+  }
+
+  void visitNumberExpr(NumberExprAST *e) {}
+  void visitVariableExpr(VariableExprAST *e) { use(e->Name, false); }
+  void visitBinaryExpr(BinaryExprAST *e) {
+    if (e->Op == '=')
+      if (auto *Var = llvm::dyn_cast<VariableExprAST>(e->LHS))
+        use(Var->Name, true);
+    visit(e->LHS);
+    visit(e->RHS);
+  }
+  void visitCallExpr(CallExprAST *e) {
+    for (ExprAST *Arg : e->Args)
+      visit(Arg);
+  }
+  void visitIfExpr(IfExprAST *e) {
+    visit(e->Cond);
+    visit(e->Then);
+    visit(e->Else);
+  }
+  void visitForExpr(ForExprAST *e) {
+    visit(e->Start);
+    ++Bound[e->VarName];
+    visit(e->Body);
+    if (e->Step)
+      visit(e->Step);
+    visit(e->End);
+    --Bound[e->VarName];
+  }
+  void visitUnaryExpr(UnaryExprAST *e) { visit(e->Operand); }
+  void visitVarExpr(VarExprAST *e) {
+    for (auto &Var : e->VarNames) {
+      if (Var.second)
+        visit(Var.second);
+      ++Bound[Var.first];
     }
+    visit(e->Body);
+    for (auto &Var : e->VarNames)
+      --Bound[Var.first];
+  }
+  void visitIndexExpr(IndexExprAST *e) {
+    visit(e->Array);
+    visit(e->Index);
+  }
+  void visitParForExpr(ParForExprAST *e) {
+    visit(e->Start);
+    visit(e->End);
+    if (e->Grain)
+      visit(e->Grain);
+    ++Bound[e->VarName];
+    visit(e->Body);
+    --Bound[e->VarName];
+  }
+};
 
-    llvm::Function *F = getFunction(std::string("unary") + e->Opcode);
-    if (!F) {
-      lastReturn = LogErrorV("Unknown unary operator");
-      return;
+} // end anonymous namespace
+
+/// visitParForExpr - A parfor is a call to the runtime,
+///
+///   kale_parfor(Chunk, Env, Start, End, Grain, Reduce)
+///
+/// which calls Chunk, the body generated as a function of its own, for
+/// ranges of the trips on a pool of threads and combines what it returns.
+/// Env holds the values of the variables around the body that it uses.
+llvm::Value *codegenVisitor::visitParForExpr(ParForExprAST *e) {
+  llvm::IRBuilder<> &B = *CI.Builder;
+  llvm::Value *StartVal = emit(e->Start, VT_Int);
+  if (!StartVal)
+    return nullptr;
+  llvm::Value *EndVal = emit(e->End, VT_Int);
+  if (!EndVal)
+    return nullptr;
+  llvm::Value *GrainVal = B.getInt64(0);  // The runtime picks one
+  if (e->Grain && !(GrainVal = emit(e->Grain, VT_Int)))
+    return nullptr;
+
+  // The trips run at the same time, so the body can only read the
+  // variables around it; there's no order its stores could be seen in.
+  CaptureCollector Captures(e);
+  std::vector<std::pair<Symbol, ValueType>> Vars;
+  std::vector<llvm::Value *> Vals;
+  std::vector<llvm::Type *> Tys;
+  for (Symbol Name : Captures.Uses) {
+    auto It = CI.NamedValues.find(Name);
+    if (It == CI.NamedValues.end())
+      continue;  // The body reports it
+    if (Captures.Assigned.count(Name))
+      return LogErrorV("a parfor body can't assign the variables around it");
+    Vars.push_back({Name, VarTypes[It->second]});
+    Vals.push_back(readVariable(It->second, B.GetInsertBlock()));
+    Tys.push_back(Vals.back()->getType());
+  }
+  llvm::StructType *EnvTy = llvm::StructType::get(*CI.TheContext, Tys);
+  llvm::Function *Chunk = emitParForChunk(e, Vars, EnvTy);
+  if (!Chunk)
+    return nullptr;
+
+  llvm::Function *TheFunction = B.GetInsertBlock()->getParent();
+  llvm::BasicBlock &Entry = TheFunction->getEntryBlock();
+  llvm::AllocaInst *Env = llvm::IRBuilder<>(&Entry, Entry.begin())
+                              .CreateAlloca(EnvTy, nullptr, "env");
+  for (unsigned i = 0, n = Vals.size(); i != n; ++i)
+    B.CreateStore(Vals[i], B.CreateStructGEP(EnvTy, Env, i));
+
+  llvm::Type *I8Ptr = B.getInt8PtrTy(), *Int64Ty = B.getInt64Ty();
+  llvm::FunctionCallee Run = CI.TheModule->getOrInsertFunction(
+      "kale_parfor",
+      llvm::FunctionType::get(B.getDoubleTy(),
+                              {I8Ptr, I8Ptr, Int64Ty, Int64Ty, Int64Ty,
+                               B.getInt32Ty()},
+                              false));
+  return B.CreateCall(Run,
+                      {B.CreateBitCast(Chunk, I8Ptr),
+                       B.CreateBitCast(Env, I8Ptr), StartVal, EndVal,
+                       GrainVal, B.getInt32(e->Reduce)},
+                      "parfor");
+}
+
+llvm::Function *codegenVisitor::emitParForChunk(
+    ParForExprAST *e, llvm::ArrayRef<std::pair<Symbol, ValueType>> Vars,
+    llvm::StructType *EnvTy) {
+  llvm::IRBuilder<> &B = *CI.Builder;
+  llvm::LLVMContext &C = *CI.TheContext;
+  llvm::Type *Int64Ty = B.getInt64Ty(), *DoubleTy = B.getDoubleTy();
+  llvm::BasicBlock *OuterBB = B.GetInsertBlock();
+  llvm::BasicBlock::iterator OuterPt = B.GetInsertPoint();
+
+  llvm::FunctionType *FT = llvm::FunctionType::get(
+      DoubleTy, {B.getInt8PtrTy(), Int64Ty, Int64Ty}, false);
+  llvm::Function *F = llvm::Function::Create(
+      FT, llvm::Function::InternalLinkage,
+      OuterBB->getParent()->getName() + ".parfor", CI.TheModule.get());
+  llvm::Argument *EnvArg = F->getArg(0), *Begin = F->getArg(1),
+                 *End = F->getArg(2);
+  EnvArg->setName("env");
+  EnvArg->addAttr(llvm::Attribute::NoAlias);
+  EnvArg->addAttr(llvm::Attribute::ReadOnly);
+  Begin->setName("begin");
+  End->setName("end");
+
+  // The body sees the variables it uses from around it, read from Env,
+  // and nothing else.
+  FunctionState Outer;
+  swapFunctionState(Outer);
+  size_t NumOutlined = Outlined.size();
+  llvm::BasicBlock *EntryBB = llvm::BasicBlock::Create(C, "entry", F);
+  B.SetInsertPoint(EntryBB);
+  llvm::Value *Env = B.CreateBitCast(EnvArg, EnvTy->getPointerTo());
+  for (unsigned i = 0, n = Vars.size(); i != n; ++i)
+    declareVariable(Vars[i].first, Vars[i].second,
+                    B.CreateLoad(EnvTy->getElementType(i),
+                                 B.CreateStructGEP(EnvTy, Env, i),
+                                 Symbols.getName(Vars[i].first)));
+
+  llvm::BasicBlock *HeaderBB = llvm::BasicBlock::Create(C, "parloop", F);
+  llvm::BasicBlock *BodyBB = llvm::BasicBlock::Create(C, "parbody", F);
+  llvm::BasicBlock *AfterBB = llvm::BasicBlock::Create(C, "afterparloop", F);
+  Unsealed.insert(HeaderBB);
+  B.CreateBr(HeaderBB);
+
+  B.SetInsertPoint(HeaderBB);
+  llvm::PHINode *IV = B.CreatePHI(Int64Ty, 2, Symbols.getName(e->VarName));
+  IV->addIncoming(Begin, EntryBB);
+  llvm::PHINode *Acc = nullptr;
+  if (e->Reduce != ParForExprAST::RO_None) {
+    double Identity = e->Reduce == ParForExprAST::RO_Add   ? -0.0
+                      : e->Reduce == ParForExprAST::RO_Mul ? 1.0
+                      : e->Reduce == ParForExprAST::RO_Min ? INFINITY
+                                                           : -INFINITY;
+    Acc = B.CreatePHI(DoubleTy, 2, "acc");
+    Acc->addIncoming(llvm::ConstantFP::get(DoubleTy, Identity), EntryBB);
+  }
+  B.CreateCondBr(B.CreateICmpSLT(IV, End, "more"), BodyBB, AfterBB);
+
+  B.SetInsertPoint(BodyBB);
+  declareVariable(e->VarName, VT_Int, IV);
+  llvm::Value *Val = emit(e->Body, VT_Double);
+  if (Val) {
+    // The runtime already combines the ranges' results in an order of its
+    // own, so a range's may be combined in any order too, which lets sums
+    // and products be vectorized.
+    llvm::IRBuilderBase::FastMathFlagGuard Guard(B);
+    llvm::FastMathFlags Reassoc;
+    Reassoc.setAllowReassoc();
+    B.setFastMathFlags(Reassoc);
+    llvm::Value *Next = nullptr;
+    switch (e->Reduce) {
+    case ParForExprAST::RO_None:
+      break;
+    case ParForExprAST::RO_Add:
+      Next = B.CreateFAdd(Acc, Val, "acc.next");
+      break;
+    case ParForExprAST::RO_Mul:
+      Next = B.CreateFMul(Acc, Val, "acc.next");
+      break;
+    case ParForExprAST::RO_Min:
+      Next = B.CreateBinaryIntrinsic(llvm::Intrinsic::minnum, Acc, Val,
+                                     nullptr, "acc.next");
+      break;
+    case ParForExprAST::RO_Max:
+      Next = B.CreateBinaryIntrinsic(llvm::Intrinsic::maxnum, Acc, Val,
+                                     nullptr, "acc.next");
+      break;
     }
+    if (Acc)
+      Acc->addIncoming(Next, B.GetInsertBlock());
+    IV->addIncoming(B.CreateNSWAdd(IV, B.getInt64(1), "nextvar"),
+                    B.GetInsertBlock());
+    B.CreateBr(HeaderBB);
+    sealBlock(HeaderBB);
+
+    B.SetInsertPoint(AfterBB);
+    B.CreateRet(Acc ? static_cast<llvm::Value *>(Acc)
+                    : llvm::ConstantFP::get(DoubleTy, 0.0));
+    llvm::verifyFunction(*F);
+    CI.TheFPM->run(*F, *CI.TheFAM);
+  } else {
+    F->eraseFromParent();
+    eraseOutlined(NumOutlined);
+    F = nullptr;
+  }
+
+  swapFunctionState(Outer);
+  B.SetInsertPoint(OuterBB, OuterPt);
+  if (F)
+    Outlined.push_back(F);
+  return F;
+}
+
+llvm::Function *codegenVisitor::emitLoopResume(
+    ForExprAST *Loop, llvm::ArrayRef<std::pair<Symbol, unsigned>> Vars,
+    const std::string &Name) {
+  llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*CI.TheContext);
+  llvm::FunctionType *FT =
+    llvm::FunctionType::get(llvm::Type::getVoidTy(*CI.TheContext),
+                            {DoubleTy->getPointerTo()}, false);
+  llvm::Function *TheFunction = llvm::Function::Create(
+      FT, llvm::Function::ExternalLinkage, Name, CI.TheModule.get());
+  llvm::Argument *Frame = TheFunction->getArg(0);
+  Frame->setName("frame");
+
+  llvm::BasicBlock *BB = llvm::BasicBlock::Create(*CI.TheContext, "entry", TheFunction);
+  CI.Builder->SetInsertPoint(BB);
+
+  // Copy the variables out of the frame, so that they're in registers like
+  // any others.
+  startFunction();
+  std::vector<llvm::Value *> Slots;
+  std::vector<std::pair<Symbol, ValueType>> Params;
+  for (auto &Var : Vars) {
+    llvm::Value *Slot =
+      CI.Builder->CreateConstInBoundsGEP1_64(DoubleTy, Frame, Var.second);
+    declareVariable(Var.first, VT_Double,
+                    CI.Builder->CreateLoad(DoubleTy, Slot,
+                                           Symbols.getName(Var.first)));
+    Slots.push_back(Slot);
+    Params.push_back({Var.first, VT_Double});
+  }
+
+  // The interpreter has just stepped the loop variable, so the rest of the
+  // loop is the loop again, starting where the variable is now.
+  VariableExprAST Start(Loop->VarName);
+  ForExprAST Rest(Loop->VarName, &Start, Loop->End, Loop->Step, Loop->Body);
+  TypeInference::infer(&Rest, Params, VT_Double, CI);
+  LoopNarrowing::run(&Rest, Params);
+  if (!visit(&Rest)) {
+    TheFunction->eraseFromParent();
+    return nullptr;
+  }
+
+  for (size_t i = 0, e = Vars.size(); i != e; ++i) {
+    unsigned Var = CI.NamedValues.lookup(Vars[i].first);
+    llvm::Value *Val = readVariable(Var, CI.Builder->GetInsertBlock());
+    CI.Builder->CreateStore(convert(Val, VarTypes[Var], VT_Double), Slots[i]);
+  }
+  CI.Builder->CreateRetVoid();
+
+  llvm::verifyFunction(*TheFunction);
+  CI.TheFPM->run(*TheFunction, *CI.TheFAM);
+  return TheFunction;
+}
 
-    lastReturn = Builder->CreateCall(F, OperandV, "unop");
-  }
-  void visit(VarExprAST* expr) {
-    std::vector<llvm::AllocaInst *> OldBindings;
-    llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
-
-    // Register all variables and emit their initializer
-    for (unsigned i = 0, e = expr->VarNames.size(); i != e; ++i) {
-      const std::string &VarName = expr->VarNames[i].first;
-      ExprAST *Init = expr->VarNames[i].second.get();
-
-      // Emit the initializer before adding the variable to scope
-      llvm::Value *InitVal;
-      if (Init) {
-        Init->accept(this);
-        InitVal = lastReturn;
-        if (!InitVal) {
-          lastReturn = nullptr;
-          return;
-        }
-      } else { // If not specified use 0.0
-        InitVal = llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
-      }
-
-      llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-      Builder->CreateStore(InitVal, Alloca);
-
-      // Remember the old variable binding to restore after the body
-      OldBindings.push_back(NamedValues[VarName]);
-      NamedValues[VarName] = Alloca;
+llvm::Function *codegenVisitor::emitBatch(Symbol Callee,
+                                          const std::string &Name) {
+  llvm::Function *CalleeF = getFunction(Callee);
+  if (!CalleeF) {
+    LogError("Unknown function referenced");
+    return nullptr;
+  }
+  for (llvm::Argument &Arg : CalleeF->args())
+    if (getValueType(Arg.getType()) == VT_DoublePtr) {
+      LogError("a function taking an array can't run over columns");
+      return nullptr;
     }
 
-    // Codegen the body
-    expr->Body->accept(this);
-    llvm::Value *BodyVal = lastReturn;
-    if (!BodyVal) {
-      lastReturn = nullptr;
-      return;
+  llvm::IRBuilder<> &B = *CI.Builder;
+  llvm::Type *DoubleTy = B.getDoubleTy();
+  llvm::Type *ColumnTy = DoubleTy->getPointerTo();
+  llvm::FunctionType *FT = llvm::FunctionType::get(
+      B.getVoidTy(), {ColumnTy->getPointerTo(), ColumnTy, B.getInt64Ty()},
+      false);
+  llvm::Function *TheFunction = llvm::Function::Create(
+      FT, llvm::Function::ExternalLinkage, Name, CI.TheModule.get());
+  llvm::Argument *Columns = TheFunction->getArg(0);
+  llvm::Argument *Out = TheFunction->getArg(1);
+  llvm::Argument *Rows = TheFunction->getArg(2);
+  Columns->setName("columns");
+  Out->setName("out");
+  Rows->setName("rows");
+  // Nothing else writes the output, so the loop needs no overlap checks to
+  // be vectorized.
+  Columns->addAttr(llvm::Attribute::NoAlias);
+  Columns->addAttr(llvm::Attribute::ReadOnly);
+  Out->addAttr(llvm::Attribute::NoAlias);
+
+  llvm::BasicBlock *Entry =
+    llvm::BasicBlock::Create(*CI.TheContext, "entry", TheFunction);
+  llvm::BasicBlock *LoopBB =
+    llvm::BasicBlock::Create(*CI.TheContext, "row", TheFunction);
+  llvm::BasicBlock *AfterBB =
+    llvm::BasicBlock::Create(*CI.TheContext, "afterrows", TheFunction);
+
+  // The columns are loaded once, outside the loop.
+  B.SetInsertPoint(Entry);
+  std::vector<llvm::Value *> Cols;
+  for (unsigned i = 0, e = CalleeF->arg_size(); i != e; ++i)
+    Cols.push_back(B.CreateAlignedLoad(
+        ColumnTy, B.CreateConstInBoundsGEP1_64(ColumnTy, Columns, i),
+        llvm::Align(8), "column"));
+  B.CreateCondBr(B.CreateICmpSGT(Rows, B.getInt64(0), "any"), LoopBB,
+                 AfterBB);
+
+  B.SetInsertPoint(LoopBB);
+  llvm::PHINode *Row = B.CreatePHI(B.getInt64Ty(), 2, "r");
+  Row->addIncoming(B.getInt64(0), Entry);
+  std::vector<llvm::Value *> ArgsV;
+  for (unsigned i = 0, e = Cols.size(); i != e; ++i) {
+    llvm::Value *Elt = B.CreateAlignedLoad(
+        DoubleTy, B.CreateInBoundsGEP(DoubleTy, Cols[i], Row, "eltaddr"),
+        llvm::Align(8), "elt");
+    ArgsV.push_back(convert(Elt, VT_Double,
+                            getValueType(CalleeF->getArg(i)->getType())));
+  }
+  llvm::Value *Result = B.CreateCall(CalleeF, ArgsV, "calltmp");
+  Result = convert(Result, getValueType(Result->getType()), VT_Double);
+  B.CreateAlignedStore(
+      Result, B.CreateInBoundsGEP(DoubleTy, Out, Row, "eltaddr"),
+      llvm::Align(8));
+  llvm::Value *Next = B.CreateAdd(Row, B.getInt64(1), "nextrow", false, true);
+  Row->addIncoming(Next, LoopBB);
+  B.CreateCondBr(B.CreateICmpSLT(Next, Rows, "more"), LoopBB, AfterBB);
+
+  B.SetInsertPoint(AfterBB);
+  B.CreateRetVoid();
+
+  llvm::verifyFunction(*TheFunction);
+  return TheFunction;
+}
+
+llvm::Value *codegenVisitor::visitUnaryExpr(UnaryExprAST *e) {
+  llvm::Function *F = getFunction(getOperatorSymbol("unary", e->Opcode));
+  if (!F) {
+    // Still codegen the operand, for its errors.
+    if (!visit(e->Operand))
+      return nullptr;
+    return LogErrorV("Unknown unary operator");
+  }
+
+  return emitCall(F, e->Operand, "unop");
+}
+
+llvm::Value *codegenVisitor::visitVarExpr(VarExprAST *expr) {
+  std::vector<llvm::Optional<unsigned>> OldBindings;
+
+  // Register all variables and emit their initializer
+  for (unsigned i = 0, e = expr->VarNames.size(); i != e; ++i) {
+    Symbol VarName = expr->VarNames[i].first;
+    ExprAST *Init = expr->VarNames[i].second;
+
+    // Emit the initializer before adding the variable to scope
+    ValueType Ty = expr->VarTypes[i];
+    llvm::Value *InitVal;
+    if (Init) {
+      InitVal = emit(Init, Ty);
+      if (!InitVal)
+        return nullptr;
+    } else { // If not specified use 0
+      InitVal = llvm::Constant::getNullValue(getType(Ty));
     }
 
-    for (unsigned i = 0, e = expr->VarNames.size(); i != e; ++i)
-      NamedValues[expr->VarNames[i].first] = OldBindings[i];
-    lastReturn = BodyVal;
+    // Remember the old variable binding to restore after the body
+    auto Old = CI.NamedValues.find(VarName);
+    OldBindings.push_back(Old != CI.NamedValues.end()
+                              ? llvm::Optional<unsigned>(Old->second)
+                              : llvm::None);
+    declareVariable(VarName, Ty, InitVal);
   }
-};
+
+  // Codegen the body
+  llvm::Value *BodyVal = visit(expr->Body);
+  if (!BodyVal)
+    return nullptr;
+
+  for (unsigned i = expr->VarNames.size(); i != 0; --i) {
+    Symbol VarName = expr->VarNames[i - 1].first;
+    if (OldBindings[i - 1])
+      CI.NamedValues[VarName] = *OldBindings[i - 1];
+    else
+      CI.NamedValues.erase(VarName);
+  }
+  return BodyVal;
+}
+
+bool PrototypeAST::isTyped() const {
+  return RetType != VT_Double ||
+         llvm::any_of(ArgTypes, [](ValueType Ty) { return Ty != VT_Double; });
+}
 
 bool PrototypeAST::isUnaryOp() const {
   return IsOperator && Args.size() == 1;
@@ -444,9 +1185,19 @@ bool PrototypeAST::isBinaryOp() const {
 
 char PrototypeAST::getOperatorName() const {
   assert(isUnaryOp() || isBinaryOp());
-  return Name[Name.size() - 1];
+  const std::string &Spelling = getName();
+  return Spelling[Spelling.size() - 1];
 }
 
 unsigned PrototypeAST::getBinaryPrecedence() const {
   return Precedence;
 }
+
+Symbol getOperatorSymbol(const char *Kind, char Op) {
+  // Spell the name on the stack; interning an existing name doesn't allocate.
+  char Name[8];
+  size_t Len = strlen(Kind);
+  memcpy(Name, Kind, Len);
+  Name[Len] = Op;
+  return Symbols.intern(std::string_view(Name, Len + 1));
+}
@@ -0,0 +1,147 @@
+#ifndef CODEGENVISITOR_H
+#define CODEGENVISITOR_H
+
+#include <string>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/ValueHandle.h"
+#include "ast.h"
+#include "compilerInstance.h"
+
+/// codegenVisitor - Generates LLVM IR for the AST it visits into the module of
+/// a CompilerInstance. Each visit returns the value of the expression, of
+/// the type TypeInference gave it, or null on error. Doubles are LLVM
+/// doubles, ints i64 and bools i1.
+///
+/// Variables live in SSA values from the start, rather than in allocas for
+/// mem2reg to promote: phis are placed as the code is generated, following
+/// Braun et al., "Simple and Efficient Construction of Static Single
+/// Assignment Form" (CC 2013). Each variable has a number (CI.NamedValues
+/// maps the names in scope to theirs), and its value is looked up by
+/// variable and block, asking the predecessors if the block doesn't assign
+/// it. A loop header is "sealed" once its back edge exists; until then,
+/// reads in it get a phi whose operands are filled in when it is.
+class codegenVisitor : public ExprVisitor<codegenVisitor, llvm::Value *> {
+  CompilerInstance &CI;
+  llvm::Function *getFunction(Symbol Name);
+  void emitTierUpCounter(llvm::Function *F);
+
+  std::vector<Symbol> VarNames;  // Of each variable, to name its phis
+  std::vector<ValueType> VarTypes;
+  llvm::DenseMap<std::pair<unsigned, llvm::BasicBlock *>, llvm::WeakTrackingVH>
+      CurrentDef;
+  llvm::SmallPtrSet<llvm::BasicBlock *, 8> Unsealed;
+  llvm::DenseMap<llvm::BasicBlock *,
+                 llvm::SmallVector<std::pair<unsigned, llvm::PHINode *>, 4>>
+      IncompletePhis;
+
+  /// startFunction - Forget the variables of the last function generated.
+  void startFunction();
+  /// declareVariable - Bring a new variable called Name of type Ty into
+  /// scope, with value Init in the current block, and return its number.
+  unsigned declareVariable(Symbol Name, ValueType Ty, llvm::Value *Init);
+  void writeVariable(unsigned Var, llvm::BasicBlock *BB, llvm::Value *Val) {
+    CurrentDef[{Var, BB}] = Val;
+  }
+  llvm::Value *readVariable(unsigned Var, llvm::BasicBlock *BB);
+  llvm::Value *readVariableRecursive(unsigned Var, llvm::BasicBlock *BB);
+  llvm::Value *addPhiOperands(unsigned Var, llvm::PHINode *Phi);
+  llvm::Value *tryRemoveTrivialPhi(llvm::PHINode *Phi);
+  /// sealBlock - Note that BB has all its predecessors now.
+  void sealBlock(llvm::BasicBlock *BB);
+
+  /// FunctionState - The variables of the function being generated, put
+  /// aside while the body of a parfor in it is generated as a function of
+  /// its own.
+  struct FunctionState {
+    llvm::DenseMap<Symbol, unsigned> NamedValues;
+    std::vector<Symbol> VarNames;
+    std::vector<ValueType> VarTypes;
+    llvm::DenseMap<std::pair<unsigned, llvm::BasicBlock *>,
+                   llvm::WeakTrackingVH>
+        CurrentDef;
+    llvm::SmallPtrSet<llvm::BasicBlock *, 8> Unsealed;
+    llvm::DenseMap<llvm::BasicBlock *,
+                   llvm::SmallVector<std::pair<unsigned, llvm::PHINode *>, 4>>
+        IncompletePhis;
+  };
+  void swapFunctionState(FunctionState &S);
+  std::vector<llvm::Function *> Outlined;  // Parfor bodies generated so far
+  /// eraseOutlined - Erase the parfor bodies generated after the first N.
+  void eraseOutlined(size_t N);
+
+  llvm::Type *getType(ValueType Ty);
+  /// convert - V, of type From, as a To.
+  llvm::Value *convert(llvm::Value *V, ValueType From, ValueType To);
+  /// emit - Generate E and convert its value to Ty.
+  llvm::Value *emit(ExprAST *E, ValueType Ty);
+  /// emitCall - Call F with Args, converted to its parameters' types.
+  llvm::Value *emitCall(llvm::Function *F, llvm::ArrayRef<ExprAST *> Args,
+                        const llvm::Twine &Name);
+  /// emitElementAddress - The address of the element e indexes.
+  llvm::Value *emitElementAddress(IndexExprAST *e);
+
+  bool CountLoops = false;  // CI.CountLoops, but for the fallback loops
+  /// emitLoop - Generate e as written, given the value it starts at. Returns
+  /// false on error.
+  bool emitLoop(ForExprAST *e, llvm::Value *StartVal);
+  /// emitCountedLoop - Generate e, which is Counted, as a loop counting an
+  /// i64 from StartVal, tested before each trip, if StartVal and the limit
+  /// allow it when the loop is reached, and as written otherwise.
+  bool emitCountedLoop(ForExprAST *e, llvm::Value *StartVal);
+  /// emitParForChunk - Generate "double F(i8 *Env, i64 Begin, i64 End)",
+  /// which runs the trips of e from Begin to End and combines their values.
+  /// Env points to an EnvTy holding the variables Vars. Returns null on
+  /// error.
+  llvm::Function *
+  emitParForChunk(ParForExprAST *e,
+                  llvm::ArrayRef<std::pair<Symbol, ValueType>> Vars,
+                  llvm::StructType *EnvTy);
+
+public:
+  explicit codegenVisitor(CompilerInstance &CI) : CI(CI) {}
+
+  /// codegen - Generate the declaration of a function, or null on error.
+  llvm::Function *codegen(PrototypeAST &P);
+
+  /// codegen - Generate a function, or null on error. Its prototype moves to
+  /// CI.FunctionProtos, so that later modules can call it.
+  llvm::Function *codegen(FunctionAST &F);
+
+  /// emitLoopResume - Generate "void Name(double *Frame)", which runs the
+  /// rest of Loop from the top of an iteration, for a loop the bytecode
+  /// interpreter has been running. Vars are the variables in scope in the
+  /// loop's body, with where they are in Frame; they're read from there,
+  /// and written back once the loop is done. Returns null on error.
+  llvm::Function *
+  emitLoopResume(ForExprAST *Loop,
+                 llvm::ArrayRef<std::pair<Symbol, unsigned>> Vars,
+                 const std::string &Name);
+
+  /// emitBatch - Generate
+  ///
+  ///   void Name(double **Columns, double *Out, i64 Rows)
+  ///
+  /// which stores Callee(Columns[0][r], ..., Columns[N-1][r]) to Out[r] for
+  /// each row r, converting the doubles to and from Callee's types. Out
+  /// mustn't overlap the columns. Returns null on error, e.g. if Callee
+  /// takes an array.
+  llvm::Function *emitBatch(Symbol Callee, const std::string &Name);
+
+  llvm::Value *visitNumberExpr(NumberExprAST *e);
+  llvm::Value *visitVariableExpr(VariableExprAST *e);
+  llvm::Value *visitBinaryExpr(BinaryExprAST *e);
+  llvm::Value *visitCallExpr(CallExprAST *e);
+  llvm::Value *visitIfExpr(IfExprAST *e);
+  llvm::Value *visitForExpr(ForExprAST *e);
+  llvm::Value *visitUnaryExpr(UnaryExprAST *e);
+  llvm::Value *visitVarExpr(VarExprAST *e);
+  llvm::Value *visitIndexExpr(IndexExprAST *e);
+  llvm::Value *visitParForExpr(ParForExprAST *e);
+};
+
+#endif	// CODEGENVISITOR_H
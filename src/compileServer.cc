@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "compileServer.h"
+
+/// MaxStringSize, MaxArgs - Limits on what a peer may send, past which the
+/// connection is dropped rather than the memory allocated.
+static const uint64_t MaxStringSize = uint64_t(1) << 30;
+static const uint32_t MaxArgs = 1 << 16;
+
+static bool writeAll(int FD, const void *Data, size_t Size) {
+  const char *P = static_cast<const char *>(Data);
+  while (Size) {
+    // A peer that hung up gets EPIPE instead of a SIGPIPE that would kill
+    // the server.
+    ssize_t N = send(FD, P, Size, MSG_NOSIGNAL);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool readAll(int FD, void *Data, size_t Size) {
+  char *P = static_cast<char *>(Data);
+  while (Size) {
+    ssize_t N = read(FD, P, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    P += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool writeString(int FD, const std::string &S) {
+  uint64_t Size = S.size();
+  return writeAll(FD, &Size, sizeof(Size)) && writeAll(FD, S.data(), Size);
+}
+
+static bool readString(int FD, std::string &S) {
+  uint64_t Size;
+  if (!readAll(FD, &Size, sizeof(Size)) || Size > MaxStringSize)
+    return false;
+  // Grow the string as the data comes in, so that a peer claiming more than
+  // it sends doesn't get it all allocated.
+  S.clear();
+  while (S.size() != Size) {
+    size_t Done = S.size();
+    S.resize(Done + std::min<uint64_t>(Size - Done, 1 << 20));
+    if (!readAll(FD, &S[Done], S.size() - Done))
+      return false;
+  }
+  return true;
+}
+
+bool sendRequest(int FD, const CompileRequest &Req) {
+  uint32_t NumArgs = Req.Args.size();
+  if (!writeString(FD, Req.Cwd) || !writeAll(FD, &NumArgs, sizeof(NumArgs)))
+    return false;
+  for (const std::string &Arg : Req.Args)
+    if (!writeString(FD, Arg))
+      return false;
+  return writeString(FD, Req.SourceName) && writeString(FD, Req.Source);
+}
+
+bool receiveRequest(int FD, CompileRequest &Req) {
+  uint32_t NumArgs;
+  if (!readString(FD, Req.Cwd) || !readAll(FD, &NumArgs, sizeof(NumArgs)) ||
+      NumArgs > MaxArgs)
+    return false;
+  Req.Args.resize(NumArgs);
+  for (std::string &Arg : Req.Args)
+    if (!readString(FD, Arg))
+      return false;
+  return readString(FD, Req.SourceName) && readString(FD, Req.Source);
+}
+
+bool sendResponse(int FD, const CompileResponse &Resp) {
+  int32_t Status = Resp.Status;
+  return writeAll(FD, &Status, sizeof(Status)) && writeString(FD, Resp.Out) &&
+         writeString(FD, Resp.Err) && writeString(FD, Resp.Object);
+}
+
+bool receiveResponse(int FD, CompileResponse &Resp) {
+  int32_t Status;
+  if (!readAll(FD, &Status, sizeof(Status)))
+    return false;
+  Resp.Status = Status;
+  return readString(FD, Resp.Out) && readString(FD, Resp.Err) &&
+         readString(FD, Resp.Object);
+}
+
+std::string getDefaultSocketPath() {
+  if (const char *Path = getenv("KALE_SERVER"))
+    return Path;
+  return "/tmp/kale-" + std::to_string(getuid()) + ".sock";
+}
+
+/// getAddress - The address of the socket at Path; false if it's too long.
+static bool getAddress(const std::string &Path, sockaddr_un &Addr,
+                       std::string &Error) {
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    Error = "socket path too long: " + Path;
+    return false;
+  }
+  memcpy(Addr.sun_path, Path.c_str(), Path.size() + 1);
+  return true;
+}
+
+int connectToServer(const std::string &Path, std::string &Error) {
+  sockaddr_un Addr;
+  if (!getAddress(Path, Addr, Error))
+    return -1;
+  int FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (FD < 0 ||
+      connect(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+    Error = "cannot connect to " + Path + ": " + strerror(errno);
+    if (FD >= 0)
+      close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+bool runCompileServer(const std::string &Path, unsigned NumWorkers,
+                      const CompileHandler &Handler, std::string &Error) {
+  sockaddr_un Addr;
+  if (!getAddress(Path, Addr, Error))
+    return false;
+  std::string ConnectError;
+  int Other = connectToServer(Path, ConnectError);
+  if (Other >= 0) {
+    close(Other);
+    Error = "a server is already listening on " + Path;
+    return false;
+  }
+  // What's left at Path is a stale socket, unless it isn't a socket at all.
+  struct stat St;
+  if (lstat(Path.c_str(), &St) == 0) {
+    if (!S_ISSOCK(St.st_mode)) {
+      Error = Path + " exists and is not a socket";
+      return false;
+    }
+    unlink(Path.c_str());
+  }
+
+  int Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (Listener < 0 ||
+      bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0 ||
+      listen(Listener, SOMAXCONN) < 0) {
+    Error = "cannot listen on " + Path + ": " + strerror(errno);
+    return false;
+  }
+
+  // Each worker accepts connections itself, so there's no queue to share,
+  // and serves the requests on them one at a time. The handler's per-thread
+  // state, like target machines, stays with the worker.
+  auto Worker = [&] {
+    while (true) {
+      int FD = accept4(Listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (FD < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        return;
+      }
+      CompileRequest Req;
+      while (receiveRequest(FD, Req)) {
+        // An exception fails the request it came from, not the server.
+        CompileResponse Resp;
+        try {
+          Handler(Req, Resp);
+        } catch (const std::exception &E) {
+          Resp = CompileResponse();
+          Resp.Status = 1;
+          Resp.Err = std::string("Error: internal error: ") + E.what() + "\n";
+        }
+        if (!sendResponse(FD, Resp))
+          break;
+      }
+      close(FD);
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned I = 1; I < NumWorkers; ++I)
+    Workers.emplace_back(Worker);
+  Worker();
+  for (std::thread &W : Workers)
+    W.join();
+  Error = std::string("accept failed: ") + strerror(errno);
+  return false;
+}
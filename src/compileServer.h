@@ -0,0 +1,54 @@
+#ifndef COMPILESERVER_H
+#define COMPILESERVER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// CompileRequest - One ahead-of-time build for `Kale --server`: the command
+/// line the client was given, and the program it read. The server reads no
+/// files of the client's, and the client writes the object.
+struct CompileRequest {
+  std::string Cwd;  // The client's, for relative paths like --cache-dir
+  std::vector<std::string> Args;  // Without argv[0]
+  std::string SourceName;         // For error locations
+  std::string Source;
+};
+
+/// CompileResponse - What `Kale` would have printed for the request, its exit
+/// status, and the object file it would have written, if any.
+struct CompileResponse {
+  int Status = 0;
+  std::string Out, Err;
+  std::string Object;
+};
+
+/// The messages are length-prefixed fields in host byte order, as both ends
+/// run on the same machine. Each returns false if the connection fails.
+bool sendRequest(int FD, const CompileRequest &Req);
+bool receiveRequest(int FD, CompileRequest &Req);
+bool sendResponse(int FD, const CompileResponse &Resp);
+bool receiveResponse(int FD, CompileResponse &Resp);
+
+/// getDefaultSocketPath - $KALE_SERVER, or a socket of the user's in /tmp.
+std::string getDefaultSocketPath();
+
+/// connectToServer - A socket connected to the server listening on Path, or
+/// -1 with Error set.
+int connectToServer(const std::string &Path, std::string &Error);
+
+/// CompileHandler - Serves one request; called on any worker thread.
+using CompileHandler =
+    std::function<void(const CompileRequest &, CompileResponse &)>;
+
+/// runCompileServer - Listen on the Unix socket Path and serve requests on
+/// NumWorkers threads, each taking the next connection as soon as it is done
+/// with its last one, until the process is killed. A stale socket file is
+/// replaced, but not one a server is still listening on, nor anything at
+/// Path that isn't a socket. A request whose handler throws gets an error
+/// response. Returns false with Error set if it can't start.
+bool runCompileServer(const std::string &Path, unsigned NumWorkers,
+                      const CompileHandler &Handler, std::string &Error);
+
+#endif	// COMPILESERVER_H
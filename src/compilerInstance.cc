@@ -0,0 +1,151 @@
+#include "compilerInstance.h"
+#include "ast.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+
+#if LLVM_VERSION_MAJOR >= 14
+using OptimizationLevel = llvm::OptimizationLevel;
+using GVNPass = llvm::GVNPass;
+#else
+using OptimizationLevel = llvm::PassBuilder::OptimizationLevel;
+using GVNPass = llvm::GVN;
+#endif
+
+/// getOptimizationLevel - The pass builder's name for -O<Level>.
+static OptimizationLevel getOptimizationLevel(unsigned Level) {
+  switch (Level) {
+  case 0: return OptimizationLevel::O0;
+  case 1: return OptimizationLevel::O1;
+  case 2: return OptimizationLevel::O2;
+  default: return OptimizationLevel::O3;
+  }
+}
+
+/// createPassBuilder - A pass builder for TM tuned for -O<Level>. Loops are
+/// unrolled from -O1 and vectorized from -O2 on, as clang does.
+static llvm::PassBuilder createPassBuilder(llvm::TargetMachine *TM,
+                                           unsigned Level) {
+  llvm::PipelineTuningOptions PTO;
+  PTO.LoopUnrolling = Level >= 1;
+  PTO.LoopInterleaving = Level >= 2;
+  PTO.LoopVectorization = Level >= 2;
+  PTO.SLPVectorization = Level >= 2;
+#if LLVM_VERSION_MAJOR == 11 || LLVM_VERSION_MAJOR == 12
+  return llvm::PassBuilder(/*DebugLogging=*/false, TM, PTO);
+#else
+  return llvm::PassBuilder(TM, PTO);
+#endif
+}
+
+CompilerInstance::CompilerInstance() {
+  // Install standard binary operators.
+  // 1 is lowest precedence.
+  BinopPrecedence['='] = 2;
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40; // highest.
+}
+
+CompilerInstance::~CompilerInstance() { releaseModule(); }
+
+void CompilerInstance::initializeModule(const llvm::DataLayout &DL) {
+  releaseModule();
+
+  // Open a new module.
+  TheContext = std::make_unique<llvm::LLVMContext>();
+  TheModule = std::make_unique<llvm::Module>("Kale Compiler", *TheContext);
+  TheModule->setDataLayout(DL);
+  if (TM)
+    TheModule->setTargetTriple(TM->getTargetTriple().str());
+
+  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+
+  // Create the analysis managers and register everything the pipelines can
+  // ask them for.
+  TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
+  TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
+  TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
+  TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
+  llvm::PassBuilder PB = createPassBuilder(TM, OptLevel);
+  PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
+  PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
+  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+  // Create a new pass manager for the per-function cleanups, which keep the
+  // module small for the passes that follow. Codegen puts variables in
+  // registers itself, so there are no allocas to promote first.
+  TheFPM = std::make_unique<llvm::FunctionPassManager>();
+  if (OptLevel == 0)
+    return;
+
+  // Do simple "peephole" optimizations and bit-twiddling optzns.
+  TheFPM->addPass(llvm::InstCombinePass());
+  // Reassociate expressions.
+  TheFPM->addPass(llvm::ReassociatePass());
+  // Eliminate Common SubExpressions.
+  TheFPM->addPass(GVNPass());
+  // Simplify the control flow graph (deleting unreachable blocks, etc).
+  TheFPM->addPass(llvm::SimplifyCFGPass());
+}
+
+void CompilerInstance::optimizeModule() {
+  if (OptLevel == 0)
+    return;
+  llvm::PassBuilder PB = createPassBuilder(TM, OptLevel);
+  llvm::ModulePassManager MPM =
+      PB.buildPerModuleDefaultPipeline(getOptimizationLevel(OptLevel));
+  MPM.run(*TheModule, *TheMAM);
+}
+
+void optimizeModule(llvm::Module &M, llvm::TargetMachine *TM, unsigned Level) {
+  if (Level == 0)
+    return;
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB = createPassBuilder(TM, Level);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  llvm::ModulePassManager MPM =
+      PB.buildPerModuleDefaultPipeline(getOptimizationLevel(Level));
+  MPM.run(M, MAM);
+}
+
+llvm::CodeGenOpt::Level CompilerInstance::getCodeGenOptLevel(unsigned Level) {
+  switch (Level) {
+  case 0: return llvm::CodeGenOpt::None;
+  case 1: return llvm::CodeGenOpt::Less;
+  case 2: return llvm::CodeGenOpt::Default;
+  default: return llvm::CodeGenOpt::Aggressive;
+  }
+}
+
+void CompilerInstance::takeModule(std::unique_ptr<llvm::Module> &M,
+                                  std::unique_ptr<llvm::LLVMContext> &Context) {
+  M = std::move(TheModule);
+  Context = std::move(TheContext);
+  releaseModule();
+}
+
+void CompilerInstance::releaseModule() {
+  // Tear down in dependency order; the context has to go last.
+  NamedValues.clear();
+  TheFPM.reset();
+  TheMAM.reset();
+  TheCGAM.reset();
+  TheFAM.reset();
+  TheLAM.reset();
+  Builder.reset();
+  TheModule.reset();
+  TheContext.reset();
+}
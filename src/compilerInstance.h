@@ -0,0 +1,127 @@
+#ifndef COMPILERINSTANCE_H
+#define COMPILERINSTANCE_H
+
+#include <map>
+#include <memory>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Target/TargetMachine.h"
+#include "arena.h"
+#include "symbol.h"
+
+class ExprAST;
+class PrototypeAST;
+
+/// InlineOperator - The body of a user defined operator small enough to be
+/// inlined where it's used, with its parameters renamed to names no program
+/// can spell (see ASTSimplifier).
+struct InlineOperator {
+  llvm::SmallVector<Symbol, 2> Params;
+  /// UsedOnce - Which parameters Body uses just once, if it binds no
+  /// variables of its own; operands for them can go where they're used.
+  llvm::SmallVector<bool, 2> UsedOnce;
+  ExprAST *Body;
+};
+
+/// CompilerInstance - Everything one compilation needs besides its input: the
+/// LLVM context and module being generated, and what the program has declared
+/// so far. The Parser and codegenVisitor working on a program share one
+/// instance; separate instances share nothing but the symbol table, so any
+/// number of them can be used on different threads at the same time.
+class CompilerInstance {
+public:
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  std::unique_ptr<llvm::Module> TheModule;
+
+  /// TheFPM - The per-function pipeline, run on each function as soon as it
+  /// has been generated. Empty at -O0.
+  std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+  std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+  std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+  std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+  std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+
+  /// OptLevel - 0 to 3, as in -O0 to -O3. Takes effect at the next
+  /// initializeModule().
+  unsigned OptLevel = 0;
+
+  /// TM - The machine code is generated for, if known. Optimizations use it
+  /// to ask which instructions are cheap, e.g. how wide vectors can be.
+  llvm::TargetMachine *TM = nullptr;
+
+  /// TierUpThreshold - If not 0, every function generated counts its calls
+  /// and asks to be recompiled at a higher level after this many; see
+  /// codegenVisitor::emitTierUpCounter().
+  unsigned TierUpThreshold = 0;
+
+  /// CountLoops - Whether loops over doubles that LoopNarrowing finds only
+  /// hold whole numbers are generated counting an i64, which only pays off
+  /// once the code is optimized; see codegenVisitor::emitCountedLoop().
+  bool CountLoops = false;
+
+  /// Simplify - Whether the driver runs the ASTSimplifier on each item
+  /// before generating code for it.
+  bool Simplify = true;
+
+  /// NamedValues - Variables in scope in the function being generated, by
+  /// name; codegenVisitor numbers them.
+  llvm::DenseMap<Symbol, unsigned> NamedValues;
+
+  /// FunctionProtos - The most recent prototype of every function declared,
+  /// so that calls can be generated in any module of the compilation.
+  llvm::DenseMap<Symbol, std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+  /// BinopPrecedence - The precedence of each binary operator defined. The
+  /// standard operators are installed on construction.
+  std::map<char, int> BinopPrecedence;
+
+  /// InlineOperators - The operators among FunctionProtos that the
+  /// ASTSimplifier inlines, by name. Their bodies are in OperatorArena, or
+  /// in that of an instance that outlives this one.
+  llvm::DenseMap<Symbol, InlineOperator> InlineOperators;
+  ASTArena OperatorArena;
+
+  CompilerInstance();
+  ~CompilerInstance();
+  CompilerInstance(const CompilerInstance &) = delete;
+  CompilerInstance &operator=(const CompilerInstance &) = delete;
+
+  /// initializeModule - Start a new, empty module (in a new context) to
+  /// generate code into, and set up the optimization pipeline for it.
+  /// Declarations and operators are kept.
+  void initializeModule(const llvm::DataLayout &DL);
+
+  /// optimizeModule - Run the whole-module pipeline for OptLevel on the
+  /// module: inlining, LICM, loop unrolling, loop and SLP vectorization,
+  /// global DCE and the rest of LLVM's default pipeline. Call it once all
+  /// the functions are in, before handing the module to the JIT or emitting
+  /// an object file.
+  void optimizeModule();
+
+  /// getCodeGenOptLevel - The code generator's optimization level matching
+  /// -O<Level>.
+  static llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned Level);
+
+  /// takeModule - Hand the module and its context over, e.g. to the JIT. The
+  /// instance has no module until the next initializeModule().
+  void takeModule(std::unique_ptr<llvm::Module> &M,
+                  std::unique_ptr<llvm::LLVMContext> &Context);
+
+  /// releaseModule - Tear down the module and its context.
+  void releaseModule();
+};
+
+/// optimizeModule - Run the whole-module pipeline for -O<Level> on M, tuned
+/// for TM if it isn't null. Unlike CompilerInstance::optimizeModule() it
+/// works on any module, e.g. one the JIT is about to compile.
+void optimizeModule(llvm::Module &M, llvm::TargetMachine *TM, unsigned Level);
+
+#endif	// COMPILERINSTANCE_H
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+
+#include "cpuDispatch.h"
+
+TargetCPU resolveTargetCPU(const std::string &CPU, const std::string &Attrs) {
+  if (CPU != "native")
+    return {CPU, Attrs};
+
+  TargetCPU Host{llvm::sys::getHostCPUName().str(), ""};
+  llvm::StringMap<bool> HostFeatures;
+  if (llvm::sys::getHostCPUFeatures(HostFeatures))
+    for (auto &F : HostFeatures) {
+      if (!Host.Features.empty())
+        Host.Features += ',';
+      Host.Features += (F.second ? "+" : "-") + F.first().str();
+    }
+  // Explicit -mattr flags come last so that they win.
+  if (!Attrs.empty())
+    Host.Features += (Host.Features.empty() ? "" : ",") + Attrs;
+  return Host;
+}
+
+static std::unique_ptr<llvm::MCSubtargetInfo>
+createSubtargetInfo(const llvm::TargetMachine &TM, const TargetCPU &CPU) {
+  return std::unique_ptr<llvm::MCSubtargetInfo>(
+      TM.getTarget().createMCSubtargetInfo(TM.getTargetTriple().str(),
+                                           CPU.Name, CPU.Features));
+}
+
+bool isValidCPU(const llvm::Target &T, const std::string &Triple,
+                const std::string &Name) {
+  std::unique_ptr<llvm::MCSubtargetInfo> STI(
+      T.createMCSubtargetInfo(Triple, "generic", ""));
+  return STI->isCPUStringValid(Name);
+}
+
+/// Bits of __cpu_model.__cpu_features[0] (enum ProcessorFeatures in libgcc
+/// and compiler-rt) and the LLVM features they stand for. Only features a
+/// clone can make the code depend on are listed; a CPU with any of the later
+/// vector extensions also has the ones before it here.
+static const struct {
+  const char *Name;
+  unsigned Bit;
+} CPUModelFeatures[] = {
+    {"cmov", 0},      {"popcnt", 2},    {"sse", 3},       {"sse2", 4},
+    {"sse3", 5},      {"ssse3", 6},     {"sse4.1", 7},    {"sse4.2", 8},
+    {"avx", 9},       {"avx2", 10},     {"fma", 14},      {"avx512f", 15},
+    {"bmi", 16},      {"bmi2", 17},     {"aes", 18},      {"pclmul", 19},
+    {"avx512vl", 20}, {"avx512bw", 21}, {"avx512dq", 22}, {"avx512cd", 23},
+};
+
+/// getRequiredFeatures - The __cpu_features bits a CPU has to have for code
+/// compiled for CPU to run on it.
+static uint32_t getRequiredFeatures(const llvm::TargetMachine &TM,
+                                    const TargetCPU &CPU) {
+  auto STI = createSubtargetInfo(TM, CPU);
+  uint32_t Mask = 0;
+  for (auto &F : CPUModelFeatures)
+    if (STI->checkFeatures(std::string("+") + F.Name))
+      Mask |= 1u << F.Bit;
+  return Mask;
+}
+
+/// getCPUFeaturesFunction - An internal function returning
+/// __cpu_model.__cpu_features[0] once __cpu_indicator_init() has filled it
+/// in. Resolvers run before constructors do, so they have to initialize it
+/// themselves, as GCC's do.
+static llvm::Function *getCPUFeaturesFunction(llvm::Module &M) {
+  if (auto *F = M.getFunction("__kale_cpu_features"))
+    return F;
+  llvm::LLVMContext &C = M.getContext();
+  llvm::Type *I32 = llvm::Type::getInt32Ty(C);
+  llvm::StructType *ModelTy =
+      llvm::StructType::create(C, {I32, I32, I32, llvm::ArrayType::get(I32, 1)},
+                               "struct.__processor_model");
+  auto *Model = new llvm::GlobalVariable(
+      M, ModelTy, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+      "__cpu_model");
+  llvm::FunctionCallee Init = M.getOrInsertFunction(
+      "__cpu_indicator_init", llvm::Type::getVoidTy(C));
+
+  llvm::Function *F = llvm::Function::Create(
+      llvm::FunctionType::get(I32, false), llvm::Function::InternalLinkage,
+      "__kale_cpu_features", M);
+  llvm::IRBuilder<> B(llvm::BasicBlock::Create(C, "entry", F));
+  B.CreateCall(Init);
+  llvm::Value *Idx[] = {B.getInt32(0), B.getInt32(3), B.getInt32(0)};
+  llvm::Value *Features = B.CreateInBoundsGEP(ModelTy, Model, Idx);
+  B.CreateRet(B.CreateLoad(I32, Features, "features"));
+  return F;
+}
+
+bool emitCPUClones(llvm::Module &M, const llvm::TargetMachine &TM,
+                   llvm::ArrayRef<TargetCPU> Clones, std::string &Error) {
+  const llvm::Triple &TT = TM.getTargetTriple();
+  if (!TT.isX86() || !TT.isOSBinFormatELF()) {
+    Error = "CPU clones need an x86 ELF target, not " + TT.str();
+    return false;
+  }
+
+  std::vector<llvm::Function *> Exported;
+  for (llvm::Function &F : M)
+    if (!F.isDeclaration() && F.hasExternalLinkage())
+      Exported.push_back(&F);
+  if (Exported.empty())
+    return true;
+
+  // Try the most demanding clones first.
+  struct Variant {
+    const TargetCPU *CPU;
+    uint32_t Required;
+  };
+  std::vector<Variant> Variants;
+  for (const TargetCPU &CPU : Clones)
+    Variants.push_back({&CPU, getRequiredFeatures(TM, CPU)});
+  std::stable_sort(Variants.begin(), Variants.end(),
+                   [](const Variant &A, const Variant &B) {
+                     return __builtin_popcount(A.Required) >
+                            __builtin_popcount(B.Required);
+                   });
+
+  // Clone all the functions for one CPU at a time, mapping each function to
+  // its clone so that calls stay within the variant.
+  std::vector<std::vector<llvm::Function *>> Cloned(Variants.size());
+  for (size_t V = 0; V != Variants.size(); ++V) {
+    const TargetCPU &CPU = *Variants[V].CPU;
+    llvm::ValueToValueMapTy VMap;
+    for (llvm::Function *F : Exported) {
+      llvm::Function *NewF = llvm::Function::Create(
+          F->getFunctionType(), llvm::Function::InternalLinkage,
+          F->getName() + "." + CPU.Name, &M);
+      NewF->addFnAttr("target-cpu", CPU.Name);
+      if (!CPU.Features.empty())
+        NewF->addFnAttr("target-features", CPU.Features);
+      VMap[F] = NewF;
+      Cloned[V].push_back(NewF);
+    }
+    for (size_t I = 0; I != Exported.size(); ++I) {
+      llvm::Function *F = Exported[I], *NewF = Cloned[V][I];
+      auto NewArg = NewF->arg_begin();
+      for (llvm::Argument &Arg : F->args()) {
+        NewArg->setName(Arg.getName());
+        VMap[&Arg] = &*NewArg++;
+      }
+      llvm::SmallVector<llvm::ReturnInst *, 4> Returns;
+#if LLVM_VERSION_MAJOR >= 13
+      llvm::CloneFunctionInto(NewF, F, VMap,
+                              llvm::CloneFunctionChangeType::LocalChangesOnly,
+                              Returns);
+#else
+      llvm::CloneFunctionInto(NewF, F, VMap, /*ModuleLevelChanges=*/false,
+                              Returns);
+#endif
+    }
+  }
+
+  // The originals become the fallback, and their names go to the ifuncs.
+  llvm::Function *GetFeatures = getCPUFeaturesFunction(M);
+  llvm::LLVMContext &C = M.getContext();
+  for (size_t I = 0; I != Exported.size(); ++I) {
+    llvm::Function *F = Exported[I];
+    std::string Name = F->getName().str();
+    F->setName(Name + ".default");
+    F->setLinkage(llvm::Function::InternalLinkage);
+
+    llvm::Function *Resolver = llvm::Function::Create(
+        llvm::FunctionType::get(F->getType(), false),
+        llvm::Function::InternalLinkage, Name + ".resolver", M);
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(C, "entry", Resolver));
+    llvm::Value *Features = B.CreateCall(GetFeatures, {}, "features");
+    for (size_t V = 0; V != Variants.size(); ++V) {
+      uint32_t Required = Variants[V].Required;
+      if (!Required) {
+        // Runs anywhere, so nothing after it could be picked.
+        B.CreateRet(Cloned[V][I]);
+        break;
+      }
+      llvm::Value *Has = B.CreateICmpEQ(B.CreateAnd(Features, Required),
+                                        B.getInt32(Required), "has");
+      auto *Use = llvm::BasicBlock::Create(C, "use", Resolver);
+      auto *Next = llvm::BasicBlock::Create(C, "next", Resolver);
+      B.CreateCondBr(Has, Use, Next);
+      B.SetInsertPoint(Use);
+      B.CreateRet(Cloned[V][I]);
+      B.SetInsertPoint(Next);
+    }
+    if (!B.GetInsertBlock()->getTerminator())
+      B.CreateRet(F);
+
+    llvm::GlobalIFunc::create(F->getFunctionType(), 0,
+                              llvm::GlobalValue::ExternalLinkage, Name,
+                              Resolver, &M);
+  }
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef CPUDISPATCH_H
+#define CPUDISPATCH_H
+
+#include <string>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// TargetCPU - A CPU to generate code for, and features to turn on or off on
+/// top of the ones it has, in -mattr syntax ("+avx2,-fma").
+struct TargetCPU {
+  std::string Name;
+  std::string Features;
+};
+
+/// resolveTargetCPU - Build the TargetCPU for a -mcpu value and -mattr
+/// string. "native" means the host CPU, with exactly the features the host
+/// reports, since virtual machines often hide some of what the model has.
+TargetCPU resolveTargetCPU(const std::string &CPU, const std::string &Attrs);
+
+/// isValidCPU - Whether target T knows a CPU called Name for Triple. Ask
+/// before creating a TargetMachine for it, which only warns about a CPU it
+/// doesn't know.
+bool isValidCPU(const llvm::Target &T, const std::string &Triple,
+                const std::string &Name);
+
+/// emitCPUClones - Compile every exported function of M once more for each of
+/// Clones, and make its symbol an ifunc that picks the variant to use when the
+/// program is loaded: the first clone whose features the running CPU has, or
+/// else the original, which keeps TM's CPU. Calls within the module go to the
+/// variant of the caller, so only calls from outside pay for the dispatch.
+///
+/// Run it before the module pipeline so that each clone is optimized for its
+/// own CPU. Dispatch uses the CPU model libgcc and compiler-rt provide, so it
+/// needs an x86 ELF target; returns false and sets Error otherwise.
+bool emitCPUClones(llvm::Module &M, const llvm::TargetMachine &TM,
+                   llvm::ArrayRef<TargetCPU> Clones, std::string &Error);
+
+#endif	// CPUDISPATCH_H
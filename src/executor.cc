@@ -0,0 +1,554 @@
+#include <chrono>
+#include <cstdio>
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
+#include "../include/KaleidoscopeJIT.h"
+#include "codegenVisitor.h"
+#include "executor.h"
+
+static double secondsSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       Start).count();
+}
+
+std::unique_ptr<Executor> Executor::create(const Options &Opts,
+                                           std::string &Error) {
+  auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB) {
+    Error = llvm::toString(JTMB.takeError());
+    return nullptr;
+  }
+  std::unique_ptr<Executor> Exec(new Executor);
+  Exec->Interpret = Opts.Interpret;
+  Exec->PromoteAfter = Opts.PromoteAfter;
+  unsigned OptLevel = Opts.OptLevel;
+  bool Lazy = Opts.Lazy;
+  if (Opts.TierUpThreshold) {
+    // Counters and function names are addressed through the GOT, which the
+    // JIT can put anywhere.
+    JTMB->setRelocationModel(llvm::Reloc::PIC_);
+    Exec->Tiered = true;
+    OptLevel = 0;
+    Lazy = false;
+  }
+  Exec->O3Builder = std::make_unique<llvm::orc::JITTargetMachineBuilder>(*JTMB);
+  Exec->O3Builder->setCodeGenOptLevel(CompilerInstance::getCodeGenOptLevel(3));
+  JTMB->setCodeGenOptLevel(CompilerInstance::getCodeGenOptLevel(OptLevel));
+
+  auto TM = JTMB->createTargetMachine();
+  if (!TM) {
+    Error = llvm::toString(TM.takeError());
+    return nullptr;
+  }
+  Exec->TM = std::move(*TM);
+
+  if (!Opts.CacheDir.empty()) {
+    Exec->Cache = DiskObjectCache::create(Opts.CacheDir, Opts.CacheBytes,
+                                          *Exec->TM, Error);
+    if (!Exec->Cache)
+      return nullptr;
+  }
+
+  auto J = llvm::orc::KaleidoscopeJIT::Create(
+      *JTMB, Opts.NumCompileThreads, Lazy, Exec->Cache.get());
+  if (!J) {
+    Error = llvm::toString(J.takeError());
+    return nullptr;
+  }
+  Exec->TheJIT = std::move(*J);
+
+  // Optimize each module just before it's compiled. That may be on any
+  // compile thread, and target machines aren't thread-safe, so each module
+  // gets one of its own.
+  Executor *E = Exec.get();
+  Exec->TheJIT->setTransform(
+      [E, OptLevel, JTMB = *JTMB](llvm::orc::ThreadSafeModule TSM,
+                                  llvm::orc::MaterializationResponsibility &)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        auto TM = llvm::orc::JITTargetMachineBuilder(JTMB).createTargetMachine();
+        if (!TM)
+          return TM.takeError();
+        TSM.withModuleDo([&](llvm::Module &M) {
+          for (llvm::Function &F : M)
+            if (!F.isDeclaration())
+              ++E->FunctionsCompiled;
+          optimizeModule(M, TM->get(), OptLevel);
+        });
+        return std::move(TSM);
+      });
+  Exec->TheJIT->setObjectTransform(
+      [E](std::unique_ptr<llvm::MemoryBuffer> Obj)
+          -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+        E->ObjectBytes += Obj->getBufferSize();
+        return std::move(Obj);
+      });
+
+  if (Exec->isTiered()) {
+    auto Flags = llvm::JITSymbolFlags::Exported;
+    if (auto Err = Exec->TheJIT->defineAbsolute(
+            "__kale_tier_up", llvm::pointerToJITTargetAddress(&tierUpEntry),
+            Flags | llvm::JITSymbolFlags::Callable)) {
+      Error = llvm::toString(std::move(Err));
+      return nullptr;
+    }
+    if (auto Err = Exec->TheJIT->defineAbsolute(
+            "__kale_tier_context", llvm::pointerToJITTargetAddress(E), Flags)) {
+      Error = llvm::toString(std::move(Err));
+      return nullptr;
+    }
+    Exec->TierThread = std::thread([E] { E->runTierUps(); });
+  }
+  return Exec;
+}
+
+Executor::~Executor() {
+  if (TierThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> Guard(TierLock);
+      StopTiering = true;
+    }
+    TierReady.notify_all();
+    TierThread.join();
+  }
+}
+
+const llvm::DataLayout &Executor::getDataLayout() const {
+  return TheJIT->getDataLayout();
+}
+
+bool Executor::addDefinitions(CompilerInstance &CI, std::string &Error) {
+  std::unique_ptr<llvm::Module> M;
+  std::unique_ptr<llvm::LLVMContext> Context;
+  CI.takeModule(M, Context);
+  CI.initializeModule(getDataLayout());
+
+  // Keep the module as generated, to recompile its functions from later.
+  auto Bitcode = std::make_shared<std::string>();
+  llvm::raw_string_ostream OS(*Bitcode);
+  llvm::WriteBitcodeToFile(*M, OS);
+  OS.flush();
+  {
+    std::lock_guard<std::mutex> Guard(DefinitionsLock);
+    for (llvm::Function &F : *M)
+      if (!F.isDeclaration() && F.hasExternalLinkage())
+        Definitions[F.getName()] = Bitcode;
+  }
+
+  for (llvm::Function &F : *M)
+    if (!F.isDeclaration())
+      ++FunctionsDefined;
+  if (isTiered())
+    return addTieredDefinitions(std::move(M), std::move(Context), Error);
+  if (auto Err = TheJIT->addDefinitions(
+          llvm::orc::ThreadSafeModule(std::move(M), std::move(Context)))) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+bool Executor::addTieredDefinitions(std::unique_ptr<llvm::Module> M,
+                                    std::unique_ptr<llvm::LLVMContext> Context,
+                                    std::string &Error) {
+  auto Start = std::chrono::steady_clock::now();
+
+  // The functions are compiled under names of their own, and stubs get their
+  // names. Calls, recursive ones included, go through the stubs, so they
+  // reach the best version there is at the time.
+  std::vector<std::string> Names;
+  for (llvm::Function &F : *M)
+    if (!F.isDeclaration() && F.hasExternalLinkage())
+      Names.push_back(F.getName().str());
+  for (const std::string &Name : Names) {
+    llvm::Function *F = M->getFunction(Name);
+    F->setName(Name + ".tier0");
+    llvm::Function *Stub = llvm::Function::Create(
+        F->getFunctionType(), llvm::Function::ExternalLinkage, Name, *M);
+    F->replaceAllUsesWith(Stub);
+  }
+
+  // The stubs have to exist for the module to link. Nothing can call them
+  // before they point at the code.
+  for (const std::string &Name : Names)
+    if (auto Err = TheJIT->addStub(Name, 0)) {
+      Error = llvm::toString(std::move(Err));
+      return false;
+    }
+  if (auto Err = TheJIT->addModule(
+          llvm::orc::ThreadSafeModule(std::move(M), std::move(Context)))) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  for (const std::string &Name : Names) {
+    auto Addr = TheJIT->lookup(Name + ".tier0");
+    if (!Addr) {
+      Error = llvm::toString(Addr.takeError());
+      return false;
+    }
+    if (auto Err = TheJIT->updateStub(Name, *Addr)) {
+      Error = llvm::toString(std::move(Err));
+      return false;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> Guard(TierLock);
+    for (const std::string &Name : Names)
+      Tiers[Name].Queued = false;
+  }
+  std::lock_guard<std::mutex> Guard(StatsLock);
+  TheStats.Tier0Seconds += secondsSince(Start);
+  return true;
+}
+
+/// tierUpEntry - __kale_tier_up(), called by a function once it's hot. Ctx is
+/// the address of __kale_tier_context, which is the executor.
+void Executor::tierUpEntry(void *Ctx, const char *Name) {
+  static_cast<Executor *>(Ctx)->requestTierUp(Name);
+}
+
+void Executor::requestTierUp(const char *Name) {
+  {
+    std::lock_guard<std::mutex> Guard(TierLock);
+    auto It = Tiers.find(Name);
+    // Top-level expressions count their calls too, but aren't recompiled.
+    if (It == Tiers.end() || It->second.Queued)
+      return;
+    It->second.Queued = true;
+    TierQueue.push_back(Name);
+  }
+  TierReady.notify_one();
+}
+
+/// runTierUps - The background thread recompiling hot functions.
+void Executor::runTierUps() {
+  std::unique_lock<std::mutex> Lock(TierLock);
+  while (true) {
+    TierReady.wait(Lock, [this] { return StopTiering || !TierQueue.empty(); });
+    if (StopTiering)
+      return;
+    std::string Name = std::move(TierQueue.front());
+    TierQueue.pop_front();
+    Lock.unlock();
+
+    auto Start = std::chrono::steady_clock::now();
+    std::string Error;
+    if (tierUp(Name, Error)) {
+      std::lock_guard<std::mutex> Guard(StatsLock);
+      ++TheStats.TierUps;
+      TheStats.Tier1Seconds += secondsSince(Start);
+    } else {
+      fprintf(stderr, "Error: can't recompile %s: %s\n", Name.c_str(),
+              Error.c_str());
+    }
+    Lock.lock();
+  }
+}
+
+/// loadDefinition - The module Name was defined in, as it was generated,
+/// parsed into Context with only Name's definition left in it (along with
+/// the internal functions it uses, like the bodies of its parfors), and
+/// without its call counter. Returns null and sets Error on failure.
+std::unique_ptr<llvm::Module>
+Executor::loadDefinition(const std::string &Name, llvm::LLVMContext &Context,
+                         std::string &Error) {
+  std::shared_ptr<const std::string> Bitcode;
+  {
+    std::lock_guard<std::mutex> Guard(DefinitionsLock);
+    Bitcode = Definitions.lookup(Name);
+  }
+  if (!Bitcode) {
+    Error = "no definition of " + Name;
+    return nullptr;
+  }
+  auto M = llvm::parseBitcodeFile(llvm::MemoryBufferRef(*Bitcode, Name),
+                                  Context);
+  if (!M) {
+    Error = llvm::toString(M.takeError());
+    return nullptr;
+  }
+  llvm::Function *F = (*M)->getFunction(Name);
+
+  // The rest of the module is called where the JIT has it. Internal
+  // functions aren't there, and stay.
+  for (llvm::Function &G : **M)
+    if (&G != F && !G.isDeclaration() && G.hasExternalLinkage())
+      G.deleteBody();
+
+  // Take the call counter out again.
+  for (llvm::BasicBlock &BB : *F)
+    for (llvm::Instruction &I : llvm::make_early_inc_range(BB)) {
+      if (!I.getMetadata("kale.tierup"))
+        continue;
+      if (auto *Br = llvm::dyn_cast<llvm::BranchInst>(&I))
+        llvm::BranchInst::Create(Br->getSuccessor(1), Br);
+      else
+        I.replaceAllUsesWith(llvm::Constant::getNullValue(I.getType()));
+      I.eraseFromParent();
+    }
+  return std::move(*M);
+}
+
+/// addOptimized - Optimize M, the module of one function, at -O3 and add
+/// the code to the JIT, where it stays.
+bool Executor::addOptimized(llvm::Module &M, std::string &Error) {
+  auto TM = O3Builder->createTargetMachine();
+  if (!TM) {
+    Error = llvm::toString(TM.takeError());
+    return false;
+  }
+  optimizeModule(M, TM->get(), 3);
+  ++FunctionsCompiled;
+  llvm::orc::SimpleCompiler Compile(**TM);
+  auto Obj = Compile(M);
+  if (!Obj) {
+    Error = llvm::toString(Obj.takeError());
+    return false;
+  }
+  if (auto Err = TheJIT->addObjectFile(std::move(*Obj))) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+/// tierUp - Recompile the function Name at -O3 from the module it was first
+/// compiled from, and point its stub at the result.
+bool Executor::tierUp(const std::string &Name, std::string &Error) {
+  llvm::LLVMContext Context;
+  auto M = loadDefinition(Name, Context, Error);
+  if (!M)
+    return false;
+  M->getFunction(Name)->setName(Name + ".tier1");
+  if (!addOptimized(*M, Error))
+    return false;
+  auto Addr = TheJIT->lookup(Name + ".tier1");
+  if (!Addr) {
+    Error = llvm::toString(Addr.takeError());
+    return false;
+  }
+  if (auto Err = TheJIT->updateStub(Name, *Addr)) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+bool Executor::defineSymbol(llvm::StringRef Name, void *Addr,
+                            std::string &Error) {
+  if (auto Err = TheJIT->defineAbsolute(
+          Name, llvm::pointerToJITTargetAddress(Addr),
+          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable)) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+void *Executor::lookup(llvm::StringRef Name, std::string &Error) {
+  auto Addr = TheJIT->lookup(Name);
+  if (!Addr) {
+    Error = llvm::toString(Addr.takeError());
+    return nullptr;
+  }
+  return llvm::jitTargetAddressToPointer<void *>(*Addr);
+}
+
+Executor::BatchFn Executor::compileBatch(CompilerInstance &CI,
+                                         llvm::StringRef Name,
+                                         std::string &Error) {
+  {
+    std::lock_guard<std::mutex> Guard(DefinitionsLock);
+    if (BatchFn Fn = Batches.lookup(Name))
+      return Fn;
+  }
+  std::string BatchName =
+      Name.str() + ".batch." + std::to_string(NextExprID++);
+  codegenVisitor CodeV(CI);
+  bool Generated = CodeV.emitBatch(Symbols.intern(Name), BatchName);
+  // The module goes before its context.
+  std::unique_ptr<llvm::LLVMContext> Context;
+  std::unique_ptr<llvm::Module> M;
+  CI.takeModule(M, Context);
+  CI.initializeModule(getDataLayout());
+  if (!Generated) {
+    Error = "can't run " + Name.str() + " over columns";
+    return nullptr;
+  }
+
+  // Link in a copy of the function, local to the module so that it doesn't
+  // clash with the one in the JIT, for the optimizer to inline. Functions
+  // without a definition here, like externs, are just called.
+  std::string LoadError;
+  if (auto Def = loadDefinition(Name.str(), *Context, LoadError)) {
+    if (llvm::Linker::linkModules(*M, std::move(Def))) {
+      Error = "can't link " + Name.str() + " into its batch";
+      return nullptr;
+    }
+    M->getFunction(Name)->setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
+  if (!addOptimized(*M, Error))
+    return nullptr;
+  auto *Fn = reinterpret_cast<BatchFn>(lookup(BatchName, Error));
+  if (!Fn)
+    return nullptr;
+
+  std::lock_guard<std::mutex> Guard(DefinitionsLock);
+  if (BatchFn Old = Batches.lookup(Name))
+    return Old;  // Another thread got there first
+  Batches[Name] = Fn;
+  return Fn;
+}
+
+bool Executor::evaluate(CompilerInstance &CI, llvm::Function *Expr,
+                        Evaluation &Result, std::string &Error) {
+  // Every expression gets a name of its own, so that evaluations on other
+  // threads can't clash with it.
+  std::string Name = "__anon_expr." + std::to_string(NextExprID++);
+  Expr->setName(Name);
+
+  auto Start = std::chrono::steady_clock::now();
+  std::unique_ptr<llvm::Module> M;
+  std::unique_ptr<llvm::LLVMContext> Context;
+  CI.takeModule(M, Context);
+  CI.initializeModule(getDataLayout());
+
+  // Track the module's memory so it can be freed after the run.
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  if (auto Err = TheJIT->addModule(
+          llvm::orc::ThreadSafeModule(std::move(M), std::move(Context)), RT)) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+  auto Addr = TheJIT->lookup(Name);
+  if (!Addr) {
+    Error = llvm::toString(Addr.takeError());
+    llvm::consumeError(RT->remove());
+    return false;
+  }
+  Result.CompileSeconds = secondsSince(Start);
+
+  // Get the symbol's address and cast it to the right type (takes no
+  // arguments, returns a double) so we can call it as a native function.
+  auto *FP = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(*Addr));
+  Start = std::chrono::steady_clock::now();
+  Result.Value = FP();
+  Result.RunSeconds = secondsSince(Start);
+  Result.Interpreted = false;
+
+  // Delete the anonymous expression module from the JIT.
+  if (auto Err = RT->remove()) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+
+  std::lock_guard<std::mutex> Guard(StatsLock);
+  ++TheStats.Evaluations;
+  TheStats.CompileSeconds += Result.CompileSeconds;
+  TheStats.RunSeconds += Result.RunSeconds;
+  TheStats.MaxCompileSeconds =
+      std::max(TheStats.MaxCompileSeconds, Result.CompileSeconds);
+  TheStats.MaxRunSeconds = std::max(TheStats.MaxRunSeconds, Result.RunSeconds);
+  return true;
+}
+
+bool Executor::interpret(CompilerInstance &CI, FunctionAST &Expr,
+                         Evaluation &Result) {
+  if (!Interpret)
+    return false;
+  auto Start = std::chrono::steady_clock::now();
+  std::unique_ptr<BytecodeFunction> BC = BytecodeCompiler::compile(Expr, CI);
+  if (!BC)
+    return false;
+  // Callees are called where the JIT has them, as compiled code would.
+  for (BytecodeFunction::Callee &Callee : BC->Callees) {
+    auto Addr = TheJIT->lookup(Symbols.getName(Callee.Name));
+    if (!Addr) {
+      llvm::consumeError(Addr.takeError());
+      return false;
+    }
+    Callee.Addr = llvm::jitTargetAddressToPointer<void *>(*Addr);
+  }
+  Result.CompileSeconds = secondsSince(Start);
+  Result.Interpreted = true;
+
+  // Loops compiled part way through, and the trackers of their code, which
+  // is freed along with the bytecode.
+  std::vector<llvm::orc::ResourceTrackerSP> Trackers;
+  std::vector<LoopFn> Loops(BC->Loops.size());
+  std::vector<bool> Failed(BC->Loops.size());
+  size_t Promoted = 0;
+  auto RunLoop = [&](unsigned Index, double *Frame) {
+    if (!Loops[Index] && !Failed[Index]) {
+      Loops[Index] = compileLoop(CI, BC->Loops[Index], Trackers);
+      Failed[Index] = !Loops[Index];
+      Promoted += !Failed[Index];
+    }
+    if (!Loops[Index])
+      return false;
+    Loops[Index](Frame);
+    return true;
+  };
+
+  Start = std::chrono::steady_clock::now();
+  Result.Value = runBytecode(*BC, PromoteAfter, RunLoop);
+  Result.RunSeconds = secondsSince(Start);
+  for (auto &RT : Trackers)
+    llvm::consumeError(RT->remove());
+
+  std::lock_guard<std::mutex> Guard(StatsLock);
+  ++TheStats.Evaluations;
+  ++TheStats.Interpreted;
+  TheStats.LoopsPromoted += Promoted;
+  TheStats.CompileSeconds += Result.CompileSeconds;
+  TheStats.RunSeconds += Result.RunSeconds;
+  TheStats.MaxCompileSeconds =
+      std::max(TheStats.MaxCompileSeconds, Result.CompileSeconds);
+  TheStats.MaxRunSeconds = std::max(TheStats.MaxRunSeconds, Result.RunSeconds);
+  return true;
+}
+
+/// compileLoop - Compile the rest of Loop, a loop of an expression being
+/// interpreted, adding the tracker of its code to Trackers. Returns null if
+/// it can't be compiled, and the interpreter carries on with it.
+Executor::LoopFn Executor::compileLoop(
+    CompilerInstance &CI, const BytecodeFunction::Loop &Loop,
+    std::vector<llvm::orc::ResourceTrackerSP> &Trackers) {
+  std::string Name = "__kale_loop." + std::to_string(NextExprID++);
+  codegenVisitor CodeV(CI);
+  bool Generated = CodeV.emitLoopResume(Loop.For, Loop.Vars, Name);
+  std::unique_ptr<llvm::Module> M;
+  std::unique_ptr<llvm::LLVMContext> Context;
+  CI.takeModule(M, Context);
+  CI.initializeModule(getDataLayout());
+  if (!Generated)
+    return nullptr;
+
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  if (auto Err = TheJIT->addModule(
+          llvm::orc::ThreadSafeModule(std::move(M), std::move(Context)), RT)) {
+    llvm::consumeError(std::move(Err));
+    return nullptr;
+  }
+  Trackers.push_back(RT);
+  auto Addr = TheJIT->lookup(Name);
+  if (!Addr) {
+    llvm::consumeError(Addr.takeError());
+    return nullptr;
+  }
+  return llvm::jitTargetAddressToPointer<LoopFn>(*Addr);
+}
+
+Executor::Stats Executor::getStats() const {
+  std::lock_guard<std::mutex> Guard(StatsLock);
+  Stats Result = TheStats;
+  Result.FunctionsDefined = FunctionsDefined;
+  Result.FunctionsCompiled = FunctionsCompiled;
+  Result.ObjectBytes = ObjectBytes;
+  if (Cache) {
+    Result.CacheHits = Cache->getHits();
+    Result.CacheMisses = Cache->getMisses();
+  }
+  return Result;
+}
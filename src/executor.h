@@ -0,0 +1,214 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Target/TargetMachine.h"
+#include "ast.h"
+#include "bytecode.h"
+#include "compilerInstance.h"
+#include "objectCache.h"
+
+namespace llvm {
+namespace orc {
+class JITTargetMachineBuilder;
+class KaleidoscopeJIT;
+class ResourceTracker;
+}
+}
+
+/// Executor - Runs Kale code in this process on the JIT. Definitions are
+/// handed over a module at a time and stay; a top-level expression is
+/// compiled, run and thrown away again, so a long-running service can
+/// evaluate any number of them. Each evaluation is timed.
+///
+/// Modules are optimized by the JIT as they are compiled, on its compile
+/// threads, so CompilerInstances feeding an executor should use -O0. A lazy
+/// executor keeps definitions as IR and only optimizes and compiles each
+/// function the first time it's called.
+///
+/// A tiered executor compiles definitions at -O0 right away, with a counter
+/// in each function. Calls between functions go through stubs, and once a
+/// function has been called often enough, a background thread recompiles it
+/// at -O3 and points its stub at the new code.
+///
+/// Top-level expressions can also be run on the bytecode interpreter, which
+/// starts them without generating any code. A loop that runs long there is
+/// compiled, and the rest of it runs on the JIT.
+///
+/// Code embedding Kale can run a function over whole columns of data in one
+/// call, with a loop compiled at -O3 around an inlined copy of it. The
+/// executor keeps every module of definitions as bitcode for that, and to
+/// tier functions up.
+///
+/// Any number of threads may use one executor, each with its own
+/// CompilerInstance.
+class Executor {
+public:
+  /// Evaluation - The result of running one top-level expression.
+  struct Evaluation {
+    double Value;
+    double CompileSeconds;  // Optimizing, code generation and linking
+    double RunSeconds;
+    bool Interpreted;  // Run as bytecode; compiling means translating to it
+  };
+
+  /// Stats - Totals over all evaluations so far, and how much of the program
+  /// has been compiled.
+  struct Stats {
+    size_t Evaluations = 0;
+    double CompileSeconds = 0, MaxCompileSeconds = 0;
+    double RunSeconds = 0, MaxRunSeconds = 0;
+    size_t FunctionsDefined = 0;   // Handed over with addDefinitions()
+    size_t FunctionsCompiled = 0;  // Including top-level expressions
+    size_t ObjectBytes = 0;        // Size of the object files generated
+    unsigned CacheHits = 0, CacheMisses = 0;
+    size_t TierUps = 0;        // Functions recompiled at -O3
+    double Tier0Seconds = 0;   // Compiling definitions at -O0
+    double Tier1Seconds = 0;   // Recompiling them at -O3
+    size_t Interpreted = 0;    // Evaluations run as bytecode
+    size_t LoopsPromoted = 0;  // Interpreted loops finished on the JIT
+  };
+
+  /// Options - How to compile.
+  struct Options {
+    unsigned OptLevel = 0;
+    /// NumCompileThreads - 0 to compile on the thread asking for the code.
+    unsigned NumCompileThreads = 0;
+    /// Lazy - Only compile functions once they are called.
+    bool Lazy = false;
+    /// CacheDir - Where to keep object files across runs, if anywhere.
+    std::string CacheDir;
+    uint64_t CacheBytes = 0;
+    /// TierUpThreshold - If not 0, compile definitions at -O0 first, and
+    /// recompile each at -O3 once it has been called this many times.
+    /// OptLevel and Lazy are ignored then.
+    unsigned TierUpThreshold = 0;
+    /// Interpret - Let interpret() run top-level expressions as bytecode.
+    bool Interpret = true;
+    /// PromoteAfter - How many iterations an interpreted loop runs before
+    /// the rest of it is compiled.
+    unsigned PromoteAfter = 10000;
+  };
+
+  /// create - An executor for the host CPU. Returns null and sets Error on
+  /// failure.
+  static std::unique_ptr<Executor> create(const Options &Opts,
+                                          std::string &Error);
+  ~Executor();
+
+  /// getTargetMachine - The machine to optimize modules for. Use it for one
+  /// CompilerInstance at a time; it isn't thread-safe.
+  llvm::TargetMachine &getTargetMachine() { return *TM; }
+  const llvm::DataLayout &getDataLayout() const;
+
+  /// addDefinitions - Make the functions in CI's module callable from later
+  /// modules, and give CI a new, empty module. Unless the executor is lazy,
+  /// they start compiling right away.
+  bool addDefinitions(CompilerInstance &CI, std::string &Error);
+
+  /// evaluate - Run Expr, the function holding a top-level expression in CI's
+  /// module, then free its code. The rest of the module is thrown away too,
+  /// and CI gets a new, empty module.
+  bool evaluate(CompilerInstance &CI, llvm::Function *Expr, Evaluation &Result,
+                std::string &Error);
+
+  /// defineSymbol - Let code call the function at Addr in this process by
+  /// the name Name. Returns false and sets Error on failure.
+  bool defineSymbol(llvm::StringRef Name, void *Addr, std::string &Error);
+
+  /// lookup - The address of the function Name, compiled if it hasn't been
+  /// yet. Returns null and sets Error on failure.
+  void *lookup(llvm::StringRef Name, std::string &Error);
+
+  /// BatchFn - Stores F(Columns[0][r], ..., Columns[N-1][r]) to Out[r] for
+  /// each of the Rows rows, for a function F of N parameters. Out mustn't
+  /// overlap the columns.
+  using BatchFn = void (*)(const double *const *Columns, double *Out,
+                           int64_t Rows);
+
+  /// compileBatch - The BatchFn of the function Name, which CI has declared.
+  /// The loop over the rows is compiled at -O3 with a copy of Name's
+  /// definition, if it has one here, inlined into it, and vectorized if the
+  /// code allows. CI's module must be empty, as after addDefinitions(); the
+  /// batch stays for as long as the executor. Returns null and sets Error on
+  /// failure.
+  BatchFn compileBatch(CompilerInstance &CI, llvm::StringRef Name,
+                       std::string &Error);
+
+  /// interpret - Run Expr, a top-level expression parsed for CI, as bytecode
+  /// rather than generating code for it. Returns false without running it
+  /// if it can't be interpreted (or the executor doesn't interpret); then
+  /// generate its code and evaluate() that instead. CI is only used to
+  /// compile loops that run long.
+  bool interpret(CompilerInstance &CI, FunctionAST &Expr, Evaluation &Result);
+
+  Stats getStats() const;
+
+  bool isTiered() const { return Tiered; }
+
+private:
+  Executor() = default;
+
+  bool addTieredDefinitions(std::unique_ptr<llvm::Module> M,
+                            std::unique_ptr<llvm::LLVMContext> Context,
+                            std::string &Error);
+  static void tierUpEntry(void *Ctx, const char *Name);
+  void requestTierUp(const char *Name);
+  void runTierUps();
+  bool tierUp(const std::string &Name, std::string &Error);
+  std::unique_ptr<llvm::Module> loadDefinition(const std::string &Name,
+                                               llvm::LLVMContext &Context,
+                                               std::string &Error);
+  bool addOptimized(llvm::Module &M, std::string &Error);
+
+  using LoopFn = void (*)(double *Frame);
+  LoopFn compileLoop(
+      CompilerInstance &CI, const BytecodeFunction::Loop &Loop,
+      std::vector<llvm::IntrusiveRefCntPtr<llvm::orc::ResourceTracker>>
+          &Trackers);
+
+  std::unique_ptr<llvm::TargetMachine> TM;
+  std::unique_ptr<DiskObjectCache> Cache;
+  std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+  bool Interpret = false;
+  unsigned PromoteAfter = 0;
+  std::atomic<unsigned> NextExprID{0};
+  std::atomic<size_t> FunctionsDefined{0}, FunctionsCompiled{0};
+  std::atomic<size_t> ObjectBytes{0};
+  mutable std::mutex StatsLock;
+  Stats TheStats;
+
+  /// The bitcode of the module each function was defined in, and the
+  /// batches compiled so far, guarded by DefinitionsLock.
+  std::mutex DefinitionsLock;
+  llvm::StringMap<std::shared_ptr<const std::string>> Definitions;
+  llvm::StringMap<BatchFn> Batches;
+  /// O3Builder - For the code compiled at -O3 whatever the options: tiered
+  /// up functions and batches.
+  std::unique_ptr<llvm::orc::JITTargetMachineBuilder> O3Builder;
+
+  /// Tiering state, guarded by TierLock: whether each function is waiting
+  /// to be recompiled, and those that are.
+  struct TierInfo {
+    bool Queued = false;
+  };
+  bool Tiered = false;
+  std::mutex TierLock;
+  std::condition_variable TierReady;
+  llvm::StringMap<TierInfo> Tiers;
+  std::deque<std::string> TierQueue;
+  bool StopTiering = false;
+  std::thread TierThread;
+};
+
+#endif	// EXECUTOR_H
@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cstring>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+
+#include "incremental.h"
+#include "objectCache.h"
+
+/// Bump when the manifest or the way fingerprints are made changes.
+static const char *ManifestVersion = "kale-incremental-1";
+
+namespace {
+
+/// DependencyCollector - The functions an expression calls, including the
+/// ones implementing the user-defined operators it uses.
+class DependencyCollector : public Visitor {
+public:
+  std::vector<Symbol> Callees;
+
+  void visit(NumberExprAST *e) override {}
+  void visit(VariableExprAST *e) override {}
+  void visit(BinaryExprAST *e) override {
+    // The operators codegen implements itself.
+    if (!strchr("=+-*<", e->Op))
+      Callees.push_back(getOperatorSymbol("binary", e->Op));
+    e->LHS->accept(this);
+    e->RHS->accept(this);
+  }
+  void visit(CallExprAST *e) override {
+    Callees.push_back(e->Callee);
+    for (ExprAST *Arg : e->Args)
+      Arg->accept(this);
+  }
+  void visit(PrototypeAST *e) override {}
+  void visit(FunctionAST *e) override { e->Body->accept(this); }
+  void visit(IfExprAST *e) override {
+    e->Cond->accept(this);
+    e->Then->accept(this);
+    e->Else->accept(this);
+  }
+  void visit(ForExprAST *e) override {
+    e->Start->accept(this);
+    e->End->accept(this);
+    if (e->Step)
+      e->Step->accept(this);
+    e->Body->accept(this);
+  }
+  void visit(UnaryExprAST *e) override {
+    Callees.push_back(getOperatorSymbol("unary", e->Opcode));
+    e->Operand->accept(this);
+  }
+  void visit(VarExprAST *e) override {
+    for (auto &Var : e->VarNames)
+      if (Var.second)
+        Var.second->accept(this);
+    e->Body->accept(this);
+  }
+  void visit(IndexExprAST *e) override {
+    e->Array->accept(this);
+    e->Index->accept(this);
+  }
+  void visit(ParForExprAST *e) override {
+    e->Start->accept(this);
+    e->End->accept(this);
+    if (e->Grain)
+      e->Grain->accept(this);
+    e->Body->accept(this);
+  }
+};
+
+template <typename T> void hashValue(llvm::SHA1 &Hash, const T &V) {
+  Hash.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&V),
+                                      sizeof(V)));
+}
+
+std::string hexDigest(llvm::SHA1 &Hash) {
+  return llvm::toHex(Hash.final(), /*LowerCase=*/true);
+}
+
+/// getSignature - What a caller of Name compiles against: the types of the
+/// arguments and result, and the precedence if it's a binary operator. "?"
+/// if Name hasn't been declared.
+std::string getSignature(const CompilerInstance &CI, Symbol Name) {
+  auto It = CI.FunctionProtos.find(Name);
+  if (It == CI.FunctionProtos.end())
+    return "?";
+  const PrototypeAST &P = *It->second;
+  std::string Sig = "(";
+  for (ValueType Ty : P.ArgTypes) {
+    Sig += getTypeName(Ty);
+    Sig += ' ';
+  }
+  Sig += ')';
+  Sig += getTypeName(P.RetType);
+  if (P.isBinaryOp()) {
+    auto Prec = CI.BinopPrecedence.find(P.getOperatorName());
+    if (Prec != CI.BinopPrecedence.end())
+      Sig += "/" + std::to_string(Prec->second);
+  }
+  return Sig;
+}
+
+} // end anonymous namespace
+
+std::unique_ptr<IncrementalBuild>
+IncrementalBuild::open(const std::string &Dir, const llvm::TargetMachine &TM,
+                       unsigned OptLevel, std::string &Error) {
+  if (std::error_code EC = llvm::sys::fs::create_directories(Dir)) {
+    Error = "can't create build directory " + Dir + ": " + EC.message();
+    return nullptr;
+  }
+  llvm::SHA1 Hash;
+  Hash.update(DiskObjectCache::getTargetKey(TM));
+  hashValue(Hash, OptLevel);
+  std::unique_ptr<IncrementalBuild> Build(
+      new IncrementalBuild(Dir, hexDigest(Hash)));
+  Build->readManifest();
+  return Build;
+}
+
+std::string IncrementalBuild::getObjectPath(const Item &I) const {
+  llvm::SmallString<128> Path(Dir);
+  llvm::sys::path::append(Path, I.Fingerprint + ".o");
+  return std::string(Path);
+}
+
+std::string IncrementalBuild::getManifestPath() const {
+  llvm::SmallString<128> Path(Dir);
+  llvm::sys::path::append(Path, "manifest");
+  return std::string(Path);
+}
+
+/// readManifest - Load the items of the last build. The manifest has a
+/// header line and the target key, then a line per item:
+///
+///   name token-hash fingerprint dependency...
+void IncrementalBuild::readManifest() {
+  auto Buf = llvm::MemoryBuffer::getFile(getManifestPath());
+  if (!Buf)
+    return;
+  llvm::SmallVector<llvm::StringRef, 0> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+  if (Lines.size() < 2 || Lines[0] != ManifestVersion || Lines[1] != TargetKey)
+    return;
+  for (llvm::StringRef Line : llvm::makeArrayRef(Lines).drop_front(2)) {
+    llvm::SmallVector<llvm::StringRef, 8> Fields;
+    Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+    if (Fields.size() < 3)
+      continue;
+    Item I{Fields[0].str(), Fields[1].str(), Fields[2].str(), {}};
+    for (llvm::StringRef Dep : llvm::makeArrayRef(Fields).drop_front(3))
+      I.Deps.push_back(Dep.str());
+    Previous[I.Name] = std::move(I);
+  }
+}
+
+bool IncrementalBuild::addItem(const CompilerInstance &CI, TokenStream &Toks,
+                               size_t Begin, size_t End, FunctionAST &Fn,
+                               bool &NeedsCompile, std::string &Error) {
+  Item I;
+  I.Name = Fn.Proto->getName();
+  if (!ItemIndex.try_emplace(I.Name, Items.size()).second) {
+    Error = "'" + I.Name + "' is defined more than once, which an "
+            "incremental build can't link";
+    return false;
+  }
+
+  llvm::SHA1 TokenHash;
+  for (size_t T = Begin; T != End; ++T) {
+    int16_t Kind = Toks.getKind(T);
+    hashValue(TokenHash, Kind);
+    if (Kind == tok_number)
+      hashValue(TokenHash, Toks.getNumber(T));
+    else if (Kind == tok_identifier)
+      TokenHash.update(Symbols.getName(Toks.getSymbol(T)) + '\n');
+  }
+  I.TokenHash = hexDigest(TokenHash);
+
+  DependencyCollector Collector;
+  Fn.accept(&Collector);
+  std::sort(Collector.Callees.begin(), Collector.Callees.end());
+  Collector.Callees.erase(
+      std::unique(Collector.Callees.begin(), Collector.Callees.end()),
+      Collector.Callees.end());
+
+  llvm::SHA1 Hash;
+  Hash.update(TargetKey);
+  Hash.update(I.Name + '\n');
+  Hash.update(I.TokenHash);
+  for (Symbol Callee : Collector.Callees) {
+    const std::string &Name = Symbols.getName(Callee);
+    std::string Sig = getSignature(CI, Callee);
+    // An operator the ASTSimplifier inlines brings its body along.
+    auto Def = ItemIndex.find(Name);
+    if (CI.InlineOperators.count(Callee) && Def != ItemIndex.end())
+      Sig += ' ' + Items[Def->second].Fingerprint;
+    Hash.update(Name + ' ' + Sig + '\n');
+    I.Deps.push_back(Name);
+  }
+  std::sort(I.Deps.begin(), I.Deps.end());
+  I.Fingerprint = hexDigest(Hash);
+
+  NeedsCompile = !llvm::sys::fs::exists(getObjectPath(I));
+  ++TheStats.Items;
+  if (NeedsCompile) {
+    ++TheStats.Compiled;
+    auto Prev = Previous.find(I.Name);
+    if (Prev != Previous.end() && Prev->second.TokenHash == I.TokenHash)
+      ++TheStats.DependencyChanged;
+  }
+  Items.push_back(std::move(I));
+  return true;
+}
+
+bool IncrementalBuild::storeObject(llvm::StringRef Obj, std::string &Error) {
+  std::string Path = getObjectPath(Items.back());
+  if (llvm::Error Err =
+          llvm::writeFileAtomically(Path + ".%%%%%%.tmp", Path, Obj)) {
+    Error = "can't write " + Path + ": " + llvm::toString(std::move(Err));
+    return false;
+  }
+  return true;
+}
+
+bool IncrementalBuild::finish(const std::string &ArchivePath,
+                              std::string &Error) {
+  std::vector<llvm::NewArchiveMember> Members;
+  llvm::StringSet<> Live;
+  for (const Item &I : Items) {
+    auto Member =
+        llvm::NewArchiveMember::getFile(getObjectPath(I), /*Deterministic=*/true);
+    if (!Member) {
+      Error = llvm::toString(Member.takeError());
+      return false;
+    }
+    Members.push_back(std::move(*Member));
+    Live.insert(I.Fingerprint + ".o");
+  }
+#if LLVM_VERSION_MAJOR >= 16
+  auto Symtab = llvm::SymtabWritingMode::NormalSymtab;
+#else
+  bool Symtab = true;
+#endif
+  if (llvm::Error Err = llvm::writeArchive(
+          ArchivePath, Members, Symtab, llvm::object::Archive::K_GNU,
+          /*Deterministic=*/true, /*Thin=*/false)) {
+    Error = llvm::toString(std::move(Err));
+    return false;
+  }
+
+  std::string Manifest = std::string(ManifestVersion) + '\n' + TargetKey + '\n';
+  for (const Item &I : Items) {
+    Manifest += I.Name + ' ' + I.TokenHash + ' ' + I.Fingerprint;
+    for (const std::string &Dep : I.Deps)
+      Manifest += ' ' + Dep;
+    Manifest += '\n';
+  }
+  std::string ManifestPath = getManifestPath();
+  if (llvm::Error Err = llvm::writeFileAtomically(ManifestPath + ".%%%%%%.tmp",
+                                                  ManifestPath, Manifest)) {
+    Error = "can't write " + ManifestPath + ": " +
+            llvm::toString(std::move(Err));
+    return false;
+  }
+
+  // Objects of items that changed or went away won't be asked for again.
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+       It.increment(EC)) {
+    llvm::StringRef Name = llvm::sys::path::filename(It->path());
+    if (Name.endswith(".o") && !Live.count(Name))
+      llvm::sys::fs::remove(It->path());
+  }
+  return true;
+}
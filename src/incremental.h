@@ -0,0 +1,94 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Target/TargetMachine.h"
+#include "ast.h"
+#include "compilerInstance.h"
+#include "tokenStream.h"
+
+/// IncrementalBuild - Compiles a program one top-level item at a time, each
+/// into an object file of its own, and keeps the objects in a directory so
+/// that the next build only compiles the items that changed. The output is
+/// an archive of all the objects.
+///
+/// An item's fingerprint covers its tokens (but not where they are, so
+/// moving an item or editing comments and whitespace doesn't count), the
+/// prototypes of the functions and operators it calls as they were when it
+/// was compiled, the precedence of the operators it uses, and the target.
+/// Items don't see each other's bodies, so changing a function's body
+/// recompiles just that function, while changing its prototype recompiles
+/// everything that calls it. The exception are the small operators the
+/// ASTSimplifier inlines: their fingerprint counts as part of their
+/// prototype.
+///
+/// The directory also records what every item depended on last time, which
+/// tells why an item had to be compiled again. Only one build at a time may
+/// use a directory.
+class IncrementalBuild {
+public:
+  struct Stats {
+    unsigned Items = 0;
+    unsigned Compiled = 0;
+    /// DependencyChanged - Items compiled although their own tokens are the
+    /// same as last time.
+    unsigned DependencyChanged = 0;
+  };
+
+  /// open - A build keeping its objects in Dir, which is created if need be,
+  /// for code generated by TM at -O<OptLevel>. Returns null and sets Error
+  /// on failure.
+  static std::unique_ptr<IncrementalBuild>
+  open(const std::string &Dir, const llvm::TargetMachine &TM,
+       unsigned OptLevel, std::string &Error);
+
+  /// addItem - Record Fn, the item parsed from tokens [Begin, End) of Toks,
+  /// before it is code generated in CI. Sets NeedsCompile if there's no
+  /// object for it yet; then compile it and pass the object to
+  /// storeObject(). Returns false and sets Error if the program already has
+  /// an item of that name.
+  bool addItem(const CompilerInstance &CI, TokenStream &Toks, size_t Begin,
+               size_t End, FunctionAST &Fn, bool &NeedsCompile,
+               std::string &Error);
+
+  /// storeObject - Keep Obj as the object of the item last added.
+  bool storeObject(llvm::StringRef Obj, std::string &Error);
+
+  /// finish - Write the archive of the objects of every item added to
+  /// ArchivePath, record the dependencies for next time and delete the
+  /// objects no longer needed.
+  bool finish(const std::string &ArchivePath, std::string &Error);
+
+  const Stats &getStats() const { return TheStats; }
+
+private:
+  /// Item - A top-level item: a function definition or an expression.
+  struct Item {
+    std::string Name;
+    std::string TokenHash;    // Its tokens alone
+    std::string Fingerprint;  // Names its object file
+    std::vector<std::string> Deps;  // Functions it calls
+  };
+
+  IncrementalBuild(std::string Dir, std::string TargetKey)
+      : Dir(std::move(Dir)), TargetKey(std::move(TargetKey)) {}
+
+  std::string getObjectPath(const Item &I) const;
+  std::string getManifestPath() const;
+  void readManifest();
+
+  std::string Dir;
+  std::string TargetKey;
+  std::vector<Item> Items;
+  llvm::StringMap<size_t> ItemIndex;
+  /// Previous - The items of the last build, by name.
+  llvm::StringMap<Item> Previous;
+  Stats TheStats;
+};
+
+#endif	// INCREMENTAL_H
@@ -0,0 +1,160 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "llvm/Support/TargetSelect.h"
+#include "kale.h"
+#include "codegenVisitor.h"
+#include "executor.h"
+#include "parser.h"
+#include "simplify.h"
+
+// The runtime every session's programs can call; print_dyn.cc and
+// parfor_dyn.cc are part of the library.
+extern "C" double printd(double X);
+extern "C" double putchard(double X);
+extern "C" double kale_parfor(double (*Chunk)(void *, int64_t, int64_t),
+                              void *Env, int64_t Begin, int64_t End,
+                              int64_t Grain, int32_t Op);
+
+/// kale_session - An executor, and the compilation feeding it. Compiles are
+/// serialized, as a CompilerInstance is used by one thread at a time; the
+/// executor needs no lock.
+struct kale_session {
+  std::unique_ptr<Executor> Exec;
+  std::mutex CompileLock;  // Guards CI
+  CompilerInstance CI;
+};
+
+static void setError(char **Error, std::string Msg) {
+  if (!Error)
+    return;
+  while (!Msg.empty() && Msg.back() == '\n')
+    Msg.pop_back();
+  *Error = strdup(Msg.c_str());
+}
+
+/// compileItems - Compile the definitions and externs in Src, stopping at
+/// the first error. Errors are reported to ErrorLog.
+static bool compileItems(kale_session &S, const SourceBuffer &Src) {
+  CompilerInstance &CI = S.CI;
+  TokenStream Toks(Src, /*AllowThread=*/false);
+  Parser P(CI, Toks);
+  P.getNextToken();
+  while (true) {
+    switch (P._curTok) {
+    case tok_eof:
+      return true;
+    case ';':
+      P.getNextToken();
+      continue;
+    case tok_def: {
+      auto FnAST = P.ParseDefinition();
+      if (!FnAST)
+        return false;
+      ASTSimplifier::simplify(*FnAST, CI, P.Arena);
+      codegenVisitor CodeV(CI);
+      if (!CodeV.codegen(*FnAST))
+        return false;
+      std::string Error;
+      if (!S.Exec->addDefinitions(CI, Error)) {
+        *ErrorLog += "Error: " + Error + "\n";
+        return false;
+      }
+      break;
+    }
+    case tok_extern: {
+      auto ProtoAST = P.ParseExtern();
+      if (!ProtoAST)
+        return false;
+      codegenVisitor CodeV(CI);
+      if (!CodeV.codegen(*ProtoAST))
+        return false;
+      CI.InlineOperators.erase(ProtoAST->Name);
+      CI.FunctionProtos[ProtoAST->Name] = std::move(ProtoAST);
+      break;
+    }
+    default:
+      P.LogError("expected a definition or an extern");
+      return false;
+    }
+    P.Arena.reset();
+  }
+}
+
+kale_session *kale_session_create(unsigned OptLevel, char **Error) {
+  static std::once_flag TargetInitialized;
+  std::call_once(TargetInitialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+  if (OptLevel > 3) {
+    setError(Error, "the optimization level must be 0 to 3");
+    return nullptr;
+  }
+
+  // Code is compiled on the thread asking for it, so a session starts no
+  // threads, and nothing is interpreted, as only definitions are compiled.
+  Executor::Options Opts;
+  Opts.OptLevel = OptLevel;
+  Opts.Interpret = false;
+  std::string Msg;
+  auto S = std::make_unique<kale_session>();
+  S->Exec = Executor::create(Opts, Msg);
+  if (!S->Exec ||
+      !S->Exec->defineSymbol("printd", reinterpret_cast<void *>(&printd),
+                             Msg) ||
+      !S->Exec->defineSymbol("putchard", reinterpret_cast<void *>(&putchard),
+                             Msg) ||
+      !S->Exec->defineSymbol("kale_parfor",
+                             reinterpret_cast<void *>(&kale_parfor), Msg)) {
+    setError(Error, Msg);
+    return nullptr;
+  }
+
+  // The executor optimizes modules itself, when it compiles them.
+  S->CI.TM = &S->Exec->getTargetMachine();
+  S->CI.CountLoops = OptLevel > 0;
+  S->CI.initializeModule(S->Exec->getDataLayout());
+  return S.release();
+}
+
+void kale_session_release(kale_session *S) { delete S; }
+
+int kale_define_symbol(kale_session *S, const char *Name, void *Addr,
+                       char **Error) {
+  std::string Msg;
+  if (!S->Exec->defineSymbol(Name, Addr, Msg)) {
+    setError(Error, Msg);
+    return 1;
+  }
+  return 0;
+}
+
+int kale_compile(kale_session *S, const char *Source, size_t Size,
+                 char **Error) {
+  auto Src = SourceBuffer::fromString(std::string(Source, Size), "<source>");
+  std::lock_guard<std::mutex> Guard(S->CompileLock);
+  std::string Log;
+  ErrorLog = &Log;
+  bool Compiled = compileItems(*S, *Src);
+  ErrorLog = nullptr;
+  if (!Compiled) {
+    setError(Error, Log);
+    return 1;
+  }
+  return 0;
+}
+
+void *kale_lookup(kale_session *S, const char *Name, char **Error) {
+  std::string Msg;
+  void *Addr = S->Exec->lookup(Name, Msg);
+  if (!Addr)
+    setError(Error, Msg);
+  return Addr;
+}
+
+void kale_error_free(char *Error) { free(Error); }
@@ -0,0 +1,92 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "compileServer.h"
+
+/// readAll - Append everything left in F to Text.
+static bool readAll(FILE *F, std::string &Text) {
+  char Buf[1 << 16];
+  size_t N;
+  while ((N = fread(Buf, 1, sizeof(Buf), F)) != 0)
+    Text.append(Buf, N);
+  return !ferror(F);
+}
+
+/// main - Build output.o on a running `Kale --server` instead of starting a
+/// compiler: take the same arguments as Kale, read the program, and print
+/// and write what Kale would have.
+int main(int argc, char **argv) {
+  CompileRequest Req;
+  Req.Args.assign(argv + 1, argv + argc);
+
+  // The input is found the way Kale finds it; the server checks the rest.
+  std::string InputPath;
+  for (size_t I = 0; I != Req.Args.size(); ++I) {
+    const std::string &Arg = Req.Args[I];
+    if (Arg == "-j")
+      ++I;
+    else if (InputPath.empty() && (Arg == "-" || Arg[0] != '-'))
+      InputPath = Arg;
+  }
+
+  if (InputPath.empty() || InputPath == "-") {
+    if (isatty(fileno(stdin))) {
+      fprintf(stderr, "Error: %s can't run a REPL; use Kale\n", argv[0]);
+      return 1;
+    }
+    Req.SourceName = "<stdin>";
+    if (!readAll(stdin, Req.Source)) {
+      fprintf(stderr, "Error: cannot read stdin: %s\n", strerror(errno));
+      return 1;
+    }
+  } else {
+    Req.SourceName = InputPath;
+    FILE *F = fopen(InputPath.c_str(), "rb");
+    if (!F) {
+      fprintf(stderr, "Error: cannot open '%s': %s\n", InputPath.c_str(),
+              strerror(errno));
+      return 1;
+    }
+    bool Read = readAll(F, Req.Source);
+    fclose(F);
+    if (!Read) {
+      fprintf(stderr, "Error: cannot read '%s'\n", InputPath.c_str());
+      return 1;
+    }
+  }
+
+  char Cwd[4096];
+  if (getcwd(Cwd, sizeof(Cwd)))
+    Req.Cwd = Cwd;
+
+  std::string Error;
+  int FD = connectToServer(getDefaultSocketPath(), Error);
+  if (FD < 0) {
+    fprintf(stderr, "Error: %s (is `Kale --server` running?)\n",
+            Error.c_str());
+    return 1;
+  }
+  CompileResponse Resp;
+  bool Answered = sendRequest(FD, Req) && receiveResponse(FD, Resp);
+  close(FD);
+  if (!Answered) {
+    fprintf(stderr, "Error: the server hung up\n");
+    return 1;
+  }
+
+  if (!Resp.Object.empty()) {
+    FILE *Out = fopen("output.o", "wb");
+    if (!Out ||
+        fwrite(Resp.Object.data(), 1, Resp.Object.size(), Out) !=
+            Resp.Object.size() ||
+        fclose(Out) != 0) {
+      fprintf(stderr, "Could not open file:%s", strerror(errno));
+      return 1;
+    }
+  }
+  fwrite(Resp.Err.data(), 1, Resp.Err.size(), stderr);
+  fwrite(Resp.Out.data(), 1, Resp.Out.size(), stdout);
+  return Resp.Status;
+}
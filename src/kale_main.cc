@@ -1,9 +1,14 @@
-#include "../include/KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
@@ -11,106 +16,131 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Utils.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
 #include "llvm/Support/TargetRegistry.h"
+#endif
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "parser.h"
 #include "lexer.h"
+#include "source.h"
+#include "tokenStream.h"
 #include "ast.h"
-#include "codegenVisitor.cc"
+#include "codegenVisitor.h"
+#include "compileServer.h"
+#include "compilerInstance.h"
+#include "cpuDispatch.h"
+#include "executor.h"
+#include "incremental.h"
+#include "objectCache.h"
+#include "simplify.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <system_error>
+#include <thread>
 #include <utility>
+#include <unistd.h>
 
 
 //===----------------------------------------------------------------------===//
-// Setup code for pass manager and JIT.
+// Top-Level parsing
 //===----------------------------------------------------------------------===//
 
-void InitializeModuleAndPassManager(std::unique_ptr<llvm::orc::KaleidoscopeJIT>& TheJIT) {
-  // Open a new module.
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("Kale Compiler", *TheContext);
-  TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-
-  // Create a new pass manager attached to it.
-  TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
-#if 0
-  // Promote allocas to registers
-  TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->add(llvm::createInstructionCombiningPass());
-  // Reassociate expressions.
-  TheFPM->add(llvm::createReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->add(llvm::createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->add(llvm::createCFGSimplificationPass());
-#endif
+/// ShowTimes - Print how long each evaluation took to compile and run.
+static bool ShowTimes = false;
 
-  TheFPM->doInitialization();
+/// Diag - Report Msg where the driver's errors go: to ErrorLog if it's set,
+/// as it is while serving a --server request, or else to stderr.
+static void Diag(const llvm::Twine &Msg) {
+  if (ErrorLog)
+    *ErrorLog += Msg.str();
+  else
+    llvm::errs() << Msg;
 }
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing
-//===----------------------------------------------------------------------===//
-
-static void HandleDefinition(Parser& parser, std::unique_ptr<llvm::orc::KaleidoscopeJIT>& TheJIT) {
+static void HandleDefinition(CompilerInstance& CI, Parser& parser, Executor *Exec) {
   if (auto FnAST = parser.ParseDefinition()) {
-    codegenVisitor* codeV = new codegenVisitor();
-    FnAST->accept(codeV);
-    if (!codeV->generatedCode) {
-      fprintf(stderr, "Error in parsing a function definition.\n");
+    if (CI.Simplify)
+      ASTSimplifier::simplify(*FnAST, CI, parser.Arena);
+    codegenVisitor codeV(CI);
+    if (!codeV.codegen(*FnAST)) {
+      Diag("Error in parsing a function definition.\n");
+    } else if (Exec) {
+      std::string Error;
+      if (!Exec->addDefinitions(CI, Error))
+        Diag("Error: " + Error + "\n");
     }
-    delete codeV;
   } else {
     // Skip token for error recovery.
     parser.getNextToken();
   }
 }
 
-static void HandleExtern(Parser& parser) {
+static void HandleExtern(CompilerInstance& CI, Parser& parser) {
   if (auto ProtoAST = parser.ParseExtern()) {
-    codegenVisitor* codeV = new codegenVisitor();
-    ProtoAST->accept(codeV);
-    if (codeV->generatedCode) {
+    codegenVisitor codeV(CI);
+    if (codeV.codegen(*ProtoAST)) {
       // FnIR->print(llvm::errs());
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      CI.InlineOperators.erase(ProtoAST->Name);
+      CI.FunctionProtos[ProtoAST->Name] = std::move(ProtoAST);
     }
-    delete codeV;
   } else {
     // Skip token for error recovery.
     parser.getNextToken();
   }
 }
 
-static void HandleTopLevelExpression(Parser& parser, std::unique_ptr<llvm::orc::KaleidoscopeJIT>& TheJIT) {
+/// PrintEvaluation - Report the value of a top-level expression.
+static void PrintEvaluation(const Executor::Evaluation &Eval) {
+  fprintf(stderr, "Evaluated to %f\n", Eval.Value);
+  if (ShowTimes)
+    fprintf(stderr, "  (%scompile %.3f ms, run %.3f ms)\n",
+            Eval.Interpreted ? "interpreted: " : "",
+            Eval.CompileSeconds * 1e3, Eval.RunSeconds * 1e3);
+}
+
+static void HandleTopLevelExpression(CompilerInstance& CI, Parser& parser, Executor *Exec) {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = parser.ParseTopLevelExpr()) {
-    codegenVisitor* codeV = new codegenVisitor();
-    FnAST->accept(codeV);
-    if (!codeV->generatedCode)
-        fprintf(stderr, "Error in top level expr\n");
+    if (CI.Simplify)
+      ASTSimplifier::simplify(*FnAST, CI, parser.Arena);
+    // Most expressions are over long before their code would be generated.
+    Executor::Evaluation Eval;
+    if (Exec && Exec->interpret(CI, *FnAST, Eval)) {
+      PrintEvaluation(Eval);
+      return;
+    }
+
+    codegenVisitor codeV(CI);
+    llvm::Function *F = codeV.codegen(*FnAST);
+    if (!F) {
+      Diag("Error in top level expr\n");
+    } else if (Exec) {
+      // JIT the module containing the anonymous expression, run it and
+      // free it again.
+      std::string Error;
+      if (!Exec->evaluate(CI, F, Eval, Error)) {
+        fprintf(stderr, "Error: %s\n", Error.c_str());
+        return;
+      }
+      PrintEvaluation(Eval);
+    }
   } else {
     // Skip token for error recovery.
     parser.getNextToken();
@@ -118,8 +148,14 @@ static void HandleTopLevelExpression(Parser& parser, std::unique_ptr<llvm::orc::
 }
 
 /// top ::= definition | external | expression | ';'
-static void MainLoop(std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT, Parser& parser) {
-  while (true) {
+///
+/// Handles top-level items until EOF, or until the item starting at token
+/// index End is reached. With an executor, definitions are handed to the JIT
+/// and expressions are run as soon as they have been compiled; otherwise
+/// everything is left in CI's module.
+static void MainLoop(CompilerInstance& CI, Executor *Exec,
+                     Parser& parser, size_t End = SIZE_MAX) {
+  while (parser.getTokIndex() < End) {
     switch (parser._curTok) {
     case tok_eof:
       return;
@@ -127,16 +163,297 @@ static void MainLoop(std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT, Parser&
       parser.getNextToken();
       break;
     case tok_def:
-      HandleDefinition(parser, TheJIT);
+      HandleDefinition(CI, parser, Exec);
       break;
     case tok_extern:
-      HandleExtern(parser);
+      HandleExtern(CI, parser);
       break;
     default:
-      HandleTopLevelExpression(parser, TheJIT);
+      HandleTopLevelExpression(CI, parser, Exec);
       break;
     }
+    // Everything parsed for this item has been code generated by now.
+    parser.Arena.reset();
+  }
+}
+
+/// PrintStats - Report what Exec has compiled and run so far.
+static void PrintStats(const Executor &Exec) {
+  Executor::Stats Stats = Exec.getStats();
+  if (Stats.Evaluations)
+    fprintf(stderr,
+            "%zu evaluations: compile %.3f ms avg, %.3f ms max; "
+            "run %.3f ms avg, %.3f ms max\n",
+            Stats.Evaluations, Stats.CompileSeconds * 1e3 / Stats.Evaluations,
+            Stats.MaxCompileSeconds * 1e3,
+            Stats.RunSeconds * 1e3 / Stats.Evaluations,
+            Stats.MaxRunSeconds * 1e3);
+  fprintf(stderr, "%zu functions defined, %zu compiled, %zu bytes of code\n",
+          Stats.FunctionsDefined, Stats.FunctionsCompiled, Stats.ObjectBytes);
+  if (Stats.CacheHits || Stats.CacheMisses)
+    fprintf(stderr, "object cache: %u hits, %u misses\n", Stats.CacheHits,
+            Stats.CacheMisses);
+  if (Stats.Interpreted)
+    fprintf(stderr, "%zu evaluations interpreted, %zu loops promoted to the "
+            "JIT\n", Stats.Interpreted, Stats.LoopsPromoted);
+  if (Exec.isTiered())
+    fprintf(stderr,
+            "tier 0 (-O0): %zu functions in %.3f ms; "
+            "tier 1 (-O3): %zu tier-ups in %.3f ms\n",
+            Stats.FunctionsDefined, Stats.Tier0Seconds * 1e3, Stats.TierUps,
+            Stats.Tier1Seconds * 1e3);
+}
+
+/// InteractiveLoop - Read the program from a terminal a line at a time, and
+/// run each item as soon as it is complete.
+///
+/// ":stats" prints what has been compiled and run so far.
+///
+/// An item is complete once the parser stops short of the end of what has
+/// been typed, e.g. at the ';' after it. Until then it is parsed quietly
+/// each time a line comes in, and the text is kept for the next try.
+static void InteractiveLoop(CompilerInstance& CI, Executor& Exec) {
+  std::string Pending;
+  char Line[4096];
+  fprintf(stderr, "ready> ");
+  while (fgets(Line, sizeof(Line), stdin)) {
+    // Commands start with ':' and take a line of their own.
+    if (Pending.empty() && Line[0] == ':') {
+      llvm::StringRef Command = llvm::StringRef(Line).trim();
+      if (Command == ":stats")
+        PrintStats(Exec);
+      else
+        fprintf(stderr, "Error: unknown command '%s' (try :stats)\n",
+                Command.str().c_str());
+      fprintf(stderr, "ready> ");
+      continue;
+    }
+    Pending += Line;
+    if (Pending.back() != '\n')
+      continue;  // Only part of a long line so far
+
+    auto Src = SourceBuffer::fromString(Pending, "<stdin>");
+    TokenStream Toks(*Src, /*AllowThread=*/false);
+    size_t Pos = 0;
+    while (true) {
+      int Kind = Toks.getKind(Pos);
+      if (Kind == tok_eof) {
+        Pending.clear();
+        break;
+      }
+      if (Kind == ';') {
+        ++Pos;
+        continue;
+      }
+
+      Parser Probe(CI, Toks, Pos);
+      Probe.ReportErrors = false;
+      Probe.getNextToken();
+      if (Kind == tok_def)
+        Probe.ParseDefinition();
+      else if (Kind == tok_extern)
+        Probe.ParseExtern();
+      else
+        Probe.ParseTopLevelExpr();
+      if (Probe._curTok == tok_eof) {
+        Pending.erase(0, Toks.getOffset(Pos));
+        break;
+      }
+
+      Parser parser(CI, Toks, Pos);
+      parser.getNextToken();
+      MainLoop(CI, &Exec, parser, Probe.getTokIndex());
+      Pos = parser.getTokIndex();
+    }
+    fprintf(stderr, "ready> ");
+  }
+  fprintf(stderr, "\n");
+}
+
+//===----------------------------------------------------------------------===//
+// Parallel front end
+//===----------------------------------------------------------------------===//
+
+/// Chunk - A run of consecutive top-level items compiled by one worker.
+struct Chunk {
+  size_t Begin, End;                  // Token range of the items
+  size_t FirstItem;                   // Index of the first item
+  std::map<char, int> Precedence;     // BinopPrecedence before the first item
+  llvm::DenseMap<Symbol, InlineOperator> InlineOperators;  // Likewise
+  llvm::SmallVector<char, 0> Bitcode; // The chunk's module once compiled
+  std::string Log;                    // Errors reported compiling it
+};
+
+/// CompileParallel - Compile the program in Toks on NumThreads threads and
+/// leave the result in the module of CI.
+///
+/// Top-level items are found by looking for 'def' and 'extern', which can't
+/// appear inside an expression. Their prototypes are parsed up front, which
+/// tells every chunk which functions earlier items declared and what operator
+/// precedences are in effect where it starts. Operator definitions are parsed
+/// whole, so that chunks inline the same operators a serial compile would. Each chunk is then parsed and
+/// code generated by its own CompilerInstance, and the modules are linked
+/// back together in source order. Functions end up in the same order as in a
+/// serial compile, so the output is the same, and so are the errors, which
+/// are reported chunk by chunk once all are compiled.
+static bool CompileParallel(CompilerInstance &CI, TokenStream &Toks,
+                            unsigned NumThreads, const llvm::DataLayout &DL) {
+  size_t NumToks = Toks.size();
+
+  std::vector<size_t> ItemStarts;
+  if (Toks.getKind(0) != tok_def && Toks.getKind(0) != tok_extern)
+    ItemStarts.push_back(0);
+  for (size_t I = 0; I != NumToks; ++I)
+    if (Toks.getKind(I) == tok_def || Toks.getKind(I) == tok_extern)
+      ItemStarts.push_back(I);
+
+  // Prototypes of def/extern items, null for top-level expressions. Errors are
+  // left for the worker that parses the item for real to report.
+  std::vector<std::unique_ptr<PrototypeAST>> ItemProtos(ItemStarts.size());
+  std::vector<Chunk> Chunks;
+  std::map<char, int> Precedence = CI.BinopPrecedence;
+  size_t TargetTokens = NumToks / (NumThreads * 8) + 1;
+  for (size_t Item = 0; Item != ItemStarts.size(); ++Item) {
+    size_t Start = ItemStarts[Item];
+    if (Chunks.empty() || Start - Chunks.back().Begin >= TargetTokens) {
+      if (!Chunks.empty())
+        Chunks.back().End = Start;
+      Chunks.push_back(
+          {Start, NumToks, Item, Precedence, CI.InlineOperators, {}, {}});
+    }
+
+    int Kind = Toks.getKind(Start);
+    if (Kind != tok_def && Kind != tok_extern)
+      continue;
+    Parser ProtoParser(CI, Toks, Start + 1);
+    ProtoParser.ReportErrors = false;
+    ProtoParser.getNextToken();
+    ItemProtos[Item] = ProtoParser.ParsePrototype();
+    if (!ItemProtos[Item])
+      continue;
+    PrototypeAST &P = *ItemProtos[Item];
+    if (Kind == tok_def && P.isBinaryOp())
+      Precedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    if (!CI.Simplify || !P.IsOperator)
+      continue;
+    if (Kind == tok_extern) {
+      CI.InlineOperators.erase(P.Name);
+      continue;
+    }
+    // The body is parsed with the precedences in effect after the prototype,
+    // as MainLoop would.
+    CI.BinopPrecedence = Precedence;
+    Parser OpParser(CI, Toks, Start);
+    OpParser.ReportErrors = false;
+    OpParser.getNextToken();
+    if (auto FnAST = OpParser.ParseDefinition())
+      ASTSimplifier::simplify(*FnAST, CI, OpParser.Arena);
+  }
+
+  std::atomic<size_t> NextChunk(0);
+  auto Worker = [&] {
+    // A TargetMachine caches per-function subtargets without locking, so
+    // each worker needs its own.
+    std::unique_ptr<llvm::TargetMachine> WorkerTM;
+    if (CI.TM)
+      WorkerTM.reset(CI.TM->getTarget().createTargetMachine(
+          CI.TM->getTargetTriple().str(), CI.TM->getTargetCPU(),
+          CI.TM->getTargetFeatureString(), CI.TM->Options,
+          CI.TM->getRelocationModel(), CI.TM->getCodeModel(),
+          CI.TM->getOptLevel()));
+    for (size_t C; (C = NextChunk++) < Chunks.size();) {
+      Chunk &Ch = Chunks[C];
+      CompilerInstance ChunkCI;
+      ChunkCI.OptLevel = CI.OptLevel;
+      ChunkCI.CountLoops = CI.CountLoops;
+      ChunkCI.Simplify = CI.Simplify;
+      ChunkCI.TM = WorkerTM.get();
+      ChunkCI.initializeModule(DL);
+      ChunkCI.BinopPrecedence = Ch.Precedence;
+      ChunkCI.InlineOperators = Ch.InlineOperators;
+      for (size_t Item = 0; Item != Ch.FirstItem; ++Item)
+        if (ItemProtos[Item])
+          ChunkCI.FunctionProtos[ItemProtos[Item]->Name] =
+              std::make_unique<PrototypeAST>(*ItemProtos[Item]);
+
+      ErrorLog = &Ch.Log;
+      Parser parser(ChunkCI, Toks, Ch.Begin);
+      parser.getNextToken();
+      MainLoop(ChunkCI, nullptr, parser, Ch.End);
+      ErrorLog = nullptr;
+
+      llvm::raw_svector_ostream OS(Ch.Bitcode);
+      llvm::WriteBitcodeToFile(*ChunkCI.TheModule, OS);
+    }
+  };
+
+  // No more workers than chunks, each of which would make a TargetMachine
+  // only to find nothing to do.
+  std::vector<std::thread> Workers;
+  for (size_t I = 0; I != std::min<size_t>(NumThreads, Chunks.size()); ++I)
+    Workers.emplace_back(Worker);
+  for (auto &W : Workers)
+    W.join();
+  for (Chunk &Ch : Chunks)
+    Diag(Ch.Log);
+
+  CI.initializeModule(DL);
+  // Link errors are reported like any other, instead of LLVM exiting on them.
+  CI.TheContext->setDiagnosticHandlerCallBack(
+      [](const llvm::DiagnosticInfo &DI, void *) {
+        std::string Msg;
+        llvm::raw_string_ostream OS(Msg);
+        llvm::DiagnosticPrinterRawOStream DP(OS);
+        OS << llvm::LLVMContext::getDiagnosticMessagePrefix(DI.getSeverity())
+           << ": ";
+        DI.print(DP);
+        Diag(OS.str() + "\n");
+      },
+      nullptr, /*RespectFilters=*/true);
+  std::vector<std::string> Order;  // Every function, where it first appears
+  for (Chunk &Ch : Chunks) {
+    llvm::MemoryBufferRef Buf(
+        llvm::StringRef(Ch.Bitcode.data(), Ch.Bitcode.size()), "chunk");
+    auto M = llvm::parseBitcodeFile(Buf, *CI.TheContext);
+    if (!M) {
+      Diag("Error: " + llvm::toString(M.takeError()) + "\n");
+      return false;
+    }
+    // The linker only brings in declarations that are used, and appends what
+    // it brings in. Declare everything up front, in the chunk's order, so that
+    // unused externs survive and every function lands where a serial compile
+    // would have put it; linking then fills in the bodies in place.
+    //
+    // A serial compile keeps the first body of a function defined more than
+    // once, as every top-level expression 'main' is: the later ones are
+    // generated after its return and never run. So a body defined by an
+    // earlier chunk wins here too, and the chunk's own is dropped.
+    for (llvm::Function &F : **M) {
+      llvm::Function *Prev = CI.TheModule->getFunction(F.getName());
+      if (!Prev) {
+        // Local functions, like a parfor's body, can't be declared; they're
+        // only put in their place once they're linked.
+        if (!F.hasLocalLinkage())
+          llvm::Function::Create(F.getFunctionType(),
+                                 llvm::Function::ExternalLinkage, F.getName(),
+                                 CI.TheModule.get());
+        Order.push_back(F.getName().str());
+      } else if (!Prev->isDeclaration() && !F.isDeclaration() &&
+               !F.hasLocalLinkage())
+        F.deleteBody();
+    }
+    if (llvm::Linker::linkModules(*CI.TheModule, std::move(*M)))
+      return false;
   }
+
+  // The linker replaces the intrinsics declared up front with declarations
+  // of its own at the start of the module, and appends local functions; put
+  // everything back in order.
+  auto &Functions = CI.TheModule->getFunctionList();
+  for (const std::string &Name : Order)
+    if (llvm::Function *F = CI.TheModule->getFunction(Name))
+      Functions.splice(Functions.end(), Functions, F->getIterator());
+  return true;
 }
 
 //===----------------------------------------------------------------------===//
@@ -161,59 +478,595 @@ extern "C" DLLEXPORT double printd(double X) {
   return 0;
 }
 
-//===----------------------------------------------------------------------===//
-// Main driver code.
-//===----------------------------------------------------------------------===//
+/// EmitObject - Generate the object file for M into Obj.
+static bool EmitObject(llvm::TargetMachine &TM, llvm::Module &M,
+                       llvm::SmallVectorImpl<char> &Obj) {
+  llvm::raw_svector_ostream ObjStream(Obj);
+  llvm::legacy::PassManager pass;
+#if LLVM_VERSION_MAJOR >= 10
+  auto FileType = llvm::CGFT_ObjectFile;
+#else
+  auto FileType = llvm::LLVMTargetMachine::CGFT_ObjectFile;
+#endif
+  if (TM.addPassesToEmitFile(pass, ObjStream, nullptr, FileType)) {
+    Diag("TheTargetMachine can't emit a file of this type");
+    return false;
+  }
+  pass.run(M);
+  return true;
+}
+
+/// BuildIncremental - Compile each definition and the first top-level
+/// expression into an object of its own, reusing the objects of Build's last
+/// run for items that haven't changed, and archive them all into
+/// ArchivePath.
+static bool BuildIncremental(CompilerInstance &CI, TokenStream &Toks,
+                             IncrementalBuild &Build,
+                             const std::string &ArchivePath) {
+  Parser parser(CI, Toks);
+  parser.getNextToken();
+  const llvm::DataLayout DL = CI.TM->createDataLayout();
+  std::string Error;
+  bool Ok = true;
+  bool HaveMain = false;
+  while (parser._curTok != tok_eof) {
+    int Kind = parser._curTok;
+    if (Kind == ';') {
+      parser.getNextToken();
+      continue;
+    }
+    if (Kind == tok_extern) {
+      CI.initializeModule(DL);
+      HandleExtern(CI, parser);
+      parser.Arena.reset();
+      continue;
+    }
 
-int main() {
-  std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+    size_t Begin = parser.getTokIndex();
+    std::unique_ptr<FunctionAST> FnAST = Kind == tok_def
+                                             ? parser.ParseDefinition()
+                                             : parser.ParseTopLevelExpr();
+    if (!FnAST) {
+      // Skip token for error recovery.
+      parser.getNextToken();
+      Ok = false;
+      continue;
+    }
 
-  LLVMInitializeNativeTarget();
-  LLVMInitializeNativeAsmPrinter();
-  LLVMInitializeNativeAsmParser();
+    // A serial build keeps the body of the first top-level expression as
+    // main. The ones after it are only checked for errors, and aren't items.
+    if (Kind != tok_def && HaveMain) {
+      if (CI.Simplify)
+        ASTSimplifier::simplify(*FnAST, CI, parser.Arena);
+      CI.initializeModule(DL);
+      codegenVisitor codeV(CI);
+      if (!codeV.codegen(*FnAST)) {
+        fprintf(stderr, "Error in top level expr\n");
+        Ok = false;
+      }
+      parser.Arena.reset();
+      continue;
+    }
+    HaveMain |= Kind != tok_def;
 
-  TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+    bool NeedsCompile;
+    if (!Build.addItem(CI, Toks, Begin, parser.getTokIndex(), *FnAST,
+                       NeedsCompile, Error)) {
+      llvm::errs() << "Error: " << Error << "\n";
+      return false;
+    }
+    // After addItem(), which needs to see the operators it uses before
+    // they're inlined. Unchanged operators are still inlined in the items
+    // after them.
+    if (CI.Simplify)
+      ASTSimplifier::simplify(*FnAST, CI, parser.Arena);
+    if (NeedsCompile) {
+      CI.initializeModule(DL);
+      codegenVisitor codeV(CI);
+      llvm::SmallVector<char, 0> Obj;
+      if (!codeV.codegen(*FnAST)) {
+        fprintf(stderr, "Error in parsing a function definition.\n");
+        Ok = false;
+      } else {
+        CI.optimizeModule();
+        if (!EmitObject(*CI.TM, *CI.TheModule, Obj))
+          return false;
+        if (!Build.storeObject(llvm::StringRef(Obj.data(), Obj.size()),
+                               Error)) {
+          llvm::errs() << "Error: " << Error << "\n";
+          return false;
+        }
+      }
+    } else {
+      // Declare the function for the items after it, as codegen would.
+      PrototypeAST &P = *FnAST->Proto;
+      if (P.isBinaryOp())
+        CI.BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+      CI.FunctionProtos[P.Name] = std::move(FnAST->Proto);
+    }
+    parser.Arena.reset();
+  }
+  CI.releaseModule();
 
-  Parser parser;
-  // Install standard binary operators.
-  // 1 is lowest precedence.
-  BinopPrecedence['='] = 2;
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40; // highest.
+  if (!Ok)
+    return false;
+  if (!Build.finish(ArchivePath, Error)) {
+    llvm::errs() << "Error: " << Error << "\n";
+    return false;
+  }
+  const IncrementalBuild::Stats &Stats = Build.getStats();
+  fprintf(stderr, "%u of %u items compiled, %u of them for a changed "
+          "dependency\n", Stats.Compiled, Stats.Items, Stats.DependencyChanged);
+  return true;
+}
 
-  // Prime the first token.
-  parser.getNextToken();
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
 
-  InitializeModuleAndPassManager(TheJIT);
+/// DriverOptions - What the command line asks for.
+struct DriverOptions {
+  unsigned OptLevel = 0;
+  unsigned NumThreads = 0;  // 0 if not given
+  std::string CPUName = "generic", Attrs;
+  std::vector<std::string> CloneNames;
+  std::string CacheDir;
+  uint64_t CacheMB = 512;
+  bool Simplify = true;
+  bool CountLoops = true;  // When optimizing; see LoopNarrowing
+  bool UseJIT = false, Lazy = false, Interpret = true, ShowTimes = false;
+  unsigned TierUpThreshold = 0;
+  std::string IncrementalDir;
+  std::string InputPath;  // Empty if not given; "-" for stdin
+  bool Server = false;
+  std::string ServerPath;  // Empty for the default
+};
+
+/// MaxThreads - The most threads -j asks for that are taken seriously.
+static const unsigned MaxThreads = 1024;
+
+/// ParseArgs - Fill in Opts from the arguments after the program name.
+/// Returns false if they don't make sense.
+static bool ParseArgs(const std::vector<std::string> &Args,
+                      DriverOptions &Opts) {
+  for (size_t i = 0; i != Args.size(); ++i) {
+    const std::string &Arg = Args[i];
+    if (Arg.compare(0, 2, "-j") == 0) {
+      // -j N or -jN: compile with N threads.
+      std::string N = Arg.size() > 2 ? Arg.substr(2)
+                                     : (i + 1 != Args.size() ? Args[++i] : "");
+      if (llvm::StringRef(N).getAsInteger(10, Opts.NumThreads) ||
+          Opts.NumThreads == 0 || Opts.NumThreads > MaxThreads)
+        return false;
+    } else if (Arg == "--jit") {
+      Opts.UseJIT = true;
+    } else if (Arg == "--lazy") {
+      Opts.UseJIT = Opts.Lazy = true;
+    } else if (Arg == "--tiered" || Arg.compare(0, 9, "--tiered=") == 0) {
+      Opts.UseJIT = true;
+      Opts.TierUpThreshold =
+          Arg.size() > 9 ? atoi(Arg.c_str() + 9) : 1000;
+      if (Opts.TierUpThreshold == 0)
+        return false;
+    } else if (Arg == "--no-interpret") {
+      Opts.Interpret = false;
+    } else if (Arg == "--no-simplify") {
+      Opts.Simplify = false;
+    } else if (Arg == "--no-count-loops") {
+      Opts.CountLoops = false;
+    } else if (Arg.compare(0, 12, "--cache-dir=") == 0) {
+      Opts.CacheDir = Arg.substr(12);
+    } else if (Arg.compare(0, 14, "--incremental=") == 0) {
+      Opts.IncrementalDir = Arg.substr(14);
+    } else if (Arg.compare(0, 13, "--cache-size=") == 0) {
+      Opts.CacheMB = strtoull(Arg.c_str() + 13, nullptr, 10);
+      if (Opts.CacheMB == 0)
+        return false;
+    } else if (Arg == "--server" || Arg.compare(0, 9, "--server=") == 0) {
+      Opts.Server = true;
+      Opts.ServerPath = Arg.size() > 9 ? Arg.substr(9) : "";
+    } else if (Arg == "-time") {
+      Opts.ShowTimes = true;
+    } else if (Arg.size() == 3 && Arg.compare(0, 2, "-O") == 0 &&
+               Arg[2] >= '0' && Arg[2] <= '3') {
+      Opts.OptLevel = Arg[2] - '0';
+    } else if (Arg.compare(0, 6, "-mcpu=") == 0 ||
+               Arg.compare(0, 7, "-march=") == 0) {
+      Opts.CPUName = Arg.substr(Arg.find('=') + 1);
+    } else if (Arg.compare(0, 7, "-mattr=") == 0) {
+      Opts.Attrs = Arg.substr(7);
+    } else if (Arg.compare(0, 9, "-mclones=") == 0) {
+      // A comma separated list of CPUs to clone exported functions for.
+      llvm::SmallVector<llvm::StringRef, 4> Names;
+      llvm::StringRef(Arg).substr(9).split(Names, ',', -1, false);
+      for (llvm::StringRef Name : Names)
+        Opts.CloneNames.push_back(Name.str());
+    } else if (Opts.InputPath.empty() && (Arg == "-" || Arg[0] != '-')) {
+      Opts.InputPath = Arg;
+    } else {
+      return false;
+    }
+  }
+  // A server reads its programs from clients.
+  return !Opts.Server || Opts.InputPath.empty();
+}
 
-  // Run the main "interpreter loop" now.
-  MainLoop(std::move(TheJIT), parser);
+static int Usage(llvm::raw_ostream &OS, const char *Argv0) {
+  OS << "Usage: " << Argv0
+     << " [-O0|-O1|-O2|-O3] [-mcpu=CPU] [-mattr=+F,-F...]\n"
+        "       [-mclones=CPU,CPU...] [-j N] [--jit] [--lazy] [-time]\n"
+        "       [--tiered[=CALLS]] [--no-interpret] [--no-simplify]\n"
+        "       [--no-count-loops] [--cache-dir=DIR] [--cache-size=MB]\n"
+        "       [--incremental=DIR] [--server[=SOCKET]]\n"
+        "       [file.kl]\n"
+        "CPU may be 'native' for the host this runs on.\n"
+        "--jit runs the program instead of writing output.o; so does\n"
+        "typing it in at a terminal. --lazy runs it too, compiling each\n"
+        "function when it's first called. --tiered runs it at -O0 and\n"
+        "recompiles functions at -O3 after CALLS calls (default 1000).\n"
+        "Top-level expressions run on an interpreter until they loop for\n"
+        "long; --no-interpret compiles them all.\n"
+        "--no-simplify generates code for every expression as written,\n"
+        "without folding constants or inlining small operators first.\n"
+        "--no-count-loops keeps loops over doubles that only ever hold\n"
+        "whole numbers counting in doubles when optimizing.\n"
+        "--cache-dir (default: $KALE_CACHE_DIR) keeps object files across\n"
+        "runs, up to --cache-size MB (default 512).\n"
+        "--incremental compiles each item separately into output.a,\n"
+        "keeping the objects in DIR to reuse the ones that didn't change.\n"
+        "--server keeps running to build output.o for kale_client, which\n"
+        "takes the same arguments, on -j N threads (default: one per core).\n"
+        "Its --cache-dir is used for clients that don't name their own.\n"
+        "SOCKET defaults to $KALE_SERVER, or else /tmp/kale-UID.sock.\n";
+  return 1;
+}
 
+/// InitializeTargets - Make every target LLVM was built with available for
+/// ahead-of-time builds.
+static void InitializeTargets() {
   llvm::InitializeAllTargetInfos();
   llvm::InitializeAllTargets();
   llvm::InitializeAllTargetMCs();
   llvm::InitializeAllAsmParsers();
   llvm::InitializeAllAsmPrinters();
+}
 
+/// CreateTargetMachine - A machine generating code for the host's triple and
+/// the CPU, features and optimization level in Opts, or null with Error set.
+static std::unique_ptr<llvm::TargetMachine>
+CreateTargetMachine(const DriverOptions &Opts, std::string &Error) {
   auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(TargetTriple);
+  auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!Target)
+    return nullptr;
+
+  TargetCPU CPU = resolveTargetCPU(Opts.CPUName, Opts.Attrs);
+  llvm::TargetOptions opt;
+  // Position-independent, as cc links executables as PIE by default; the
+  // -mclones resolvers' tables of functions wouldn't link otherwise.
+  auto RM = llvm::Optional<llvm::Reloc::Model>(llvm::Reloc::PIC_);
+  return std::unique_ptr<llvm::TargetMachine>(Target->createTargetMachine(
+      TargetTriple, CPU.Name, CPU.Features, opt, RM,
+      llvm::Optional<llvm::CodeModel::Model>(),
+      CompilerInstance::getCodeGenOptLevel(Opts.OptLevel)));
+}
 
+/// CheckCPUs - Whether the host's target knows the CPU in Opts and those
+/// -mclones asks for. Check before CreateTargetMachine(), which would warn
+/// about an unknown one instead.
+static bool CheckCPUs(const DriverOptions &Opts) {
   std::string Error;
+  auto TargetTriple = llvm::sys::getDefaultTargetTriple();
   auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
   if (!Target) {
+    Diag(Error);
+    return false;
+  }
+  std::vector<std::string> Names = Opts.CloneNames;
+  Names.push_back(Opts.CPUName);
+  for (const std::string &Name : Names)
+    if (Name != "native" && !isValidCPU(*Target, TargetTriple, Name)) {
+      Diag("Error: unknown CPU '" + Name + "'\n");
+      return false;
+    }
+  return true;
+}
+
+/// ResolveClones - The CPUs that -mclones asks for.
+static std::vector<TargetCPU> ResolveClones(const DriverOptions &Opts) {
+  // Clones get the -mattr flags too, so that e.g. -mattr=-avx512f applies to
+  // every variant.
+  std::vector<TargetCPU> Clones;
+  for (const std::string &Name : Opts.CloneNames)
+    Clones.push_back(resolveTargetCPU(Name, Opts.Attrs));
+  return Clones;
+}
+
+/// BuildObject - Compile the program in Src for TM into the object file Obj,
+/// and print the optimized module. A module compiled before is taken from
+/// Cache instead, if there is one.
+static bool BuildObject(const SourceBuffer &Src, const DriverOptions &Opts,
+                        llvm::TargetMachine &TM,
+                        const std::vector<TargetCPU> &Clones,
+                        DiskObjectCache *Cache,
+                        llvm::SmallVectorImpl<char> &Obj) {
+  // Code is generated and optimized for the machine the object file is for.
+  CompilerInstance CI;
+  CI.OptLevel = Opts.OptLevel;
+  CI.CountLoops = Opts.CountLoops && Opts.OptLevel;
+  CI.Simplify = Opts.Simplify;
+  CI.TM = &TM;
+  TokenStream Toks(Src);
+
+  llvm::DataLayout DL = TM.createDataLayout();
+  if (Opts.NumThreads > 1) {
+    if (!CompileParallel(CI, Toks, Opts.NumThreads, DL))
+      return false;
+  } else {
+    Parser parser(CI, Toks);
+    // Prime the first token.
+    parser.getNextToken();
+
+    CI.initializeModule(DL);
+
+    // Run the main "interpreter loop" now.
+    MainLoop(CI, nullptr, parser);
+  }
+  std::string Error;
+  if (!Clones.empty() && !emitCPUClones(*CI.TheModule, TM, Clones, Error)) {
+    Diag("Error: " + Error + "\n");
+    return false;
+  }
+  CI.optimizeModule();
+
+  std::unique_ptr<llvm::MemoryBuffer> Cached;
+  if (Cache)
+    Cached = Cache->getObject(CI.TheModule.get());
+  if (Cached) {
+    llvm::StringRef ObjData = Cached->getBuffer();
+    Obj.append(ObjData.begin(), ObjData.end());
+  } else {
+    if (!EmitObject(TM, *CI.TheModule, Obj))
+      return false;
+    if (Cache)
+      Cache->notifyObjectCompiled(
+          CI.TheModule.get(),
+          llvm::MemoryBufferRef(llvm::StringRef(Obj.data(), Obj.size()),
+                                "output.o"));
+  }
+
+  if (ErrorLog) {
+    llvm::raw_string_ostream OS(*ErrorLog);
+    CI.TheModule->print(OS, nullptr);
+  } else {
+    CI.TheModule->print(llvm::errs(), nullptr);
+  }
+  return true;
+}
+
+/// RunJIT - Compile and run the program on the JIT, printing the value of
+/// every top-level expression.
+static int RunJIT(const SourceBuffer *Src, const DriverOptions &Opts,
+                  const Executor::Options &JITOpts) {
+  std::string Error;
+  auto Exec = Executor::create(JITOpts, Error);
+  if (!Exec) {
+    llvm::errs() << "Error: " << Error << "\n";
+    return 1;
+  }
+
+  // The JIT optimizes modules itself, when it compiles them.
+  CompilerInstance CI;
+  CI.TM = &Exec->getTargetMachine();
+  CI.TierUpThreshold = JITOpts.TierUpThreshold;
+  CI.CountLoops =
+      Opts.CountLoops && (JITOpts.OptLevel || JITOpts.TierUpThreshold);
+  CI.Simplify = Opts.Simplify;
+  CI.initializeModule(Exec->getDataLayout());
+  if (Src) {
+    TokenStream Toks(*Src);
+    Parser parser(CI, Toks);
+    parser.getNextToken();
+    MainLoop(CI, Exec.get(), parser);
+  } else {
+    InteractiveLoop(CI, *Exec);
+  }
+
+  if (ShowTimes)
+    PrintStats(*Exec);
+  return 0;
+}
+
+/// ServeRequest - Build the program in Req as `Kale` would given its
+/// arguments, reporting to ErrorLog. Target machines and object caches are
+/// kept for the requests after it.
+static bool ServeRequest(const CompileRequest &Req,
+                         const std::string &DefaultCacheDir,
+                         CompileResponse &Resp) {
+  DriverOptions Opts;
+  Opts.CacheDir = DefaultCacheDir;
+  if (!ParseArgs(Req.Args, Opts)) {
+    llvm::raw_string_ostream OS(*ErrorLog);
+    Usage(OS, "kale_client");
+    return false;
+  }
+  if (Opts.UseJIT || !Opts.IncrementalDir.empty() || Opts.Server) {
+    Diag("Error: the server only writes output.o; use Kale itself for "
+         "--jit, --lazy, --tiered, --incremental and --server\n");
+    return false;
+  }
+  if (!CheckCPUs(Opts))
+    return false;
+  // The workers share the machine, so -j gets at most a thread per core.
+  Opts.NumThreads = std::min(
+      Opts.NumThreads, std::max(1u, std::thread::hardware_concurrency()));
+
+  // A TargetMachine caches per-function subtargets without locking, so each
+  // worker keeps its own, one for each CPU, features and level asked for.
+  static thread_local std::map<std::string,
+                               std::unique_ptr<llvm::TargetMachine>> Machines;
+  std::unique_ptr<llvm::TargetMachine> &TM =
+      Machines[Opts.CPUName + '\n' + Opts.Attrs + '\n' +
+               std::to_string(Opts.OptLevel)];
+  std::string Error;
+  if (!TM && !(TM = CreateTargetMachine(Opts, Error))) {
+    Diag(Error);
+    return false;
+  }
+  std::vector<TargetCPU> Clones = ResolveClones(Opts);
+
+  // Caches are shared by all workers, as they lock what needs locking. A
+  // relative --cache-dir is the client's.
+  DiskObjectCache *Cache = nullptr;
+  if (!Opts.CacheDir.empty()) {
+    llvm::SmallString<128> Dir(Opts.CacheDir);
+    llvm::sys::fs::make_absolute(Req.Cwd, Dir);
+    std::string Key = std::string(Dir.str()) + '\n' +
+                      std::to_string(Opts.CacheMB) + '\n' +
+                      DiskObjectCache::getTargetKey(*TM);
+    static std::mutex CachesLock;
+    static std::map<std::string, std::unique_ptr<DiskObjectCache>> Caches;
+    std::lock_guard<std::mutex> Guard(CachesLock);
+    std::unique_ptr<DiskObjectCache> &C = Caches[Key];
+    if (!C)
+      C = DiskObjectCache::create(std::string(Dir.str()), Opts.CacheMB << 20,
+                                  *TM, Error);
+    if (!C)
+      Diag("Warning: " + Error + "\n");
+    Cache = C.get();
+  }
+
+  auto Src = SourceBuffer::fromString(Req.Source, Req.SourceName);
+  llvm::SmallVector<char, 0> Obj;
+  if (!BuildObject(*Src, Opts, *TM, Clones, Cache, Obj))
+    return false;
+  Resp.Object.assign(Obj.begin(), Obj.end());
+  Resp.Out = "Wrote output.o\n";
+  return true;
+}
+
+/// RunServer - Serve kale_client until killed.
+static int RunServer(const DriverOptions &Opts) {
+  InitializeTargets();
+
+  // Clients that name no cache share the server's.
+  llvm::SmallString<128> CacheDir(Opts.CacheDir);
+  if (!CacheDir.empty())
+    llvm::sys::fs::make_absolute(CacheDir);
+  unsigned NumWorkers =
+      Opts.NumThreads ? Opts.NumThreads : std::thread::hardware_concurrency();
+  std::string Path =
+      Opts.ServerPath.empty() ? getDefaultSocketPath() : Opts.ServerPath;
+
+  std::string Error;
+  runCompileServer(
+      Path, std::max(NumWorkers, 1u),
+      [&](const CompileRequest &Req, CompileResponse &Resp) {
+        ErrorLog = &Resp.Err;
+        // Also if the request throws, which runCompileServer reports.
+        auto Reset = llvm::make_scope_exit([] { ErrorLog = nullptr; });
+        Resp.Status = ServeRequest(Req, std::string(CacheDir.str()), Resp)
+                          ? 0 : 1;
+      },
+      Error);
+  llvm::errs() << "Error: " << Error << "\n";
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  DriverOptions Opts;
+  const char *CacheEnv = getenv("KALE_CACHE_DIR");
+  Opts.CacheDir = CacheEnv ? CacheEnv : "";
+  if (!ParseArgs(std::vector<std::string>(argv + 1, argv + argc), Opts))
+    return Usage(llvm::errs(), argv[0]);
+  ShowTimes = Opts.ShowTimes;
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  if (Opts.Server)
+    return RunServer(Opts);
+
+  Executor::Options JITOpts;
+  JITOpts.OptLevel = Opts.OptLevel;
+  JITOpts.NumCompileThreads = Opts.NumThreads
+                                  ? Opts.NumThreads
+                                  : std::thread::hardware_concurrency();
+  JITOpts.Lazy = Opts.Lazy;
+  JITOpts.TierUpThreshold = Opts.TierUpThreshold;
+  JITOpts.Interpret = Opts.Interpret;
+  JITOpts.CacheDir = Opts.CacheDir;
+  JITOpts.CacheBytes = Opts.CacheMB << 20;
+
+  // Someone typing at a terminal gets a REPL: it reads a line at a time
+  // and runs each item as soon as it is complete.
+  bool FromStdin = Opts.InputPath.empty() || Opts.InputPath == "-";
+  if (FromStdin && isatty(fileno(stdin)))
+    return RunJIT(nullptr, Opts, JITOpts);
+
+  // Read the program from the named file, or from stdin if there is none.
+  std::unique_ptr<SourceBuffer> Src;
+  if (!FromStdin)
+    Src = SourceBuffer::openFile(Opts.InputPath);
+  else
+    Src = SourceBuffer::openStdin();
+  if (!Src)
+    return 1;
+
+  if (Opts.UseJIT)
+    return RunJIT(Src.get(), Opts, JITOpts);
+
+  InitializeTargets();
+  if (!CheckCPUs(Opts))
+    return 1;
+
+  std::string Error;
+  auto TheTargetMachine = CreateTargetMachine(Opts, Error);
+  if (!TheTargetMachine) {
     llvm::errs() << Error;
     return 1;
   }
+  std::vector<TargetCPU> Clones = ResolveClones(Opts);
 
-  auto CPU = "generic";
-  auto Features = "";
-  llvm::TargetOptions opt;
-  auto RM = llvm::Optional<llvm::Reloc::Model>();
-  auto TheTargetMachine =
-    Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
-  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+  if (!Opts.IncrementalDir.empty()) {
+    if (!Clones.empty()) {
+      llvm::errs() << "Error: -mclones needs the whole program at once, "
+                      "which --incremental doesn't have\n";
+      return 1;
+    }
+    auto Build = IncrementalBuild::open(Opts.IncrementalDir,
+                                        *TheTargetMachine, Opts.OptLevel,
+                                        Error);
+    if (!Build) {
+      llvm::errs() << "Error: " << Error << "\n";
+      return 1;
+    }
+    CompilerInstance CI;
+    CI.OptLevel = Opts.OptLevel;
+    CI.CountLoops = Opts.CountLoops && Opts.OptLevel;
+    CI.Simplify = Opts.Simplify;
+    CI.TM = TheTargetMachine.get();
+    TokenStream Toks(*Src);
+    if (!BuildIncremental(CI, Toks, *Build, "output.a"))
+      return 1;
+    llvm::outs() << "Wrote output.a\n";
+    return 0;
+  }
+
+  // A module compiled before is taken from the cache instead. A cache that
+  // can't be set up is only worth a warning.
+  std::unique_ptr<DiskObjectCache> Cache;
+  if (!Opts.CacheDir.empty()) {
+    Cache = DiskObjectCache::create(Opts.CacheDir, Opts.CacheMB << 20,
+                                    *TheTargetMachine, Error);
+    if (!Cache)
+      llvm::errs() << "Warning: " << Error << "\n";
+  }
+
+  llvm::SmallVector<char, 0> Obj;
+  if (!BuildObject(*Src, Opts, *TheTargetMachine, Clones, Cache.get(), Obj))
+    return 1;
 
   auto Filename = "output.o";
   std::error_code EC;
@@ -222,20 +1075,7 @@ int main() {
     llvm::errs() << "Could not open file:" << EC.message();
     return 1;
   }
-
-  llvm::legacy::PassManager pass;
-#if LLVM_VERSION_MAJOR >= 10
-  auto FileType = llvm::CGFT_ObjectFile;
-#else
-  auto FileType = llvm::LLVMTargetMachine::CGFT_ObjectFile;
-#endif
-  if (TheTargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-    llvm::errs() << "TheTargetMachine can't emit a file of this type";
-    return 1;
-  }
-
-  pass.run(*TheModule);
-  TheModule->print(llvm::errs(), nullptr);
+  dest << llvm::StringRef(Obj.data(), Obj.size());
   dest.flush();
   llvm::outs() << "Wrote " << Filename << "\n";
 
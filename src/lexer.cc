@@ -1,71 +1,83 @@
-#include <string>
-#include <cstdlib>
 #include <cctype>
+#include <cstring>
 #include "lexer.h"
+#include "scan.h"
 
-/// gettok - Return the next token from standard input.
+/// getKeyword - Return the keyword token spelled by S, or 0 if S is not a
+/// keyword. Switching on the length first means almost every identifier is
+/// rejected after a single compare.
+static int getKeyword(const char *S, size_t Len) {
+    auto Is = [&](const char *Kw) { return memcmp(S, Kw, Len) == 0; };
+    switch (Len) {
+        case 2:
+            if (Is("if")) return tok_if;
+            if (Is("in")) return tok_in;
+            return 0;
+        case 3:
+            if (Is("def")) return tok_def;
+            if (Is("for")) return tok_for;
+            if (Is("var")) return tok_var;
+            return 0;
+        case 4:
+            if (Is("then")) return tok_then;
+            if (Is("else")) return tok_else;
+            return 0;
+        case 5:
+            return Is("unary") ? tok_unary : 0;
+        case 6:
+            if (Is("extern")) return tok_extern;
+            if (Is("binary")) return tok_binary;
+            if (Is("parfor")) return tok_parfor;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/// gettok - Return the next token from the source buffer.
 int Lexer::gettok() {
-    // Skip any whitespace.
-    while (isspace(_lastChar))
-        _lastChar = getchar();
+    while (true) {
+        // Skip any whitespace.
+        _cur = skipSpace(_cur, _end);
 
-    if (isalpha(_lastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-        IdentifierStr = _lastChar;
-        while (isalnum((_lastChar = getchar())))
-            IdentifierStr += _lastChar;
+        if (_cur == _end || *_cur != '#')
+            break;
 
-        if (IdentifierStr == "def")
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        if (IdentifierStr == "if")
-            return tok_if;
-        if (IdentifierStr == "then")
-            return tok_then;
-        if (IdentifierStr == "else")
-            return tok_else;
-        if (IdentifierStr == "for")
-            return tok_for;
-        if (IdentifierStr == "in")
-            return tok_in;
-        if (IdentifierStr == "binary")
-            return tok_binary;
-        if (IdentifierStr == "unary")
-            return tok_unary;
-        if (IdentifierStr == "in")
-            return tok_in;
-        if (IdentifierStr == "var")
-            return tok_var;
-        return tok_identifier;
+        // Comment until end of line.
+        _cur = skipLine(_cur, _end);
     }
 
-    if (isdigit(_lastChar) || _lastChar == '.') { // Number: [0-9.]+
-        std::string NumStr;
-        do {
-            NumStr += _lastChar;
-            _lastChar = getchar();
-        } while (isdigit(_lastChar) || _lastChar == '.');
-
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+    if (_cur == _end) {
+        TokOffset = _cur - _src.begin();
+        return tok_eof;
     }
 
-    if (_lastChar == '#') {
-        // Comment until end of line.
-        do
-            _lastChar = getchar();
-        while (_lastChar != EOF && _lastChar != '\n' && _lastChar != '\r');
+    const char *TokStart = _cur;
+    TokOffset = TokStart - _src.begin();
+    int LastChar = (unsigned char)*_cur;
 
-        if (_lastChar != EOF)
-            return gettok();
+    if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+        while (++_cur != _end && isalnum((unsigned char)*_cur))
+            ;
+        IdentifierStr = std::string_view(TokStart, _cur - TokStart);
+
+        if (int Kw = getKeyword(TokStart, _cur - TokStart))
+            return Kw;
+        IdentifierSym = Symbols.intern(IdentifierStr);
+        return tok_identifier;
     }
 
-    // Check for end of file.  Don't eat the EOF.
-    if (_lastChar == EOF)
-        return tok_eof;
+    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
+        while (++_cur != _end && (isdigit((unsigned char)*_cur) || *_cur == '.'))
+            ;
+        if (!parseNumber(TokStart, _cur, NumVal)) {
+            ErrorStr = "malformed number literal";
+            return tok_error;
+        }
+        return tok_number;
+    }
 
     // Otherwise, just return the character as its ascii value.
-    int ThisChar = _lastChar;
-    _lastChar = getchar();
-    return ThisChar;
+    ++_cur;
+    return LastChar;
 }
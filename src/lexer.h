@@ -1,6 +1,11 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <cstdint>
+#include <string_view>
+#include "source.h"
+#include "symbol.h"
+
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things.
 enum Token {
@@ -26,16 +31,36 @@ enum Token {
   tok_unary = -12,
 
   // definition
-  tok_var = -13
+  tok_var = -13,
+
+  // malformed input, see Lexer::ErrorStr
+  tok_error = -14,
+
+  // control
+  tok_parfor = -15
 };
 
+/// Lexer - Splits a SourceBuffer into tokens. Identifiers are handed out as
+/// views into the buffer, so the buffer must outlive anything holding one.
 class Lexer {
     private:
-        int _lastChar = ' ';
+        const SourceBuffer &_src;
+        const char *_cur;
+        const char *_end;
     public:
-        std::string IdentifierStr; // Filled in if tok_identifier
-        double NumVal;             // Filled in if tok_number
+        explicit Lexer(const SourceBuffer &Src)
+            : _src(Src), _cur(Src.begin()), _end(Src.end()) {}
+
+        std::string_view IdentifierStr; // Filled in if tok_identifier
+        Symbol IdentifierSym;           // Interned IdentifierStr
+        double NumVal;                  // Filled in if tok_number
+        uint32_t TokOffset = 0;         // Buffer offset of the last token
+        const char *ErrorStr = nullptr; // Filled in if tok_error
         int gettok();
+
+        const SourceBuffer &getSource() const { return _src; }
+        /// getTokLoc - Line and column of the last token returned.
+        SourceLocation getTokLoc() const { return _src.getLocation(TokOffset); }
 };
 
 #endif	// LEXER_H
@@ -0,0 +1,109 @@
+#include <cstring>
+
+#include "loopNarrowing.h"
+
+void LoopNarrowing::run(ExprAST *Body,
+                        llvm::ArrayRef<std::pair<Symbol, ValueType>> Params) {
+  LoopNarrowing LN;
+  for (auto &Param : Params)
+    ++LN.InScope[Param.first];
+  LN.visit(Body);
+}
+
+bool LoopNarrowing::isInvariant(ExprAST *E, Symbol Var) const {
+  if (llvm::isa<NumberExprAST>(E))
+    return true;
+  if (auto *V = llvm::dyn_cast<VariableExprAST>(E))
+    return V->Name != Var && InScope.lookup(V->Name) &&
+           !Assigned.count(V->Name);
+  if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E))
+    return strchr("+-*", Bin->Op) && isInvariant(Bin->LHS, Var) &&
+           isInvariant(Bin->RHS, Var);
+  return false;
+}
+
+bool LoopNarrowing::isCounted(ForExprAST *e) const {
+  if ((e->VarType != VT_Double && e->VarType != VT_Int) ||
+      Assigned.count(e->VarName))
+    return false;
+  if (e->Step) {
+    auto *Step = llvm::dyn_cast<NumberExprAST>(e->Step);
+    if (!Step || !NumberExprAST::isIntegral(Step->Val) || Step->Val <= 0)
+      return false;
+  }
+  auto *Cond = llvm::dyn_cast<BinaryExprAST>(e->End);
+  if (!Cond || Cond->Op != '<')
+    return false;
+  // An int compared with an int already counts in an i64.
+  if (e->VarType == VT_Int && Cond->RHS->Type == VT_Int)
+    return false;
+  auto *Var = llvm::dyn_cast<VariableExprAST>(Cond->LHS);
+  return Var && Var->Name == e->VarName && isInvariant(Cond->RHS, e->VarName);
+}
+
+void LoopNarrowing::visitBinaryExpr(BinaryExprAST *e) {
+  if (e->Op == '=')
+    if (auto *Var = llvm::dyn_cast<VariableExprAST>(e->LHS))
+      Assigned.insert(Var->Name);
+  visit(e->LHS);
+  visit(e->RHS);
+}
+
+void LoopNarrowing::visitCallExpr(CallExprAST *e) {
+  for (ExprAST *Arg : e->Args)
+    visit(Arg);
+}
+
+void LoopNarrowing::visitIfExpr(IfExprAST *e) {
+  visit(e->Cond);
+  visit(e->Then);
+  visit(e->Else);
+}
+
+void LoopNarrowing::visitForExpr(ForExprAST *e) {
+  visit(e->Start);
+
+  // Collect what this loop assigns on its own, then add it to the loops
+  // around it.
+  llvm::DenseSet<Symbol> Outer;
+  std::swap(Outer, Assigned);
+  ++InScope[e->VarName];
+  visit(e->Body);
+  if (e->Step)
+    visit(e->Step);
+  visit(e->End);
+  e->Counted = isCounted(e);
+  --InScope[e->VarName];
+
+  // Assigning the variable assigns the loop's own, not the one it hides.
+  Assigned.erase(e->VarName);
+  Outer.insert(Assigned.begin(), Assigned.end());
+  std::swap(Outer, Assigned);
+}
+
+void LoopNarrowing::visitParForExpr(ParForExprAST *e) {
+  visit(e->Start);
+  visit(e->End);
+  if (e->Grain)
+    visit(e->Grain);
+
+  // The body is a function of its own, which can't assign the variables
+  // around it.
+  llvm::DenseSet<Symbol> Outer;
+  std::swap(Outer, Assigned);
+  ++InScope[e->VarName];
+  visit(e->Body);
+  --InScope[e->VarName];
+  std::swap(Outer, Assigned);
+}
+
+void LoopNarrowing::visitVarExpr(VarExprAST *e) {
+  for (auto &Var : e->VarNames) {
+    if (Var.second)
+      visit(Var.second);
+    ++InScope[Var.first];
+  }
+  visit(e->Body);
+  for (auto &Var : e->VarNames)
+    --InScope[Var.first];
+}
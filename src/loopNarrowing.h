@@ -0,0 +1,63 @@
+#ifndef LOOPNARROWING_H
+#define LOOPNARROWING_H
+
+#include <utility>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "ast.h"
+
+/// LoopNarrowing - Finds the for loops over a double, or ending on a
+/// comparison with one, that codegen can count with an i64 instead, which
+/// LLVM's loop passes understand: they work out trip counts, unroll and
+/// vectorize integer loops, but not ones tested in doubles.
+///
+/// A loop is marked Counted when, once TypeInference has run,
+///
+///  - its variable is a double, or an int compared with a double (as an
+///    array index compared with an untyped bound is), that nothing in the
+///    loop assigns,
+///  - its step is a positive whole number, or there's none, and
+///  - its end condition is `Var < Limit`, where Limit is built from numbers,
+///    variables in scope that the loop doesn't assign, and the builtin +, -
+///    and *, so that it has the same value on every trip and evaluating it
+///    early has no side effects.
+///
+/// Whether the values are in range is only known when the loop is entered,
+/// so codegen checks then that Start is a whole number within 2^53 and
+/// that Limit keeps every value the variable takes below 2^53, which makes
+/// them all exact as doubles, and falls back to the loop as written if not.
+class LoopNarrowing : public ExprVisitor<LoopNarrowing> {
+public:
+  /// run - Mark the loops in Body, which has the variables Params in scope,
+  /// that can be counted, and unmark the ones that can't.
+  static void run(ExprAST *Body,
+                  llvm::ArrayRef<std::pair<Symbol, ValueType>> Params);
+
+  void visitNumberExpr(NumberExprAST *e) {}
+  void visitVariableExpr(VariableExprAST *e) {}
+  void visitBinaryExpr(BinaryExprAST *e);
+  void visitCallExpr(CallExprAST *e);
+  void visitIfExpr(IfExprAST *e);
+  void visitForExpr(ForExprAST *e);
+  void visitUnaryExpr(UnaryExprAST *e) { visit(e->Operand); }
+  void visitVarExpr(VarExprAST *e);
+  void visitIndexExpr(IndexExprAST *e) {
+    visit(e->Array);
+    visit(e->Index);
+  }
+  void visitParForExpr(ParForExprAST *e);
+
+private:
+  LoopNarrowing() = default;
+
+  /// isInvariant - Whether E computes the same value without side effects
+  /// on every trip of the loop over Var just visited.
+  bool isInvariant(ExprAST *E, Symbol Var) const;
+  bool isCounted(ForExprAST *e) const;
+
+  llvm::DenseMap<Symbol, unsigned> InScope;  // Bindings of each name
+  llvm::DenseSet<Symbol> Assigned;  // By the innermost loop so far
+};
+
+#endif	// LOOPNARROWING_H
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "objectCache.h"
+
+/// Bump when the layout of the cache or the way keys are made changes.
+static const char *CacheVersion = "kale-object-cache-1";
+
+std::unique_ptr<DiskObjectCache>
+DiskObjectCache::create(const std::string &Dir, uint64_t MaxBytes,
+                        const llvm::TargetMachine &TM, std::string &Error) {
+  if (std::error_code EC = llvm::sys::fs::create_directories(Dir)) {
+    Error = "can't create cache directory " + Dir + ": " + EC.message();
+    return nullptr;
+  }
+
+  std::unique_ptr<DiskObjectCache> Cache(new DiskObjectCache(
+      Dir, MaxBytes, std::string(CacheVersion) + '\n' + getTargetKey(TM)));
+  Cache->prune();
+  return Cache;
+}
+
+std::string DiskObjectCache::getTargetKey(const llvm::TargetMachine &TM) {
+  std::string Key;
+  llvm::raw_string_ostream OS(Key);
+  OS << LLVM_VERSION_STRING << '\n' << TM.getTargetTriple().str() << '\n'
+     << TM.getTargetCPU() << '\n' << TM.getTargetFeatureString() << '\n'
+     << int(TM.getOptLevel()) << '\n' << int(TM.getRelocationModel())
+     << '\n';
+  return OS.str();
+}
+
+DiskObjectCache::~DiskObjectCache() {
+  if (Size > MaxBytes)
+    prune();
+}
+
+std::string DiskObjectCache::getKey(const llvm::Module &M) const {
+  llvm::SmallVector<char, 0> Bitcode;
+  llvm::raw_svector_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(M, OS);
+
+  llvm::SHA1 Hash;
+  Hash.update(Target);
+  Hash.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+  return llvm::toHex(Hash.final(), /*LowerCase=*/true);
+}
+
+std::string DiskObjectCache::getPath(const std::string &Key) const {
+  llvm::SmallString<128> Path(Dir);
+  llvm::sys::path::append(Path, Key + ".o");
+  return std::string(Path);
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+DiskObjectCache::getObject(const llvm::Module *M) {
+  std::string Key = getKey(*M);
+  std::string Path = getPath(Key);
+
+  llvm::sys::fs::file_t FD;
+  if (!llvm::sys::fs::openFileForRead(Path, FD)) {
+    auto Obj = llvm::MemoryBuffer::getOpenFile(FD, Path, /*FileSize=*/-1);
+    // Mark the entry as recently used.
+    (void)llvm::sys::fs::setLastAccessAndModificationTime(
+        FD, llvm::sys::TimePoint<>(std::chrono::system_clock::now()));
+    llvm::sys::fs::closeFile(FD);
+    if (Obj) {
+      ++Hits;
+      return std::move(*Obj);
+    }
+  }
+
+  ++Misses;
+  std::lock_guard<std::mutex> Guard(PendingLock);
+  PendingKeys[M] = std::move(Key);
+  return nullptr;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module *M,
+                                           llvm::MemoryBufferRef Obj) {
+  std::string Key;
+  {
+    std::lock_guard<std::mutex> Guard(PendingLock);
+    auto It = PendingKeys.find(M);
+    if (It != PendingKeys.end()) {
+      Key = std::move(It->second);
+      PendingKeys.erase(It);
+    }
+  }
+  if (Key.empty())
+    Key = getKey(*M);
+
+  // Write the entry under a name of its own, then move it into place in one
+  // step, so that no one ever reads half an object. Failing to store an
+  // entry just means it will be compiled again next time.
+  llvm::SmallString<128> Model(Dir), TmpPath;
+  llvm::sys::path::append(Model, "%%%%%%%%%%%%.tmp");
+  int FD;
+  if (llvm::sys::fs::createUniqueFile(Model, FD, TmpPath))
+    return;
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Obj.getBuffer();
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TmpPath);
+      return;
+    }
+  }
+  if (llvm::sys::fs::rename(TmpPath, getPath(Key))) {
+    llvm::sys::fs::remove(TmpPath);
+    return;
+  }
+
+  if ((Size += Obj.getBufferSize()) > MaxBytes)
+    prune();
+}
+
+void DiskObjectCache::prune() {
+  // Whoever is already pruning will get to what this thread has added.
+  std::unique_lock<std::mutex> Guard(PruneLock, std::try_to_lock);
+  if (!Guard.owns_lock())
+    return;
+
+  struct Entry {
+    std::string Path;
+    llvm::sys::TimePoint<> LastUsed;
+    uint64_t Size;
+  };
+  std::vector<Entry> Entries;
+  auto Now = std::chrono::system_clock::now();
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(Dir, EC), End; It != End && !EC;
+       It.increment(EC)) {
+    llvm::StringRef Path = It->path();
+    auto Status = It->status();
+    if (!Status)
+      continue;
+    if (Path.endswith(".tmp")) {
+      // Left behind by a process that died while storing an entry.
+      if (Now - Status->getLastModificationTime() > std::chrono::hours(1))
+        llvm::sys::fs::remove(Path);
+    } else if (Path.endswith(".o")) {
+      Entries.push_back(
+          {Path.str(), Status->getLastModificationTime(), Status->getSize()});
+    }
+  }
+
+  uint64_t Total = 0;
+  for (const Entry &E : Entries)
+    Total += E.Size;
+  if (Total <= MaxBytes) {
+    Size = Total;
+    return;
+  }
+
+  // Keep the most recently used entries that fit in three quarters of the
+  // limit, so that the next prune is some way off.
+  std::sort(Entries.begin(), Entries.end(),
+            [](const Entry &A, const Entry &B) {
+              return A.LastUsed > B.LastUsed;
+            });
+  uint64_t Kept = 0;
+  for (const Entry &E : Entries) {
+    if (Kept + E.Size <= MaxBytes / 4 * 3)
+      Kept += E.Size;
+    else
+      llvm::sys::fs::remove(E.Path);
+  }
+  Size = Kept;
+}
@@ -0,0 +1,77 @@
+#ifndef OBJECTCACHE_H
+#define OBJECTCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+
+/// DiskObjectCache - Object files kept in a directory across runs, so that a
+/// module that has been compiled before is not compiled again. An entry's key
+/// is a hash of the module's bitcode, the target triple, CPU, features and
+/// code generation level, and the LLVM version; the module is looked at
+/// before code generation, which changes it.
+///
+/// Entries are written to a temporary file and renamed into place, so any
+/// number of processes (and threads) can share a directory. Once it grows
+/// past its size limit, the entries used least recently are deleted.
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  /// create - A cache in Dir, which is created if need be, holding at most
+  /// about MaxBytes of objects generated by TM. Returns null and sets Error
+  /// on failure.
+  static std::unique_ptr<DiskObjectCache>
+  create(const std::string &Dir, uint64_t MaxBytes,
+         const llvm::TargetMachine &TM, std::string &Error);
+  ~DiskObjectCache() override;
+
+  /// getObject - The object file for M if it's in the cache, or null.
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+  /// notifyObjectCompiled - Store Obj, the object file just compiled from M.
+  /// Call getObject() for M before compiling it, so that M is hashed as it
+  /// was before code generation.
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override;
+
+  /// getTargetKey - Everything about TM that the code it generates from a
+  /// module depends on, and the LLVM version, as a string.
+  static std::string getTargetKey(const llvm::TargetMachine &TM);
+
+  unsigned getHits() const { return Hits; }
+  unsigned getMisses() const { return Misses; }
+
+private:
+  DiskObjectCache(std::string Dir, uint64_t MaxBytes, std::string Target)
+      : Dir(std::move(Dir)), MaxBytes(MaxBytes), Target(std::move(Target)) {}
+
+  std::string getKey(const llvm::Module &M) const;
+  std::string getPath(const std::string &Key) const;
+
+  /// prune - If the directory holds more than MaxBytes, delete the least
+  /// recently used entries until it's down to three quarters of that.
+  void prune();
+
+  std::string Dir;
+  uint64_t MaxBytes;
+  std::string Target;  // Everything besides the module that goes into a key
+
+  /// PendingKeys - The keys of modules looked up but not yet stored.
+  std::mutex PendingLock;
+  llvm::DenseMap<const llvm::Module *, std::string> PendingKeys;
+
+  std::atomic<unsigned> Hits{0}, Misses{0};
+
+  /// Size - The size of the directory as of the last prune(), plus what has
+  /// been stored since.
+  std::atomic<uint64_t> Size{0};
+  std::mutex PruneLock;
+};
+
+#endif	// OBJECTCACHE_H
@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// ParForChunk - The body of a parfor, as codegen generates it: runs the
+/// trips from Begin up to End with the variables in Env, and returns their
+/// values combined.
+typedef double (*ParForChunk)(void *Env, int64_t Begin, int64_t End);
+
+namespace {
+
+/// ReduceOp - ParForExprAST::ReduceOp, which codegen passes on.
+enum ReduceOp { RO_None, RO_Add, RO_Mul, RO_Min, RO_Max };
+
+double identity(int Op) {
+  switch (Op) {
+  case RO_Add:
+    return -0.0;
+  case RO_Mul:
+    return 1.0;
+  case RO_Min:
+    return INFINITY;
+  case RO_Max:
+    return -INFINITY;
+  default:
+    return 0.0;
+  }
+}
+
+double combine(int Op, double A, double B) {
+  switch (Op) {
+  case RO_Add:
+    return A + B;
+  case RO_Mul:
+    return A * B;
+  case RO_Min:
+    return std::fmin(A, B);
+  case RO_Max:
+    return std::fmax(A, B);
+  default:
+    return 0.0;
+  }
+}
+
+/// MaxTasks - How many tasks a parfor is split into at most, and so how
+/// many results a reduction keeps.
+const int64_t MaxTasks = 4096;
+
+/// Job - One parfor, split into NumChunks chunks of Grain trips (the last
+/// may have fewer). The chunks are run in tasks of ChunksPerTask in a row
+/// (the last may have fewer), each of which combines the results of its
+/// chunks in order into its own slot of Results, if there is a reduction.
+struct Job {
+  ParForChunk Chunk;
+  void *Env;
+  int64_t Begin, End;
+  uint64_t Grain;
+  int64_t NumChunks, ChunksPerTask;
+  int Op;
+  double *Results;
+
+  double runChunk(int64_t C) const {
+    // In unsigned, as End - Begin may not fit in an int64_t.
+    uint64_t From = uint64_t(Begin) + uint64_t(C) * Grain;
+    uint64_t To = From + std::min(Grain, uint64_t(End) - From);
+    return Chunk(Env, int64_t(From), int64_t(To));
+  }
+
+  void run(int64_t T) const {
+    int64_t C = T * ChunksPerTask;
+    int64_t Last = std::min(C + ChunksPerTask, NumChunks);
+    double Result = runChunk(C);
+    while (++C != Last)
+      Result = combine(Op, Result, runChunk(C));
+    if (Results)
+      Results[T] = Result;
+  }
+};
+
+/// ThreadPool - Runs the tasks of a job on a fixed set of workers that
+/// steal from each other. Every worker starts with an even share of the
+/// tasks and takes them from the front; one that runs out takes the back
+/// half of what another has left, so a worker never waits while there are
+/// tasks to run. The thread running the job is worker 0.
+class ThreadPool {
+  /// Worker - The tasks a worker has left, [Next, End).
+  struct alignas(64) Worker {
+    std::mutex Lock;
+    int64_t Next = 0, End = 0;
+  };
+
+  unsigned NumWorkers;
+  std::unique_ptr<Worker[]> Workers;
+  std::vector<std::thread> Threads;
+
+  std::mutex Lock;  // Guards the members below
+  std::condition_variable Started, Finished;
+  const Job *Current = nullptr;
+  uint64_t Generation = 0;  // Of the jobs started
+  unsigned Running = 0;     // Threads still on the current job
+  bool Stopping = false;
+  std::mutex RunLock;  // Held while a job runs
+
+  /// take - The next task worker W has, or -1.
+  int64_t take(unsigned W) {
+    Worker &Own = Workers[W];
+    std::lock_guard<std::mutex> Guard(Own.Lock);
+    return Own.Next < Own.End ? Own.Next++ : -1;
+  }
+
+  /// steal - Move the back half of the tasks another worker has left to
+  /// worker W. Returns false if there are none left anywhere.
+  bool steal(unsigned W) {
+    for (unsigned i = 1; i != NumWorkers; ++i) {
+      Worker &Victim = Workers[(W + i) % NumWorkers];
+      int64_t From, To;
+      {
+        std::lock_guard<std::mutex> Guard(Victim.Lock);
+        int64_t Left = Victim.End - Victim.Next;
+        if (Left <= 0)
+          continue;
+        To = Victim.End;
+        From = Victim.End -= (Left + 1) / 2;
+      }
+      std::lock_guard<std::mutex> Guard(Workers[W].Lock);
+      Workers[W].Next = From;
+      Workers[W].End = To;
+      return true;
+    }
+    return false;
+  }
+
+  void work(unsigned W, const Job &J) {
+    do {
+      for (int64_t T; (T = take(W)) >= 0;)
+        J.run(T);
+    } while (steal(W));
+  }
+
+  void workerMain(unsigned W);
+
+public:
+  explicit ThreadPool(unsigned NumWorkers);
+  ~ThreadPool();
+  unsigned size() const { return NumWorkers; }
+  /// run - Run the NumTasks tasks of J, returning once they're all done.
+  void run(const Job &J, int64_t NumTasks);
+};
+
+/// InPool - Whether this thread is running chunks; a parfor in a chunk
+/// runs on that thread alone.
+thread_local bool InPool = false;
+
+ThreadPool::ThreadPool(unsigned NumWorkers)
+    : NumWorkers(NumWorkers), Workers(new Worker[NumWorkers]) {
+  for (unsigned W = 1; W < NumWorkers; ++W)
+    Threads.emplace_back(&ThreadPool::workerMain, this, W);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Stopping = true;
+  }
+  Started.notify_all();
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+void ThreadPool::workerMain(unsigned W) {
+  InPool = true;
+  uint64_t Seen = 0;
+  std::unique_lock<std::mutex> Guard(Lock);
+  while (true) {
+    Started.wait(Guard, [&] { return Stopping || Generation != Seen; });
+    if (Stopping)
+      return;
+    Seen = Generation;
+    const Job *J = Current;
+    Guard.unlock();
+    work(W, *J);
+    Guard.lock();
+    if (--Running == 0)
+      Finished.notify_one();
+  }
+}
+
+void ThreadPool::run(const Job &J, int64_t NumTasks) {
+  std::lock_guard<std::mutex> RunGuard(RunLock);
+  for (unsigned W = 0; W != NumWorkers; ++W) {
+    std::lock_guard<std::mutex> Guard(Workers[W].Lock);
+    Workers[W].Next = NumTasks * W / NumWorkers;
+    Workers[W].End = NumTasks * (W + 1) / NumWorkers;
+  }
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Current = &J;
+    ++Generation;
+    Running = NumWorkers - 1;
+  }
+  Started.notify_all();
+
+  InPool = true;
+  work(0, J);
+  InPool = false;
+
+  // The job lives on this thread's stack, so wait for the workers to be
+  // done with it.
+  std::unique_lock<std::mutex> Guard(Lock);
+  Finished.wait(Guard, [&] { return Running == 0; });
+  Current = nullptr;
+}
+
+/// getPool - The pool, started on first use with $KALE_THREADS workers, or
+/// one per hardware thread.
+ThreadPool &getPool() {
+  static ThreadPool Pool([] {
+    if (const char *Env = getenv("KALE_THREADS"))
+      if (int N = atoi(Env); N > 0)
+        return unsigned(N);
+    return std::max(1u, std::thread::hardware_concurrency());
+  }());
+  return Pool;
+}
+
+} // end anonymous namespace
+
+/// kale_parfor - Run the trips Begin to End (not included) of a parfor in
+/// chunks of Grain, and combine the chunks' results with Op in the order of
+/// the chunks: those of each task first, then those of the tasks. With
+/// Grain <= 0 there are at most about a thousand chunks, each a task of its
+/// own. Neither the chunks nor the tasks depend on the number of threads, so
+/// neither does the result, reduction included.
+extern "C" DLLEXPORT double kale_parfor(ParForChunk Chunk, void *Env,
+                                        int64_t Begin, int64_t End,
+                                        int64_t Grain, int32_t Op) {
+  // -0 is the identity of + only for combining results; an empty sum is 0.
+  if (End <= Begin)
+    return Op == RO_Add ? 0.0 : identity(Op);
+  uint64_t Trips = uint64_t(End) - uint64_t(Begin);
+  uint64_t Size = Grain > 0 ? uint64_t(Grain) : Trips / 1024 + 1;
+  int64_t NumChunks = int64_t((Trips - 1) / Size + 1);
+  int64_t ChunksPerTask = (NumChunks - 1) / MaxTasks + 1;
+  int64_t NumTasks = (NumChunks - 1) / ChunksPerTask + 1;
+  Job J = {Chunk, Env, Begin, End, Size, NumChunks, ChunksPerTask, Op, nullptr};
+
+  // Without a reduction there is nothing to keep.
+  std::vector<double> Results(Op == RO_None ? 0 : NumTasks);
+  J.Results = Op == RO_None ? nullptr : Results.data();
+  if (NumTasks == 1 || InPool || getPool().size() == 1) {
+    for (int64_t T = 0; T != NumTasks; ++T)
+      J.run(T);
+  } else {
+    getPool().run(J, NumTasks);
+  }
+
+  if (Op == RO_None)
+    return 0.0;
+  double Result = Results[0];
+  for (int64_t T = 1; T != NumTasks; ++T)
+    Result = combine(Op, Result, Results[T]);
+  return Result;
+}
@@ -7,7 +7,26 @@
 #include "parser.h"
 
 
-int Parser::getNextToken() { return _curTok = lex.gettok(); }
+int Parser::getNextToken() { return _curTok = _toks.getKind(++_pos); }
+
+ExprAST *Parser::LogError(const char *Str) {
+    if (!ReportErrors)
+        return nullptr;
+    const SourceBuffer &Src = _toks.getSource();
+    SourceLocation Loc = Src.getLocation(_toks.getOffset(_pos));
+    std::string Where = Src.getName() + ":" + std::to_string(Loc.Line) + ":" +
+                        std::to_string(Loc.Col) + ": ";
+    if (ErrorLog)
+        *ErrorLog += Where;
+    else
+        fputs(Where.c_str(), stderr);
+    return ::LogError(Str);
+}
+
+std::unique_ptr<PrototypeAST> Parser::LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+}
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 int Parser::GetTokPrecedence() {
@@ -15,21 +34,21 @@ int Parser::GetTokPrecedence() {
         return -1;
 
     // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[_curTok];
+    int TokPrec = _ci.BinopPrecedence[_curTok];
     if (TokPrec <= 0)
         return -1;
     return TokPrec;
 }
 
 /// numberexpr ::= number
-std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
-    auto Result = std::make_unique<NumberExprAST>(lex.NumVal);
+ExprAST *Parser::ParseNumberExpr() {
+    auto Result = Arena.make<NumberExprAST>(curNumber());
     getNextToken(); // consume the number
-    return std::move(Result);
+    return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-std::unique_ptr<ExprAST> Parser::ParseParenExpr() {
+ExprAST *Parser::ParseParenExpr() {
     getNextToken(); // eat (.
     auto V = ParseExpression();
     if (!V)
@@ -44,21 +63,34 @@ std::unique_ptr<ExprAST> Parser::ParseParenExpr() {
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
-    std::string IdName = lex.IdentifierStr;
+///   ::= identifier '[' expression ']'
+ExprAST *Parser::ParseIdentifierExpr() {
+    Symbol IdName = curSymbol();
 
     getNextToken(); // eat identifier.
 
+    if (_curTok == '[') {
+        getNextToken(); // eat [
+        auto Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (_curTok != ']')
+            return LogError("Expected ']' after index");
+        getNextToken(); // eat ]
+        return Arena.make<IndexExprAST>(Arena.make<VariableExprAST>(IdName),
+                                        Index);
+    }
+
     if (_curTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
+        return Arena.make<VariableExprAST>(IdName);
 
     // Call.
     getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    llvm::SmallVector<ExprAST *, 8> Args;
     if (_curTok != ')') {
         while (true) {
             if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
+                Args.push_back(Arg);
             else
                 return nullptr;
 
@@ -74,7 +106,7 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
     // Eat the ')'.
     getNextToken();
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
+    return Arena.make<CallExprAST>(IdName, Arena.copyArray<ExprAST *>(Args));
 }
 
 /// primary
@@ -83,8 +115,9 @@ std::unique_ptr<ExprAST> Parser::ParseIdentifierExpr() {
 ///   ::= parenexpr
 ///   ::= ifexpr
 ///   ::= forexpr
+///   ::= parforexpr
 ///   ::= varexpr
-std::unique_ptr<ExprAST> Parser::ParsePrimary() {
+ExprAST *Parser::ParsePrimary() {
     switch (_curTok) {
         default:
             return LogError("unknown token when expecting an expression");
@@ -98,15 +131,18 @@ std::unique_ptr<ExprAST> Parser::ParsePrimary() {
             return ParseIfExpr();
         case tok_for:
             return ParseForExpr();
+        case tok_parfor:
+            return ParseParForExpr();
         case tok_var:
             return ParseVarExpr();
+        case tok_error:
+            return LogError(_toks.getError(_pos));
     }
 }
 
 /// binoprhs
 ///   ::= ('+' primary)*
-std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
-        std::unique_ptr<ExprAST> LHS) {
+ExprAST *Parser::ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
     // If this is a binop, find its precedence.
     while (true) {
         int TokPrec = GetTokPrecedence();
@@ -129,34 +165,55 @@ std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
         // the pending operator take RHS as its LHS.
         int NextPrec = GetTokPrecedence();
         if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+            RHS = ParseBinOpRHS(TokPrec + 1, RHS);
             if (!RHS)
                 return nullptr;
         }
 
         // Merge LHS/RHS.
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS),
-                std::move(RHS));
+        LHS = Arena.make<BinaryExprAST>(BinOp, LHS, RHS);
     }
 }
 
 /// expression
 ///   ::= primary binoprhs
 ///
-std::unique_ptr<ExprAST> Parser::ParseExpression() {
+ExprAST *Parser::ParseExpression() {
     auto LHS = ParseUnary();
     if (!LHS)
         return nullptr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
+}
+
+/// typeannotation ::= ':' ('double' | 'int' | 'bool' | 'double' '*')
+bool Parser::ParseTypeAnnotation(ValueType &Ty) {
+    getNextToken(); // eat ':'.
+    if (_curTok != tok_identifier ||
+        (Ty = lookupTypeName(curSymbol())) == VT_Infer) {
+        LogError("Expected 'double', 'int' or 'bool' after ':'");
+        return false;
+    }
+    getNextToken(); // eat the type.
+
+    if (_curTok == '*') {
+        if (Ty != VT_Double) {
+            LogError("Only 'double' can be pointed to");
+            return false;
+        }
+        Ty = VT_DoublePtr;
+        getNextToken(); // eat '*'.
+    }
+    return true;
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= id '(' param* ')' typeannotation?
+///   ::= binary LETTER number? (param, param) typeannotation?
+///   ::= unary LETTER (param) typeannotation?
+/// param ::= id typeannotation?
 std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
-    std::string FnName;
+    Symbol FnName;
 
     unsigned Kind = 0;  // 0 = identifier, 1 = unary, 2 = binary
     unsigned BinaryPrecedence = 30;
@@ -165,7 +222,7 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
         default:
             return LogErrorP("Expected function name in prototype");
         case tok_identifier:
-            FnName = lex.IdentifierStr;
+            FnName = curSymbol();
             Kind = 0;
             getNextToken();
             break;
@@ -173,8 +230,7 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
             getNextToken();
             if (!isascii(_curTok))
                 return LogErrorP("Expected unary operator");
-            FnName = "unary";
-            FnName += (char) _curTok;
+            FnName = getOperatorSymbol("unary", _curTok);
             Kind = 1;
             getNextToken();
             break;
@@ -182,16 +238,15 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
             getNextToken();
             if (!isascii(_curTok))
                 return LogErrorP("Expected binary operator");
-            FnName = "binary";
-            FnName += (char)_curTok;
+            FnName = getOperatorSymbol("binary", _curTok);
             Kind = 2;
             getNextToken();
 
             // Read the precedence if present
             if (_curTok == tok_number) {
-                if (lex.NumVal < 1 || lex.NumVal > 100)
+                if (curNumber() < 1 || curNumber() > 100)
                     return LogErrorP("Invalid precedence: must be 1..100");
-                BinaryPrecedence = (unsigned) lex.NumVal;
+                BinaryPrecedence = (unsigned) curNumber();
                 getNextToken();
             }
             break;
@@ -200,21 +255,39 @@ std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
     if (_curTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(lex.IdentifierStr);
+    std::vector<Symbol> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    getNextToken(); // eat '('.
+    while (_curTok == tok_identifier) {
+        ArgNames.push_back(curSymbol());
+        ArgTypes.push_back(VT_Double);
+        getNextToken();
+        if (_curTok == ':' && !ParseTypeAnnotation(ArgTypes.back()))
+            return nullptr;
+    }
     if (_curTok != ')')
         return LogErrorP("Expected ')' in prototype");
 
     // success.
     getNextToken(); // eat ')'.
 
+    // The result type. A ':' not followed by a type name starts the body,
+    // as a unary operator.
+    ValueType RetType = VT_Double;
+    if (_curTok == ':' && peekToken() == tok_identifier &&
+        lookupTypeName(_toks.getSymbol(_pos + 1)) != VT_Infer &&
+        !ParseTypeAnnotation(RetType))
+        return nullptr;
+
     // Verify right number of names for operator
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator");
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames), 
+    auto Proto = std::make_unique<PrototypeAST>(FnName, std::move(ArgNames),
             Kind != 0, BinaryPrecedence);
+    Proto->ArgTypes = std::move(ArgTypes);
+    Proto->RetType = RetType;
+    return Proto;
 }
 
 /// definition ::= 'def' prototype expression
@@ -225,7 +298,7 @@ std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
         return nullptr;
 
     if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     return nullptr;
 }
 
@@ -233,9 +306,9 @@ std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
 std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
     if (auto E = ParseExpression()) {
         // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("main",
-                std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        auto Proto = std::make_unique<PrototypeAST>(Symbols.intern("main"),
+                std::vector<Symbol>());
+        return std::make_unique<FunctionAST>(std::move(Proto), E);
     }
     return nullptr;
 }
@@ -246,7 +319,7 @@ std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
     return ParsePrototype();
 }
 
-std::unique_ptr<ExprAST> Parser::ParseIfExpr() {
+ExprAST *Parser::ParseIfExpr() {
   getNextToken();  // eat the if.
 
   // condition.
@@ -271,17 +344,16 @@ std::unique_ptr<ExprAST> Parser::ParseIfExpr() {
   if (!Else)
     return nullptr;
 
-  return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                      std::move(Else));
+  return Arena.make<IfExprAST>(Cond, Then, Else);
 }
 
-std::unique_ptr<ExprAST> Parser::ParseForExpr() {
+ExprAST *Parser::ParseForExpr() {
   getNextToken();  // eat the for.
 
   if (_curTok != tok_identifier)
     return LogError("expected identifier after for");
 
-  std::string IdName = lex.IdentifierStr;
+  Symbol IdName = curSymbol();
   getNextToken();  // eat identifier.
 
   if (_curTok != '=')
@@ -301,7 +373,7 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr() {
     return nullptr;
 
   // The step value is optional.
-  std::unique_ptr<ExprAST> Step;
+  ExprAST *Step = nullptr;
   if (_curTok == ',') {
     getNextToken();
     Step = ParseExpression();
@@ -317,12 +389,70 @@ std::unique_ptr<ExprAST> Parser::ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return std::make_unique<ForExprAST>(IdName, std::move(Start),
-                                       std::move(End), std::move(Step),
-                                       std::move(Body));
+  return Arena.make<ForExprAST>(IdName, Start, End, Step, Body);
+}
+
+ExprAST *Parser::ParseParForExpr() {
+  getNextToken();  // eat the parfor.
+
+  if (_curTok != tok_identifier)
+    return LogError("expected identifier after parfor");
+
+  Symbol IdName = curSymbol();
+  getNextToken();  // eat identifier.
+
+  if (_curTok != '=')
+    return LogError("expected '=' after parfor");
+  getNextToken();  // eat '='.
+
+  auto Start = ParseExpression();
+  if (!Start)
+    return nullptr;
+  if (_curTok != ',')
+    return LogError("expected ',' after parfor start value");
+  getNextToken();
+
+  auto End = ParseExpression();
+  if (!End)
+    return nullptr;
+
+  // 'grain' and 'reduce' are only words here, not keywords.
+  ExprAST *Grain = nullptr;
+  if (_curTok == tok_identifier && Symbols.getName(curSymbol()) == "grain") {
+    getNextToken();  // eat 'grain'.
+    Grain = ParseExpression();
+    if (!Grain)
+      return nullptr;
+  }
+
+  auto Reduce = ParForExprAST::RO_None;
+  if (_curTok == tok_identifier && Symbols.getName(curSymbol()) == "reduce") {
+    getNextToken();  // eat 'reduce'.
+    if (_curTok == '+')
+      Reduce = ParForExprAST::RO_Add;
+    else if (_curTok == '*')
+      Reduce = ParForExprAST::RO_Mul;
+    else if (_curTok == tok_identifier && Symbols.getName(curSymbol()) == "min")
+      Reduce = ParForExprAST::RO_Min;
+    else if (_curTok == tok_identifier && Symbols.getName(curSymbol()) == "max")
+      Reduce = ParForExprAST::RO_Max;
+    else
+      return LogError("expected '+', '*', 'min' or 'max' after reduce");
+    getNextToken();  // eat the operator.
+  }
+
+  if (_curTok != tok_in)
+    return LogError("expected 'in' after parfor");
+  getNextToken();  // eat 'in'.
+
+  auto Body = ParseExpression();
+  if (!Body)
+    return nullptr;
+
+  return Arena.make<ParForExprAST>(IdName, Start, End, Grain, Reduce, Body);
 }
 
-std::unique_ptr<ExprAST> Parser::ParseUnary() {
+ExprAST *Parser::ParseUnary() {
     // If the current token is not an operator, it must be a primary expr
     if (!isascii(_curTok) || _curTok == '(' || _curTok == ',')
         return ParsePrimary();
@@ -331,29 +461,34 @@ std::unique_ptr<ExprAST> Parser::ParseUnary() {
     int Opc = _curTok;
     getNextToken();
     if (auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+        return Arena.make<UnaryExprAST>(Opc, Operand);
     return nullptr;
 }
 
-std::unique_ptr<ExprAST> Parser::ParseVarExpr() {
+ExprAST *Parser::ParseVarExpr() {
     getNextToken();  // eat the 'var'
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    llvm::SmallVector<std::pair<Symbol, ExprAST *>, 4> VarNames;
+    llvm::SmallVector<ValueType, 4> VarTypes;
 
     // At least one variable name is required
     if (_curTok != tok_identifier)
         return LogError("expected identifier after var");
 
     while(1) {
-        std::string Name = lex.IdentifierStr;
+        Symbol Name = curSymbol();
         getNextToken();  // eat identifier
-        std::unique_ptr<ExprAST> Init;
+        ValueType Type = VT_Infer;
+        if (_curTok == ':' && !ParseTypeAnnotation(Type))
+            return nullptr;
+        ExprAST *Init = nullptr;
         if (_curTok == '=') {
           getNextToken();  // eat the '='
           Init = ParseExpression();
           if (!Init) return nullptr;
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarNames.push_back(std::make_pair(Name, Init));
+        VarTypes.push_back(Type);
         if (_curTok != ',') break;
         getNextToken();  // eat the ','
 
@@ -369,5 +504,7 @@ std::unique_ptr<ExprAST> Parser::ParseVarExpr() {
     if (!Body)
         return nullptr;
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return Arena.make<VarExprAST>(
+            Arena.copyArray<std::pair<Symbol, ExprAST *>>(VarNames),
+            Arena.copyArray<ValueType>(VarTypes), Body);
 }
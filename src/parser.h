@@ -6,50 +6,82 @@
 #include <cstdio>
 #include <string>
 #include "ast.h"
+#include "compilerInstance.h"
 #include "lexer.h"
+#include "tokenStream.h"
 
 class Parser {
+    private:
+        CompilerInstance &_ci;  // Holds the operator precedences
+        TokenStream &_toks;
+        size_t _pos;    // Index of _curTok in _toks
     public:
         int _curTok;
         int getNextToken();
-        Lexer lex;
 
-        /// BinopPrecedence - This holds the precedence for each binary operator that is
-        /// defined.
-//        std::map<char, int> _binopPrecedence;
+        /// Parse the tokens of Toks starting at index Begin, for the
+        /// compilation CI. The first getNextToken() call makes token Begin
+        /// current.
+        Parser(CompilerInstance &CI, TokenStream &Toks, size_t Begin = 0)
+            : _ci(CI), _toks(Toks), _pos(Begin - 1) {}
+
+        /// Arena - Owns the expression nodes of the item being parsed. The
+        /// driver resets it once the item has been code generated.
+        ASTArena Arena;
+
+        /// peekToken - Look N tokens past the current one without consuming.
+        int peekToken(unsigned N = 1) { return _toks.getKind(_pos + N); }
+        /// getTokIndex - Index of the current token in the stream.
+        size_t getTokIndex() const { return _pos; }
+
+        /// Payload of the current token.
+        Symbol curSymbol() { return _toks.getSymbol(_pos); }
+        double curNumber() { return _toks.getNumber(_pos); }
+
+        /// ReportErrors - When false, parse errors are not printed. Used when
+        /// the same tokens will be parsed again for real later on.
+        bool ReportErrors = true;
+
+        /// LogError* - Report an error at the current token's location.
+        ExprAST *LogError(const char *Str);
+        std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
 
         /// GetTokPrecedence - Get the precedence of the pending binary operator token.
         int GetTokPrecedence();
 
         /// numberexpr ::= number
-        std::unique_ptr<ExprAST> ParseNumberExpr();
+        ExprAST *ParseNumberExpr();
 
         /// parenexpr ::= '(' expression ')'
-        std::unique_ptr<ExprAST> ParseParenExpr();
+        ExprAST *ParseParenExpr();
 
         /// identifierexpr
         ///   ::= identifier
         ///   ::= identifier '(' expression* ')'
-        std::unique_ptr<ExprAST> ParseIdentifierExpr();
+        ///   ::= identifier '[' expression ']'
+        ExprAST *ParseIdentifierExpr();
 
         /// primary
         ///   ::= identifierexpr
         ///   ::= numberexpr
         ///   ::= parenexpr
-        std::unique_ptr<ExprAST> ParsePrimary();
+        ExprAST *ParsePrimary();
 
         /// binoprhs
         ///   ::= ('+' primary)*
-        std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                std::unique_ptr<ExprAST> LHS);
+        ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
 
         /// expression
         ///   ::= primary binoprhs
         ///
-        std::unique_ptr<ExprAST> ParseExpression();
+        ExprAST *ParseExpression();
+
+        /// typeannotation ::= ':' ('double' | 'int' | 'bool' | 'double' '*')
+        bool ParseTypeAnnotation(ValueType &Ty);
 
         /// prototype
-        ///   ::= id '(' id* ')'
+        ///   ::= id '(' param* ')' typeannotation?
+        /// param ::= id typeannotation?
         std::unique_ptr<PrototypeAST> ParsePrototype();
 
         /// definition ::= 'def' prototype expression
@@ -62,19 +94,24 @@ class Parser {
         std::unique_ptr<PrototypeAST> ParseExtern();
 
         /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-        std::unique_ptr<ExprAST> ParseIfExpr();
+        ExprAST *ParseIfExpr();
 
         /// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-        std::unique_ptr<ExprAST> ParseForExpr();
+        ExprAST *ParseForExpr();
+
+        /// parforexpr ::= 'parfor' identifier '=' expr ',' expr
+        ///     ('grain' expr)? ('reduce' ('+' | '*' | 'min' | 'max'))?
+        ///     'in' expression
+        ExprAST *ParseParForExpr();
 
         /// unary
         ///   ::= primary
         ///   ::= '!' unary
-        std::unique_ptr<ExprAST> ParseUnary();
+        ExprAST *ParseUnary();
 
-        /// varexpr ::= 'var' identifier ('=' expression)?
-        ///                   (',' identifier ('=' expression)?)* 'in' expression
-        std::unique_ptr<ExprAST> ParseVarExpr();
+        /// varexpr ::= 'var' identifier typeannotation? ('=' expression)?
+        ///     (',' identifier typeannotation? ('=' expression)?)* 'in' expression
+        ExprAST *ParseVarExpr();
 };
 
 #endif	// PARSER_H
@@ -0,0 +1,180 @@
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "scan.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+static inline bool isSpaceByte(unsigned char C) {
+    return C == ' ' || (C >= '\t' && C <= '\r');
+}
+
+static inline bool isEOLByte(char C) { return C == '\n' || C == '\r'; }
+
+static const char *skipSpaceScalar(const char *P, const char *End) {
+    while (P != End && isSpaceByte(*P))
+        ++P;
+    return P;
+}
+
+static const char *skipLineScalar(const char *P, const char *End) {
+    while (P != End && !isEOLByte(*P))
+        ++P;
+    return P;
+}
+
+#ifdef __SSE2__
+// Bytes >= 0x80 are negative as signed chars, so the signed range check for
+// '\t'..'\r' can't misfire on them.
+
+static const char *skipSpaceSSE2(const char *P, const char *End) {
+    const __m128i Space = _mm_set1_epi8(' ');
+    const __m128i Lo = _mm_set1_epi8('\t' - 1), Hi = _mm_set1_epi8('\r' + 1);
+    while (End - P >= 16) {
+        __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+        __m128i Ctl = _mm_and_si128(_mm_cmpgt_epi8(V, Lo), _mm_cmplt_epi8(V, Hi));
+        __m128i Ws = _mm_or_si128(_mm_cmpeq_epi8(V, Space), Ctl);
+        unsigned Other = ~_mm_movemask_epi8(Ws) & 0xFFFF;
+        if (Other)
+            return P + __builtin_ctz(Other);
+        P += 16;
+    }
+    return skipSpaceScalar(P, End);
+}
+
+static const char *skipLineSSE2(const char *P, const char *End) {
+    const __m128i NL = _mm_set1_epi8('\n'), CR = _mm_set1_epi8('\r');
+    while (End - P >= 16) {
+        __m128i V = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+        unsigned EOL = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(V, NL), _mm_cmpeq_epi8(V, CR)));
+        if (EOL)
+            return P + __builtin_ctz(EOL);
+        P += 16;
+    }
+    return skipLineScalar(P, End);
+}
+
+__attribute__((target("avx2")))
+static const char *skipSpaceAVX2(const char *P, const char *End) {
+    const __m256i Space = _mm256_set1_epi8(' ');
+    const __m256i Lo = _mm256_set1_epi8('\t' - 1), Hi = _mm256_set1_epi8('\r' + 1);
+    while (End - P >= 32) {
+        __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+        __m256i Ctl = _mm256_and_si256(_mm256_cmpgt_epi8(V, Lo),
+                                       _mm256_cmpgt_epi8(Hi, V));
+        __m256i Ws = _mm256_or_si256(_mm256_cmpeq_epi8(V, Space), Ctl);
+        unsigned Other = ~(unsigned)_mm256_movemask_epi8(Ws);
+        if (Other)
+            return P + __builtin_ctz(Other);
+        P += 32;
+    }
+    return skipSpaceSSE2(P, End);
+}
+
+__attribute__((target("avx2")))
+static const char *skipLineAVX2(const char *P, const char *End) {
+    const __m256i NL = _mm256_set1_epi8('\n'), CR = _mm256_set1_epi8('\r');
+    while (End - P >= 32) {
+        __m256i V = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+        unsigned EOL = _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(V, NL), _mm256_cmpeq_epi8(V, CR)));
+        if (EOL)
+            return P + __builtin_ctz(EOL);
+        P += 32;
+    }
+    return skipLineSSE2(P, End);
+}
+#endif
+
+typedef const char *(*ScanFn)(const char *, const char *);
+
+static ScanFn selectSkipSpace() {
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("avx2"))
+        return skipSpaceAVX2;
+    return skipSpaceSSE2;
+#else
+    return skipSpaceScalar;
+#endif
+}
+
+static ScanFn selectSkipLine() {
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("avx2"))
+        return skipLineAVX2;
+    return skipLineSSE2;
+#else
+    return skipLineScalar;
+#endif
+}
+
+static const ScanFn SkipSpaceImpl = selectSkipSpace();
+static const ScanFn SkipLineImpl = selectSkipLine();
+
+const char *skipSpace(const char *P, const char *End) {
+    // Most runs are a single separating space; don't pay for a block load.
+    if (P == End || !isSpaceByte(*P))
+        return P;
+    if (++P == End || !isSpaceByte(*P))
+        return P;
+    return SkipSpaceImpl(P, End);
+}
+
+const char *skipLine(const char *P, const char *End) {
+    return SkipLineImpl(P, End);
+}
+
+bool parseNumber(const char *P, const char *End, double &Val) {
+    // The lexer only hands us [0-9.]+, so all that can be wrong is the number
+    // of dots or the absence of digits.
+    uint64_t Digits = 0;
+    unsigned NumDigits = 0, FracDigits = 0;
+    bool SawDot = false;
+    for (const char *Q = P; Q != End; ++Q) {
+        if (*Q == '.') {
+            if (SawDot)
+                return false;
+            SawDot = true;
+            continue;
+        }
+        Digits = Digits * 10 + (*Q - '0');
+        ++NumDigits;
+        FracDigits += SawDot;
+    }
+    if (NumDigits == 0)
+        return false;
+
+    // Fast path: up to 15 digits fit exactly in a double, as do the powers of
+    // ten up to 1e22, so one IEEE division gives the correctly rounded value.
+    if (NumDigits <= 15) {
+        static const double Pow10[] = {1e0, 1e1, 1e2,  1e3,  1e4,  1e5,
+                                       1e6, 1e7, 1e8,  1e9,  1e10, 1e11,
+                                       1e12, 1e13, 1e14, 1e15};
+        Val = (double)Digits / Pow10[FracDigits];
+        return true;
+    }
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    auto Res = std::from_chars(P, End, Val);
+    if (Res.ec != std::errc::result_out_of_range)
+        return Res.ec == std::errc() && Res.ptr == End;
+    // Out of range: let strtod produce the saturated value below.
+#endif
+
+    // strtod needs a terminator; long literals are rare enough to allocate.
+    char Buf[128];
+    size_t Len = End - P;
+    if (Len < sizeof(Buf)) {
+        memcpy(Buf, P, Len);
+        Buf[Len] = '\0';
+        Val = strtod(Buf, nullptr);
+    } else {
+        Val = strtod(std::string(P, End).c_str(), nullptr);
+    }
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/// Block scanners used by the lexer's inner loops. Each one looks at 16 or 32
+/// bytes per step where the CPU allows (SSE2/AVX2, picked at startup) and falls
+/// back to a byte loop otherwise. All of them stop at End.
+
+/// skipSpace - Return the first byte in [P, End) that isn't whitespace.
+const char *skipSpace(const char *P, const char *End);
+
+/// skipLine - Return the first '\n' or '\r' in [P, End), or End.
+const char *skipLine(const char *P, const char *End);
+
+/// parseNumber - Parse a number literal spelled exactly by [P, End). Returns
+/// false if the text isn't a well-formed literal (e.g. "1.2.3" or ".").
+bool parseNumber(const char *P, const char *End, double &Val);
+
+#endif	// SCAN_H
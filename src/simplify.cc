@@ -0,0 +1,564 @@
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <utility>
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "simplify.h"
+
+namespace {
+
+/// isTrue - Whether V counts as true in a condition, as codegen's fcmp one
+/// with 0 has it: NaN doesn't.
+bool isTrue(double V) { return V < 0 || V > 0; }
+
+/// AssignmentCollector - Finds the variables an expression stores to.
+class AssignmentCollector : public ExprVisitor<AssignmentCollector> {
+  llvm::DenseSet<Symbol> &Assigned;
+
+public:
+  explicit AssignmentCollector(llvm::DenseSet<Symbol> &Assigned)
+      : Assigned(Assigned) {}
+
+  void visitNumberExpr(NumberExprAST *e) {}
+  void visitVariableExpr(VariableExprAST *e) {}
+  void visitBinaryExpr(BinaryExprAST *e) {
+    if (e->Op == '=')
+      if (auto *Var = llvm::dyn_cast<VariableExprAST>(e->LHS))
+        Assigned.insert(Var->Name);
+    visit(e->LHS);
+    visit(e->RHS);
+  }
+  void visitCallExpr(CallExprAST *e) {
+    for (ExprAST *Arg : e->Args)
+      visit(Arg);
+  }
+  void visitIfExpr(IfExprAST *e) {
+    visit(e->Cond);
+    visit(e->Then);
+    visit(e->Else);
+  }
+  void visitForExpr(ForExprAST *e) {
+    visit(e->Start);
+    visit(e->End);
+    if (e->Step)
+      visit(e->Step);
+    visit(e->Body);
+  }
+  void visitUnaryExpr(UnaryExprAST *e) { visit(e->Operand); }
+  void visitVarExpr(VarExprAST *e) {
+    for (auto &Var : e->VarNames)
+      if (Var.second)
+        visit(Var.second);
+    visit(e->Body);
+  }
+  void visitIndexExpr(IndexExprAST *e) {
+    visit(e->Array);
+    visit(e->Index);
+  }
+  void visitParForExpr(ParForExprAST *e) {
+    visit(e->Start);
+    visit(e->End);
+    if (e->Grain)
+      visit(e->Grain);
+    visit(e->Body);
+  }
+};
+
+/// ExprCloner - Deep copies an expression into Arena, renaming the variables
+/// in Renames, and notes what it finds on the way.
+class ExprCloner : public ExprVisitor<ExprCloner, ExprAST *> {
+  ASTArena &Arena;
+  const llvm::DenseMap<Symbol, Symbol> *Renames;
+
+  Symbol rename(Symbol Name) {
+    if (Renames) {
+      auto It = Renames->find(Name);
+      if (It != Renames->end())
+        return It->second;
+    }
+    return Name;
+  }
+
+public:
+  llvm::DenseSet<Symbol> *Assigned = nullptr;  // Gets what '=' stores to
+  llvm::DenseMap<Symbol, unsigned> Reads;  // Uses of each variable
+  unsigned Nodes = 0;
+  bool HasCalls = false;  // Calls a function or operator, loops or indexes
+  bool HasBindings = false;  // Has a for or a var/in
+
+  explicit ExprCloner(ASTArena &Arena,
+                      const llvm::DenseMap<Symbol, Symbol> *Renames = nullptr)
+      : Arena(Arena), Renames(Renames) {}
+
+  ExprAST *visitNumberExpr(NumberExprAST *e) {
+    ++Nodes;
+    return Arena.make<NumberExprAST>(e->Val);
+  }
+  ExprAST *visitVariableExpr(VariableExprAST *e) {
+    ++Nodes;
+    Symbol Name = rename(e->Name);
+    ++Reads[Name];
+    return Arena.make<VariableExprAST>(Name);
+  }
+  ExprAST *visitBinaryExpr(BinaryExprAST *e) {
+    ++Nodes;
+    if (!strchr("=+-*<", e->Op))
+      HasCalls = true;
+    ExprAST *LHS = visit(e->LHS);
+    if (e->Op == '=' && Assigned)
+      if (auto *Var = llvm::dyn_cast<VariableExprAST>(LHS))
+        Assigned->insert(Var->Name);
+    return Arena.make<BinaryExprAST>(e->Op, LHS, visit(e->RHS));
+  }
+  ExprAST *visitCallExpr(CallExprAST *e) {
+    ++Nodes;
+    HasCalls = true;
+    llvm::SmallVector<ExprAST *, 4> Args;
+    for (ExprAST *Arg : e->Args)
+      Args.push_back(visit(Arg));
+    return Arena.make<CallExprAST>(e->Callee,
+                                   Arena.copyArray<ExprAST *>(Args));
+  }
+  ExprAST *visitIfExpr(IfExprAST *e) {
+    ++Nodes;
+    ExprAST *Cond = visit(e->Cond);
+    ExprAST *Then = visit(e->Then);
+    return Arena.make<IfExprAST>(Cond, Then, visit(e->Else));
+  }
+  ExprAST *visitForExpr(ForExprAST *e) {
+    ++Nodes;
+    HasCalls = HasBindings = true;
+    ExprAST *Start = visit(e->Start);
+    ExprAST *End = visit(e->End);
+    ExprAST *Step = e->Step ? visit(e->Step) : nullptr;
+    return Arena.make<ForExprAST>(rename(e->VarName), Start, End, Step,
+                                  visit(e->Body));
+  }
+  ExprAST *visitUnaryExpr(UnaryExprAST *e) {
+    ++Nodes;
+    HasCalls = true;
+    return Arena.make<UnaryExprAST>(e->Opcode, visit(e->Operand));
+  }
+  ExprAST *visitVarExpr(VarExprAST *e) {
+    ++Nodes;
+    HasBindings = true;
+    llvm::SmallVector<std::pair<Symbol, ExprAST *>, 4> Vars;
+    for (auto &Var : e->VarNames)
+      Vars.push_back({rename(Var.first),
+                      Var.second ? visit(Var.second) : nullptr});
+    return Arena.make<VarExprAST>(
+        Arena.copyArray<std::pair<Symbol, ExprAST *>>(Vars),
+        Arena.copyArray<ValueType>(e->VarTypes), visit(e->Body));
+  }
+  ExprAST *visitIndexExpr(IndexExprAST *e) {
+    ++Nodes;
+    // Only typed code has arrays, and operators declaring types aren't
+    // inlined, so inlining one that indexes would turn an error into code.
+    HasCalls = true;
+    ExprAST *Array = visit(e->Array);
+    return Arena.make<IndexExprAST>(Array, visit(e->Index));
+  }
+  ExprAST *visitParForExpr(ParForExprAST *e) {
+    ++Nodes;
+    HasCalls = HasBindings = true;
+    ExprAST *Start = visit(e->Start);
+    ExprAST *End = visit(e->End);
+    ExprAST *Grain = e->Grain ? visit(e->Grain) : nullptr;
+    return Arena.make<ParForExprAST>(rename(e->VarName), Start, End, Grain,
+                                     e->Reduce, visit(e->Body));
+  }
+};
+
+} // end anonymous namespace
+
+void ASTSimplifier::simplify(FunctionAST &F, CompilerInstance &CI,
+                             ASTArena &Arena) {
+  PrototypeAST &P = *F.Proto;
+  // The body sees the operator's previous definition, if any, as a call.
+  CI.InlineOperators.erase(P.Name);
+
+  ASTSimplifier S(CI, Arena, P);
+  AssignmentCollector(S.Assigned).visit(F.Body);
+  llvm::SmallVector<Binding, 4> Args(P.Args.size());
+  for (size_t i = 0, e = Args.size(); i != e; ++i) {
+    Args[i].Name = P.Args[i];
+    S.bind(Args[i]);
+  }
+  F.Body = S.visit(F.Body);
+
+  if ((P.isUnaryOp() || P.isBinaryOp()) && !S.Errors)
+    S.rememberOperator(P, F.Body);
+}
+
+void ASTSimplifier::rememberOperator(const PrototypeAST &P, ExprAST *Body) {
+  // Calls convert the operands to the declared types, which a var/in
+  // binding them wouldn't.
+  if (P.isTyped())
+    return;
+
+  // Parameters get names with a '.' in them, which no variable can have, so
+  // inlined bodies can't capture or be captured by the caller's variables.
+  InlineOperator Op;
+  llvm::DenseMap<Symbol, Symbol> Renames;
+  for (Symbol Arg : P.Args) {
+    Symbol Param =
+        Symbols.intern(P.getName() + "." + Symbols.getName(Arg));
+    Renames[Arg] = Param;
+    Op.Params.push_back(Param);
+  }
+  ExprCloner Cloner(CI.OperatorArena, &Renames);
+  Op.Body = Cloner.visit(Body);
+  if (Cloner.Nodes > MaxInlineNodes || Cloner.HasCalls)
+    return;
+  for (Symbol Param : Op.Params)
+    Op.UsedOnce.push_back(!Cloner.HasBindings &&
+                          Cloner.Reads.lookup(Param) == 1);
+  CI.InlineOperators[P.Name] = std::move(Op);
+}
+
+bool ASTSimplifier::isDeclared(Symbol Name, size_t NumArgs) const {
+  if (Name == Proto.Name)
+    return Proto.Args.size() == NumArgs;
+  auto It = CI.FunctionProtos.find(Name);
+  return It != CI.FunctionProtos.end() &&
+         It->second->Args.size() == NumArgs;
+}
+
+void ASTSimplifier::bind(Binding &B) {
+  Binding *&Slot = Scope[B.Name];
+  B.Shadowed = Slot;
+  Slot = &B;
+}
+
+void ASTSimplifier::unbind(Binding &B) {
+  if (B.Shadowed)
+    Scope[B.Name] = B.Shadowed;
+  else
+    Scope.erase(B.Name);
+}
+
+void ASTSimplifier::setValue(Binding &B, ExprAST *Val) {
+  // An array bound to anything else is an error for codegen to report.
+  if (Assigned.count(B.Name) || B.Type == VT_DoublePtr)
+    return;
+  if (auto *Num = llvm::dyn_cast<NumberExprAST>(Val)) {
+    // A declared type may change the number, e.g. to 1 for a bool.
+    if (B.Type == VT_Int && !NumberExprAST::isIntegral(Num->Val))
+      return;
+    if (B.Type == VT_Bool && Num->Val != 1 &&
+        !(Num->Val == 0 && NumberExprAST::isIntegral(Num->Val)))
+      return;
+    B.Value = Val;
+  } else if (auto *Var = llvm::dyn_cast<VariableExprAST>(Val)) {
+    // Another variable's type may not be the one declared.
+    if (B.Type != VT_Infer)
+      return;
+    // Uses of B are only replaced where Var still means the same variable.
+    Binding *Source = Scope.lookup(Var->Name);
+    if (Source && !Assigned.count(Var->Name)) {
+      B.Value = Val;
+      B.Source = Source;
+    }
+  }
+}
+
+ExprAST *ASTSimplifier::finishVar(llvm::MutableArrayRef<Binding> Vars,
+                                  ExprAST *Body) {
+  llvm::SmallVector<std::pair<Symbol, ExprAST *>, 4> Kept;
+  llvm::SmallVector<ValueType, 4> KeptTypes;
+  for (Binding &B : Vars)
+    if (B.Uses || !B.Pure) {
+      Kept.push_back({B.Name, B.Init});
+      KeptTypes.push_back(B.Type);
+    }
+  if (Kept.empty())
+    return Body;
+  return Arena.make<VarExprAST>(
+      Arena.copyArray<std::pair<Symbol, ExprAST *>>(Kept),
+      Arena.copyArray<ValueType>(KeptTypes), Body);
+}
+
+ExprAST *ASTSimplifier::inlineOperator(const InlineOperator &Op,
+                                       llvm::ArrayRef<ExprAST *> Operands,
+                                       llvm::ArrayRef<bool> Pure) {
+  // Op(a, b) is var Op.LHS = a, Op.RHS = b in Body, which evaluates the
+  // operands once, in order, like the call did.
+  ExprCloner Cloner(Arena);
+  Cloner.Assigned = &Assigned;
+  ExprAST *Body = Cloner.visit(Op.Body);
+
+  llvm::SmallVector<Binding, 2> Params(Operands.size());
+  for (size_t i = 0, e = Params.size(); i != e; ++i) {
+    Params[i].Name = Op.Params[i];
+    Params[i].Init = Operands[i];
+    Params[i].Pure = Pure[i];
+    setValue(Params[i], Operands[i]);
+    // An operand can be evaluated where the body uses it instead, if it has
+    // no side effects and none of the operands after it do either; the body
+    // can't store to the variables it reads, having none but its own.
+    if (!Params[i].Value && Op.UsedOnce[i] &&
+        llvm::all_of(Pure.drop_front(i), [](bool P) { return P; })) {
+      Params[i].Value = Operands[i];
+      Params[i].Forward = true;
+    }
+    bind(Params[i]);
+  }
+  Body = visit(Body);
+  for (size_t i = Params.size(); i != 0; --i)
+    unbind(Params[i - 1]);
+  return finishVar(Params, Body);
+}
+
+ExprAST *ASTSimplifier::visitVariableExpr(VariableExprAST *e) {
+  Binding *B = Scope.lookup(e->Name);
+  if (!B) {
+    ++Errors;  // Unknown variable name
+    return e;
+  }
+  if (B->Forward) {
+    B->Forward = false;
+    return std::exchange(B->Value, nullptr);
+  }
+  if (auto *Val = llvm::dyn_cast_or_null<NumberExprAST>(B->Value))
+    return makeNumber(Val->Val);
+  if (B->Source && Scope.lookup(B->Source->Name) == B->Source) {
+    ++B->Source->Uses;
+    return Arena.make<VariableExprAST>(B->Source->Name);
+  }
+  ++B->Uses;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitBinaryExpr(BinaryExprAST *e) {
+  if (e->Op == '=') {
+    if (llvm::isa<IndexExprAST>(e->LHS)) {
+      e->LHS = visit(e->LHS);
+      e->RHS = visit(e->RHS);
+      ++Effects;
+      return e;
+    }
+    auto *LHSE = llvm::dyn_cast<VariableExprAST>(e->LHS);
+    if (!LHSE) {
+      ++Errors;
+      return e;
+    }
+    e->RHS = visit(e->RHS);
+    if (Binding *B = Scope.lookup(LHSE->Name))
+      ++B->Uses;
+    else
+      ++Errors;
+    ++Effects;
+    return e;
+  }
+
+  unsigned Effects0 = Effects, Errors0 = Errors;
+  e->LHS = visit(e->LHS);
+  bool LHSPure = Effects == Effects0 && Errors == Errors0;
+  Effects0 = Effects, Errors0 = Errors;
+  e->RHS = visit(e->RHS);
+  bool RHSPure = Effects == Effects0 && Errors == Errors0;
+
+  auto *L = llvm::dyn_cast<NumberExprAST>(e->LHS);
+  auto *R = llvm::dyn_cast<NumberExprAST>(e->RHS);
+  switch (e->Op) {
+  case '+':
+    if (L && R)
+      return makeNumber(L->Val + R->Val);
+    // x + -0 is x, even for x = -0; x + 0 isn't.
+    if (R && R->Val == 0 && std::signbit(R->Val))
+      return e->LHS;
+    if (L && L->Val == 0 && std::signbit(L->Val))
+      return e->RHS;
+    return e;
+  case '-':
+    if (L && R)
+      return makeNumber(L->Val - R->Val);
+    if (R && R->Val == 0 && !std::signbit(R->Val))
+      return e->LHS;
+    return e;
+  case '*':
+    if (L && R)
+      return makeNumber(L->Val * R->Val);
+    if (R && R->Val == 1)
+      return e->LHS;
+    if (L && L->Val == 1)
+      return e->RHS;
+    return e;
+  case '<':
+    // Unordered operands compare less, as with codegen's fcmp ult.
+    if (L && R)
+      return makeNumber(!(L->Val >= R->Val));
+    return e;
+  default:
+    break;
+  }
+
+  Symbol Name = getOperatorSymbol("binary", e->Op);
+  auto It = CI.InlineOperators.find(Name);
+  if (It != CI.InlineOperators.end())
+    return inlineOperator(It->second, {e->LHS, e->RHS}, {LHSPure, RHSPure});
+  if (!isDeclared(Name, 2))
+    ++Errors;
+  ++Effects;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitIndexExpr(IndexExprAST *e) {
+  e->Array = visit(e->Array);
+  e->Index = visit(e->Index);
+  // A load isn't a side effect, but it can't be moved past a store either.
+  ++Effects;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitCallExpr(CallExprAST *e) {
+  for (ExprAST *&Arg : e->Args)
+    Arg = visit(Arg);
+  if (!isDeclared(e->Callee, e->Args.size()))
+    ++Errors;
+  ++Effects;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitIfExpr(IfExprAST *e) {
+  unsigned Effects0 = Effects, Errors0 = Errors;
+  e->Cond = visit(e->Cond);
+  bool CondPure = Effects == Effects0 && Errors == Errors0;
+
+  Effects0 = Effects, Errors0 = Errors;
+  e->Then = visit(e->Then);
+  unsigned ThenEffects = Effects - Effects0, ThenErrors = Errors - Errors0;
+  Effects0 = Effects, Errors0 = Errors;
+  e->Else = visit(e->Else);
+  unsigned ElseEffects = Effects - Effects0, ElseErrors = Errors - Errors0;
+
+  // The arm not taken goes, unless codegen has errors to report in it.
+  if (auto *Cond = llvm::dyn_cast<NumberExprAST>(e->Cond)) {
+    if (isTrue(Cond->Val) && !ElseErrors) {
+      Effects -= ElseEffects;
+      return e->Then;
+    }
+    if (!isTrue(Cond->Val) && !ThenErrors) {
+      Effects -= ThenEffects;
+      return e->Else;
+    }
+    return e;
+  }
+
+  auto *Then = llvm::dyn_cast<NumberExprAST>(e->Then);
+  auto *Else = llvm::dyn_cast<NumberExprAST>(e->Else);
+  if (CondPure && Then && Else &&
+      memcmp(&Then->Val, &Else->Val, sizeof(double)) == 0)
+    return Then;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitForExpr(ForExprAST *e) {
+  e->Start = visit(e->Start);
+
+  // The end condition is first evaluated with the variable still at Start,
+  // after the body. If it's false then, the loop runs just once.
+  Binding Var;
+  Var.Name = e->VarName;
+  bool RunsOnce = false;
+  if (llvm::isa<NumberExprAST>(e->Start) && !Assigned.count(e->VarName)) {
+    unsigned Effects0 = Effects, Errors0 = Errors;
+    Var.Value = e->Start;
+    bind(Var);
+    ExprAST *End = visit(ExprCloner(Arena).visit(e->End));
+    unbind(Var);
+    Effects = Effects0, Errors = Errors0;  // The copy is thrown away
+
+    auto *EndVal = llvm::dyn_cast<NumberExprAST>(End);
+    RunsOnce = EndVal && !isTrue(EndVal->Val);
+    if (!RunsOnce)
+      Var.Value = nullptr;
+  }
+
+  bind(Var);
+  unsigned Effects0 = Effects, Errors0 = Errors;
+  e->Body = visit(e->Body);
+  bool BodyPure = Effects == Effects0 && Errors == Errors0;
+  Effects0 = Effects, Errors0 = Errors;
+  if (e->Step)
+    e->Step = visit(e->Step);
+  bool StepPure = Effects == Effects0 && Errors == Errors0;
+  e->End = visit(e->End);
+  unbind(Var);
+
+  if (!RunsOnce) {
+    ++Effects;  // It may never finish
+    return e;
+  }
+
+  // for x = Start, End, Step in Body is then
+  //   var x = Start, for.body = Body, for.step = Step in 0
+  // and End, which evaluates to false without side effects, is dropped.
+  Binding Vars[3];
+  Vars[0].Name = e->VarName;
+  Vars[0].Init = e->Start;
+  Vars[0].Uses = Var.Uses;
+  Vars[1].Name = Symbols.intern("for.body");
+  Vars[1].Init = e->Body;
+  Vars[1].Pure = BodyPure;
+  Vars[2].Name = Symbols.intern("for.step");
+  Vars[2].Init = e->Step;
+  Vars[2].Pure = StepPure;
+  return finishVar(Vars, makeNumber(0));
+}
+
+ExprAST *ASTSimplifier::visitUnaryExpr(UnaryExprAST *e) {
+  unsigned Effects0 = Effects, Errors0 = Errors;
+  e->Operand = visit(e->Operand);
+  bool Pure = Effects == Effects0 && Errors == Errors0;
+
+  Symbol Name = getOperatorSymbol("unary", e->Opcode);
+  auto It = CI.InlineOperators.find(Name);
+  if (It != CI.InlineOperators.end())
+    return inlineOperator(It->second, e->Operand, Pure);
+  if (!isDeclared(Name, 1))
+    ++Errors;
+  ++Effects;
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitParForExpr(ParForExprAST *e) {
+  e->Start = visit(e->Start);
+  e->End = visit(e->End);
+  if (e->Grain)
+    e->Grain = visit(e->Grain);
+
+  Binding Var;
+  Var.Name = e->VarName;
+  Var.Type = VT_Int;
+  bind(Var);
+  e->Body = visit(e->Body);
+  unbind(Var);
+  ++Effects;  // Like a loop, it may never finish
+  return e;
+}
+
+ExprAST *ASTSimplifier::visitVarExpr(VarExprAST *e) {
+  llvm::SmallVector<Binding, 4> Vars(e->VarNames.size());
+  for (size_t i = 0, n = Vars.size(); i != n; ++i) {
+    // Each initializer sees the variables before it, not its own.
+    Binding &B = Vars[i];
+    B.Name = e->VarNames[i].first;
+    B.Type = e->VarTypes[i];
+    if (ExprAST *Init = e->VarNames[i].second) {
+      unsigned Effects0 = Effects, Errors0 = Errors;
+      B.Init = visit(Init);
+      B.Pure = Effects == Effects0 && Errors == Errors0;
+      setValue(B, B.Init);
+    } else {
+      setValue(B, makeNumber(0));
+    }
+    bind(B);
+  }
+  ExprAST *Body = visit(e->Body);
+  for (size_t i = Vars.size(); i != 0; --i)
+    unbind(Vars[i - 1]);
+  return finishVar(Vars, Body);
+}
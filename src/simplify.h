@@ -0,0 +1,95 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "ast.h"
+#include "compilerInstance.h"
+
+/// ASTSimplifier - Simplifies the body of a function before code is generated
+/// for it, so that less IR is generated, optimized and, at -O0, run:
+///
+///  - Arithmetic and comparisons of constants are folded, as are x*1, 1*x,
+///    x-0, x+(-0) and (-0)+x, which give x for every double. Nothing that
+///    could change the result under IEEE rules (e.g. x+0 or x*0) is folded.
+///  - An if whose condition is constant becomes the arm it takes.
+///  - A for loop whose end condition is false on the first trip runs once,
+///    and becomes a var/in evaluating its body.
+///  - Calls to small user defined operators that don't declare types are
+///    inlined as a var/in binding the operands, whose body is the
+///    operator's. An operand without side effects that the body uses once
+///    goes straight where it's used.
+///  - Variables bound to a constant, or to another variable, that are never
+///    assigned are replaced by what they're bound to, and bindings without
+///    uses or side effects are dropped. A variable declared with a type
+///    keeps its binding unless the constant it's bound to has that type.
+///
+/// Code with errors, such as an unknown variable, is left for codegen to
+/// report.
+class ASTSimplifier : public ExprVisitor<ASTSimplifier, ExprAST *> {
+public:
+  /// MaxInlineNodes - Operators whose bodies have more nodes than this, or
+  /// call a function, loop or index an array, are called rather than inlined.
+  static constexpr unsigned MaxInlineNodes = 16;
+
+  /// simplify - Simplify the body of F in place, allocating new nodes in
+  /// Arena. If F defines an operator that can be inlined, it's remembered in
+  /// CI.InlineOperators for the items after it.
+  static void simplify(FunctionAST &F, CompilerInstance &CI, ASTArena &Arena);
+
+  ExprAST *visitNumberExpr(NumberExprAST *e) { return e; }
+  ExprAST *visitVariableExpr(VariableExprAST *e);
+  ExprAST *visitBinaryExpr(BinaryExprAST *e);
+  ExprAST *visitCallExpr(CallExprAST *e);
+  ExprAST *visitIfExpr(IfExprAST *e);
+  ExprAST *visitForExpr(ForExprAST *e);
+  ExprAST *visitUnaryExpr(UnaryExprAST *e);
+  ExprAST *visitVarExpr(VarExprAST *e);
+  ExprAST *visitIndexExpr(IndexExprAST *e);
+  ExprAST *visitParForExpr(ParForExprAST *e);
+
+private:
+  /// Binding - A variable in scope.
+  struct Binding {
+    Symbol Name;
+    ExprAST *Init = nullptr;    // Its initializer, if it has one
+    ExprAST *Value = nullptr;   // What its uses are replaced with, if any
+    Binding *Source = nullptr;  // The variable Value names, if it's one
+    Binding *Shadowed = nullptr;  // The binding of Name it hides
+    unsigned Uses = 0;          // Uses left in the code
+    bool Pure = true;           // Whether Init has no side effects
+    bool Forward = false;       // Whether Value is Init, for its one use
+    ValueType Type = VT_Infer;  // As declared
+  };
+
+  ASTSimplifier(CompilerInstance &CI, ASTArena &Arena,
+                const PrototypeAST &Proto)
+      : CI(CI), Arena(Arena), Proto(Proto) {}
+
+  void bind(Binding &B);
+  void unbind(Binding &B);
+  /// setValue - Have the uses of B replaced with Val, if that's safe.
+  void setValue(Binding &B, ExprAST *Val);
+  /// finishVar - The var/in binding Vars around Body, which have all been
+  /// simplified, without the bindings that are no longer needed.
+  ExprAST *finishVar(llvm::MutableArrayRef<Binding> Vars, ExprAST *Body);
+  /// inlineOperator - Op applied to Operands, which have been simplified,
+  /// with Pure telling which of them have no side effects.
+  ExprAST *inlineOperator(const InlineOperator &Op,
+                          llvm::ArrayRef<ExprAST *> Operands,
+                          llvm::ArrayRef<bool> Pure);
+  void rememberOperator(const PrototypeAST &P, ExprAST *Body);
+  /// isDeclared - Whether codegen finds a function Name taking NumArgs.
+  bool isDeclared(Symbol Name, size_t NumArgs) const;
+  ExprAST *makeNumber(double Val) { return Arena.make<NumberExprAST>(Val); }
+
+  CompilerInstance &CI;
+  ASTArena &Arena;
+  const PrototypeAST &Proto;  // Of the function being simplified
+  llvm::DenseMap<Symbol, Binding *> Scope;
+  llvm::DenseSet<Symbol> Assigned;  // Variables some '=' stores to
+  unsigned Effects = 0;  // Side effects kept in the code so far
+  unsigned Errors = 0;   // Errors left for codegen to report so far
+};
+
+#endif	// SIMPLIFY_H
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "source.h"
+
+// Size of each read() when the input can't be mapped.
+static const size_t ReadChunkSize = 1 << 20;
+
+SourceBuffer::~SourceBuffer() {
+    if (_mapped)
+        munmap(const_cast<char *>(_data), _size);
+}
+
+/// readFd - Slurp FD into _storage with large reads.
+bool SourceBuffer::readFd(int FD) {
+    size_t Len = 0;
+    while (true) {
+        if (_storage.size() - Len < ReadChunkSize)
+            _storage.resize(Len + ReadChunkSize);
+        ssize_t N = read(FD, &_storage[Len], _storage.size() - Len);
+        if (N < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (N == 0)
+            break;
+        Len += N;
+    }
+    _storage.resize(Len);
+    _data = _storage.data();
+    _size = Len;
+    return true;
+}
+
+std::unique_ptr<SourceBuffer> SourceBuffer::openFile(const std::string &Path) {
+    std::unique_ptr<SourceBuffer> Buf(new SourceBuffer(Path));
+    int FD = open(Path.c_str(), O_RDONLY);
+    if (FD < 0) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", Path.c_str(),
+                strerror(errno));
+        return nullptr;
+    }
+
+    struct stat St;
+    if (fstat(FD, &St) == 0 && S_ISREG(St.st_mode) && St.st_size > 0) {
+        void *Map = mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+        if (Map != MAP_FAILED) {
+            madvise(Map, St.st_size, MADV_SEQUENTIAL);
+            Buf->_data = static_cast<const char *>(Map);
+            Buf->_size = St.st_size;
+            Buf->_mapped = true;
+            close(FD);
+            return Buf;
+        }
+    }
+
+    // Not a regular file (or mmap failed), fall back to reading it.
+    bool Ok = Buf->readFd(FD);
+    close(FD);
+    if (!Ok) {
+        fprintf(stderr, "Error: cannot read '%s': %s\n", Path.c_str(),
+                strerror(errno));
+        return nullptr;
+    }
+    return Buf;
+}
+
+std::unique_ptr<SourceBuffer> SourceBuffer::openStdin() {
+    std::unique_ptr<SourceBuffer> Buf(new SourceBuffer("<stdin>"));
+    if (!Buf->readFd(STDIN_FILENO)) {
+        fprintf(stderr, "Error: cannot read stdin: %s\n", strerror(errno));
+        return nullptr;
+    }
+    return Buf;
+}
+
+std::unique_ptr<SourceBuffer> SourceBuffer::fromString(std::string Text,
+        std::string Name) {
+    std::unique_ptr<SourceBuffer> Buf(new SourceBuffer(std::move(Name)));
+    Buf->_storage = std::move(Text);
+    Buf->_data = Buf->_storage.data();
+    Buf->_size = Buf->_storage.size();
+    return Buf;
+}
+
+SourceLocation SourceBuffer::getLocation(uint32_t Offset) const {
+    std::call_once(_lineStartsBuilt, [this] {
+        _lineStarts.push_back(0);
+        for (size_t I = 0; I != _size; ++I)
+            if (_data[I] == '\n')
+                _lineStarts.push_back(I + 1);
+    });
+
+    auto It = std::upper_bound(_lineStarts.begin(), _lineStarts.end(), Offset);
+    unsigned Line = It - _lineStarts.begin();
+    return {Line, Offset - *(It - 1) + 1};
+}
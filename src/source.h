@@ -0,0 +1,59 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// SourceLocation - 1-based line and column of a byte in a SourceBuffer.
+struct SourceLocation {
+    unsigned Line;
+    unsigned Col;
+};
+
+/// SourceBuffer - The complete text of one input, held in memory for the
+/// lifetime of the lexer. Regular files are mmap'ed, everything else (stdin,
+/// pipes) is slurped with large chunked reads.
+class SourceBuffer {
+    private:
+        std::string _name;
+        const char *_data = nullptr;
+        size_t _size = 0;
+        bool _mapped = false;
+        std::string _storage;   // Owns the bytes when not mmap'ed.
+
+        // Offsets of the first byte of every line. Only built the first time a
+        // location is asked for, so lexing never pays for it; once, as the
+        // parsers of a -j build ask from several threads.
+        mutable std::vector<uint32_t> _lineStarts;
+        mutable std::once_flag _lineStartsBuilt;
+
+        SourceBuffer(std::string Name) : _name(std::move(Name)) {}
+        bool readFd(int FD);
+
+    public:
+        ~SourceBuffer();
+        SourceBuffer(const SourceBuffer &) = delete;
+        SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+        /// openFile - Map the file at Path, or return null and print an error.
+        static std::unique_ptr<SourceBuffer> openFile(const std::string &Path);
+        /// openStdin - Read all of standard input.
+        static std::unique_ptr<SourceBuffer> openStdin();
+        /// fromString - Take ownership of an in-memory program text.
+        static std::unique_ptr<SourceBuffer> fromString(std::string Text,
+                std::string Name = "<string>");
+
+        const std::string &getName() const { return _name; }
+        const char *begin() const { return _data; }
+        const char *end() const { return _data + _size; }
+        size_t size() const { return _size; }
+
+        /// getLocation - Translate a byte offset into a line and column.
+        SourceLocation getLocation(uint32_t Offset) const;
+};
+
+#endif	// SOURCE_H
@@ -0,0 +1,35 @@
+#include "symbol.h"
+
+SymbolTable Symbols;
+
+SymbolTable::~SymbolTable() {
+    for (auto &Seg : _segments)
+        delete[] Seg.load();
+}
+
+Symbol SymbolTable::intern(std::string_view Name) {
+    size_t Hash = std::hash<std::string_view>()(Name);
+    Shard &Sh = _shards[Hash % NumShards];
+    std::lock_guard<std::mutex> Guard(Sh.Lock);
+    auto It = Sh.Ids.find(Name);
+    if (It != Sh.Ids.end())
+        return It->second;
+
+    Symbol S = _size.fetch_add(1, std::memory_order_relaxed);
+    unsigned Seg;
+    size_t Idx;
+    locate(S, Seg, Idx);
+    std::string *Names = _segments[Seg].load(std::memory_order_acquire);
+    if (!Names) {
+        // Several shards may need the segment at once; the first one wins.
+        std::string *New = new std::string[size_t(1) << (FirstSegmentBits + Seg)];
+        if (_segments[Seg].compare_exchange_strong(Names, New,
+                                                   std::memory_order_acq_rel))
+            Names = New;
+        else
+            delete[] New;
+    }
+    Names[Idx] = std::string(Name);
+    Sh.Ids.emplace(Names[Idx], S);
+    return S;
+}
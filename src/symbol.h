@@ -0,0 +1,71 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/// Symbol - A small integer standing for an interned identifier. Two symbols
+/// are equal iff their spellings are, so they can be compared and hashed
+/// directly instead of the strings.
+using Symbol = uint32_t;
+
+/// SymbolTable - Interns identifier spellings. Each distinct name is copied
+/// once; after that, looking it up again costs a hash and a compare.
+///
+/// The table is shared by every thread of the compiler. intern() locks one of
+/// several shards, picked by the name's hash, so threads lexing different
+/// programs rarely wait for each other; getName() doesn't lock at all. Names
+/// are stored in segments that double in size and are never moved, so a name
+/// can be read while other threads add new ones.
+class SymbolTable {
+    private:
+        static const unsigned FirstSegmentBits = 10;
+        static const unsigned NumSegments = 32 - FirstSegmentBits;
+
+        static const unsigned NumShards = 64;
+
+        /// Shard - The symbols of the names hashing to one shard.
+        struct alignas(64) Shard {
+            std::unordered_map<std::string_view, Symbol> Ids;
+            std::mutex Lock;
+        };
+
+        std::atomic<std::string *> _segments[NumSegments] = {};
+        Shard _shards[NumShards];
+        std::atomic<Symbol> _size{0};
+
+        /// locate - Segment and index within it holding symbol S. Segment K
+        /// holds the 2^(FirstSegmentBits + K) symbols after those before it.
+        static void locate(Symbol S, unsigned &Seg, size_t &Idx) {
+            uint64_t Biased = uint64_t(S) + (1u << FirstSegmentBits);
+            unsigned Bit = 63 - __builtin_clzll(Biased);
+            Seg = Bit - FirstSegmentBits;
+            Idx = Biased - (uint64_t(1) << Bit);
+        }
+
+    public:
+        SymbolTable() = default;
+        ~SymbolTable();
+        SymbolTable(const SymbolTable &) = delete;
+        SymbolTable &operator=(const SymbolTable &) = delete;
+
+        /// intern - Return the symbol for Name, creating it if needed.
+        Symbol intern(std::string_view Name);
+
+        /// getName - Return the spelling of S.
+        const std::string &getName(Symbol S) const {
+            unsigned Seg;
+            size_t Idx;
+            locate(S, Seg, Idx);
+            return _segments[Seg].load(std::memory_order_acquire)[Idx];
+        }
+};
+
+/// Symbols - The table every identifier in the compiler is interned in.
+extern SymbolTable Symbols;
+
+#endif	// SYMBOL_H
@@ -0,0 +1,72 @@
+#include "tokenStream.h"
+
+// How many tokens the lexer thread produces between publishing them.
+static const size_t PublishInterval = 256;
+
+TokenStream::TokenStream(const SourceBuffer &Src, bool AllowThread)
+    : _src(Src) {
+    _numBlocks = (Src.size() + 1) / BlockSize + 1;
+    _blocks.reset(new std::unique_ptr<Block>[_numBlocks]);
+
+    if (AllowThread && Src.size() >= ThreadedLexThreshold)
+        _lexThread = std::thread([this] { lexAll(); });
+    else
+        lexAll();
+}
+
+TokenStream::~TokenStream() {
+    if (_lexThread.joinable())
+        _lexThread.join();
+}
+
+/// lexAll - Run the lexer to the end of the buffer, appending every token.
+void TokenStream::lexAll() {
+    Lexer Lex(_src);
+    size_t N = 0;
+    while (true) {
+        size_t BlockIdx = N >> BlockBits;
+        if (!_blocks[BlockIdx])
+            _blocks[BlockIdx].reset(new Block);
+        Block &B = *_blocks[BlockIdx];
+        size_t Idx = N & BlockMask;
+
+        int Tok = Lex.gettok();
+        B.Kinds[Idx] = Tok;
+        B.Offsets[Idx] = Lex.TokOffset;
+        if (Tok == tok_number)
+            B.Payloads[Idx].Num = Lex.NumVal;
+        else if (Tok == tok_identifier)
+            B.Payloads[Idx].Sym = Lex.IdentifierSym;
+        else if (Tok == tok_error)
+            B.Payloads[Idx].Err = Lex.ErrorStr;
+        ++N;
+
+        if (Tok == tok_eof)
+            break;
+        if (N % PublishInterval == 0)
+            _published.store(N, std::memory_order_release);
+    }
+    _published.store(N, std::memory_order_release);
+    _done.store(true, std::memory_order_release);
+}
+
+void TokenStream::waitFor(size_t &I) {
+    while (true) {
+        bool Done = _done.load(std::memory_order_acquire);
+        size_t Known = _published.load(std::memory_order_acquire);
+        _known.store(Known, std::memory_order_release);
+        if (I < Known)
+            return;
+        if (Done) {
+            I = Known - 1;
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+size_t TokenStream::size() {
+    size_t Last = SIZE_MAX;
+    waitFor(Last);
+    return Last + 1;
+}
@@ -0,0 +1,94 @@
+#ifndef TOKENSTREAM_H
+#define TOKENSTREAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include "lexer.h"
+#include "source.h"
+
+/// TokenStream - Every token of a SourceBuffer, stored structure-of-arrays
+/// style (kinds, payloads and offsets in separate arrays) and addressed by
+/// index. This decouples the parser from the lexer: the parser can look any
+/// number of tokens ahead, and for big inputs the lexer runs ahead on its own
+/// thread while the parser consumes what has been published so far.
+class TokenStream {
+    public:
+        /// Payload - The value attached to a token, selected by its kind.
+        union Payload {
+            double Num;         // tok_number
+            Symbol Sym;         // tok_identifier
+            const char *Err;    // tok_error
+        };
+
+        /// Inputs at least this big are lexed on a background thread.
+        static const size_t ThreadedLexThreshold = 1 << 20;
+
+        explicit TokenStream(const SourceBuffer &Src, bool AllowThread = true);
+        ~TokenStream();
+        TokenStream(const TokenStream &) = delete;
+        TokenStream &operator=(const TokenStream &) = delete;
+
+        const SourceBuffer &getSource() const { return _src; }
+
+        /// Accessors for token I. Indices past the end read as the final
+        /// tok_eof. Any number of threads may read a stream at once.
+        int getKind(size_t I) {
+            Block &B = block(I);
+            return B.Kinds[I & BlockMask];
+        }
+        double getNumber(size_t I) { return payload(I).Num; }
+        Symbol getSymbol(size_t I) { return payload(I).Sym; }
+        const char *getError(size_t I) { return payload(I).Err; }
+        uint32_t getOffset(size_t I) {
+            Block &B = block(I);
+            return B.Offsets[I & BlockMask];
+        }
+
+        /// size - Number of tokens including the final tok_eof. Waits for the
+        /// lexer to finish.
+        size_t size();
+
+    private:
+        static const unsigned BlockBits = 12;
+        static const size_t BlockSize = size_t(1) << BlockBits;
+        static const size_t BlockMask = BlockSize - 1;
+
+        struct Block {
+            int16_t Kinds[BlockSize];
+            Payload Payloads[BlockSize];
+            uint32_t Offsets[BlockSize];
+        };
+
+        const SourceBuffer &_src;
+        // Every token but EOF eats at least one byte, which bounds the number
+        // of blocks up front; the table is never reallocated, so readers can
+        // index it while the lexer thread appends.
+        std::unique_ptr<std::unique_ptr<Block>[]> _blocks;
+        size_t _numBlocks;
+        std::atomic<size_t> _published{0};  // Tokens visible to readers
+        std::atomic<bool> _done{false};     // tok_eof has been published
+        // Last _published value any reader saw, so readers only touch the
+        // lexer's counter when they catch up with it.
+        std::atomic<size_t> _known{0};
+        std::thread _lexThread;
+
+        void lexAll();
+        void waitFor(size_t &I);
+
+        /// block - The block holding token I, waiting for the lexer if it
+        /// hasn't got that far yet. Clamps I to the final token.
+        Block &block(size_t &I) {
+            if (I >= _known.load(std::memory_order_acquire))
+                waitFor(I);
+            return *_blocks[I >> BlockBits];
+        }
+        Payload &payload(size_t I) {
+            Block &B = block(I);
+            return B.Payloads[I & BlockMask];
+        }
+};
+
+#endif	// TOKENSTREAM_H
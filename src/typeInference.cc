@@ -0,0 +1,369 @@
+#include <cstring>
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "typeInference.h"
+
+namespace {
+
+/// join - The type of a variable holding values of types A and B.
+ValueType join(ValueType A, ValueType B) {
+  if (A == B)
+    return A;
+  if ((A == VT_Infer && B == VT_Int) || (A == VT_Int && B == VT_Infer))
+    return VT_Int;
+  return VT_Double;
+}
+
+/// arithmetic - The type +, - and * compute in, and '<' compares in, for
+/// operands of types A and B.
+ValueType arithmetic(ValueType A, ValueType B) {
+  if ((A == VT_Infer || A == VT_Int) && (B == VT_Infer || B == VT_Int))
+    return join(A, B);
+  return VT_Double;
+}
+
+const PrototypeAST *lookupProto(const CompilerInstance &CI, Symbol Name,
+                                size_t NumArgs) {
+  auto It = CI.FunctionProtos.find(Name);
+  if (It == CI.FunctionProtos.end() || It->second->Args.size() != NumArgs)
+    return nullptr;
+  return It->second.get();
+}
+
+/// TypeSettler - Gives the whole numbers left without a type the one their
+/// context wants: an int where an int is wanted, a double elsewhere.
+class TypeSettler : public ExprVisitor<TypeSettler> {
+  const CompilerInstance &CI;
+
+  void settleArgs(Symbol Callee, llvm::ArrayRef<ExprAST *> Args) {
+    const PrototypeAST *P = lookupProto(CI, Callee, Args.size());
+    for (size_t i = 0, e = Args.size(); i != e; ++i)
+      settle(Args[i], P ? P->ArgTypes[i] : VT_Double);
+  }
+
+public:
+  explicit TypeSettler(const CompilerInstance &CI) : CI(CI) {}
+
+  void settle(ExprAST *E, ValueType Want) {
+    if (E->Type == VT_Infer)
+      E->Type = Want == VT_Int ? VT_Int : VT_Double;
+    visit(E);
+  }
+
+  void visitNumberExpr(NumberExprAST *e) {}
+  void visitVariableExpr(VariableExprAST *e) {}
+  void visitBinaryExpr(BinaryExprAST *e) {
+    if (e->Op == '=') {
+      if (llvm::isa<IndexExprAST>(e->LHS))
+        visit(e->LHS);
+      settle(e->RHS, e->Type);
+      return;
+    }
+    if (!strchr("+-*<", e->Op)) {
+      settleArgs(getOperatorSymbol("binary", e->Op), {e->LHS, e->RHS});
+      return;
+    }
+    ValueType Op = e->Type;
+    if (e->Op == '<') {
+      Op = arithmetic(e->LHS->Type, e->RHS->Type);
+      if (Op == VT_Infer)
+        Op = VT_Double;
+    }
+    settle(e->LHS, Op);
+    settle(e->RHS, Op);
+  }
+  void visitCallExpr(CallExprAST *e) { settleArgs(e->Callee, e->Args); }
+  void visitIfExpr(IfExprAST *e) {
+    ValueType Ty = e->Type;
+    settle(e->Cond, VT_Bool);
+    settle(e->Then, Ty);
+    settle(e->Else, Ty);
+  }
+  void visitForExpr(ForExprAST *e) {
+    settle(e->Start, e->VarType);
+    settle(e->Body, VT_Double);
+    if (e->Step)
+      settle(e->Step, e->VarType);
+    settle(e->End, VT_Bool);
+  }
+  void visitUnaryExpr(UnaryExprAST *e) {
+    settleArgs(getOperatorSymbol("unary", e->Opcode), e->Operand);
+  }
+  void visitVarExpr(VarExprAST *e) {
+    ValueType Ty = e->Type;
+    for (size_t i = 0, n = e->VarNames.size(); i != n; ++i)
+      if (ExprAST *Init = e->VarNames[i].second)
+        settle(Init, e->VarTypes[i]);
+    settle(e->Body, Ty);
+  }
+  void visitIndexExpr(IndexExprAST *e) { settle(e->Index, VT_Int); }
+  void visitParForExpr(ParForExprAST *e) {
+    settle(e->Start, VT_Int);
+    settle(e->End, VT_Int);
+    if (e->Grain)
+      settle(e->Grain, VT_Int);
+    settle(e->Body, VT_Double);
+  }
+};
+
+} // end anonymous namespace
+
+void TypeInference::infer(ExprAST *Body,
+                          llvm::ArrayRef<std::pair<Symbol, ValueType>> Params,
+                          ValueType Result, const CompilerInstance &CI) {
+  // Variables only ever widen, so this stops after a few walks at most.
+  TypeInference TI(CI);
+  do
+    TI.walk(Body, Params, Result);
+  while (TI.Changed);
+
+  for (Variable &V : TI.Vars)
+    if (V.Type == VT_Infer)
+      V.Type = VT_Double;
+  TI.Final = true;
+  TI.walk(Body, Params, Result);
+  TypeSettler(CI).settle(Body, Result);
+}
+
+void TypeInference::walk(ExprAST *Body,
+                         llvm::ArrayRef<std::pair<Symbol, ValueType>> Params,
+                         ValueType Result) {
+  NextVar = 0;
+  Scope.clear();
+  Uses.clear();
+  Changed = false;
+  for (auto &Param : Params)
+    bind(Param.first, Param.second, Param.second);
+  visit(Body);
+  if (Result == VT_Int)
+    wantInt(Body);
+}
+
+unsigned TypeInference::bind(Symbol Name, ValueType Declared,
+                             ValueType Init) {
+  unsigned Var = NextVar++;
+  if (Var == Vars.size())
+    Vars.push_back({Declared == VT_Infer ? Init : Declared,
+                    Declared != VT_Infer});
+  else
+    widen(Var, Init);
+  Scope[Name] = Var;
+  return Var;
+}
+
+void TypeInference::widen(unsigned Var, ValueType Ty) {
+  Variable &V = Vars[Var];
+  if (V.Declared)
+    return;
+  ValueType Wider = join(V.Type, Ty);
+  if (Wider != V.Type) {
+    V.Type = Wider;
+    Changed = true;
+  }
+}
+
+void TypeInference::wantInt(ExprAST *E) {
+  if (E->Type != VT_Infer)
+    return;
+  if (auto *Var = llvm::dyn_cast<VariableExprAST>(E)) {
+    auto It = Uses.find(Var);
+    if (It != Uses.end())
+      widen(It->second, VT_Int);
+  } else if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E)) {
+    // An assignment's value is the variable's; +, - and * take the type of
+    // their operands.
+    if (Bin->Op != '=')
+      wantInt(Bin->RHS);
+    wantInt(Bin->LHS);
+  } else if (auto *If = llvm::dyn_cast<IfExprAST>(E)) {
+    wantInt(If->Then);
+    wantInt(If->Else);
+  } else if (auto *Var = llvm::dyn_cast<VarExprAST>(E)) {
+    wantInt(Var->Body);
+  }
+}
+
+ValueType TypeInference::visitNumberExpr(NumberExprAST *e) {
+  return e->Type = NumberExprAST::isIntegral(e->Val) ? VT_Infer : VT_Double;
+}
+
+ValueType TypeInference::visitVariableExpr(VariableExprAST *e) {
+  auto It = Scope.find(e->Name);
+  if (It == Scope.end())
+    return e->Type = VT_Double;
+  Uses[e] = It->second;
+  return e->Type = Vars[It->second].Type;
+}
+
+ValueType TypeInference::visitBinaryExpr(BinaryExprAST *e) {
+  if (e->Op == '=') {
+    if (llvm::isa<IndexExprAST>(e->LHS)) {
+      visit(e->LHS);
+      visit(e->RHS);
+      return e->Type = VT_Double;
+    }
+    ValueType RHS = visit(e->RHS);
+    auto *LHSE = llvm::dyn_cast<VariableExprAST>(e->LHS);
+    auto It = LHSE ? Scope.find(LHSE->Name) : Scope.end();
+    if (It == Scope.end())
+      return e->Type = VT_Double;
+    Uses[LHSE] = It->second;
+    widen(It->second, RHS);
+    e->Type = LHSE->Type = Vars[It->second].Type;
+    if (e->Type == VT_Int)
+      wantInt(e->RHS);
+    return e->Type;
+  }
+
+  if (!strchr("+-*<", e->Op))
+    return e->Type = visitCall(getOperatorSymbol("binary", e->Op),
+                               {e->LHS, e->RHS});
+
+  ValueType Op = arithmetic(visit(e->LHS), visit(e->RHS));
+  if (Op == VT_Int) {
+    wantInt(e->LHS);
+    wantInt(e->RHS);
+  }
+  return e->Type = e->Op == '<' ? VT_Bool : Op;
+}
+
+ValueType TypeInference::visitCall(Symbol Callee,
+                                   llvm::ArrayRef<ExprAST *> Args) {
+  const PrototypeAST *P = lookupProto(CI, Callee, Args.size());
+  for (size_t i = 0, e = Args.size(); i != e; ++i) {
+    visit(Args[i]);
+    if (P && P->ArgTypes[i] == VT_Int)
+      wantInt(Args[i]);
+  }
+  return P ? P->RetType : VT_Double;
+}
+
+ValueType TypeInference::visitCallExpr(CallExprAST *e) {
+  return e->Type = visitCall(e->Callee, e->Args);
+}
+
+ValueType TypeInference::visitIfExpr(IfExprAST *e) {
+  visit(e->Cond);
+  ValueType Then = visit(e->Then);
+  e->Type = join(Then, visit(e->Else));
+  if (e->Type == VT_Int) {
+    wantInt(e->Then);
+    wantInt(e->Else);
+  }
+  return e->Type;
+}
+
+ValueType TypeInference::visitForExpr(ForExprAST *e) {
+  ValueType Start = visit(e->Start);
+  auto Old = Scope.find(e->VarName);
+  llvm::Optional<unsigned> OldVar;
+  if (Old != Scope.end())
+    OldVar = Old->second;
+  unsigned Var = bind(e->VarName, VT_Infer, Start);
+
+  visit(e->Body);
+  // The variable is stepped by adding Step (1 if there's none) to it.
+  ValueType Step = e->Step ? visit(e->Step) : VT_Infer;
+  widen(Var, arithmetic(Vars[Var].Type, Step));
+  visit(e->End);
+  if (Vars[Var].Type == VT_Int) {
+    wantInt(e->Start);
+    if (e->Step)
+      wantInt(e->Step);
+  }
+  if (Final)
+    e->VarType = Vars[Var].Type;
+
+  if (OldVar)
+    Scope[e->VarName] = *OldVar;
+  else
+    Scope.erase(e->VarName);
+  return e->Type = VT_Infer;  // It's always 0
+}
+
+ValueType TypeInference::visitUnaryExpr(UnaryExprAST *e) {
+  return e->Type =
+             visitCall(getOperatorSymbol("unary", e->Opcode), e->Operand);
+}
+
+ValueType TypeInference::visitVarExpr(VarExprAST *e) {
+  llvm::SmallVector<std::pair<Symbol, llvm::Optional<unsigned>>, 4> Old;
+  for (size_t i = 0, n = e->VarNames.size(); i != n; ++i) {
+    // Each initializer sees the variables before it, not its own.
+    Symbol Name = e->VarNames[i].first;
+    ExprAST *Init = e->VarNames[i].second;
+    ValueType InitTy = Init ? visit(Init) : VT_Infer;  // 0 if there's none
+
+    auto It = Scope.find(Name);
+    Old.push_back({Name, It == Scope.end()
+                             ? llvm::Optional<unsigned>()
+                             : llvm::Optional<unsigned>(It->second)});
+    unsigned Var = bind(Name, e->VarTypes[i], InitTy);
+    if (Init && Vars[Var].Type == VT_Int)
+      wantInt(Init);
+    if (Final)
+      e->VarTypes[i] = Vars[Var].Type;
+  }
+
+  e->Type = visit(e->Body);
+
+  for (auto &Binding : llvm::reverse(Old)) {
+    if (Binding.second)
+      Scope[Binding.first] = *Binding.second;
+    else
+      Scope.erase(Binding.first);
+  }
+  return e->Type;
+}
+
+ValueType TypeInference::visitIndexExpr(IndexExprAST *e) {
+  visit(e->Array);
+  visit(e->Index);
+  wantInt(e->Index);
+  return e->Type = VT_Double;
+}
+
+ValueType TypeInference::visitParForExpr(ParForExprAST *e) {
+  for (ExprAST *Bound : {e->Start, e->End, e->Grain})
+    if (Bound) {
+      visit(Bound);
+      wantInt(Bound);
+    }
+
+  auto Old = Scope.find(e->VarName);
+  llvm::Optional<unsigned> OldVar;
+  if (Old != Scope.end())
+    OldVar = Old->second;
+  bind(e->VarName, VT_Int, VT_Int);
+  visit(e->Body);
+  if (OldVar)
+    Scope[e->VarName] = *OldVar;
+  else
+    Scope.erase(e->VarName);
+  return e->Type = VT_Double;
+}
+
+const char *getTypeName(ValueType Ty) {
+  switch (Ty) {
+  case VT_Double:
+    return "double";
+  case VT_Int:
+    return "int";
+  case VT_Bool:
+    return "bool";
+  case VT_DoublePtr:
+    return "double*";
+  case VT_Infer:
+    break;
+  }
+  return "?";
+}
+
+ValueType lookupTypeName(Symbol Name) {
+  for (ValueType Ty : {VT_Double, VT_Int, VT_Bool})
+    if (Symbols.getName(Name) == getTypeName(Ty))
+      return Ty;
+  return VT_Infer;
+}
@@ -0,0 +1,88 @@
+#ifndef TYPEINFERENCE_H
+#define TYPEINFERENCE_H
+
+#include <utility>
+#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "ast.h"
+#include "compilerInstance.h"
+
+/// TypeInference - Works out the type of every expression in a function
+/// body, and of every variable that doesn't declare one, before code is
+/// generated for it.
+///
+/// Arguments and results are doubles unless declared otherwise, so a
+/// function without declarations keeps the signature it always had. In a
+/// body, types come from the declarations and the operations:
+///
+///  - '<' gives a bool. +, - and * on two ints give an int, and on
+///    anything else (bools included) a double.
+///  - A whole number (see NumberExprAST::isIntegral) is an int where one is
+///    wanted, e.g. as the other operand of an int's '+', and a double
+///    anywhere else.
+///  - A var or for variable has the type of its initial value, widened to
+///    hold what is stored to it: ints and whole numbers make an int, any
+///    other mix a double. One holding nothing but whole numbers is an int
+///    if it meets one, as an operand of an int's '+', '<' and so on, or
+///    when stored to an int or passed as one; it's a double otherwise.
+///  - An element of an array, a[i], is a double, and its index an int.
+///  - A parfor counts with an int and gives a double.
+///
+/// Code that declares nothing is thus all doubles, as before, but for
+/// comparisons, which stay bools until used as numbers. Unknown variables
+/// and functions are taken to be doubles; codegen reports them.
+class TypeInference : public ExprVisitor<TypeInference, ValueType> {
+public:
+  /// infer - Fill in the types in Body, which has the variables Params in
+  /// scope and whose value is returned as Result, calling the functions
+  /// declared in CI. Each ExprAST gets its Type, and each var and for
+  /// variable without one declared gets the type inferred for it.
+  static void infer(ExprAST *Body,
+                    llvm::ArrayRef<std::pair<Symbol, ValueType>> Params,
+                    ValueType Result, const CompilerInstance &CI);
+
+  ValueType visitNumberExpr(NumberExprAST *e);
+  ValueType visitVariableExpr(VariableExprAST *e);
+  ValueType visitBinaryExpr(BinaryExprAST *e);
+  ValueType visitCallExpr(CallExprAST *e);
+  ValueType visitIfExpr(IfExprAST *e);
+  ValueType visitForExpr(ForExprAST *e);
+  ValueType visitUnaryExpr(UnaryExprAST *e);
+  ValueType visitVarExpr(VarExprAST *e);
+  ValueType visitIndexExpr(IndexExprAST *e);
+  ValueType visitParForExpr(ParForExprAST *e);
+
+private:
+  /// Variable - A variable, with the type it has so far; VT_Infer while it
+  /// has held nothing but whole numbers.
+  struct Variable {
+    ValueType Type;
+    bool Declared;
+  };
+
+  explicit TypeInference(const CompilerInstance &CI) : CI(CI) {}
+
+  /// walk - Type Body once with the variables as they are, widening them
+  /// for what it stores to them.
+  void walk(ExprAST *Body, llvm::ArrayRef<std::pair<Symbol, ValueType>> Params,
+            ValueType Result);
+  /// bind - Bring the next variable bound into scope as Name, returning its
+  /// index. It's Declared, or VT_Infer to hold Init.
+  unsigned bind(Symbol Name, ValueType Declared, ValueType Init);
+  /// widen - Have variable Var hold values of type Ty too.
+  void widen(unsigned Var, ValueType Ty);
+  /// wantInt - Make the variables whose whole numbers E computes with ints.
+  void wantInt(ExprAST *E);
+  ValueType visitCall(Symbol Callee, llvm::ArrayRef<ExprAST *> Args);
+
+  const CompilerInstance &CI;
+  std::vector<Variable> Vars;  // In the order they're bound in the body
+  unsigned NextVar = 0;        // Index of the next one bound in this walk
+  llvm::DenseMap<Symbol, unsigned> Scope;
+  llvm::DenseMap<VariableExprAST *, unsigned> Uses;  // The variable of each
+  bool Changed = false;  // Whether this walk widened a variable
+  bool Final = false;    // Whether this walk records the variables' types
+};
+
+#endif	// TYPEINFERENCE_H